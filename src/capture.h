@@ -0,0 +1,327 @@
+// Capture logs: the runs a batch or server was asked for, kept to replay
+// later with mill-replay. A header line, then each program the first
+// time a run uses it, and a line per run:
+//
+//     mill-capture 1
+//     program HASH N     followed by N bytes of program text
+//     run US HASH MS TAPE
+//
+// HASH is the program's, in hex; US the microseconds since the capture
+// started; MS the run's deadline in milliseconds, or 0 for none; and TAPE
+// the input in run-length form, as mill_print_rle writes it.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "mill.h"
+
+
+#define CAPTURE_HEADER "mill-capture 1"
+
+
+struct Capture {
+    FILE* file;
+    pthread_mutex_t lock;
+    struct timespec start;
+    // The program given with -p.
+    uint64_t program;
+    uint64_t* seen;
+    size_t seen_count;
+    size_t seen_cap;
+    int error;
+};
+
+
+struct CaptureProgram {
+    uint64_t hash;
+    char* text;
+    size_t len;
+};
+
+
+struct CaptureRun {
+    uint64_t us;
+    size_t program;
+    size_t deadline_ms;
+    wchar_t* tape;
+    size_t len;
+};
+
+
+struct CaptureLog {
+    struct CaptureProgram* programs;
+    size_t program_count;
+    struct CaptureRun* runs;
+    size_t run_count;
+};
+
+
+static inline uint64_t
+capture_hash(const char* text, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i) {
+        hash = (hash ^ (unsigned char) text[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+
+static inline int
+_capture_program(struct Capture* capture, uint64_t hash, const char* text, size_t len) {
+    for (size_t i = 0; i < capture->seen_count; ++i) {
+        if (capture->seen[i] == hash) {
+            return 0;
+        }
+    }
+    if (capture->seen_count == capture->seen_cap) {
+        size_t cap = capture->seen_cap != 0 ? capture->seen_cap * 2 : 16;
+        void* p = realloc(capture->seen, cap * sizeof(capture->seen[0]));
+        if (p == NULL) {
+            return 1;
+        }
+        capture->seen = p;
+        capture->seen_cap = cap;
+    }
+    capture->seen[capture->seen_count++] = hash;
+    if (fprintf(capture->file, "program %016" PRIx64 " %zu\n", hash, len) < 0 ||
+        fwrite(text, 1, len, capture->file) != len) {
+        capture->error = 1;
+    }
+    return 0;
+}
+
+
+// Starts a capture at path, with text as the program runs use unless
+// they say otherwise.
+static inline struct Capture*
+capture_open(const char* path, const char* text, size_t len) {
+    struct Capture* capture = calloc(1, sizeof(*capture));
+    if (capture == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    capture->file = fopen(path, "w");
+    if (capture->file == NULL) {
+        perror(path);
+        free(capture);
+        return NULL;
+    }
+    pthread_mutex_init(&capture->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &capture->start);
+    capture->program = capture_hash(text, len);
+    if (fprintf(capture->file, CAPTURE_HEADER "\n") < 0 ||
+        _capture_program(capture, capture->program, text, len) != 0) {
+        capture->error = 1;
+    }
+    return capture;
+}
+
+
+// Records the program's text unless it has been already; nonzero if
+// it could not be, so runs of it should not be recorded either.
+static inline int
+capture_program(struct Capture* capture, uint64_t hash, const char* text, size_t len) {
+    pthread_mutex_lock(&capture->lock);
+    int res = _capture_program(capture, hash, text, len);
+    pthread_mutex_unlock(&capture->lock);
+    return res;
+}
+
+
+static inline void
+capture_run(struct Capture* capture, uint64_t hash, size_t deadline_ms,
+    const wchar_t* tape, size_t len) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t us = (now.tv_sec - capture->start.tv_sec) * 1000000ull
+        + (now.tv_nsec - capture->start.tv_nsec) / 1000;
+    pthread_mutex_lock(&capture->lock);
+    if (fprintf(capture->file, "run %" PRIu64 " %016" PRIx64 " %zu ", us, hash, deadline_ms) < 0 ||
+        mill_print_rle(capture->file, tape, len) != 0) {
+        capture->error = 1;
+    }
+    pthread_mutex_unlock(&capture->lock);
+}
+
+
+// Ends the capture; nonzero if any of it could not be written.
+static inline int
+capture_close(struct Capture* capture) {
+    if (capture == NULL) {
+        return 0;
+    }
+    int res = capture->error;
+    if (fclose(capture->file) != 0) {
+        res = 1;
+    }
+    if (res != 0) {
+        fprintf(stderr, "error: --capture: write failed\n");
+    }
+    pthread_mutex_destroy(&capture->lock);
+    free(capture->seen);
+    free(capture);
+    return res;
+}
+
+
+static inline void
+capture_log_free(struct CaptureLog* log) {
+    for (size_t i = 0; i < log->program_count; ++i) {
+        free(log->programs[i].text);
+    }
+    for (size_t i = 0; i < log->run_count; ++i) {
+        free(log->runs[i].tape);
+    }
+    free(log->programs);
+    free(log->runs);
+    *log = (struct CaptureLog) {};
+}
+
+
+static inline int
+_capture_read_program(FILE* file, char* line, struct CaptureLog* log) {
+    char* end = NULL;
+    uint64_t hash = strtoull(line, &end, 16);
+    if (end == line || *end != ' ') {
+        return 1;
+    }
+    size_t len = strtoull(end + 1, &end, 10);
+    if (*end != '\n') {
+        return 1;
+    }
+    void* p = realloc(log->programs, (log->program_count + 1) * sizeof(log->programs[0]));
+    char* text = malloc(len + 1);
+    if (p != NULL) {
+        log->programs = p;
+    }
+    if (p == NULL || text == NULL) {
+        free(text);
+        return 1;
+    }
+    if (fread(text, 1, len, file) != len) {
+        free(text);
+        return 1;
+    }
+    text[len] = '\0';
+    log->programs[log->program_count++] = (struct CaptureProgram) {
+        .hash = hash,
+        .text = text,
+        .len = len,
+    };
+    return 0;
+}
+
+
+static inline int
+_capture_read_run(char* line, struct CaptureLog* log, size_t* cap,
+    wchar_t* wide, wchar_t* cells) {
+    char* end = NULL;
+    struct CaptureRun run = {.us = strtoull(line, &end, 10)};
+    if (end == line || *end != ' ') {
+        return 1;
+    }
+    line = end + 1;
+    uint64_t hash = strtoull(line, &end, 16);
+    if (end == line || *end != ' ') {
+        return 1;
+    }
+    line = end + 1;
+    run.deadline_ms = strtoull(line, &end, 10);
+    if (end == line || *end != ' ') {
+        return 1;
+    }
+    line = end + 1;
+    line[strcspn(line, "\n")] = '\0';
+
+    run.program = log->program_count;
+    for (size_t i = 0; i < log->program_count; ++i) {
+        if (log->programs[i].hash == hash) {
+            run.program = i;
+        }
+    }
+    size_t n = mbstowcs(wide, line, MILL_TAPE_SIZE);
+    if (run.program == log->program_count || n == (size_t) -1 || n >= MILL_TAPE_SIZE ||
+        mill_rle_decode(wide, n, cells, MILL_TAPE_SIZE, &run.len) != 0) {
+        return 1;
+    }
+    run.tape = malloc((run.len + 1) * sizeof(wchar_t));
+    if (run.tape == NULL) {
+        return 1;
+    }
+    wmemcpy(run.tape, cells, run.len + 1);
+
+    if (log->run_count == *cap) {
+        *cap = *cap != 0 ? *cap * 2 : 1024;
+        void* p = realloc(log->runs, *cap * sizeof(log->runs[0]));
+        if (p == NULL) {
+            free(run.tape);
+            return 1;
+        }
+        log->runs = p;
+    }
+    log->runs[log->run_count++] = run;
+    return 0;
+}
+
+
+// Reads a capture log; prints the line at fault if it is malformed.
+static inline int
+capture_read(const char* path, struct CaptureLog* log) {
+    *log = (struct CaptureLog) {};
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    wchar_t* wide = malloc(MILL_TAPE_SIZE * sizeof(wchar_t));
+    wchar_t* cells = malloc(MILL_TAPE_SIZE * sizeof(wchar_t));
+    char* line = NULL;
+    size_t line_cap = 0;
+    size_t run_cap = 0;
+    int res = wide == NULL || cells == NULL;
+    if (res != 0) {
+        perror("malloc");
+    }
+    else if (getline(&line, &line_cap, file) < 0 ||
+        strcmp(line, CAPTURE_HEADER "\n") != 0) {
+        fprintf(stderr, "error: %s: not a capture log\n", path);
+        res = 1;
+    }
+    for (size_t n = 2; res == 0 && getline(&line, &line_cap, file) >= 0; ++n) {
+        if (strncmp(line, "program ", 8) == 0) {
+            res = _capture_read_program(file, line + 8, log);
+            for (size_t i = 0; res == 0 && i < log->programs[log->program_count - 1].len; ++i) {
+                n += log->programs[log->program_count - 1].text[i] == '\n';
+            }
+        }
+        else if (strncmp(line, "run ", 4) == 0) {
+            res = _capture_read_run(line + 4, log, &run_cap, wide, cells);
+        }
+        else {
+            res = 1;
+        }
+        if (res != 0) {
+            fprintf(stderr, "error: %s: line %zu: malformed\n", path, n);
+        }
+    }
+    free(line);
+    free(cells);
+    free(wide);
+    fclose(file);
+    if (res != 0) {
+        capture_log_free(log);
+    }
+    return res;
+}
+
+
+#endif
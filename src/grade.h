@@ -0,0 +1,376 @@
+// Input families and expected-result expressions shared by the grading
+// tools.
+
+#ifndef GRADE_H
+#define GRADE_H
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#include "mill.h"
+
+
+enum GradeFamily {
+    GradeFamily_unary,
+    GradeFamily_sum,
+    GradeFamily_binary,
+};
+
+
+struct GradeSpec {
+    enum GradeFamily family;
+    size_t limit;
+    size_t count;
+};
+
+
+struct GradeVars {
+    long long n;
+    long long a;
+    long long b;
+    long long l;
+};
+
+
+struct GradeExpr {
+    const char* text;
+    const char* p;
+    const struct GradeVars* vars;
+    int error;
+    int domain;
+};
+
+
+static inline int
+grade_parse_family(const char* text, struct GradeSpec* spec) {
+    static const struct {
+        const char* name;
+        enum GradeFamily family;
+        size_t max;
+    } families[] = {
+        {"unary", GradeFamily_unary, MILL_TAPE_SIZE - 1},
+        {"sum", GradeFamily_sum, MILL_TAPE_SIZE / 2 - 1},
+        {"binary", GradeFamily_binary, 30},
+    };
+
+    const char* sep = strchr(text, ':');
+    if (sep == NULL) {
+        return 1;
+    }
+    char* end = NULL;
+    unsigned long long limit = strtoull(sep + 1, &end, 10);
+    if (sep[1] == '\0' || *end != '\0') {
+        return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(families) / sizeof(families[0]); ++i) {
+        size_t n = strlen(families[i].name);
+        if ((size_t) (sep - text) != n || strncmp(text, families[i].name, n) != 0) {
+            continue;
+        }
+        if (limit > families[i].max) {
+            return 1;
+        }
+        spec->family = families[i].family;
+        spec->limit = limit;
+        switch (spec->family) {
+            case GradeFamily_unary:
+                spec->count = limit + 1;
+                break;
+            case GradeFamily_sum:
+                spec->count = (limit + 1) * (limit + 1);
+                break;
+            case GradeFamily_binary:
+                spec->count = ((size_t) 2 << limit) - 1;
+                break;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+
+static inline size_t
+grade_input(const struct GradeSpec* spec, size_t index,
+    wchar_t* text, struct GradeVars* vars) {
+    size_t n = 0;
+    *vars = (struct GradeVars) {};
+
+    switch (spec->family) {
+        case GradeFamily_unary:
+            vars->n = index;
+            wmemset(text, L'|', index);
+            n = index;
+            break;
+
+        case GradeFamily_sum: {
+            size_t a = index / (spec->limit + 1);
+            size_t b = index % (spec->limit + 1);
+            vars->a = a;
+            vars->b = b;
+            wmemset(text, L'|', a);
+            text[a] = L'+';
+            wmemset(&text[a + 1], L'|', b);
+            n = a + b + 1;
+            break;
+        }
+
+        case GradeFamily_binary: {
+            size_t len = 0;
+            while (index >= ((size_t) 2 << len) - 1) {
+                ++len;
+            }
+            size_t value = index - (((size_t) 1 << len) - 1);
+            vars->n = value;
+            vars->l = len;
+            for (size_t i = 0; i < len; ++i) {
+                text[i] = (value >> (len - 1 - i)) & 1 ? L'1' : L'0';
+            }
+            n = len;
+            break;
+        }
+    }
+
+    text[n] = L'\0';
+    return n;
+}
+
+
+// The longest input in the family.
+static inline size_t
+grade_max_len(const struct GradeSpec* spec) {
+    return spec->family == GradeFamily_sum ? 2 * spec->limit + 1 : spec->limit;
+}
+
+
+// The cells that may follow the prefix text[0, len) in the family, L'\0'
+// standing for the end of the input. The end comes first, and the cell
+// that leads to the longest inputs last.
+static inline size_t
+grade_next(const struct GradeSpec* spec, const wchar_t* text, size_t len,
+    wchar_t next[3]) {
+    size_t n = 0;
+    switch (spec->family) {
+        case GradeFamily_unary:
+            next[n++] = L'\0';
+            if (len < spec->limit) {
+                next[n++] = L'|';
+            }
+            break;
+
+        case GradeFamily_sum: {
+            const wchar_t* plus = wmemchr(text, L'+', len);
+            if (plus == NULL) {
+                next[n++] = L'+';
+                if (len < spec->limit) {
+                    next[n++] = L'|';
+                }
+            }
+            else {
+                next[n++] = L'\0';
+                if (len - (size_t) (plus - text) - 1 < spec->limit) {
+                    next[n++] = L'|';
+                }
+            }
+            break;
+        }
+
+        case GradeFamily_binary:
+            next[n++] = L'\0';
+            if (len < spec->limit) {
+                next[n++] = L'0';
+                next[n++] = L'1';
+            }
+            break;
+    }
+    return n;
+}
+
+
+// The index grade_input gives text[0, len), an input of the family.
+static inline size_t
+grade_index(const struct GradeSpec* spec, const wchar_t* text, size_t len) {
+    switch (spec->family) {
+        case GradeFamily_unary:
+            return len;
+
+        case GradeFamily_sum: {
+            size_t a = (size_t) (wmemchr(text, L'+', len) - text);
+            return a * (spec->limit + 1) + (len - a - 1);
+        }
+
+        case GradeFamily_binary: {
+            size_t value = 0;
+            for (size_t i = 0; i < len; ++i) {
+                value = value * 2 + (text[i] == L'1');
+            }
+            return ((size_t) 1 << len) - 1 + value;
+        }
+    }
+    return 0;
+}
+
+
+static inline long long grade_expr_sum(struct GradeExpr* expr);
+
+
+static inline void
+grade_expr_space(struct GradeExpr* expr) {
+    while (*expr->p == ' ') {
+        ++expr->p;
+    }
+}
+
+
+static inline long long
+grade_expr_factor(struct GradeExpr* expr) {
+    grade_expr_space(expr);
+    char c = *expr->p;
+
+    if (c == '(') {
+        ++expr->p;
+        long long v = grade_expr_sum(expr);
+        grade_expr_space(expr);
+        if (*expr->p != ')') {
+            expr->error = 1;
+            return 0;
+        }
+        ++expr->p;
+        return v;
+    }
+    if (c == '-') {
+        ++expr->p;
+        long long v = grade_expr_factor(expr);
+        if (v == LLONG_MIN) {
+            expr->domain = 1;
+            return 0;
+        }
+        return -v;
+    }
+    if (c >= '0' && c <= '9') {
+        long long v = 0;
+        while (*expr->p >= '0' && *expr->p <= '9') {
+            int d = *expr->p++ - '0';
+            if (v > (LLONG_MAX - d) / 10) {
+                expr->error = 1;
+                return 0;
+            }
+            v = v * 10 + d;
+        }
+        return v;
+    }
+
+    if (c == '\0') {
+        expr->error = 1;
+        return 0;
+    }
+    ++expr->p;
+    switch (c) {
+        case 'n': return expr->vars->n;
+        case 'a': return expr->vars->a;
+        case 'b': return expr->vars->b;
+        case 'l': return expr->vars->l;
+        default:
+            expr->error = 1;
+            return 0;
+    }
+}
+
+
+static inline long long
+grade_expr_term(struct GradeExpr* expr) {
+    long long v = grade_expr_factor(expr);
+    for (;;) {
+        grade_expr_space(expr);
+        char op = *expr->p;
+        if (op != '*' && op != '/' && op != '%') {
+            return v;
+        }
+        ++expr->p;
+        long long r = grade_expr_factor(expr);
+        if (op == '*') {
+            if (__builtin_mul_overflow(v, r, &v)) {
+                expr->domain = 1;
+                v = 0;
+            }
+        }
+        else if (r == 0 || (r == -1 && v == LLONG_MIN)) {
+            expr->domain = 1;
+            v = 0;
+        }
+        else {
+            v = (op == '/') ? v / r : v % r;
+        }
+    }
+}
+
+
+static inline long long
+grade_expr_sum(struct GradeExpr* expr) {
+    long long v = grade_expr_term(expr);
+    for (;;) {
+        grade_expr_space(expr);
+        char op = *expr->p;
+        if (op != '+' && op != '-') {
+            return v;
+        }
+        ++expr->p;
+        long long r = grade_expr_term(expr);
+        if (op == '+' ? __builtin_add_overflow(v, r, &v) : __builtin_sub_overflow(v, r, &v)) {
+            expr->domain = 1;
+            v = 0;
+        }
+    }
+}
+
+
+static inline int
+grade_expr_eval(const char* text, const struct GradeVars* vars, long long* value) {
+    struct GradeExpr expr = {.text = text, .p = text, .vars = vars};
+    *value = grade_expr_sum(&expr);
+    grade_expr_space(&expr);
+    if (expr.error != 0 || *expr.p != '\0') {
+        return -1;
+    }
+    return expr.domain;
+}
+
+
+static inline int
+grade_expected(const struct GradeSpec* spec, long long value,
+    wchar_t* text, size_t textsize) {
+    if (value < 0) {
+        return 1;
+    }
+
+    size_t n = 0;
+    switch (spec->family) {
+        case GradeFamily_unary:
+        case GradeFamily_sum:
+            if ((unsigned long long) value >= textsize) {
+                return 1;
+            }
+            n = value;
+            wmemset(text, L'|', n);
+            break;
+
+        case GradeFamily_binary: {
+            size_t len = 1;
+            while (len < 63 && (value >> len) != 0) {
+                ++len;
+            }
+            for (size_t i = 0; i < len; ++i) {
+                text[i] = (value >> (len - 1 - i)) & 1 ? L'1' : L'0';
+            }
+            n = len;
+            break;
+        }
+    }
+    text[n] = L'\0';
+    return 0;
+}
+
+
+#endif
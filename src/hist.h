@@ -0,0 +1,156 @@
+// Log-linear histograms in the style of HdrHistogram: every power of two
+// is split into HIST_HALF buckets, so any recorded value is known to
+// within 1/HIST_HALF of itself whatever its magnitude.
+
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+
+#define HIST_SUB_BITS 8
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS ((66 - HIST_SUB_BITS) * HIST_HALF)
+
+
+struct Hist {
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+    uint64_t counts[HIST_BUCKETS];
+};
+
+
+static inline size_t
+hist_index(uint64_t value) {
+    if (value < 2 * HIST_HALF) {
+        return value;
+    }
+    unsigned shift = 63 - __builtin_clzll(value) - (HIST_SUB_BITS - 1);
+    return (shift + 1) * HIST_HALF + ((value >> shift) - HIST_HALF);
+}
+
+
+// The highest value that lands in bucket index.
+static inline uint64_t
+hist_value(size_t index) {
+    if (index < 2 * HIST_HALF) {
+        return index;
+    }
+    unsigned shift = index / HIST_HALF - 1;
+    uint64_t low = (uint64_t) (HIST_HALF + index % HIST_HALF) << shift;
+    return low + ((uint64_t) 1 << shift) - 1;
+}
+
+
+static inline void
+hist_clear(struct Hist* hist) {
+    memset(hist, 0, sizeof(*hist));
+}
+
+
+static inline void
+hist_record(struct Hist* hist, uint64_t value) {
+    if (hist->total == 0 || value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    hist->total += 1;
+    hist->sum += value;
+    hist->counts[hist_index(value)] += 1;
+}
+
+
+static inline void
+hist_merge(struct Hist* dst, const struct Hist* src) {
+    if (src->total == 0) {
+        return;
+    }
+    if (dst->total == 0 || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    dst->total += src->total;
+    dst->sum += src->sum;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        dst->counts[i] += src->counts[i];
+    }
+}
+
+
+// The smallest recorded value, to bucket precision, at or below which
+// lie `percent` percent of the values.
+static inline uint64_t
+hist_percentile(const struct Hist* hist, double percent) {
+    if (hist->total == 0) {
+        return 0;
+    }
+    uint64_t want = (uint64_t) (percent / 100 * hist->total + 0.5);
+    if (want == 0) {
+        want = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->counts[i];
+        if (seen >= want) {
+            uint64_t value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+
+static inline double
+hist_mean(const struct Hist* hist) {
+    return hist->total != 0 ? hist->sum / hist->total : 0.0;
+}
+
+
+// Prints the percentile spectrum as HdrHistogram does: value, percentile,
+// count at or below, and 1/(1-percentile), halving the distance to 100%
+// every `ticks` lines.
+static inline void
+hist_print_spectrum(FILE* file, const struct Hist* hist, double scale, unsigned ticks) {
+    fprintf(file, "%12s %14s %10s %14s\n", "Value", "Percentile", "TotalCount",
+        "1/(1-Percentile)");
+    if (hist->total == 0) {
+        return;
+    }
+    double percent = 0;
+    double step = 50.0 / ticks;
+    unsigned tick = 0;
+    for (;;) {
+        uint64_t value = hist_percentile(hist, percent);
+        uint64_t below = 0;
+        for (size_t i = 0; i <= hist_index(value) && i < HIST_BUCKETS; ++i) {
+            below += hist->counts[i];
+        }
+        double fraction = (double) below / hist->total;
+        if (fraction >= 1) {
+            fprintf(file, "%12.3f %14.12f %10llu\n", value / scale, 1.0,
+                (unsigned long long) below);
+            break;
+        }
+        fprintf(file, "%12.3f %14.12f %10llu %14.2f\n", value / scale, fraction,
+            (unsigned long long) below, 1 / (1 - fraction));
+        percent += step;
+        if (++tick == ticks) {
+            tick = 0;
+            step /= 2;
+        }
+        if (percent > 100) {
+            percent = 100;
+        }
+    }
+}
+
+
+#endif
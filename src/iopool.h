@@ -0,0 +1,208 @@
+// A pool of threads that read and write whole files, so that many small
+// files are in flight at once instead of each open, read and close
+// waiting behind the last. Requests are taken in the order they were
+// submitted and complete in any order, through their callback on a pool
+// thread.
+
+#ifndef IOPOOL_H
+#define IOPOOL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define IO_THREADS 16
+
+
+enum IoOp {
+    IoOp_read,
+    IoOp_write,
+};
+
+
+struct IoRequest {
+    enum IoOp op;
+    const char* path;
+    // A read fills these with the file and a terminating NUL; a write
+    // takes them as given.
+    char* data;
+    size_t size;
+    // The errno of a failed request, or 0.
+    int error;
+    void (*done)(struct IoRequest* req);
+    void* arg;
+    struct IoRequest* next;
+};
+
+
+struct IoPool {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct IoRequest* head;
+    struct IoRequest* tail;
+    int closing;
+    size_t thread_count;
+    pthread_t threads[IO_THREADS];
+};
+
+
+static inline int
+io_read_file(const char* path, char** data, size_t* size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno;
+    }
+    struct stat st;
+    size_t cap = (fstat(fd, &st) == 0 && st.st_size > 0) ? (size_t) st.st_size + 1 : 4096;
+    char* buf = malloc(cap);
+    size_t n = 0;
+    int error = buf == NULL ? ENOMEM : 0;
+    while (error == 0) {
+        if (n + 1 >= cap) {
+            void* p = realloc(buf, cap * 2);
+            if (p == NULL) {
+                error = ENOMEM;
+                break;
+            }
+            buf = p;
+            cap *= 2;
+        }
+        ssize_t got = read(fd, &buf[n], cap - n - 1);
+        if (got < 0 && errno != EINTR) {
+            error = errno;
+        }
+        else if (got == 0) {
+            break;
+        }
+        else if (got > 0) {
+            n += got;
+        }
+    }
+    close(fd);
+    if (error != 0) {
+        free(buf);
+        return error;
+    }
+    buf[n] = '\0';
+    *data = buf;
+    *size = n;
+    return 0;
+}
+
+
+static inline int
+io_write_file(const char* path, const char* data, size_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return errno;
+    }
+    int error = 0;
+    for (size_t n = 0; n < size && error == 0;) {
+        ssize_t put = write(fd, &data[n], size - n);
+        if (put < 0 && errno != EINTR) {
+            error = errno;
+        }
+        else if (put > 0) {
+            n += put;
+        }
+    }
+    if (close(fd) != 0 && error == 0) {
+        error = errno;
+    }
+    return error;
+}
+
+
+static inline void*
+_io_thread(void* arg) {
+    struct IoPool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->head == NULL && pool->closing == 0) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        struct IoRequest* req = pool->head;
+        if (req == NULL) {
+            break;
+        }
+        pool->head = req->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (req->op == IoOp_read) {
+            req->error = io_read_file(req->path, &req->data, &req->size);
+        }
+        else {
+            req->error = io_write_file(req->path, req->data, req->size);
+        }
+        if (req->done != NULL) {
+            req->done(req);
+        }
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+
+// Starts up to IO_THREADS threads; fails only if none start.
+static inline int
+io_pool_start(struct IoPool* pool, size_t threads) {
+    *pool = (struct IoPool) {};
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    if (threads > IO_THREADS) {
+        threads = IO_THREADS;
+    }
+    while (pool->thread_count < threads &&
+        pthread_create(&pool->threads[pool->thread_count], NULL, _io_thread, pool) == 0) {
+        pool->thread_count += 1;
+    }
+    if (pool->thread_count == 0) {
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+        return 1;
+    }
+    return 0;
+}
+
+
+static inline void
+io_submit(struct IoPool* pool, struct IoRequest* req) {
+    req->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail != NULL) {
+        pool->tail->next = req;
+    }
+    else {
+        pool->head = req;
+    }
+    pool->tail = req;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+// Completes every request submitted so far and stops the threads.
+static inline void
+io_pool_finish(struct IoPool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->closing = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->thread_count; ++i) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+
+#endif
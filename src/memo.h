@@ -0,0 +1,246 @@
+// A bounded map from input tapes to the results of running them, shared
+// by every thread that runs one program. Entries never change once in
+// the map and are reference counted, so a lookup holds its shard's lock
+// only while it probes, and copies the output after letting go. Each
+// shard keeps to its part of the byte budget, evicting by CLOCK.
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "mill.h"
+
+
+#define MEMO_SHARDS 16
+
+
+struct MemoEntry {
+    atomic_size_t refs;
+    uint64_t hash;
+    size_t len;
+    int status;
+    size_t steps;
+    ptrdiff_t offset;
+    size_t bytes;
+    // Owned by the shard, under its lock.
+    struct MemoEntry* next;
+    int used;
+    // The input, then the output if the run halted, in one block.
+    wchar_t* output;
+    wchar_t input[];
+};
+
+
+// buckets has cap chains, cap being a power of two, and is rebuilt from
+// the ring whenever the ring grows, so chains stay short.
+struct MemoShard {
+    pthread_mutex_t lock;
+    struct MemoEntry** buckets;
+    struct MemoEntry** ring;
+    size_t count;
+    size_t cap;
+    size_t hand;
+    size_t bytes;
+};
+
+
+struct Memo {
+    size_t budget;
+    atomic_size_t hits;
+    atomic_size_t misses;
+    atomic_size_t evicted;
+    struct MemoShard shards[MEMO_SHARDS];
+};
+
+
+// A memo holding at most about `bytes` of tapes and outputs.
+static inline struct Memo*
+memo_new(size_t bytes) {
+    struct Memo* memo = calloc(1, sizeof(*memo));
+    if (memo == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    memo->budget = bytes / MEMO_SHARDS;
+    for (size_t i = 0; i < MEMO_SHARDS; ++i) {
+        pthread_mutex_init(&memo->shards[i].lock, NULL);
+    }
+    return memo;
+}
+
+
+static inline void
+memo_release(struct MemoEntry* entry) {
+    if (entry != NULL && atomic_fetch_sub(&entry->refs, 1) == 1) {
+        free(entry);
+    }
+}
+
+
+static inline void
+memo_free(struct Memo* memo) {
+    if (memo == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < MEMO_SHARDS; ++i) {
+        struct MemoShard* shard = &memo->shards[i];
+        for (size_t k = 0; k < shard->count; ++k) {
+            memo_release(shard->ring[k]);
+        }
+        free(shard->ring);
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(memo);
+}
+
+
+static inline struct MemoEntry**
+_memo_bucket(struct MemoShard* shard, uint64_t hash) {
+    return &shard->buckets[(hash / MEMO_SHARDS) & (shard->cap - 1)];
+}
+
+
+static inline struct MemoEntry*
+_memo_probe(struct MemoShard* shard, uint64_t hash, const wchar_t* input, size_t len) {
+    if (shard->cap == 0) {
+        return NULL;
+    }
+    for (struct MemoEntry* e = *_memo_bucket(shard, hash); e != NULL; e = e->next) {
+        if (e->hash == hash && e->len == len && wmemcmp(e->input, input, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+
+// The entry for input, whose hash is given, with a reference the caller
+// gives back through memo_release; or NULL.
+static inline struct MemoEntry*
+memo_get(struct Memo* memo, uint64_t hash, const wchar_t* input, size_t len) {
+    struct MemoShard* shard = &memo->shards[hash % MEMO_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    struct MemoEntry* entry = _memo_probe(shard, hash, input, len);
+    if (entry != NULL) {
+        entry->used = 1;
+        atomic_fetch_add(&entry->refs, 1);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    atomic_fetch_add(entry != NULL ? &memo->hits : &memo->misses, 1);
+    return entry;
+}
+
+
+// Drops the first entry the hand finds unused since it last passed,
+// filling its slot from the end of the ring.
+static inline void
+_memo_evict(struct Memo* memo, struct MemoShard* shard) {
+    for (;;) {
+        if (shard->hand >= shard->count) {
+            shard->hand = 0;
+        }
+        struct MemoEntry* victim = shard->ring[shard->hand];
+        if (victim->used != 0) {
+            victim->used = 0;
+            shard->hand += 1;
+            continue;
+        }
+
+        struct MemoEntry** link = _memo_bucket(shard, victim->hash);
+        while (*link != victim) {
+            link = &(*link)->next;
+        }
+        *link = victim->next;
+        struct MemoEntry* last = shard->ring[--shard->count];
+        shard->ring[shard->hand] = last;
+        shard->bytes -= victim->bytes;
+        atomic_fetch_add(&memo->evicted, 1);
+        memo_release(victim);
+        return;
+    }
+}
+
+
+// Keeps the result of running input. Runs cut short by a deadline are
+// not kept, as another run of the same tape could go further.
+static inline void
+memo_put(struct Memo* memo, uint64_t hash, const wchar_t* input, size_t len,
+    int status, size_t steps, const wchar_t* output, ptrdiff_t offset) {
+    if (status > 0 && steps < MILL_STEPS_MAX) {
+        return;
+    }
+    size_t output_len = output != NULL ? wcslen(output) : 0;
+    size_t cells = len + (output != NULL ? output_len + 1 : 0);
+    size_t bytes = sizeof(struct MemoEntry) + cells * sizeof(wchar_t);
+    if (bytes > memo->budget) {
+        return;
+    }
+    struct MemoEntry* entry = malloc(bytes);
+    if (entry == NULL) {
+        return;
+    }
+    *entry = (struct MemoEntry) {
+        .hash = hash,
+        .len = len,
+        .status = status,
+        .steps = steps,
+        .offset = offset,
+        .bytes = bytes,
+    };
+    atomic_init(&entry->refs, 1);
+    wmemcpy(entry->input, input, len);
+    if (output != NULL) {
+        entry->output = &entry->input[len];
+        wmemcpy(entry->output, output, output_len + 1);
+    }
+
+    struct MemoShard* shard = &memo->shards[entry->hash % MEMO_SHARDS];
+    pthread_mutex_lock(&shard->lock);
+    if (_memo_probe(shard, entry->hash, input, len) != NULL) {
+        pthread_mutex_unlock(&shard->lock);
+        free(entry);
+        return;
+    }
+    while (shard->count > 0 && shard->bytes + bytes > memo->budget) {
+        _memo_evict(memo, shard);
+    }
+    if (shard->count == shard->cap) {
+        size_t cap = shard->cap != 0 ? shard->cap * 2 : 64;
+        void* p = realloc(shard->ring, cap * sizeof(shard->ring[0]));
+        struct MemoEntry** buckets = calloc(cap, sizeof(buckets[0]));
+        if (p != NULL) {
+            shard->ring = p;
+        }
+        if (p == NULL || buckets == NULL) {
+            pthread_mutex_unlock(&shard->lock);
+            free(buckets);
+            free(entry);
+            return;
+        }
+        free(shard->buckets);
+        shard->buckets = buckets;
+        shard->cap = cap;
+        for (size_t k = 0; k < shard->count; ++k) {
+            struct MemoEntry** bucket = _memo_bucket(shard, shard->ring[k]->hash);
+            shard->ring[k]->next = *bucket;
+            *bucket = shard->ring[k];
+        }
+    }
+    struct MemoEntry** bucket = _memo_bucket(shard, entry->hash);
+    entry->next = *bucket;
+    *bucket = entry;
+    shard->ring[shard->count++] = entry;
+    shard->bytes += bytes;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+#endif
@@ -0,0 +1,702 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+
+
+static const char _usage[] =
+    "usage: mill-load -s SOCKET -m MIX [-c CONNS] [-r RATE] [-n COUNT | -d SECONDS] [-H]\n";
+
+static const char _help_page[] =
+    "usage: mill-load -s SOCKET -m MIX [-c CONNS] [-r RATE] [-n COUNT | -d SECONDS] [-H]\n"
+    "\n"
+    "Replay programs and tapes against mill --serve and report latency\n"
+    "\n"
+    "options:\n"
+    "  -h, --help            show this help\n"
+    "  -s, --socket SOCKET   server socket\n"
+    "  -m, --mix MIX         requests to replay in turn, one PROG TAPE per\n"
+    "                          line, PROG being a program file\n"
+    "  -c, --conns CONNS     connections to spread requests over (default 4)\n"
+    "  -r, --rate RATE       send RATE requests/s whatever the replies;\n"
+    "                          by default each connection waits for its reply\n"
+    "  -n, --count COUNT     requests to send (default 1000)\n"
+    "  -d, --duration SECONDS\n"
+    "                        send requests for SECONDS instead\n"
+    "  -H, --histogram       print the full latency percentile spectrum\n"
+    "\n"
+    "With -r, latency counts from when a request was due to be sent, so a\n"
+    "stalled server is not hidden by requests that were never sent.\n"
+    ;
+
+
+struct AppArgs {
+    int needs_help;
+    int spectrum;
+    size_t conns;
+    double rate;
+    size_t count;
+    double duration;
+    const char* socket;
+    const char* mix;
+};
+
+
+static void
+arg_error(const char* message) {
+    fputs(_usage, stderr);
+    fprintf(stderr, "error: %s\n", message);
+}
+
+
+static void
+arg_perror(const char* message) {
+    perror(message);
+    fputs(_usage, stderr);
+}
+
+
+static int
+parse_args(int argc, const char* argv[], struct AppArgs* args) {
+    *args = (struct AppArgs) {.conns = 4};
+    int state = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        switch (state) {
+            case 0:
+                if (strcmp(argv[i], "-h") == 0 ||
+                    strcmp(argv[i], "--help") == 0) {
+                    args->needs_help = 1;
+                }
+                else if (strcmp(argv[i], "-s") == 0 ||
+                    strcmp(argv[i], "--socket") == 0) {
+                    state = 1;
+                }
+                else if (strcmp(argv[i], "-m") == 0 ||
+                    strcmp(argv[i], "--mix") == 0) {
+                    state = 2;
+                }
+                else if (strcmp(argv[i], "-c") == 0 ||
+                    strcmp(argv[i], "--conns") == 0) {
+                    state = 3;
+                }
+                else if (strcmp(argv[i], "-r") == 0 ||
+                    strcmp(argv[i], "--rate") == 0) {
+                    state = 4;
+                }
+                else if (strcmp(argv[i], "-n") == 0 ||
+                    strcmp(argv[i], "--count") == 0) {
+                    state = 5;
+                }
+                else if (strcmp(argv[i], "-d") == 0 ||
+                    strcmp(argv[i], "--duration") == 0) {
+                    state = 6;
+                }
+                else if (strcmp(argv[i], "-H") == 0 ||
+                    strcmp(argv[i], "--histogram") == 0) {
+                    args->spectrum = 1;
+                }
+                else {
+                    arg_error("unknown argument");
+                    return 1;
+                }
+                break;
+
+            case 1:
+                args->socket = argv[i];
+                state = 0;
+                break;
+
+            case 2:
+                args->mix = argv[i];
+                state = 0;
+                break;
+
+            case 3:
+            case 5: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0) {
+                    arg_error(state == 3 ? "-c/--conns: expected a positive number" :
+                        "-n/--count: expected a positive number");
+                    return 1;
+                }
+                if (state == 3) {
+                    args->conns = n;
+                }
+                else {
+                    args->count = n;
+                }
+                state = 0;
+                break;
+            }
+
+            case 4:
+            case 6: {
+                char* end = NULL;
+                double x = strtod(argv[i], &end);
+                if (*end != '\0' || !(x > 0)) {
+                    arg_error(state == 4 ? "-r/--rate: expected requests per second" :
+                        "-d/--duration: expected seconds");
+                    return 1;
+                }
+                if (state == 4) {
+                    args->rate = x;
+                }
+                else {
+                    args->duration = x;
+                }
+                state = 0;
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    if (args->needs_help != 0) {
+        return 0;
+    }
+
+    if (args->socket == NULL || args->mix == NULL) {
+        arg_error("-s/--socket and -m/--mix are required");
+        return 1;
+    }
+    if (args->count != 0 && args->duration != 0) {
+        arg_error("-n/--count: conflicting -d/--duration");
+        return 1;
+    }
+    if (args->count == 0 && args->duration == 0) {
+        args->count = 1000;
+    }
+
+    return 0;
+}
+
+
+struct LoadProgram {
+    char* path;
+    char* text;
+    size_t len;
+};
+
+
+struct LoadItem {
+    size_t program;
+    char* tape;
+};
+
+
+struct LoadMix {
+    struct LoadProgram* programs;
+    size_t program_count;
+    struct LoadItem* items;
+    size_t item_count;
+};
+
+
+static void
+load_mix_free(struct LoadMix* mix) {
+    for (size_t i = 0; i < mix->program_count; ++i) {
+        free(mix->programs[i].path);
+        free(mix->programs[i].text);
+    }
+    for (size_t i = 0; i < mix->item_count; ++i) {
+        free(mix->items[i].tape);
+    }
+    free(mix->programs);
+    free(mix->items);
+}
+
+
+static int
+load_read_file(const char* path, char** text, size_t* len) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    char* buf = NULL;
+    size_t cap = 0;
+    size_t n = 0;
+    for (;;) {
+        if (n == cap) {
+            cap = cap != 0 ? cap * 2 : 4096;
+            void* p = realloc(buf, cap);
+            if (p == NULL) {
+                perror("malloc");
+                free(buf);
+                fclose(file);
+                return 1;
+            }
+            buf = p;
+        }
+        size_t got = fread(&buf[n], 1, cap - n, file);
+        n += got;
+        if (got == 0) {
+            break;
+        }
+    }
+    fclose(file);
+    *text = buf;
+    *len = n;
+    return 0;
+}
+
+
+// Reads PROG TAPE lines; each program file is read once.
+static int
+load_read_mix(const char* path, struct LoadMix* mix) {
+    *mix = (struct LoadMix) {};
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        arg_perror("-m/--mix");
+        return 1;
+    }
+
+    int res = 0;
+    size_t program_cap = 0;
+    size_t item_cap = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    size_t line_no = 0;
+    while (getline(&line, &line_cap, file) > 0) {
+        ++line_no;
+        char* save = NULL;
+        char* prog = strtok_r(line, " \t\r\n", &save);
+        char* tape = strtok_r(NULL, " \t\r\n", &save);
+        if (prog == NULL) {
+            continue;
+        }
+
+        size_t p = 0;
+        while (p < mix->program_count && strcmp(mix->programs[p].path, prog) != 0) {
+            ++p;
+        }
+        if (p == mix->program_count) {
+            if (p == program_cap) {
+                program_cap = program_cap != 0 ? program_cap * 2 : 8;
+                void* q = realloc(mix->programs, program_cap * sizeof(mix->programs[0]));
+                if (q == NULL) {
+                    perror("malloc");
+                    res = 1;
+                    break;
+                }
+                mix->programs = q;
+            }
+            struct LoadProgram* program = &mix->programs[p];
+            *program = (struct LoadProgram) {.path = strdup(prog)};
+            mix->program_count += 1;
+            if (program->path == NULL ||
+                load_read_file(prog, &program->text, &program->len) != 0) {
+                fprintf(stderr, "error: %s:%zu: cannot read program\n", path, line_no);
+                res = 1;
+                break;
+            }
+        }
+
+        if (mix->item_count == item_cap) {
+            item_cap = item_cap != 0 ? item_cap * 2 : 64;
+            void* q = realloc(mix->items, item_cap * sizeof(mix->items[0]));
+            if (q == NULL) {
+                perror("malloc");
+                res = 1;
+                break;
+            }
+            mix->items = q;
+        }
+        mix->items[mix->item_count++] = (struct LoadItem) {
+            .program = p,
+            .tape = strdup(tape != NULL ? tape : ""),
+        };
+    }
+    free(line);
+    fclose(file);
+
+    if (res == 0 && mix->item_count == 0) {
+        fprintf(stderr, "error: %s: no requests\n", path);
+        res = 1;
+    }
+    if (res != 0) {
+        load_mix_free(mix);
+    }
+    return res;
+}
+
+
+struct LoadConn {
+    int fd;
+    size_t program;
+    size_t outstanding;
+    char* in;
+    size_t in_len;
+    size_t in_cap;
+    char* out;
+    size_t out_sent;
+    size_t out_len;
+    size_t out_cap;
+};
+
+
+struct LoadStats {
+    struct Hist latency;
+    size_t sent;
+    size_t halted;
+    size_t failed;
+    size_t timeouts;
+    size_t invalid;
+    size_t protocol;
+};
+
+
+static double
+_seconds(const struct timespec* t) {
+    return t->tv_sec + t->tv_nsec * 1e-9;
+}
+
+
+static uint64_t
+_ns_between(const struct timespec* a, const struct timespec* b) {
+    int64_t ns = (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+    return ns > 0 ? (uint64_t) ns : 0;
+}
+
+
+static int
+_reserve(char** buf, size_t* cap, size_t need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t n = *cap != 0 ? *cap : 4096;
+    while (n < need) {
+        n *= 2;
+    }
+    void* p = realloc(*buf, n);
+    if (p == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+
+// Queues request id on conn, switching the connection's program first
+// if the item needs another one.
+static int
+load_queue(struct LoadConn* conn, const struct LoadMix* mix, size_t id) {
+    const struct LoadItem* item = &mix->items[id % mix->item_count];
+    const struct LoadProgram* program = &mix->programs[item->program];
+    size_t tape_len = strlen(item->tape);
+    if (_reserve(&conn->out, &conn->out_cap,
+        conn->out_len + program->len + tape_len + 64) != 0) {
+        return 1;
+    }
+    if (conn->program != item->program) {
+        conn->out_len += sprintf(&conn->out[conn->out_len], "program %zu\n", program->len);
+        memcpy(&conn->out[conn->out_len], program->text, program->len);
+        conn->out_len += program->len;
+        conn->program = item->program;
+    }
+    conn->out_len += sprintf(&conn->out[conn->out_len], "run %zu %s\n", id, item->tape);
+    conn->outstanding += 1;
+    return 0;
+}
+
+
+// Handles the reply lines read so far.
+static void
+load_replies(struct LoadConn* conn, struct LoadStats* stats,
+    const struct timespec* due, size_t due_count) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    size_t start = 0;
+    for (;;) {
+        char* line = &conn->in[start];
+        char* nl = memchr(line, '\n', conn->in_len - start);
+        if (nl == NULL) {
+            break;
+        }
+        *nl = '\0';
+        start = nl - conn->in + 1;
+
+        if (strncmp(line, "program ok", 10) == 0) {
+            continue;
+        }
+        char* end = NULL;
+        size_t id = strtoull(line, &end, 10);
+        if (end == line || *end != ' ' || id >= due_count) {
+            stats->protocol += 1;
+            continue;
+        }
+        conn->outstanding -= 1;
+        hist_record(&stats->latency, _ns_between(&due[id], &now));
+
+        const char* status = end + 1;
+        if (strncmp(status, "halted ", 7) == 0) {
+            stats->halted += 1;
+        }
+        else if (strncmp(status, "error ", 6) == 0) {
+            stats->failed += 1;
+        }
+        else if (strncmp(status, "timeout ", 8) == 0 || strncmp(status, "deadline ", 9) == 0) {
+            stats->timeouts += 1;
+        }
+        else {
+            stats->invalid += 1;
+        }
+    }
+    memmove(conn->in, &conn->in[start], conn->in_len - start);
+    conn->in_len -= start;
+}
+
+
+static int
+load_connect(const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: -s/--socket: path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static void
+load_print(FILE* file, const struct LoadStats* stats, double seconds, int spectrum) {
+    size_t done = stats->latency.total;
+    fprintf(file, "%zu requests in %.3f s (%.1f req/s): %zu halted, %zu errors, "
+        "%zu timeouts, %zu invalid", stats->sent, seconds,
+        seconds > 0 ? done / seconds : 0.0,
+        stats->halted, stats->failed, stats->timeouts, stats->invalid);
+    if (stats->sent > done) {
+        fprintf(file, ", %zu unanswered", stats->sent - done);
+    }
+    if (stats->protocol > 0) {
+        fprintf(file, ", %zu bad replies", stats->protocol);
+    }
+    fputc('\n', file);
+
+    const struct Hist* h = &stats->latency;
+    fprintf(file, "latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+        "p99.9 %.1f  max %.1f  mean %.1f\n",
+        h->min / 1e3, hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+        hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+        h->max / 1e3, hist_mean(h) / 1e3);
+    if (spectrum != 0) {
+        fputc('\n', file);
+        hist_print_spectrum(file, h, 1e3, 5);
+    }
+}
+
+
+static int
+load_run(const struct AppArgs* args, const struct LoadMix* mix, struct LoadStats* stats) {
+    size_t conn_count = args->conns;
+    struct LoadConn* conns = calloc(conn_count, sizeof(conns[0]));
+    struct pollfd* fds = calloc(conn_count, sizeof(fds[0]));
+    size_t due_cap = args->count != 0 ? args->count : 4096;
+    struct timespec* due = malloc(due_cap * sizeof(due[0]));
+    if (conns == NULL || fds == NULL || due == NULL) {
+        perror("malloc");
+        free(conns);
+        free(fds);
+        free(due);
+        return 1;
+    }
+
+    int res = 0;
+    size_t opened = 0;
+    for (; opened < conn_count; ++opened) {
+        conns[opened] = (struct LoadConn) {.program = SIZE_MAX};
+        conns[opened].fd = load_connect(args->socket);
+        if (conns[opened].fd < 0) {
+            res = 1;
+            break;
+        }
+    }
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    double interval = args->rate > 0 ? 1 / args->rate : 0;
+    size_t next = 0;
+    while (res == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double elapsed = _seconds(&now) - _seconds(&start);
+        int sending = args->count != 0 ? next < args->count : elapsed < args->duration;
+
+        // Open loop: everything due by now goes out, round robin. Closed
+        // loop: each idle connection sends its next request.
+        while (sending != 0) {
+            struct LoadConn* conn = NULL;
+            struct timespec when = now;
+            if (interval > 0) {
+                double at = _seconds(&start) + next * interval;
+                if (at > _seconds(&now)) {
+                    break;
+                }
+                when.tv_sec = (time_t) at;
+                when.tv_nsec = (long) ((at - when.tv_sec) * 1e9);
+                conn = &conns[next % conn_count];
+            }
+            else {
+                for (size_t i = 0; i < conn_count && conn == NULL; ++i) {
+                    if (conns[i].outstanding == 0) {
+                        conn = &conns[i];
+                    }
+                }
+                if (conn == NULL) {
+                    break;
+                }
+            }
+
+            if (next == due_cap) {
+                due_cap *= 2;
+                void* p = realloc(due, due_cap * sizeof(due[0]));
+                if (p == NULL) {
+                    perror("malloc");
+                    res = 1;
+                    break;
+                }
+                due = p;
+            }
+            due[next] = when;
+            if (load_queue(conn, mix, next) != 0) {
+                res = 1;
+                break;
+            }
+            ++next;
+            stats->sent = next;
+            sending = args->count != 0 ? next < args->count : elapsed < args->duration;
+        }
+        if (res != 0) {
+            break;
+        }
+
+        size_t outstanding = 0;
+        for (size_t i = 0; i < conn_count; ++i) {
+            outstanding += conns[i].outstanding;
+            fds[i] = (struct pollfd) {
+                .fd = conns[i].fd,
+                .events = POLLIN | (conns[i].out_sent < conns[i].out_len ? POLLOUT : 0),
+            };
+        }
+        if (sending == 0 && outstanding == 0) {
+            break;
+        }
+
+        int timeout = -1;
+        if (sending != 0 && interval > 0) {
+            double at = _seconds(&start) + next * interval - _seconds(&now);
+            timeout = at > 0 ? (int) ceil(at * 1e3) : 0;
+        }
+        else if (sending == 0 && args->duration > 0) {
+            timeout = 1000;
+        }
+        int n = poll(fds, conn_count, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("poll");
+            res = 1;
+            break;
+        }
+
+        for (size_t i = 0; n > 0 && i < conn_count; ++i) {
+            struct LoadConn* conn = &conns[i];
+            if (fds[i].revents & POLLOUT) {
+                ssize_t k = send(conn->fd, &conn->out[conn->out_sent],
+                    conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+                if (k < 0 && errno != EAGAIN) {
+                    perror("send");
+                    res = 1;
+                    break;
+                }
+                conn->out_sent += k > 0 ? k : 0;
+                if (conn->out_sent == conn->out_len) {
+                    conn->out_sent = 0;
+                    conn->out_len = 0;
+                }
+            }
+            if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (_reserve(&conn->in, &conn->in_cap, conn->in_len + 65536) != 0) {
+                    res = 1;
+                    break;
+                }
+                ssize_t k = read(conn->fd, &conn->in[conn->in_len], conn->in_cap - conn->in_len);
+                if (k == 0 || (k < 0 && errno != EAGAIN)) {
+                    fprintf(stderr, "error: server closed the connection\n");
+                    res = 1;
+                    break;
+                }
+                if (k > 0) {
+                    conn->in_len += k;
+                    load_replies(conn, stats, due, next);
+                }
+            }
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    load_print(stdout, stats, _seconds(&now) - _seconds(&start), args->spectrum);
+
+    for (size_t i = 0; i < opened; ++i) {
+        close(conns[i].fd);
+        free(conns[i].in);
+        free(conns[i].out);
+    }
+    free(conns);
+    free(fds);
+    free(due);
+    return res;
+}
+
+
+int main(int argc, const char* argv[]) {
+    struct AppArgs args = {};
+    int res = parse_args(argc, argv, &args);
+    if (res != 0) { return res; }
+
+    if (args.needs_help) {
+        puts(_help_page);
+        return 0;
+    }
+
+    struct LoadMix mix;
+    res = load_read_mix(args.mix, &mix);
+    if (res != 0) { return res; }
+
+    struct LoadStats* stats = calloc(1, sizeof(*stats));
+    if (stats == NULL) {
+        perror("malloc");
+        load_mix_free(&mix);
+        return 1;
+    }
+    res = load_run(&args, &mix, stats);
+
+    free(stats);
+    load_mix_free(&mix);
+    return res;
+}
@@ -0,0 +1,840 @@
+#define _GNU_SOURCE
+#include <locale.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "mill.h"
+#include "grade.h"
+
+
+static const char _usage[] =
+    "usage: mill-opt -p PROG (-g FAMILY -e EXPR | -T TESTS) [-o OUT] [-r ROUNDS] [-j N]\n";
+
+static const char _help_page[] =
+    "usage: mill-opt -p PROG (-g FAMILY -e EXPR | -T TESTS) [-o OUT] [-r ROUNDS] [-j N]\n"
+    "\n"
+    "Search for an equivalent program with fewer steps or states\n"
+    "\n"
+    "options:\n"
+    "  -h, --help            show this help\n"
+    "  -p, --program PROG    program text or file\n"
+    "  -g, --grade FAMILY    test inputs: unary:N, sum:N or binary:L\n"
+    "  -e, --expect EXPR     expected result, as for mill -g\n"
+    "  -T, --tests FILE      test set, one INPUT<tab>EXPECTED per line\n"
+    "  -o, --output OUT      write the optimized program to OUT\n"
+    "  -r, --rounds ROUNDS   stop after ROUNDS improvements (default 100)\n"
+    "  -j, --jobs N          number of worker threads\n"
+    "\n"
+    "Each round tries every rule redirection, written symbol change and\n"
+    "merge of two states, then pairs of them if none helps, and keeps the\n"
+    "candidate that passes all tests with the fewest total steps, then\n"
+    "the fewest states.\n"
+    ;
+
+
+struct AppArgs {
+    int needs_help;
+    size_t rounds;
+    size_t jobs;
+    const char* program;
+    const char* grade;
+    const char* expect;
+    const char* tests;
+    const char* output;
+};
+
+
+static void
+arg_error(const char* message) {
+    fputs(_usage, stderr);
+    fprintf(stderr, "error: %s\n", message);
+}
+
+
+static void
+arg_perror(const char* message) {
+    perror(message);
+    fputs(_usage, stderr);
+}
+
+
+static int
+parse_args(int argc, const char* argv[], struct AppArgs* args) {
+    *args = (struct AppArgs) {.rounds = 100};
+    int state = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        switch (state) {
+            case 0:
+                if (strcmp(argv[i], "-h") == 0 ||
+                    strcmp(argv[i], "--help") == 0) {
+                    args->needs_help = 1;
+                }
+                else if (strcmp(argv[i], "-p") == 0 ||
+                    strcmp(argv[i], "--program") == 0) {
+                    state = 1;
+                }
+                else if (strcmp(argv[i], "-g") == 0 ||
+                    strcmp(argv[i], "--grade") == 0) {
+                    state = 2;
+                }
+                else if (strcmp(argv[i], "-e") == 0 ||
+                    strcmp(argv[i], "--expect") == 0) {
+                    state = 3;
+                }
+                else if (strcmp(argv[i], "-T") == 0 ||
+                    strcmp(argv[i], "--tests") == 0) {
+                    state = 4;
+                }
+                else if (strcmp(argv[i], "-o") == 0 ||
+                    strcmp(argv[i], "--output") == 0) {
+                    state = 5;
+                }
+                else if (strcmp(argv[i], "-r") == 0 ||
+                    strcmp(argv[i], "--rounds") == 0) {
+                    state = 6;
+                }
+                else if (strcmp(argv[i], "-j") == 0 ||
+                    strcmp(argv[i], "--jobs") == 0) {
+                    state = 7;
+                }
+                else {
+                    arg_error("unknown argument");
+                    return 1;
+                }
+                break;
+
+            case 1:
+                args->program = argv[i];
+                state = 0;
+                break;
+
+            case 2:
+                args->grade = argv[i];
+                state = 0;
+                break;
+
+            case 3:
+                args->expect = argv[i];
+                state = 0;
+                break;
+
+            case 4:
+                args->tests = argv[i];
+                state = 0;
+                break;
+
+            case 5:
+                args->output = argv[i];
+                state = 0;
+                break;
+
+            case 6:
+            case 7: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0) {
+                    arg_error(state == 6 ? "-r/--rounds: expected a positive number" :
+                        "-j/--jobs: expected a positive number");
+                    return 1;
+                }
+                if (state == 6) {
+                    args->rounds = n;
+                }
+                else {
+                    args->jobs = n;
+                }
+                state = 0;
+                break;
+            }
+
+            default:
+                break;
+        }
+    }
+
+    if (args->needs_help != 0) {
+        return 0;
+    }
+
+    if (args->program == NULL) {
+        arg_error("-p/--program is required");
+        return 1;
+    }
+    if ((args->grade == NULL) == (args->tests == NULL)) {
+        arg_error("expected one of -g/--grade or -T/--tests");
+        return 1;
+    }
+    if (args->grade != NULL && args->expect == NULL) {
+        arg_error("-g/--grade requires -e/--expect");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+struct OptTest {
+    wchar_t* input;
+    size_t len;
+    wchar_t* expected;
+    atomic_size_t failures;
+};
+
+
+enum OptRewriteKind {
+    OptRewrite_redirect,
+    OptRewrite_write,
+    OptRewrite_merge,
+};
+
+
+// One local change to the op table: point rule `index` at state `value`,
+// make it write `value`, or fold state `index` into state `value`.
+struct OptRewrite {
+    enum OptRewriteKind kind;
+    size_t index;
+    size_t value;
+};
+
+
+// Pairs of rewrites are tried only when no single rewrite helps, and only
+// for programs small enough that the square stays cheap.
+#define OPT_PAIRS_MAX 1024
+
+
+struct OptScore {
+    size_t steps;
+    size_t states;
+};
+
+
+struct OptContext {
+    const struct MillCode* code;
+    const struct MillOp* ops;
+    size_t count;
+    struct OptTest* tests;
+    size_t test_count;
+    size_t* order;
+    struct OptScore best;
+
+    const struct OptRewrite* rewrites;
+    size_t rewrite_count;
+    int pairs;
+    size_t candidate_count;
+    atomic_size_t next;
+
+    pthread_mutex_t lock;
+    size_t found;
+    struct OptScore found_score;
+};
+
+
+// States reachable from INIT through defined rules, HALT excluded.
+static size_t
+opt_live_states(const struct MillCode* code, const struct MillOp* ops,
+    uint8_t* live) {
+    size_t stack[MILL_STATES_MAX + 1];
+    size_t top = 0;
+    size_t n = 0;
+    memset(live, 0, code->states);
+    stack[top++] = code->syminit;
+    live[code->syminit] = 1;
+    while (top > 0) {
+        size_t s = stack[--top];
+        if (s == code->symhalt) {
+            continue;
+        }
+        ++n;
+        for (size_t c = 0; c < code->symbols; ++c) {
+            size_t next = ops[s * code->symbols + c].state;
+            if (next != MILL_CODE_NONE && live[next] == 0) {
+                live[next] = 1;
+                stack[top++] = next;
+            }
+        }
+    }
+    return n;
+}
+
+
+static void
+opt_apply(const struct MillCode* code, const struct OptRewrite* rw,
+    struct MillOp* ops) {
+    switch (rw->kind) {
+        case OptRewrite_redirect:
+            ops[rw->index].state = rw->value;
+            break;
+        case OptRewrite_write:
+            ops[rw->index].write = rw->value;
+            break;
+        case OptRewrite_merge: {
+            size_t count = code->states * code->symbols;
+            size_t from = rw->index;
+            size_t into = rw->value;
+            for (size_t i = 0; i < count; ++i) {
+                if (ops[i].state == from) {
+                    ops[i].state = into;
+                }
+            }
+            for (size_t c = 0; c < code->symbols; ++c) {
+                struct MillOp* op = &ops[into * code->symbols + c];
+                if (op->state == MILL_CODE_NONE) {
+                    *op = ops[from * code->symbols + c];
+                }
+            }
+            break;
+        }
+    }
+}
+
+
+// Runs every test, most often failed first, and gives up on the first
+// failure or once the steps spent exceed the best score so far.
+static int
+opt_check(struct OptContext* ctx, const struct MillCode* code,
+    struct MillTape* tape, struct MillProbe* probe, wchar_t* output,
+    size_t budget, size_t* total) {
+    const int flags = MillRun_quiet | MillRun_poll;
+    mill_exec_fn exec = mill_exec_select(flags);
+    size_t spent = 0;
+
+    for (size_t k = 0; k < ctx->test_count; ++k) {
+        struct OptTest* test = &ctx->tests[ctx->order[k]];
+        size_t steps = 0;
+        mill_probe_start(probe, 0);
+        probe->step_budget = budget - spent + 1;
+        mill_tape_load(tape, test->input, test->len);
+        int res = exec(code, tape, &steps, flags, probe);
+        int pass = (res == 0);
+        if (pass != 0) {
+            size_t start = mill_tape_start_used(tape, test->len, steps);
+            mill_tape_text(tape, start, output, MILL_TAPE_SIZE + 1);
+            pass = wcscmp(output, test->expected) == 0;
+        }
+        mill_tape_clear(tape, test->len, steps);
+
+        if (pass == 0) {
+            atomic_fetch_add_explicit(&test->failures, 1, memory_order_relaxed);
+            return 1;
+        }
+        spent += steps;
+        if (spent > budget) {
+            return 1;
+        }
+    }
+    *total = spent;
+    return 0;
+}
+
+
+static int
+_score_less(const struct OptScore* x, const struct OptScore* y) {
+    return x->steps < y->steps || (x->steps == y->steps && x->states < y->states);
+}
+
+
+static void*
+opt_worker(void* arg) {
+    struct OptContext* ctx = arg;
+    size_t count = ctx->code->states * ctx->code->symbols;
+    struct MillOp* ops = malloc(count * sizeof(struct MillOp));
+    uint8_t* live = malloc(ctx->code->states);
+    struct MillTape* tape = calloc(1, sizeof(*tape));
+    struct MillProbe* probe = malloc(sizeof(*probe));
+    wchar_t* output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    if (ops == NULL || live == NULL || tape == NULL || probe == NULL || output == NULL) {
+        perror("malloc");
+        goto done;
+    }
+    tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+
+    struct MillCode code = *ctx->code;
+    code.ops = ops;
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&ctx->next, 1);
+        if (i >= ctx->candidate_count) {
+            break;
+        }
+        memcpy(ops, ctx->ops, count * sizeof(struct MillOp));
+        if (ctx->pairs != 0) {
+            size_t a = i / ctx->rewrite_count;
+            size_t b = i % ctx->rewrite_count;
+            if (b <= a) {
+                continue;
+            }
+            opt_apply(&code, &ctx->rewrites[a], ops);
+            opt_apply(&code, &ctx->rewrites[b], ops);
+        }
+        else {
+            opt_apply(&code, &ctx->rewrites[i], ops);
+        }
+
+        struct OptScore score = {.states = opt_live_states(&code, ops, live)};
+        if (score.states > ctx->best.states) {
+            continue;
+        }
+        size_t budget = ctx->best.steps;
+        if (score.states == ctx->best.states) {
+            if (budget == 0) {
+                continue;
+            }
+            budget -= 1;
+        }
+        if (opt_check(ctx, &code, tape, probe, output, budget, &score.steps) != 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        if (ctx->found == SIZE_MAX || _score_less(&score, &ctx->found_score) ||
+            (score.steps == ctx->found_score.steps &&
+             score.states == ctx->found_score.states && i < ctx->found)) {
+            ctx->found = i;
+            ctx->found_score = score;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+done:
+    free(output);
+    free(probe);
+    free(tape);
+    free(live);
+    free(ops);
+    return NULL;
+}
+
+
+static size_t
+opt_rewrites(const struct MillCode* code, const struct MillOp* ops,
+    const uint8_t* live, const wchar_t* alphabet, size_t alphabet_size,
+    struct OptRewrite* res) {
+    size_t n = 0;
+    for (size_t s = 0; s < code->states; ++s) {
+        if (live[s] == 0 || s == code->symhalt) {
+            continue;
+        }
+        for (size_t c = 0; c < code->symbols; ++c) {
+            size_t index = s * code->symbols + c;
+            const struct MillOp* op = &ops[index];
+            if (op->state == MILL_CODE_NONE) {
+                continue;
+            }
+            for (size_t t = 0; t < code->states; ++t) {
+                if (t != op->state && live[t] != 0) {
+                    res[n++] = (struct OptRewrite) {OptRewrite_redirect, index, t};
+                }
+            }
+            for (size_t k = 0; k < alphabet_size; ++k) {
+                if (alphabet[k] != op->write) {
+                    res[n++] = (struct OptRewrite) {OptRewrite_write, index, alphabet[k]};
+                }
+            }
+        }
+        for (size_t t = 0; t < code->states; ++t) {
+            if (t != s && s != code->syminit && live[t] != 0 && t != code->symhalt) {
+                res[n++] = (struct OptRewrite) {OptRewrite_merge, s, t};
+            }
+        }
+    }
+    return n;
+}
+
+
+static void
+opt_print_program(FILE* file, const struct MillCode* code,
+    const struct MillOp* ops, const uint8_t* live) {
+    wchar_t* const* names = code->prog->symtable.symbols;
+    for (size_t s = 0; s < code->states; ++s) {
+        if (live[s] == 0) {
+            continue;
+        }
+        for (size_t c = 1; c < code->symbols; ++c) {
+            const struct MillOp* op = &ops[s * code->symbols + c];
+            if (op->state == MILL_CODE_NONE) {
+                continue;
+            }
+            wchar_t in = mill_code_char(code, c);
+            fprintf(file, "%ls %lc %ls %lc %c\n", names[s],
+                in != L'\0' ? in : L'_', names[op->state],
+                op->write != L'\0' ? op->write : L'_',
+                op->move < 0 ? 'L' : 'R');
+        }
+    }
+}
+
+
+static double
+_elapsed(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+static int
+mill_optimize(FILE* file, const struct MillCode* code, struct OptTest* tests,
+    size_t test_count, size_t rounds, size_t jobs) {
+    size_t count = code->states * code->symbols;
+    struct MillOp* ops = malloc(count * sizeof(struct MillOp));
+    uint8_t* live = malloc(code->states);
+    size_t* order = malloc(test_count * sizeof(size_t));
+
+    // Every symbol the program reads or writes, so symbol reuse never
+    // introduces a new one.
+    size_t alphabet_size = 0;
+    wchar_t* alphabet = malloc((code->symbols + count) * sizeof(wchar_t));
+    size_t cap = count * (code->states + code->symbols + count) + code->states * code->states;
+    struct OptRewrite* rewrites = malloc(cap * sizeof(struct OptRewrite));
+    if (ops == NULL || live == NULL || order == NULL || alphabet == NULL || rewrites == NULL) {
+        perror("malloc");
+        free(rewrites);
+        free(alphabet);
+        free(order);
+        free(live);
+        free(ops);
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        ops[i] = *mill_code_op(code, i / code->symbols, i % code->symbols);
+    }
+    for (size_t i = 0; i < test_count; ++i) {
+        order[i] = i;
+    }
+
+    for (size_t i = 1; i < code->symbols + count; ++i) {
+        wchar_t c = L'\0';
+        if (i < code->symbols) {
+            c = mill_code_char(code, i);
+        }
+        else if (ops[i - code->symbols].state != MILL_CODE_NONE) {
+            c = ops[i - code->symbols].write;
+        }
+        else {
+            continue;
+        }
+        size_t k = 0;
+        while (k < alphabet_size && alphabet[k] != c) {
+            ++k;
+        }
+        if (k == alphabet_size) {
+            alphabet[alphabet_size++] = c;
+        }
+    }
+
+    struct OptContext ctx = {
+        .code = code,
+        .ops = ops,
+        .count = count,
+        .tests = tests,
+        .test_count = test_count,
+        .order = order,
+    };
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    struct MillTape* tape = calloc(1, sizeof(*tape));
+    struct MillProbe* probe = malloc(sizeof(*probe));
+    wchar_t* output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    int res = 0;
+    if (tape == NULL || probe == NULL || output == NULL) {
+        perror("malloc");
+        res = 1;
+    }
+    else {
+        tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+        ctx.best.states = opt_live_states(code, ops, live);
+        if (opt_check(&ctx, code, tape, probe, output, SIZE_MAX - 1, &ctx.best.steps) != 0) {
+            fprintf(stderr, "error: the program does not pass the tests\n");
+            res = 1;
+        }
+    }
+    free(output);
+    free(probe);
+    free(tape);
+
+    struct OptScore initial = ctx.best;
+    size_t checked = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (size_t round = 0; round < rounds && res == 0; ++round) {
+        opt_live_states(code, ops, live);
+        ctx.rewrites = rewrites;
+        ctx.rewrite_count = opt_rewrites(code, ops, live, alphabet, alphabet_size, rewrites);
+        atomic_store(&ctx.next, 0);
+        ctx.found = SIZE_MAX;
+
+        // Tests that rejected the most candidates go first.
+        for (size_t i = 1; i < test_count; ++i) {
+            size_t x = order[i];
+            size_t f = atomic_load(&tests[x].failures);
+            size_t j = i;
+            while (j > 0 && atomic_load(&tests[order[j - 1]].failures) < f) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = x;
+        }
+
+        ctx.pairs = 0;
+        ctx.candidate_count = ctx.rewrite_count;
+        for (;;) {
+            pthread_t threads[jobs];
+            size_t started = 0;
+            for (; started < jobs; ++started) {
+                if (pthread_create(&threads[started], NULL, opt_worker, &ctx) != 0) {
+                    break;
+                }
+            }
+            if (started == 0) {
+                opt_worker(&ctx);
+            }
+            for (size_t i = 0; i < started; ++i) {
+                pthread_join(threads[i], NULL);
+            }
+            checked += ctx.pairs != 0 ? ctx.candidate_count / 2 : ctx.candidate_count;
+
+            if (ctx.found != SIZE_MAX || ctx.pairs != 0 ||
+                ctx.rewrite_count > OPT_PAIRS_MAX) {
+                break;
+            }
+            ctx.pairs = 1;
+            ctx.candidate_count = ctx.rewrite_count * ctx.rewrite_count;
+            atomic_store(&ctx.next, 0);
+        }
+
+        if (ctx.found == SIZE_MAX) {
+            break;
+        }
+        if (ctx.pairs != 0) {
+            opt_apply(code, &rewrites[ctx.found / ctx.rewrite_count], ops);
+            opt_apply(code, &rewrites[ctx.found % ctx.rewrite_count], ops);
+        }
+        else {
+            opt_apply(code, &rewrites[ctx.found], ops);
+        }
+        ctx.best = ctx.found_score;
+    }
+    pthread_mutex_destroy(&ctx.lock);
+
+    if (res == 0) {
+        double elapsed = _elapsed(&start);
+        fprintf(stderr, "steps %zu -> %zu, states %zu -> %zu, "
+            "%zu candidates in %.2f s (%.0f/s)\n",
+            initial.steps, ctx.best.steps, initial.states, ctx.best.states,
+            checked, elapsed, elapsed > 0 ? checked / elapsed : 0.0);
+        opt_live_states(code, ops, live);
+        opt_print_program(file, code, ops, live);
+    }
+
+    free(rewrites);
+    free(alphabet);
+    free(order);
+    free(live);
+    free(ops);
+    return res;
+}
+
+
+static int
+opt_family_tests(const struct AppArgs* args, struct OptTest** tests, size_t* count) {
+    struct GradeSpec spec = {};
+    if (grade_parse_family(args->grade, &spec) != 0) {
+        arg_error("-g/--grade: expected unary:N, sum:N or binary:L");
+        return 1;
+    }
+
+    size_t bufsize = MILL_TAPE_SIZE + 1;
+    wchar_t* input = malloc(bufsize * sizeof(wchar_t));
+    wchar_t* expected = malloc(bufsize * sizeof(wchar_t));
+    struct OptTest* res_tests = calloc(spec.count, sizeof(res_tests[0]));
+    int res = 0;
+    if (input == NULL || expected == NULL || res_tests == NULL) {
+        perror("malloc");
+        res = 1;
+    }
+
+    for (size_t i = 0; i < spec.count && res == 0; ++i) {
+        struct GradeVars vars;
+        size_t len = grade_input(&spec, i, input, &vars);
+        long long value = 0;
+        res = grade_expr_eval(args->expect, &vars, &value);
+        if (res == 0) {
+            res = grade_expected(&spec, value, expected, bufsize);
+        }
+        if (res != 0) {
+            fprintf(stderr, "error: no reference for '%ls'\n", input);
+            res = 1;
+            break;
+        }
+        res_tests[i].input = wcsdup(input);
+        res_tests[i].len = len;
+        res_tests[i].expected = wcsdup(expected);
+    }
+    free(expected);
+    free(input);
+
+    if (res != 0) {
+        for (size_t i = 0; res_tests != NULL && i < spec.count; ++i) {
+            free(res_tests[i].input);
+            free(res_tests[i].expected);
+        }
+        free(res_tests);
+        return res;
+    }
+    *tests = res_tests;
+    *count = spec.count;
+    return 0;
+}
+
+
+static int
+opt_file_tests(const char* filename, struct OptTest** tests, size_t* count) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        arg_perror("-T/--tests");
+        return 1;
+    }
+
+    size_t bufsize = 2 * MILL_TAPE_SIZE + 2;
+    wchar_t* buf = malloc(bufsize * sizeof(wchar_t));
+    if (buf == NULL) {
+        perror("malloc");
+        fclose(file);
+        return 1;
+    }
+
+    int res = 0;
+    size_t n = 0;
+    size_t cap = 0;
+    struct OptTest* res_tests = NULL;
+    while (fgetws(buf, bufsize, file) != NULL) {
+        size_t len = wcslen(buf);
+        while (len > 0 && (buf[len - 1] == L'\n' || buf[len - 1] == L'\r')) {
+            buf[--len] = L'\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        wchar_t* sep = wcschr(buf, L'\t');
+        if (sep == NULL || sep - buf >= MILL_TAPE_SIZE) {
+            fprintf(stderr, "error: test %zu: expected INPUT<tab>EXPECTED\n", n + 1);
+            res = 1;
+            break;
+        }
+        *sep = L'\0';
+        if (n >= cap) {
+            cap = cap != 0 ? cap * 2 : 64;
+            void* p = realloc(res_tests, cap * sizeof(res_tests[0]));
+            if (p == NULL) {
+                perror("malloc");
+                res = 1;
+                break;
+            }
+            res_tests = p;
+        }
+        res_tests[n++] = (struct OptTest) {
+            .input = wcsdup(buf),
+            .len = sep - buf,
+            .expected = wcsdup(sep + 1),
+        };
+    }
+    free(buf);
+    fclose(file);
+
+    if (res == 0 && n == 0) {
+        fprintf(stderr, "error: no tests in %s\n", filename);
+        res = 1;
+    }
+    if (res != 0) {
+        for (size_t i = 0; i < n; ++i) {
+            free(res_tests[i].input);
+            free(res_tests[i].expected);
+        }
+        free(res_tests);
+        return res;
+    }
+    *tests = res_tests;
+    *count = n;
+    return 0;
+}
+
+
+static struct MillProgram _Program;
+
+
+int main(int argc, const char* argv[]) {
+    setlocale(LC_ALL, "");
+
+    struct AppArgs args = {};
+    int res = parse_args(argc, argv, &args);
+    if (res != 0) { return res; }
+
+    if (args.needs_help) {
+        puts(_help_page);
+        return 0;
+    }
+
+    FILE* program_file = fopen(args.program, "r");
+    if (program_file == NULL) {
+        program_file = mill_open_text(args.program, strlen(args.program));
+    }
+    if (program_file == NULL) {
+        arg_perror("-p/--program");
+        return 1;
+    }
+    res = mill_parse_program(program_file, &_Program);
+    fclose(program_file);
+    if (res != 0) { return res; }
+
+    struct OptTest* tests = NULL;
+    size_t test_count = 0;
+    if (args.grade != NULL) {
+        res = opt_family_tests(&args, &tests, &test_count);
+    }
+    else {
+        res = opt_file_tests(args.tests, &tests, &test_count);
+    }
+    if (res != 0) { return res; }
+
+    FILE* output_file = stdout;
+    if (args.output != NULL) {
+        output_file = fopen(args.output, "w");
+        if (output_file == NULL) {
+            arg_perror("-o/--output");
+            res = 1;
+        }
+    }
+
+    struct MillCode code;
+    if (res == 0) {
+        res = mill_compile(&_Program, &code);
+    }
+    if (res == 0) {
+        size_t jobs = args.jobs;
+        if (jobs == 0) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = n > 0 ? n : 1;
+        }
+        res = mill_optimize(output_file, &code, tests, test_count, args.rounds, jobs);
+        mill_code_free(&code);
+    }
+
+    if (output_file != NULL && output_file != stdout) {
+        fclose(output_file);
+    }
+    for (size_t i = 0; i < test_count; ++i) {
+        free(tests[i].input);
+        free(tests[i].expected);
+    }
+    free(tests);
+    return res;
+}
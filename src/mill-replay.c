@@ -0,0 +1,748 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "mill.h"
+#include "capture.h"
+#include "hist.h"
+
+
+static const char _usage[] =
+    "usage: mill-replay -l LOG [-s SOCKET] [-j N] [-x SPEED] [-o RESULTS] [-c RESULTS] [-H]\n";
+
+static const char _help_page[] =
+    "usage: mill-replay -l LOG [-s SOCKET] [-j N] [-x SPEED] [-o RESULTS] [-c RESULTS] [-H]\n"
+    "\n"
+    "Replay the runs a mill --capture log recorded and report throughput\n"
+    "\n"
+    "options:\n"
+    "  -h, --help            show this help\n"
+    "  -l, --log LOG         capture log to replay\n"
+    "  -s, --socket SOCKET   send runs to mill --serve at SOCKET instead of\n"
+    "                          running them with this build's engine\n"
+    "  -j, --jobs N          runs in flight at once, threads or connections\n"
+    "                          (default 1)\n"
+    "  -x, --speed SPEED     replay at SPEED times the captured pace, or as\n"
+    "                          fast as possible with 0 (default 1)\n"
+    "  -o, --output RESULTS  write STATUS STEPS OUTPUT for each run, in log\n"
+    "                          order\n"
+    "  -c, --compare RESULTS compare with the RESULTS of an earlier replay\n"
+    "                          and fail if any run differs\n"
+    "  -H, --histogram       print the full latency percentile spectrum\n"
+    "\n"
+    "Latency counts from when a run was due, so a replay that falls behind\n"
+    "the captured pace shows it.\n"
+    ;
+
+
+struct AppArgs {
+    int needs_help;
+    int spectrum;
+    size_t jobs;
+    double speed;
+    const char* log;
+    const char* socket;
+    const char* output;
+    const char* compare;
+};
+
+
+static void
+arg_error(const char* message) {
+    fputs(_usage, stderr);
+    fprintf(stderr, "error: %s\n", message);
+}
+
+
+static int
+parse_args(int argc, const char* argv[], struct AppArgs* args) {
+    *args = (struct AppArgs) {.jobs = 1, .speed = 1};
+    int state = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        switch (state) {
+            case 0:
+                if (strcmp(argv[i], "-h") == 0 ||
+                    strcmp(argv[i], "--help") == 0) {
+                    args->needs_help = 1;
+                }
+                else if (strcmp(argv[i], "-l") == 0 ||
+                    strcmp(argv[i], "--log") == 0) {
+                    state = 1;
+                }
+                else if (strcmp(argv[i], "-s") == 0 ||
+                    strcmp(argv[i], "--socket") == 0) {
+                    state = 2;
+                }
+                else if (strcmp(argv[i], "-j") == 0 ||
+                    strcmp(argv[i], "--jobs") == 0) {
+                    state = 3;
+                }
+                else if (strcmp(argv[i], "-x") == 0 ||
+                    strcmp(argv[i], "--speed") == 0) {
+                    state = 4;
+                }
+                else if (strcmp(argv[i], "-o") == 0 ||
+                    strcmp(argv[i], "--output") == 0) {
+                    state = 5;
+                }
+                else if (strcmp(argv[i], "-c") == 0 ||
+                    strcmp(argv[i], "--compare") == 0) {
+                    state = 6;
+                }
+                else if (strcmp(argv[i], "-H") == 0 ||
+                    strcmp(argv[i], "--histogram") == 0) {
+                    args->spectrum = 1;
+                }
+                else {
+                    arg_error("unknown argument");
+                    return 1;
+                }
+                break;
+
+            case 1:
+                args->log = argv[i];
+                state = 0;
+                break;
+
+            case 2:
+                args->socket = argv[i];
+                state = 0;
+                break;
+
+            case 3: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0) {
+                    arg_error("-j/--jobs: expected a positive number");
+                    return 1;
+                }
+                args->jobs = n;
+                state = 0;
+                break;
+            }
+
+            case 4: {
+                char* end = NULL;
+                double x = strtod(argv[i], &end);
+                if (*end != '\0' || !(x >= 0)) {
+                    arg_error("-x/--speed: expected a factor, or 0");
+                    return 1;
+                }
+                args->speed = x;
+                state = 0;
+                break;
+            }
+
+            case 5:
+                args->output = argv[i];
+                state = 0;
+                break;
+
+            case 6:
+                args->compare = argv[i];
+                state = 0;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (args->needs_help != 0) {
+        return 0;
+    }
+
+    if (args->log == NULL) {
+        arg_error("-l/--log is required");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+enum ReplayStatus {
+    ReplayStatus_halted,
+    ReplayStatus_error,
+    ReplayStatus_timeout,
+    ReplayStatus_deadline,
+    ReplayStatus_invalid,
+    ReplayStatus_count,
+};
+
+
+static const char* const _status_names[] = {
+    [ReplayStatus_halted] = "halted",
+    [ReplayStatus_error] = "error",
+    [ReplayStatus_timeout] = "timeout",
+    [ReplayStatus_deadline] = "deadline",
+    [ReplayStatus_invalid] = "invalid",
+};
+
+
+struct ReplayResult {
+    enum ReplayStatus status;
+    size_t steps;
+    // The output of a halted run, as the server would send it.
+    char* output;
+};
+
+
+struct Replay {
+    const struct AppArgs* args;
+    const struct CaptureLog* log;
+    // One per log program when running locally.
+    struct MillCode* codes;
+    struct ReplayResult* results;
+    struct timespec start;
+    atomic_size_t next;
+    atomic_int error;
+    pthread_mutex_t lock;
+    struct Hist latency;
+};
+
+
+static double
+_seconds(const struct timespec* t) {
+    return t->tv_sec + t->tv_nsec * 1e-9;
+}
+
+
+static uint64_t
+_ns_between(const struct timespec* a, const struct timespec* b) {
+    int64_t ns = (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+    return ns > 0 ? (uint64_t) ns : 0;
+}
+
+
+// Writes cells as the server does, with '?' for any the locale cannot
+// encode; buf holds at least len * MB_CUR_MAX + 1 bytes.
+static size_t
+_replay_text(char* buf, const wchar_t* cells, size_t len) {
+    size_t n = 0;
+    mbstate_t mbs = {};
+    for (size_t i = 0; i < len; ++i) {
+        size_t k = wcrtomb(&buf[n], cells[i], &mbs);
+        if (k == (size_t) -1) {
+            buf[n] = '?';
+            k = 1;
+            mbs = (mbstate_t) {};
+        }
+        n += k;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+
+// Waits until run i is due, and returns when that was.
+static struct timespec
+replay_wait(struct Replay* replay, size_t i) {
+    struct timespec due;
+    if (replay->args->speed == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        return due;
+    }
+    uint64_t ns = (uint64_t) (replay->log->runs[i].us * 1e3 / replay->args->speed);
+    due = replay->start;
+    due.tv_sec += ns / 1000000000;
+    due.tv_nsec += ns % 1000000000;
+    if (due.tv_nsec >= 1000000000) {
+        due.tv_sec += 1;
+        due.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+    }
+    return due;
+}
+
+
+static void
+replay_done(struct Hist* latency, const struct timespec* due) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hist_record(latency, _ns_between(due, &now));
+}
+
+
+static void*
+replay_local(void* arg) {
+    struct Replay* replay = arg;
+    enum MillPages pages;
+    struct MillTape* tape = mill_tape_alloc(0, &pages);
+    struct MillProbe* probe = malloc(sizeof(*probe));
+    wchar_t* output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    char* text = malloc(MILL_TAPE_SIZE * MB_CUR_MAX + 1);
+    struct Hist* latency = calloc(1, sizeof(*latency));
+    if (tape == NULL || probe == NULL || output == NULL || text == NULL || latency == NULL) {
+        perror("malloc");
+        atomic_store(&replay->error, 1);
+        goto done;
+    }
+    tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+    mill_exec_fn exec = mill_exec_select(MillRun_quiet | MillRun_poll);
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&replay->next, 1);
+        if (i >= replay->log->run_count || atomic_load(&replay->error) != 0) {
+            break;
+        }
+        const struct CaptureRun* run = &replay->log->runs[i];
+        struct ReplayResult* result = &replay->results[i];
+        struct timespec due = replay_wait(replay, i);
+
+        size_t steps = 0;
+        mill_probe_start(probe, run->deadline_ms);
+        mill_tape_load(tape, run->tape, run->len);
+        int status = exec(&replay->codes[run->program], tape, &steps,
+            MillRun_quiet | MillRun_poll, probe);
+        if (status == 0) {
+            size_t start = mill_tape_start_used(tape, run->len, steps);
+            size_t n = mill_tape_text(tape, start, output, MILL_TAPE_SIZE + 1);
+            _replay_text(text, output, n);
+            result->output = strdup(text);
+        }
+        mill_tape_clear(tape, run->len, steps);
+        replay_done(latency, &due);
+
+        result->steps = steps;
+        result->status = status == 0 ? ReplayStatus_halted
+            : status < 0 ? ReplayStatus_error
+            : steps < MILL_STEPS_MAX ? ReplayStatus_deadline : ReplayStatus_timeout;
+        if (status == 0 && result->output == NULL) {
+            perror("malloc");
+            atomic_store(&replay->error, 1);
+        }
+    }
+
+    pthread_mutex_lock(&replay->lock);
+    hist_merge(&replay->latency, latency);
+    pthread_mutex_unlock(&replay->lock);
+
+done:
+    if (tape != NULL) {
+        mill_tape_free(tape, pages);
+    }
+    free(probe);
+    free(output);
+    free(text);
+    free(latency);
+    return NULL;
+}
+
+
+static int
+replay_connect(const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: -s/--socket: path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static int
+_send_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t k = send(fd, data, len, MSG_NOSIGNAL);
+        if (k < 0 && errno != EINTR) {
+            perror("send");
+            return 1;
+        }
+        if (k > 0) {
+            data += k;
+            len -= k;
+        }
+    }
+    return 0;
+}
+
+
+// Reads the reply to a run: ID STATUS STEPS OUTPUT.
+static int
+replay_parse_reply(char* line, size_t id, struct ReplayResult* result) {
+    line[strcspn(line, "\n")] = '\0';
+    char* end = NULL;
+    if (strtoull(line, &end, 10) != id || end == line || *end != ' ') {
+        return 1;
+    }
+    char* status = end + 1;
+    char* steps = strchr(status, ' ');
+    if (steps == NULL) {
+        return 1;
+    }
+    *steps++ = '\0';
+    result->status = ReplayStatus_invalid;
+    for (size_t k = 0; k < ReplayStatus_invalid; ++k) {
+        if (strcmp(status, _status_names[k]) == 0) {
+            result->status = k;
+        }
+    }
+    if (result->status == ReplayStatus_invalid) {
+        return 0;
+    }
+    result->steps = strtoull(steps, &end, 10);
+    if (end == steps || *end != ' ') {
+        return 1;
+    }
+    if (result->status == ReplayStatus_halted && (result->output = strdup(end + 1)) == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    return 0;
+}
+
+
+// Sends runs one at a time over a connection of its own, switching its
+// program when the next run needs another.
+static void*
+replay_remote(void* arg) {
+    struct Replay* replay = arg;
+    const struct CaptureLog* log = replay->log;
+    int fd = replay_connect(replay->args->socket);
+    FILE* in = fd >= 0 ? fdopen(fd, "r") : NULL;
+    size_t size = MILL_TAPE_SIZE * MB_CUR_MAX + 64;
+    char* request = malloc(size);
+    struct Hist* latency = calloc(1, sizeof(*latency));
+    char* line = NULL;
+    size_t line_cap = 0;
+    if (in == NULL || request == NULL || latency == NULL) {
+        if (fd >= 0) {
+            perror("malloc");
+            if (in == NULL) {
+                close(fd);
+            }
+        }
+        atomic_store(&replay->error, 1);
+        goto done;
+    }
+
+    size_t program = SIZE_MAX;
+    int res = 0;
+    while (res == 0) {
+        size_t i = atomic_fetch_add(&replay->next, 1);
+        if (i >= log->run_count || atomic_load(&replay->error) != 0) {
+            break;
+        }
+        const struct CaptureRun* run = &log->runs[i];
+        struct ReplayResult* result = &replay->results[i];
+        struct timespec due = replay_wait(replay, i);
+
+        if (run->program != program) {
+            const struct CaptureProgram* p = &log->programs[run->program];
+            int n = snprintf(request, size, "program %zu\n", p->len);
+            res = _send_all(fd, request, n) != 0 || _send_all(fd, p->text, p->len) != 0 ||
+                getline(&line, &line_cap, in) < 0 || strncmp(line, "program ", 8) != 0;
+            if (res != 0) {
+                break;
+            }
+            program = strncmp(line, "program ok", 10) == 0 ? run->program : SIZE_MAX;
+        }
+        if (program == SIZE_MAX) {
+            result->status = ReplayStatus_invalid;
+            replay_done(latency, &due);
+            continue;
+        }
+
+        // The server takes an empty tape as a missing one, which leaves
+        // no room for a deadline.
+        size_t n = snprintf(request, size, "run %zu", i);
+        if (run->len > 0) {
+            request[n++] = ' ';
+            n += _replay_text(&request[n], run->tape, run->len);
+            n += snprintf(&request[n], size - n, " %zu", run->deadline_ms);
+        }
+        request[n++] = '\n';
+        res = _send_all(fd, request, n) != 0 || getline(&line, &line_cap, in) < 0 ||
+            replay_parse_reply(line, i, result) != 0;
+        replay_done(latency, &due);
+    }
+    if (res != 0) {
+        fprintf(stderr, "error: %s: unexpected reply or closed connection\n",
+            replay->args->socket);
+        atomic_store(&replay->error, 1);
+    }
+
+    pthread_mutex_lock(&replay->lock);
+    hist_merge(&replay->latency, latency);
+    pthread_mutex_unlock(&replay->lock);
+
+done:
+    if (in != NULL) {
+        fclose(in);
+    }
+    free(request);
+    free(latency);
+    free(line);
+    return NULL;
+}
+
+
+static int
+replay_compile(const struct CaptureLog* log, struct MillCode** codes) {
+    *codes = calloc(log->program_count, sizeof(**codes));
+    if (*codes == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < log->program_count; ++i) {
+        struct MillProgram* prog = malloc(sizeof(*prog));
+        FILE* file = mill_open_text(log->programs[i].text, log->programs[i].len);
+        int res = prog == NULL || file == NULL;
+        if (res != 0) {
+            perror("malloc");
+        }
+        if (res == 0) {
+            res = mill_parse_program(file, prog);
+        }
+        if (res == 0) {
+            res = mill_compile(prog, &(*codes)[i]);
+        }
+        if (file != NULL) {
+            fclose(file);
+        }
+        if (res != 0) {
+            fprintf(stderr, "error: program %016" PRIx64 " does not compile\n",
+                log->programs[i].hash);
+            free(prog);
+            for (size_t k = 0; k < i; ++k) {
+                free((*codes)[k].prog);
+                mill_code_free(&(*codes)[k]);
+            }
+            free(*codes);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void
+replay_print(FILE* file, const struct Replay* replay, double seconds) {
+    const struct CaptureLog* log = replay->log;
+    size_t counts[ReplayStatus_count] = {};
+    double steps = 0;
+    for (size_t i = 0; i < log->run_count; ++i) {
+        counts[replay->results[i].status] += 1;
+        steps += replay->results[i].steps;
+    }
+    fprintf(file, "%zu runs in %.3f s (%.1f runs/s, %.0f steps/s): %zu halted, "
+        "%zu errors, %zu timeouts, %zu deadlines",
+        log->run_count, seconds,
+        seconds > 0 ? log->run_count / seconds : 0.0, seconds > 0 ? steps / seconds : 0.0,
+        counts[ReplayStatus_halted], counts[ReplayStatus_error],
+        counts[ReplayStatus_timeout], counts[ReplayStatus_deadline]);
+    if (counts[ReplayStatus_invalid] > 0) {
+        fprintf(file, ", %zu invalid", counts[ReplayStatus_invalid]);
+    }
+    fputc('\n', file);
+    double span = log->run_count > 0 ? log->runs[log->run_count - 1].us / 1e6 : 0;
+    fprintf(file, "captured over %.3f s, %zu programs\n", span, log->program_count);
+
+    const struct Hist* h = &replay->latency;
+    fprintf(file, "latency (us): min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  "
+        "p99.9 %.1f  max %.1f  mean %.1f\n",
+        h->min / 1e3, hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+        hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+        h->max / 1e3, hist_mean(h) / 1e3);
+    if (replay->args->spectrum != 0) {
+        fputc('\n', file);
+        hist_print_spectrum(file, h, 1e3, 5);
+    }
+}
+
+
+static int
+replay_write(const char* path, const struct Replay* replay) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    for (size_t i = 0; i < replay->log->run_count; ++i) {
+        const struct ReplayResult* result = &replay->results[i];
+        fprintf(file, "%s %zu %s\n", _status_names[result->status], result->steps,
+            result->output != NULL ? result->output : "");
+    }
+    if (ferror(file) | fclose(file)) {
+        perror(path);
+        return 1;
+    }
+    return 0;
+}
+
+
+// Lists the first runs whose result differs from the one in path; fails
+// if any does.
+static int
+replay_compare(const char* path, const struct Replay* replay) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    size_t count = replay->log->run_count;
+    size_t differ = 0;
+    size_t lines = 0;
+    char* line = NULL;
+    size_t line_cap = 0;
+    char* mine = NULL;
+    size_t mine_cap = 0;
+    while (getline(&line, &line_cap, file) >= 0) {
+        size_t i = lines++;
+        if (i >= count) {
+            continue;
+        }
+        const struct ReplayResult* result = &replay->results[i];
+        const char* output = result->output != NULL ? result->output : "";
+        size_t need = strlen(output) + 64;
+        if (need > mine_cap) {
+            void* p = realloc(mine, need);
+            if (p == NULL) {
+                perror("malloc");
+                break;
+            }
+            mine = p;
+            mine_cap = need;
+        }
+        snprintf(mine, mine_cap, "%s %zu %s\n", _status_names[result->status],
+            result->steps, output);
+        if (strcmp(line, mine) == 0) {
+            continue;
+        }
+        if (differ++ < 10) {
+            int n = strcspn(line, " \n");
+            int k = n + (line[n] == ' ' ? strcspn(&line[n + 1], " \n") + 1 : 0);
+            fprintf(stdout, "run %zu: %s %zu, was %.*s%s\n", i + 1,
+                _status_names[result->status], result->steps, k, line,
+                strncmp(line, mine, k + 1) == 0 ? ", output differs" : "");
+        }
+    }
+    free(mine);
+    free(line);
+    fclose(file);
+
+    if (lines != count) {
+        fprintf(stdout, "%s has %zu results for %zu runs\n", path, lines, count);
+        return 1;
+    }
+    if (differ > 0) {
+        fprintf(stdout, "%zu of %zu runs differ from %s\n", differ, count, path);
+        return 1;
+    }
+    fprintf(stdout, "all %zu runs match %s\n", count, path);
+    return 0;
+}
+
+
+static int
+replay_run(const struct AppArgs* args, const struct CaptureLog* log) {
+    struct Replay* replay = calloc(1, sizeof(*replay));
+    if (replay == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    replay->args = args;
+    replay->log = log;
+    replay->results = calloc(log->run_count + 1, sizeof(replay->results[0]));
+    if (replay->results == NULL) {
+        perror("malloc");
+        free(replay);
+        return 1;
+    }
+    if (args->socket == NULL && replay_compile(log, &replay->codes) != 0) {
+        free(replay->results);
+        free(replay);
+        return 1;
+    }
+    pthread_mutex_init(&replay->lock, NULL);
+
+    void* (*worker)(void*) = args->socket != NULL ? replay_remote : replay_local;
+    pthread_t threads[args->jobs];
+    size_t started = 0;
+    clock_gettime(CLOCK_MONOTONIC, &replay->start);
+    for (; started < args->jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, worker, replay) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        perror("pthread_create");
+        atomic_store(&replay->error, 1);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int res = atomic_load(&replay->error);
+    if (res == 0) {
+        replay_print(stdout, replay, _seconds(&now) - _seconds(&replay->start));
+    }
+    if (res == 0 && args->output != NULL) {
+        res = replay_write(args->output, replay);
+    }
+    if (res == 0 && args->compare != NULL) {
+        res = replay_compare(args->compare, replay);
+    }
+
+    for (size_t i = 0; i < log->run_count; ++i) {
+        free(replay->results[i].output);
+    }
+    for (size_t i = 0; replay->codes != NULL && i < log->program_count; ++i) {
+        free(replay->codes[i].prog);
+        mill_code_free(&replay->codes[i]);
+    }
+    pthread_mutex_destroy(&replay->lock);
+    free(replay->codes);
+    free(replay->results);
+    free(replay);
+    return res;
+}
+
+
+int main(int argc, const char* argv[]) {
+    setlocale(LC_ALL, "");
+
+    struct AppArgs args = {};
+    int res = parse_args(argc, argv, &args);
+    if (res != 0) { return res; }
+
+    if (args.needs_help) {
+        puts(_help_page);
+        return 0;
+    }
+
+    struct CaptureLog log;
+    res = capture_read(args.log, &log);
+    if (res != 0) { return res; }
+
+    res = replay_run(&args, &log);
+    capture_log_free(&log);
+    return res;
+}
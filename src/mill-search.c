@@ -0,0 +1,959 @@
+#define _GNU_SOURCE
+#include <locale.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+
+#include "mill.h"
+
+
+static const char _usage[] =
+    "usage: mill-search -n STATES [-k SYMBOLS | -a ALPHABET] [-t TAPE] [-l STEPS]\n"
+    "                   [-r steps|output | -w WANT] [-c COUNT] [-j N]\n";
+
+static const char _help_page[] =
+    "usage: mill-search -n STATES [-k SYMBOLS | -a ALPHABET] [-t TAPE] [-l STEPS]\n"
+    "                   [-r steps|output | -w WANT] [-c COUNT] [-j N]\n"
+    "\n"
+    "Enumerate Logic Mill programs in tree-normal form\n"
+    "\n"
+    "options:\n"
+    "  -h, --help            show this help\n"
+    "  -n, --states STATES   number of states besides HALT, up to 16\n"
+    "  -k, --symbols K       alphabet size, up to 8 (default 2): _|abcdef\n"
+    "  -a, --alphabet CHARS  alphabet, blank first (default _|)\n"
+    "  -t, --tape TAPE       input tape text (default blank)\n"
+    "  -l, --limit STEPS     steps before a run is left undecided\n"
+    "                          (default 10000)\n"
+    "  -r, --rank KEY        champions by most steps or longest output\n"
+    "  -w, --want WANT       report programs that output WANT,\n"
+    "                          fewest states and steps first\n"
+    "  -c, --count COUNT     number of champions to report (default 5)\n"
+    "  -j, --jobs N          number of worker threads\n"
+    ;
+
+
+#define SEARCH_STATES_MAX 16
+#define SEARCH_SYMBOLS_MAX 8
+#define SEARCH_NONE 0xff
+
+
+enum SearchRank {
+    SearchRank_steps = 0,
+    SearchRank_output,
+    SearchRank_want,
+};
+
+
+struct AppArgs {
+    int needs_help;
+    size_t states;
+    size_t symbols;
+    size_t limit;
+    size_t count;
+    size_t jobs;
+    enum SearchRank rank;
+    const char* alphabet;
+    const char* tape;
+    const char* want;
+};
+
+
+static void
+arg_error(const char* message) {
+    fputs(_usage, stderr);
+    fprintf(stderr, "error: %s\n", message);
+}
+
+
+static int
+_parse_size(const char* s, size_t* value) {
+    char* end = NULL;
+    unsigned long n = strtoul(s, &end, 10);
+    if (*end != '\0' || n == 0) {
+        return 1;
+    }
+    *value = n;
+    return 0;
+}
+
+
+static int
+parse_args(int argc, const char* argv[], struct AppArgs* args) {
+    *args = (struct AppArgs) {
+        .symbols = 2,
+        .limit = 10000,
+        .count = 5,
+    };
+    int state = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        switch (state) {
+            case 0:
+                if (strcmp(argv[i], "-h") == 0 ||
+                    strcmp(argv[i], "--help") == 0) {
+                    args->needs_help = 1;
+                }
+                else if (strcmp(argv[i], "-n") == 0 ||
+                    strcmp(argv[i], "--states") == 0) {
+                    state = 1;
+                }
+                else if (strcmp(argv[i], "-k") == 0 ||
+                    strcmp(argv[i], "--symbols") == 0) {
+                    state = 2;
+                }
+                else if (strcmp(argv[i], "-a") == 0 ||
+                    strcmp(argv[i], "--alphabet") == 0) {
+                    state = 3;
+                }
+                else if (strcmp(argv[i], "-t") == 0 ||
+                    strcmp(argv[i], "--tape") == 0) {
+                    state = 4;
+                }
+                else if (strcmp(argv[i], "-l") == 0 ||
+                    strcmp(argv[i], "--limit") == 0) {
+                    state = 5;
+                }
+                else if (strcmp(argv[i], "-r") == 0 ||
+                    strcmp(argv[i], "--rank") == 0) {
+                    state = 6;
+                }
+                else if (strcmp(argv[i], "-w") == 0 ||
+                    strcmp(argv[i], "--want") == 0) {
+                    state = 7;
+                }
+                else if (strcmp(argv[i], "-c") == 0 ||
+                    strcmp(argv[i], "--count") == 0) {
+                    state = 8;
+                }
+                else if (strcmp(argv[i], "-j") == 0 ||
+                    strcmp(argv[i], "--jobs") == 0) {
+                    state = 9;
+                }
+                else {
+                    arg_error("unknown argument");
+                    return 1;
+                }
+                break;
+
+            case 1:
+                if (_parse_size(argv[i], &args->states) != 0 ||
+                    args->states > SEARCH_STATES_MAX) {
+                    arg_error("-n/--states: expected 1 to 16");
+                    return 1;
+                }
+                state = 0;
+                break;
+
+            case 2:
+                if (_parse_size(argv[i], &args->symbols) != 0 ||
+                    args->symbols < 2 || args->symbols > SEARCH_SYMBOLS_MAX) {
+                    arg_error("-k/--symbols: expected 2 to 8");
+                    return 1;
+                }
+                state = 0;
+                break;
+
+            case 3:
+                args->alphabet = argv[i];
+                state = 0;
+                break;
+
+            case 4:
+                args->tape = argv[i];
+                state = 0;
+                break;
+
+            case 5:
+                if (_parse_size(argv[i], &args->limit) != 0 ||
+                    args->limit > MILL_STEPS_MAX) {
+                    arg_error("-l/--limit: expected 1 to 1000000 steps");
+                    return 1;
+                }
+                state = 0;
+                break;
+
+            case 6:
+                if (strcmp(argv[i], "steps") == 0) {
+                    args->rank = SearchRank_steps;
+                }
+                else if (strcmp(argv[i], "output") == 0) {
+                    args->rank = SearchRank_output;
+                }
+                else {
+                    arg_error("-r/--rank: expected steps or output");
+                    return 1;
+                }
+                state = 0;
+                break;
+
+            case 7:
+                args->want = argv[i];
+                args->rank = SearchRank_want;
+                state = 0;
+                break;
+
+            case 8:
+                if (_parse_size(argv[i], &args->count) != 0) {
+                    arg_error("-c/--count: expected a positive number");
+                    return 1;
+                }
+                state = 0;
+                break;
+
+            case 9:
+                if (_parse_size(argv[i], &args->jobs) != 0) {
+                    arg_error("-j/--jobs: expected a positive number");
+                    return 1;
+                }
+                state = 0;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if (state != 0) {
+        arg_error("missing argument value");
+        return 1;
+    }
+
+    if (args->needs_help != 0) {
+        return 0;
+    }
+
+    if (args->states == 0) {
+        arg_error("-n/--states is required");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+// A partial program: undefined transitions are SEARCH_NONE and are
+// filled in as the run reaches them.
+struct SearchNode {
+    uint8_t used;
+    uint8_t defined;
+    uint8_t state[SEARCH_STATES_MAX * SEARCH_SYMBOLS_MAX];
+    uint8_t write[SEARCH_STATES_MAX * SEARCH_SYMBOLS_MAX];
+    int8_t move[SEARCH_STATES_MAX * SEARCH_SYMBOLS_MAX];
+};
+
+
+struct SearchChampion {
+    struct SearchNode node;
+    size_t steps;
+    wchar_t* output;
+};
+
+
+struct SearchDeque {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t tail;
+    size_t cap;
+    struct SearchNode* nodes;
+};
+
+
+struct SearchStats {
+    size_t halted;
+    size_t cycled;
+    size_t escaped;
+    size_t undecided;
+};
+
+
+struct SearchContext;
+
+
+struct SearchWorker {
+    struct SearchContext* ctx;
+    size_t id;
+    struct SearchDeque deque;
+    struct SearchStats stats;
+    struct MillTape* tape;
+    wchar_t* output;
+    wchar_t* snapshot;
+    size_t champion_count;
+    struct SearchChampion* champions;
+};
+
+
+struct SearchContext {
+    size_t states;
+    size_t symbols;
+    size_t limit;
+    size_t count;
+    enum SearchRank rank;
+    wchar_t alphabet[SEARCH_SYMBOLS_MAX];
+    uint8_t symbol_of[MILL_CODE_DIRECT];
+    const wchar_t* input;
+    size_t len;
+    const wchar_t* want;
+
+    atomic_size_t pending;
+    size_t worker_count;
+    struct SearchWorker* workers;
+};
+
+
+static int
+deque_push(struct SearchDeque* deque, const struct SearchNode* node) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail >= deque->cap) {
+        if (deque->head > 0) {
+            memmove(deque->nodes, &deque->nodes[deque->head],
+                (deque->tail - deque->head) * sizeof(deque->nodes[0]));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        if (deque->tail >= deque->cap) {
+            size_t cap = deque->cap != 0 ? deque->cap * 2 : 256;
+            void* p = realloc(deque->nodes, cap * sizeof(deque->nodes[0]));
+            if (p == NULL) {
+                pthread_mutex_unlock(&deque->lock);
+                perror("malloc");
+                return 1;
+            }
+            deque->nodes = p;
+            deque->cap = cap;
+        }
+    }
+    deque->nodes[deque->tail++] = *node;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+
+// The owner works depth-first from the tail; thieves take from the head,
+// where the shallowest nodes, and so the largest subtrees, are.
+static int
+deque_pop(struct SearchDeque* deque, struct SearchNode* node, int steal) {
+    int res = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        if (steal != 0) {
+            *node = deque->nodes[deque->head++];
+        }
+        else {
+            *node = deque->nodes[--deque->tail];
+        }
+        if (deque->head == deque->tail) {
+            deque->head = 0;
+            deque->tail = 0;
+        }
+        res = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return res;
+}
+
+
+static const char _state_names[] = "BCDEFGHIJKLMNOPQ";
+
+
+static void
+search_print_program(FILE* file, const struct SearchContext* ctx,
+    const struct SearchNode* node) {
+    for (size_t s = 0; s < ctx->states; ++s) {
+        for (size_t c = 0; c < ctx->symbols; ++c) {
+            size_t index = s * SEARCH_SYMBOLS_MAX + c;
+            if (node->state[index] == SEARCH_NONE) {
+                continue;
+            }
+            size_t next = node->state[index];
+            wchar_t in = ctx->alphabet[c];
+            wchar_t out = ctx->alphabet[node->write[index]];
+
+            if (s == 0) {
+                fputs("INIT", file);
+            }
+            else {
+                fputc(_state_names[s - 1], file);
+            }
+            fprintf(file, " %lc ", in != L'\0' ? in : L'_');
+            if (next == ctx->states) {
+                fputs("HALT", file);
+            }
+            else if (next == 0) {
+                fputs("INIT", file);
+            }
+            else {
+                fputc(_state_names[next - 1], file);
+            }
+            fprintf(file, " %lc %c\n", out != L'\0' ? out : L'_',
+                node->move[index] < 0 ? 'L' : 'R');
+        }
+    }
+}
+
+
+// Orders champions best first; ties fall back to the transition tables
+// so the report does not depend on which worker found what.
+static int
+search_compare(const struct SearchContext* ctx,
+    const struct SearchChampion* x, const struct SearchChampion* y) {
+    size_t xlen = wcslen(x->output);
+    size_t ylen = wcslen(y->output);
+    int res = 0;
+    switch (ctx->rank) {
+        case SearchRank_steps:
+            res = (x->steps < y->steps) - (x->steps > y->steps);
+            if (res == 0) {
+                res = (xlen < ylen) - (xlen > ylen);
+            }
+            break;
+        case SearchRank_output:
+            res = (xlen < ylen) - (xlen > ylen);
+            if (res == 0) {
+                res = (x->steps > y->steps) - (x->steps < y->steps);
+            }
+            break;
+        case SearchRank_want:
+            res = (x->node.used > y->node.used) - (x->node.used < y->node.used);
+            if (res == 0) {
+                res = (x->node.defined > y->node.defined) -
+                    (x->node.defined < y->node.defined);
+            }
+            if (res == 0) {
+                res = (x->steps > y->steps) - (x->steps < y->steps);
+            }
+            break;
+    }
+    if (res == 0) {
+        res = memcmp(&x->node, &y->node, sizeof(x->node));
+    }
+    return res;
+}
+
+
+static void
+search_offer(struct SearchWorker* w, const struct SearchNode* node,
+    size_t steps, const wchar_t* output) {
+    const struct SearchContext* ctx = w->ctx;
+    if (ctx->rank == SearchRank_want && wcscmp(output, ctx->want) != 0) {
+        return;
+    }
+
+    struct SearchChampion cand = {
+        .node = *node,
+        .steps = steps,
+        .output = (wchar_t*) output,
+    };
+    size_t n = w->champion_count;
+    if (n == ctx->count && search_compare(ctx, &cand, &w->champions[n - 1]) >= 0) {
+        return;
+    }
+
+    wchar_t* text = wcsdup(output);
+    if (text == NULL) {
+        return;
+    }
+    if (n == ctx->count) {
+        free(w->champions[--n].output);
+    }
+    size_t i = n;
+    while (i > 0 && search_compare(ctx, &cand, &w->champions[i - 1]) < 0) {
+        w->champions[i] = w->champions[i - 1];
+        --i;
+    }
+    cand.output = text;
+    w->champions[i] = cand;
+    w->champion_count = n + 1;
+}
+
+
+// A head that has run past every written cell only reads blanks from then
+// on; if the blank transitions keep it moving the same way and come back
+// to a state, it never returns.
+static int
+search_escapes(const struct SearchContext* ctx, const struct SearchNode* node,
+    size_t state, int dir) {
+    uint32_t seen = 0;
+    for (size_t i = 0; i <= ctx->states; ++i) {
+        if (seen & (1u << state)) {
+            return 1;
+        }
+        seen |= 1u << state;
+        size_t index = state * SEARCH_SYMBOLS_MAX;
+        if (node->state[index] == SEARCH_NONE || node->move[index] != dir) {
+            return 0;
+        }
+        state = node->state[index];
+        if (state == ctx->states) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+
+enum SearchStatus {
+    SearchStatus_undefined = 0,
+    SearchStatus_cycled,
+    SearchStatus_escaped,
+    SearchStatus_undecided,
+};
+
+
+// Runs a partial program from the input tape until it reads an undefined
+// transition, is proved never to halt, or reaches the step limit.
+// Configurations are saved at powers of two steps to catch cycles.
+static enum SearchStatus
+search_run(struct SearchWorker* w, const struct SearchNode* node,
+    size_t* steps, size_t* index) {
+    const struct SearchContext* ctx = w->ctx;
+    struct MillTape* tape = w->tape;
+    wchar_t* buf = tape->buf;
+    size_t mask = tape->size - 1;
+    size_t state = 0;
+    long rel = 0;
+    long lo = 0;
+    long hi = ctx->len > 0 ? (long) ctx->len - 1 : 0;
+
+    size_t snap_at = 1;
+    size_t snap_state = SEARCH_NONE;
+    long snap_rel = 0;
+    long snap_lo = 0;
+    long snap_hi = 0;
+
+    enum SearchStatus res = SearchStatus_undecided;
+    size_t t = 0;
+    for (; t < ctx->limit; ++t) {
+        size_t pos = (size_t) rel & mask;
+        size_t i = state * SEARCH_SYMBOLS_MAX + ctx->symbol_of[buf[pos]];
+        if (node->state[i] == SEARCH_NONE) {
+            *index = i;
+            res = SearchStatus_undefined;
+            break;
+        }
+
+        buf[pos] = ctx->alphabet[node->write[i]];
+        state = node->state[i];
+        rel += node->move[i];
+
+        if (rel > hi) {
+            hi = rel;
+            if (search_escapes(ctx, node, state, 1)) {
+                res = SearchStatus_escaped;
+                break;
+            }
+        }
+        else if (rel < lo) {
+            lo = rel;
+            if (search_escapes(ctx, node, state, -1)) {
+                res = SearchStatus_escaped;
+                break;
+            }
+        }
+
+        if (state == snap_state && rel == snap_rel && lo == snap_lo && hi == snap_hi) {
+            long k = lo;
+            for (; k <= hi; ++k) {
+                if (buf[(size_t) k & mask] != w->snapshot[k - lo]) { break; }
+            }
+            if (k > hi) {
+                res = SearchStatus_cycled;
+                break;
+            }
+        }
+        if (t + 1 == snap_at) {
+            snap_at *= 2;
+            snap_state = state;
+            snap_rel = rel;
+            snap_lo = lo;
+            snap_hi = hi;
+            for (long k = lo; k <= hi; ++k) {
+                w->snapshot[k - lo] = buf[(size_t) k & mask];
+            }
+        }
+    }
+
+    tape->pos = (size_t) rel & mask;
+    *steps = t;
+    return res;
+}
+
+
+static int
+search_expand(struct SearchWorker* w, const struct SearchNode* node) {
+    struct SearchContext* ctx = w->ctx;
+    struct MillTape* tape = w->tape;
+
+    mill_tape_load(tape, ctx->input, ctx->len);
+    size_t steps = 0;
+    size_t index = 0;
+    enum SearchStatus status = search_run(w, node, &steps, &index);
+    int res = 0;
+
+    switch (status) {
+        case SearchStatus_cycled: w->stats.cycled += 1; break;
+        case SearchStatus_escaped: w->stats.escaped += 1; break;
+        case SearchStatus_undecided: w->stats.undecided += 1; break;
+        case SearchStatus_undefined: {
+            // Left and right are mirror images on a blank tape.
+            int mirror = (steps == 0 && ctx->len == 0);
+            size_t pos = tape->pos;
+            wchar_t cell = tape->buf[pos];
+            size_t slots = ctx->states * ctx->symbols;
+
+            struct SearchNode child = *node;
+            child.defined += 1;
+            for (size_t c = 0; c < ctx->symbols; ++c) {
+                for (int move = mirror ? 1 : -1; move <= 1; move += 2) {
+                    child.state[index] = ctx->states;
+                    child.write[index] = c;
+                    child.move[index] = move;
+                    child.used = node->used;
+
+                    tape->buf[pos] = ctx->alphabet[c];
+                    tape->pos = (pos + move) & (tape->size - 1);
+                    size_t start = mill_tape_start_used(tape, ctx->len, steps + 1);
+                    mill_tape_text(tape, start, w->output, MILL_TAPE_SIZE + 1);
+                    tape->buf[pos] = cell;
+                    tape->pos = pos;
+
+                    w->stats.halted += 1;
+                    search_offer(w, &child, steps + 1, w->output);
+
+                    // The last free transition can only halt.
+                    if ((size_t) node->defined + 1 >= slots) {
+                        continue;
+                    }
+                    size_t next_max = node->used < ctx->states ? node->used : ctx->states - 1;
+                    for (size_t next = 0; next <= next_max && res == 0; ++next) {
+                        child.state[index] = next;
+                        child.used = next + 1 > node->used ? next + 1 : node->used;
+                        atomic_fetch_add(&ctx->pending, 1);
+                        res = deque_push(&w->deque, &child);
+                    }
+                }
+            }
+            break;
+        }
+    }
+
+    mill_tape_clear(tape, ctx->len, steps + 1);
+    return res;
+}
+
+
+static int
+search_steal(struct SearchWorker* w, struct SearchNode* node) {
+    struct SearchContext* ctx = w->ctx;
+    for (size_t i = 1; i < ctx->worker_count; ++i) {
+        struct SearchWorker* victim = &ctx->workers[(w->id + i) % ctx->worker_count];
+        if (deque_pop(&victim->deque, node, 1) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+static void*
+search_worker(void* arg) {
+    struct SearchWorker* w = arg;
+    struct SearchContext* ctx = w->ctx;
+    struct SearchNode node;
+
+    for (;;) {
+        if (deque_pop(&w->deque, &node, 0) == 0 && search_steal(w, &node) == 0) {
+            if (atomic_load(&ctx->pending) == 0) {
+                break;
+            }
+            sched_yield();
+            continue;
+        }
+        if (search_expand(w, &node) != 0) {
+            atomic_store(&ctx->pending, 0);
+            break;
+        }
+        atomic_fetch_sub(&ctx->pending, 1);
+    }
+    return NULL;
+}
+
+
+static struct MillProgram _Program;
+static struct MillTape _Tape;
+
+
+// Re-runs a champion through the mill engine, so a report never depends
+// on the search's own run loop alone.
+static int
+search_verify(const struct SearchContext* ctx, const struct SearchChampion* champ) {
+    char* text = NULL;
+    size_t size = 0;
+    FILE* fp = open_memstream(&text, &size);
+    if (fp == NULL) {
+        perror("open_memstream");
+        return 1;
+    }
+    search_print_program(fp, ctx, &champ->node);
+    fclose(fp);
+
+    fp = mill_open_text(text, size);
+    free(text);
+    if (fp == NULL) {
+        perror("tmpfile");
+        return 1;
+    }
+    int res = mill_parse_program(fp, &_Program);
+    fclose(fp);
+    if (res != 0) { return res; }
+
+    struct MillCode code;
+    res = mill_compile(&_Program, &code);
+    if (res != 0) { return res; }
+
+    _Tape.size = sizeof(_Tape.buf) / sizeof(_Tape.buf[0]);
+    mill_tape_clear(&_Tape, MILL_TAPE_SIZE, MILL_TAPE_SIZE);
+    mill_tape_load(&_Tape, ctx->input, ctx->len);
+    size_t steps = 0;
+    res = mill_exec(&code, &_Tape, &steps, MillRun_quiet);
+    mill_code_free(&code);
+
+    wchar_t* output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    if (output == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    size_t start = mill_tape_start_used(&_Tape, ctx->len, steps);
+    mill_tape_text(&_Tape, start, output, MILL_TAPE_SIZE + 1);
+    if (res != 0 || steps != champ->steps || wcscmp(output, champ->output) != 0) {
+        fprintf(stderr, "error: engine disagrees: %zu steps, output '%ls'\n",
+            steps, output);
+        res = 1;
+    }
+    free(output);
+    return res;
+}
+
+
+static int
+mill_search(FILE* file, struct SearchContext* ctx, size_t jobs) {
+    struct SearchWorker* workers = calloc(jobs, sizeof(workers[0]));
+    if (workers == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    ctx->workers = workers;
+    ctx->worker_count = jobs;
+
+    int res = 0;
+    for (size_t i = 0; i < jobs; ++i) {
+        struct SearchWorker* w = &workers[i];
+        w->ctx = ctx;
+        w->id = i;
+        pthread_mutex_init(&w->deque.lock, NULL);
+        w->tape = calloc(1, sizeof(*w->tape));
+        w->output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+        w->snapshot = malloc((2 * ctx->limit + ctx->len + 2) * sizeof(wchar_t));
+        w->champions = calloc(ctx->count + 1, sizeof(w->champions[0]));
+        if (w->tape == NULL || w->output == NULL || w->snapshot == NULL ||
+            w->champions == NULL) {
+            perror("malloc");
+            res = 1;
+        }
+        else {
+            w->tape->size = sizeof(w->tape->buf) / sizeof(w->tape->buf[0]);
+        }
+    }
+
+    if (res == 0) {
+        struct SearchNode root = {.used = 1};
+        memset(root.state, SEARCH_NONE, sizeof(root.state));
+        atomic_store(&ctx->pending, 1);
+        res = deque_push(&workers[0].deque, &root);
+    }
+
+    if (res == 0) {
+        pthread_t threads[jobs];
+        size_t started = 0;
+        for (; started < jobs; ++started) {
+            if (pthread_create(&threads[started], NULL, search_worker, &workers[started]) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            search_worker(&workers[0]);
+        }
+        for (size_t i = 0; i < started; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    struct SearchStats total = {};
+    struct SearchWorker* best = &workers[0];
+    for (size_t i = 0; i < jobs && res == 0; ++i) {
+        struct SearchWorker* w = &workers[i];
+        total.halted += w->stats.halted;
+        total.cycled += w->stats.cycled;
+        total.escaped += w->stats.escaped;
+        total.undecided += w->stats.undecided;
+        if (i == 0) {
+            continue;
+        }
+        for (size_t j = 0; j < w->champion_count; ++j) {
+            search_offer(best, &w->champions[j].node, w->champions[j].steps,
+                w->champions[j].output);
+        }
+    }
+
+    if (res == 0) {
+        fprintf(file, "%zu programs: %zu halted, %zu cycled, %zu escaped, "
+            "%zu undecided after %zu steps\n",
+            total.halted + total.cycled + total.escaped + total.undecided,
+            total.halted, total.cycled, total.escaped, total.undecided,
+            ctx->limit);
+        for (size_t i = 0; i < best->champion_count && res == 0; ++i) {
+            const struct SearchChampion* champ = &best->champions[i];
+            fprintf(file, "\n#%zu: %zu steps, %u states, output '%ls'\n",
+                i + 1, champ->steps, (unsigned) champ->node.used, champ->output);
+            search_print_program(file, ctx, &champ->node);
+            res = search_verify(ctx, champ);
+        }
+    }
+
+    for (size_t i = 0; i < jobs; ++i) {
+        struct SearchWorker* w = &workers[i];
+        for (size_t j = 0; j < w->champion_count; ++j) {
+            free(w->champions[j].output);
+        }
+        free(w->champions);
+        free(w->snapshot);
+        free(w->output);
+        free(w->tape);
+        free(w->deque.nodes);
+        pthread_mutex_destroy(&w->deque.lock);
+    }
+    free(workers);
+    return res;
+}
+
+
+static wchar_t*
+_widen(const char* s, size_t* len) {
+    size_t n = mbstowcs(NULL, s, 0);
+    if (n == (size_t) -1) {
+        return NULL;
+    }
+    wchar_t* res = malloc((n + 1) * sizeof(wchar_t));
+    if (res != NULL) {
+        mbstowcs(res, s, n + 1);
+        *len = n;
+    }
+    return res;
+}
+
+
+static int
+search_setup(const struct AppArgs* args, struct SearchContext* ctx,
+    wchar_t** input, wchar_t** want) {
+    static const char default_alphabet[] = "_|abcdef";
+
+    ctx->states = args->states;
+    ctx->limit = args->limit;
+    ctx->count = args->count;
+    ctx->rank = args->rank;
+    memset(ctx->symbol_of, SEARCH_NONE, sizeof(ctx->symbol_of));
+
+    size_t len = 0;
+    wchar_t* alphabet = NULL;
+    if (args->alphabet != NULL) {
+        alphabet = _widen(args->alphabet, &len);
+        if (alphabet == NULL || len < 2 || len > SEARCH_SYMBOLS_MAX || alphabet[0] != L'_') {
+            free(alphabet);
+            arg_error("-a/--alphabet: expected 2 to 8 symbols starting with _");
+            return 1;
+        }
+    }
+    else {
+        len = args->symbols;
+        alphabet = _widen(default_alphabet, &(size_t) {0});
+        if (alphabet == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    ctx->symbols = len;
+    for (size_t i = 0; i < len; ++i) {
+        wchar_t c = (i == 0) ? L'\0' : alphabet[i];
+        if ((uint32_t) c >= MILL_CODE_DIRECT || ctx->symbol_of[c] != SEARCH_NONE) {
+            free(alphabet);
+            arg_error("-a/--alphabet: symbols must be distinct Latin-1 characters");
+            return 1;
+        }
+        ctx->alphabet[i] = c;
+        ctx->symbol_of[c] = i;
+    }
+    free(alphabet);
+
+    *input = _widen(args->tape != NULL ? args->tape : "", &ctx->len);
+    if (*input == NULL || ctx->len >= MILL_TAPE_SIZE / 2) {
+        arg_error("-t/--tape: invalid tape");
+        return 1;
+    }
+    for (size_t i = 0; i < ctx->len; ++i) {
+        wchar_t c = (*input)[i] == L'_' ? L'\0' : (*input)[i];
+        if ((uint32_t) c >= MILL_CODE_DIRECT || ctx->symbol_of[c] == SEARCH_NONE) {
+            arg_error("-t/--tape: symbol not in the alphabet");
+            return 1;
+        }
+        (*input)[i] = c;
+    }
+    ctx->input = *input;
+
+    if (args->want != NULL) {
+        size_t n = 0;
+        *want = _widen(args->want, &n);
+        if (*want == NULL) {
+            arg_error("-w/--want: invalid text");
+            return 1;
+        }
+        ctx->want = *want;
+    }
+    return 0;
+}
+
+
+int main(int argc, const char* argv[]) {
+    setlocale(LC_ALL, "");
+
+    struct AppArgs args = {};
+    int res = parse_args(argc, argv, &args);
+    if (res != 0) { return res; }
+
+    if (args.needs_help) {
+        puts(_help_page);
+        return 0;
+    }
+
+    struct SearchContext ctx = {};
+    wchar_t* input = NULL;
+    wchar_t* want = NULL;
+    res = search_setup(&args, &ctx, &input, &want);
+    if (res == 0) {
+        size_t jobs = args.jobs;
+        if (jobs == 0) {
+            long n = sysconf(_SC_NPROCESSORS_ONLN);
+            jobs = n > 0 ? n : 1;
+        }
+        res = mill_search(stdout, &ctx, jobs);
+    }
+
+    free(want);
+    free(input);
+    return res;
+}
@@ -1,26 +1,59 @@
+#define _GNU_SOURCE
+#include <dirent.h>
 #include <errno.h>
 #include <locale.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <wchar.h>
 
-
-#define MILL_TAPE_SIZE 0x100000
-#define MILL_STATES_MAX 1024
-#define MILL_STATE_MAX 32
-#define MILL_INSTR_MAX 0x10000
-#define MILL_STEPS_MAX 1000000
+#include "mill.h"
+#include "capture.h"
+#include "grade.h"
+#include "hist.h"
+#include "iopool.h"
+#include "memo.h"
+#include "mill_sched.h"
+#include "trie.h"
 
 
 static const char _usage[] =
-    "usage: mill -p PROG [-t TAPE] [-o OUT] [-s] [-v]\n";
+    "usage: mill -p PROG [-t TAPE] [-o OUT] [-s] [-v]\n"
+    "       mill -p PROG -b TAPES [-o OUT] [-j N [--memo MB] | --slice K]\n"
+    "       mill -p PROG --tape-dir DIR [-o OUT] [-j N]\n"
+    "       mill -p PROG --explain [-o OUT]\n"
+    "       mill -p PROG --serve SOCKET [--slice K] [--capture FILE]\n"
+    "       mill -p PROG -b TAPES --coordinator ADDR [--unit N] [-o OUT]\n"
+    "       mill --worker ADDR [-j N] [--memo MB]\n"
+    "       mill --apply-delta DELTAS (-t TAPE | -b TAPES) [-o OUT]\n"
+    "       mill -p PROG -g FAMILY (-e EXPR | -E FILE) [-j N] [-a] [--share-prefixes]\n"
+    "       mill -P LIST (-g FAMILY (-e EXPR | -E FILE) | -T TESTS) [-j N]\n";
 
 static const char _help_page[] =
     "usage: mill -p PROG [-t TAPE] [-o OUT] [-s] [-v]\n"
+    "       mill -p PROG -b TAPES [-o OUT] [-j N [--memo MB] | --slice K]\n"
+    "       mill -p PROG --tape-dir DIR [-o OUT] [-j N]\n"
+    "       mill -p PROG --explain [-o OUT]\n"
+    "       mill -p PROG --serve SOCKET [--slice K] [--capture FILE]\n"
+    "       mill -p PROG -b TAPES --coordinator ADDR [--unit N] [-o OUT]\n"
+    "       mill --worker ADDR [-j N] [--memo MB]\n"
+    "       mill --apply-delta DELTAS (-t TAPE | -b TAPES) [-o OUT]\n"
+    "       mill -p PROG -g FAMILY (-e EXPR | -E FILE) [-j N] [-a] [--share-prefixes]\n"
+    "       mill -P LIST (-g FAMILY (-e EXPR | -E FILE) | -T TESTS) [-j N]\n"
     "\n"
     "Logic Mill engine https://mng.quest/\n"
     "\n"
@@ -31,19 +64,110 @@ static const char _help_page[] =
     "  -s, --steps           log steps taken\n"
     "  -t, --tape TAPE       tape text or file\n"
     "  -v, --verbose         verbose output\n"
+    "      --profile         log how often each rule fired\n"
+    "      --explain         report what compiling the program did\n"
+    "      --output-format FORMAT\n"
+    "                        text; delta, the output span and the cells\n"
+    "                          that differ from the input; or rle, runs\n"
+    "                          of a cell as C{N}; see readme\n"
+    "      --apply-delta DELTAS\n"
+    "                        rebuild outputs from tapes and delta lines\n"
+    "      --deadline MS     stop each run after MS milliseconds\n"
+    "  -b, --batch TAPES     run every tape in TAPES, one per line, and\n"
+    "                          print the outputs in order\n"
+    "      --tape-dir DIR    run every DIR/NAME.tape into NAME.output,\n"
+    "                          checking NAME.expected, see readme\n"
+    "      --coverage        with -b or -g, report rules that never fired\n"
+    "                          and states left without a rule\n"
+    "      --cache FILE      with -b, keep per-tape results in FILE and\n"
+    "                          rerun only tapes an edit can affect\n"
+    "      --serve SOCKET    run tapes sent to a Unix socket, see readme\n"
+    "      --capture FILE    with -b or --serve, log every run asked for to\n"
+    "                          FILE, for mill-replay; see readme\n"
+    "      --slice K         with -b or --serve, run tapes on one thread in\n"
+    "                          turns of K steps, short runs first\n"
+    "      --coordinator ADDR\n"
+    "                        with -b, listen on HOST:PORT and run the batch\n"
+    "                          on the workers that connect, see readme\n"
+    "      --unit N          tapes handed to a worker at a time (64, at most 65536)\n"
+    "      --worker ADDR     run tapes for the coordinator at HOST:PORT,\n"
+    "                          reconnecting until stopped\n"
+    "      --memo MB         with -b or --worker, keep up to MB of results\n"
+    "                          that threads running the same program share\n"
+    "      --huge-pages      back tapes and the transition table with huge\n"
+    "                          pages where the system has them\n"
+    "      --stats           log run time and the memory backing obtained;\n"
+    "                          with -b, percentiles of run latency, steps,\n"
+    "                          tape parse time and output size\n"
+    "      --stats-json      with -b, log those percentiles as JSON\n"
+    "\n"
+    "SIGUSR1 makes a running program log its progress to stderr.\n"
+    "\n"
+    "grading:\n"
+    "  -g, --grade FAMILY    run the program over an input family:\n"
+    "                          unary:N   |...| for 0..N\n"
+    "                          sum:N     |..|+|..| for all pairs a, b <= N\n"
+    "                          binary:L  binary strings of length <= L\n"
+    "  -e, --expect EXPR     expected result as an expression over\n"
+    "                          n (unary, binary value), a, b (sum),\n"
+    "                          l (binary length); + - * / % ( )\n"
+    "  -E, --expect-file FILE\n"
+    "                        expected tapes, one line per input\n"
+    "  -j, --jobs N          number of worker threads\n"
+    "  -a, --all             report all mismatches\n"
+    "      --share-prefixes  run the steps inputs share before the head\n"
+    "                          first tells them apart once, see readme\n"
+    "  -P, --programs LIST   grade every program file listed in LIST,\n"
+    "                          one per line, and print a results matrix\n"
+    "  -T, --tests FILE      test set, one INPUT<tab>EXPECTED per line\n"
     ;
 
 
+enum OutputFormat {
+    OutputFormat_text,
+    OutputFormat_delta,
+    OutputFormat_rle,
+};
+
+
 struct AppArgs {
     int needs_help;
     int log_steps;
     int verbose;
+    int profile;
+    int explain;
+    int coverage;
+    int stats;
+    int stats_json;
+    int huge_pages;
+    int grade_all;
+    int share_prefixes;
+    size_t jobs;
+    size_t deadline_ms;
+    size_t slice;
     const char* program;
     const char* tape;
     const char* output;
+    const char* grade;
+    const char* expect;
+    const char* expect_file;
+    const char* programs;
+    const char* tests;
+    const char* batch;
+    const char* cache;
+    const char* serve;
+    const char* coordinator;
+    const char* worker;
+    size_t unit;
+    size_t memo_mb;
+    const char* tape_dir;
+    const char* capture;
+    enum OutputFormat output_format;
+    const char* apply_delta;
     FILE* program_file;
     FILE* tape_file;
     FILE* output_file;
+    FILE* batch_file;
 };
 
 
@@ -61,6 +185,25 @@ arg_perror(const char* message) {
 }
 
 
+static int
+args_output_format(const char* name, enum OutputFormat* format) {
+    if (strcmp(name, "text") == 0) {
+        *format = OutputFormat_text;
+    }
+    else if (strcmp(name, "delta") == 0) {
+        *format = OutputFormat_delta;
+    }
+    else if (strcmp(name, "rle") == 0) {
+        *format = OutputFormat_rle;
+    }
+    else {
+        arg_error("--output-format: expected text, delta or rle");
+        return 1;
+    }
+    return 0;
+}
+
+
 static int
 parse_args(int argc, const char* argv[], struct AppArgs* args) {
     *args = (struct AppArgs) {};
@@ -93,6 +236,101 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                     strcmp(argv[i], "--verbose") == 0) {
                     args->verbose = 1;
                 }
+                else if (strcmp(argv[i], "--profile") == 0) {
+                    args->profile = 1;
+                }
+                else if (strcmp(argv[i], "--explain") == 0) {
+                    args->explain = 1;
+                }
+                else if (strcmp(argv[i], "--deadline") == 0) {
+                    state = 10;
+                }
+                else if (strcmp(argv[i], "-b") == 0 ||
+                    strcmp(argv[i], "--batch") == 0) {
+                    state = 11;
+                }
+                else if (strcmp(argv[i], "--coverage") == 0) {
+                    args->coverage = 1;
+                }
+                else if (strcmp(argv[i], "--stats") == 0) {
+                    args->stats = 1;
+                }
+                else if (strcmp(argv[i], "--stats-json") == 0) {
+                    args->stats = 1;
+                    args->stats_json = 1;
+                }
+                else if (strcmp(argv[i], "--huge-pages") == 0) {
+                    args->huge_pages = 1;
+                }
+                else if (strcmp(argv[i], "--cache") == 0) {
+                    state = 12;
+                }
+                else if (strcmp(argv[i], "--serve") == 0) {
+                    state = 13;
+                }
+                else if (strcmp(argv[i], "--slice") == 0) {
+                    state = 14;
+                }
+                else if (strcmp(argv[i], "--coordinator") == 0) {
+                    state = 15;
+                }
+                else if (strcmp(argv[i], "--worker") == 0) {
+                    state = 16;
+                }
+                else if (strcmp(argv[i], "--unit") == 0) {
+                    state = 17;
+                }
+                else if (strcmp(argv[i], "--output-format") == 0) {
+                    state = 18;
+                }
+                else if (strncmp(argv[i], "--output-format=", 16) == 0) {
+                    if (args_output_format(argv[i] + 16, &args->output_format) != 0) {
+                        return 1;
+                    }
+                }
+                else if (strcmp(argv[i], "--apply-delta") == 0) {
+                    state = 19;
+                }
+                else if (strcmp(argv[i], "--memo") == 0) {
+                    state = 20;
+                }
+                else if (strcmp(argv[i], "--tape-dir") == 0) {
+                    state = 21;
+                }
+                else if (strcmp(argv[i], "--capture") == 0) {
+                    state = 22;
+                }
+                else if (strcmp(argv[i], "-g") == 0 ||
+                    strcmp(argv[i], "--grade") == 0) {
+                    state = 4;
+                }
+                else if (strcmp(argv[i], "-e") == 0 ||
+                    strcmp(argv[i], "--expect") == 0) {
+                    state = 5;
+                }
+                else if (strcmp(argv[i], "-E") == 0 ||
+                    strcmp(argv[i], "--expect-file") == 0) {
+                    state = 6;
+                }
+                else if (strcmp(argv[i], "-j") == 0 ||
+                    strcmp(argv[i], "--jobs") == 0) {
+                    state = 7;
+                }
+                else if (strcmp(argv[i], "-a") == 0 ||
+                    strcmp(argv[i], "--all") == 0) {
+                    args->grade_all = 1;
+                }
+                else if (strcmp(argv[i], "--share-prefixes") == 0) {
+                    args->share_prefixes = 1;
+                }
+                else if (strcmp(argv[i], "-P") == 0 ||
+                    strcmp(argv[i], "--programs") == 0) {
+                    state = 8;
+                }
+                else if (strcmp(argv[i], "-T") == 0 ||
+                    strcmp(argv[i], "--tests") == 0) {
+                    state = 9;
+                }
                 break;
 
             case 1:
@@ -119,6 +357,141 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
                 state = 0;
                 break;
 
+            case 4:
+                args->grade = argv[i];
+                state = 0;
+                break;
+
+            case 5:
+                args->expect = argv[i];
+                state = 0;
+                break;
+
+            case 6:
+                args->expect_file = argv[i];
+                state = 0;
+                break;
+
+            case 7: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0) {
+                    arg_error("-j/--jobs: expected a positive number");
+                    return 1;
+                }
+                args->jobs = n;
+                state = 0;
+                break;
+            }
+
+            case 8:
+                args->programs = argv[i];
+                state = 0;
+                break;
+
+            case 9:
+                args->tests = argv[i];
+                state = 0;
+                break;
+
+            case 10: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0) {
+                    arg_error("--deadline: expected milliseconds");
+                    return 1;
+                }
+                args->deadline_ms = n;
+                state = 0;
+                break;
+            }
+
+            case 11:
+                args->batch = argv[i];
+                if (strcmp(argv[i], "-") == 0) {
+                    args->batch_file = stdin;
+                }
+                state = 0;
+                break;
+
+            case 12:
+                args->cache = argv[i];
+                state = 0;
+                break;
+
+            case 13:
+                args->serve = argv[i];
+                state = 0;
+                break;
+
+            case 14: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0) {
+                    arg_error("--slice: expected a number of steps");
+                    return 1;
+                }
+                args->slice = n;
+                state = 0;
+                break;
+            }
+
+            case 15:
+                args->coordinator = argv[i];
+                state = 0;
+                break;
+
+            case 16:
+                args->worker = argv[i];
+                state = 0;
+                break;
+
+            case 17: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0) {
+                    arg_error("--unit: expected a number of tapes");
+                    return 1;
+                }
+                args->unit = n;
+                state = 0;
+                break;
+            }
+
+            case 18:
+                if (args_output_format(argv[i], &args->output_format) != 0) {
+                    return 1;
+                }
+                state = 0;
+                break;
+
+            case 19:
+                args->apply_delta = argv[i];
+                state = 0;
+                break;
+
+            case 20: {
+                char* end = NULL;
+                unsigned long n = strtoul(argv[i], &end, 10);
+                if (*end != '\0' || n == 0 || n > (SIZE_MAX >> 20)) {
+                    arg_error("--memo: expected a size in MB");
+                    return 1;
+                }
+                args->memo_mb = n;
+                state = 0;
+                break;
+            }
+
+            case 21:
+                args->tape_dir = argv[i];
+                state = 0;
+                break;
+
+            case 22:
+                args->capture = argv[i];
+                state = 0;
+                break;
+
             default:
                 break;
         }
@@ -128,12 +501,148 @@ parse_args(int argc, const char* argv[], struct AppArgs* args) {
         return 0;
     }
 
-    if (args->program == NULL) {
+    if (args->apply_delta != NULL) {
+        if (args->program != NULL || (args->tape == NULL) == (args->batch == NULL) ||
+            args->grade != NULL || args->programs != NULL || args->serve != NULL ||
+            args->worker != NULL) {
+            arg_error("--apply-delta: expected one of -t/--tape, -b/--batch and no program");
+            return 1;
+        }
+        if (args->output == NULL) {
+            args->output_file = stdout;
+        }
+        return 0;
+    }
+
+    if (args->worker != NULL) {
+        if (args->program != NULL || args->tape != NULL || args->batch != NULL ||
+            args->grade != NULL || args->programs != NULL || args->serve != NULL) {
+            arg_error("--worker: conflicting -p/--program, -t/--tape, -b/--batch, "
+                "-g/--grade, -P/--programs or --serve");
+            return 1;
+        }
+        return 0;
+    }
+
+    if (args->programs != NULL) {
+        if (args->program != NULL || args->tape != NULL) {
+            arg_error("-P/--programs: conflicting -p/--program or -t/--tape");
+            return 1;
+        }
+        if ((args->grade == NULL) == (args->tests == NULL)) {
+            arg_error("-P/--programs: expected one of -g/--grade, -T/--tests");
+            return 1;
+        }
+    }
+    else if (args->program == NULL) {
         arg_error("-p/--program: expected filename");
         return 1;
     }
+    else if (args->tests != NULL) {
+        arg_error("-T/--tests: expected -P/--programs");
+        return 1;
+    }
+
+    if (args->explain != 0 && (args->batch != NULL || args->grade != NULL ||
+        args->tape != NULL || args->programs != NULL || args->serve != NULL ||
+        args->tape_dir != NULL || args->coordinator != NULL)) {
+        arg_error("--explain: expected -p/--program and no tapes");
+        return 1;
+    }
+    if (args->tape_dir != NULL && (args->batch != NULL || args->grade != NULL ||
+        args->tape != NULL || args->programs != NULL || args->serve != NULL ||
+        args->coordinator != NULL || args->coverage != 0 || args->cache != NULL ||
+        args->slice != 0 || args->stats != 0 || args->memo_mb != 0 ||
+        args->output_format != OutputFormat_text)) {
+        arg_error("--tape-dir: expected -p/--program, with only -j, --deadline, "
+            "--huge-pages or -o");
+        return 1;
+    }
+    if (args->batch != NULL) {
+        if (args->grade != NULL || args->tape != NULL || args->programs != NULL) {
+            arg_error("-b/--batch: conflicting -g/--grade, -t/--tape or -P/--programs");
+            return 1;
+        }
+        if (args->program_file == stdin && args->batch_file == stdin) {
+            arg_error("-b/--batch: conflicting filename");
+            return 1;
+        }
+    }
+    if (args->coverage != 0 && args->batch == NULL && args->grade == NULL) {
+        arg_error("--coverage: expected -b/--batch or -g/--grade");
+        return 1;
+    }
+    if (args->cache != NULL && (args->batch == NULL || args->coverage != 0)) {
+        arg_error("--cache: expected -b/--batch without --coverage");
+        return 1;
+    }
+    if (args->stats != 0 && (args->grade != NULL || args->programs != NULL)) {
+        arg_error("--stats: expected a single run or -b/--batch");
+        return 1;
+    }
+    if (args->stats_json != 0 && args->batch == NULL) {
+        arg_error("--stats-json: expected -b/--batch");
+        return 1;
+    }
+    if (args->huge_pages != 0 && (args->grade != NULL || args->programs != NULL)) {
+        arg_error("--huge-pages: expected a single run, -b/--batch or --serve");
+        return 1;
+    }
+    if (args->serve != NULL && (args->batch != NULL || args->grade != NULL ||
+        args->tape != NULL || args->coverage != 0 || args->stats != 0)) {
+        arg_error("--serve: conflicting -b/--batch, -g/--grade, -t/--tape, --coverage or --stats");
+        return 1;
+    }
+    if (args->coordinator != NULL && (args->batch == NULL || args->coverage != 0 ||
+        args->cache != NULL || args->stats != 0 || args->slice != 0 || args->jobs != 0)) {
+        arg_error("--coordinator: expected -b/--batch, without --coverage, --cache, "
+            "--stats, --slice or -j");
+        return 1;
+    }
+    if (args->output_format != OutputFormat_text &&
+        (args->grade != NULL || args->programs != NULL || args->serve != NULL ||
+        args->cache != NULL)) {
+        arg_error("--output-format: conflicting -g/--grade, -P/--programs, --serve or --cache");
+        return 1;
+    }
+    if (args->unit != 0 && args->coordinator == NULL) {
+        arg_error("--unit: expected --coordinator");
+        return 1;
+    }
+    if (args->slice != 0 && ((args->batch == NULL && args->serve == NULL) ||
+        args->jobs != 0 || args->coverage != 0 || args->cache != NULL)) {
+        arg_error("--slice: expected -b/--batch or --serve, without -j, --coverage or --cache");
+        return 1;
+    }
+    if (args->memo_mb != 0 && (args->batch == NULL || args->coverage != 0 ||
+        args->cache != NULL || args->slice != 0 || args->coordinator != NULL)) {
+        arg_error("--memo: expected -b/--batch or --worker, without --coverage, "
+            "--cache, --slice or --coordinator");
+        return 1;
+    }
+    if (args->capture != NULL && ((args->batch == NULL && args->serve == NULL) ||
+        args->coordinator != NULL)) {
+        arg_error("--capture: expected -b/--batch or --serve, without --coordinator");
+        return 1;
+    }
+    if (args->share_prefixes != 0 && (args->grade == NULL || args->programs != NULL ||
+        args->deadline_ms != 0 || args->coverage != 0)) {
+        arg_error("--share-prefixes: expected -g/--grade, without -P/--programs, --deadline or --coverage");
+        return 1;
+    }
 
-    if (args->tape == NULL) {
+    if (args->grade != NULL) {
+        if ((args->expect == NULL) == (args->expect_file == NULL)) {
+            arg_error("-g/--grade: expected one of -e/--expect, -E/--expect-file");
+            return 1;
+        }
+        if (args->tape != NULL) {
+            arg_error("-g/--grade: conflicting -t/--tape");
+            return 1;
+        }
+    }
+    else if (args->tape == NULL && args->programs == NULL && args->batch == NULL &&
+        args->tape_dir == NULL && args->explain == 0) {
         if (args->program_file == stdin) {
             arg_error("-t/--tape: expected filename");
             return 1;
@@ -170,7 +679,7 @@ args_open_file(const char* filename, const char* mode, FILE** file) {
         return 1;
     }
 
-    fp = fmemopen((void*) filename, strlen(filename), mode);
+    fp = mill_open_text(filename, strlen(filename));
     if (fp != NULL) {
         *file = fp;
         return 0;
@@ -180,433 +689,4627 @@ args_open_file(const char* filename, const char* mode, FILE** file) {
 }
 
 
+// Reads the whole program into text, leaving program_file open on a copy
+// for the parser.
+static int
+args_read_program(struct AppArgs* args, char** text, size_t* len) {
+    size_t cap = 4096;
+    size_t n = 0;
+    char* buf = malloc(cap);
+    while (buf != NULL) {
+        n += fread(&buf[n], 1, cap - n, args->program_file);
+        if (n < cap) {
+            break;
+        }
+        cap *= 2;
+        void* p = realloc(buf, cap);
+        if (p == NULL) {
+            free(buf);
+        }
+        buf = p;
+    }
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    if (ferror(args->program_file)) {
+        arg_perror("-p/--program");
+        free(buf);
+        return 1;
+    }
+
+    FILE* copy = mill_open_text(buf, n);
+    if (copy == NULL) {
+        perror("tmpfile");
+        free(buf);
+        return 1;
+    }
+    if (args->program_file != stdin) {
+        fclose(args->program_file);
+    }
+    args->program_file = copy;
+    *text = buf;
+    *len = n;
+    return 0;
+}
+
+
 static void
 args_close_files(struct AppArgs* args) {
     if (args->output_file != stdout) {
         fclose(args->output_file);
     }
 
-    if (args->program_file != stdin) {
+    if (args->program_file != NULL && args->program_file != stdin) {
         fclose(args->program_file);
     }
 
-    if (args->tape_file != stdin) {
+    if (args->tape_file != NULL && args->tape_file != stdin) {
         fclose(args->tape_file);
     }
-}
-
-
-enum HeadMove {
-    HeadMove_none = 0,
-    HeadMove_left = 'L',
-    HeadMove_right = 'R',
-};
 
-
-struct MillInstr {
-    size_t state_in;
-    wchar_t char_in;
-    size_t state_out;
-    wchar_t char_out;
-    enum HeadMove move;
-};
+    if (args->batch_file != NULL && args->batch_file != stdin) {
+        fclose(args->batch_file);
+    }
+}
 
 
-struct SymTable {
-    size_t size;
-    wchar_t* symbols[MILL_STATES_MAX + 1];
-    size_t datasize;
-    wchar_t symdata[MILL_STATES_MAX * (MILL_STATE_MAX + 1)];
+struct CoverageMiss {
+    size_t state;
+    wchar_t c;
+    size_t hits;
+    wchar_t* example;
 };
 
 
-struct MillProgram {
-    struct SymTable symtable;
-    size_t syminit;
-    size_t symhalt;
-    size_t instr_count;
-    struct MillInstr instructions[MILL_INSTR_MAX];
+// Rule hits and unhandled (state, symbol) pairs seen by one worker; the
+// workers' counters are merged once the run is over.
+struct Coverage {
+    size_t* counts;
+    size_t tapes;
+    size_t miss_count;
+    size_t miss_cap;
+    struct CoverageMiss* misses;
 };
 
 
-struct MillTape {
-    size_t size;
-    size_t pos;
-    wchar_t buf[MILL_TAPE_SIZE];
-    wchar_t _null;
-};
+static int
+coverage_init(struct Coverage* cov, const struct MillCode* code) {
+    *cov = (struct Coverage) {};
+    cov->counts = calloc(code->states * code->symbols, sizeof(size_t));
+    if (cov->counts == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    return 0;
+}
 
 
 static void
-parse_error(const char* fmt, ...) {
-    fputs("parse error: ", stderr);
-    va_list args;
-    va_start(args, fmt);
-    vfprintf(stderr, fmt, args);
-    va_end(args);
-    fputc('\n', stderr);
+coverage_free(struct Coverage* cov) {
+    for (size_t i = 0; i < cov->miss_count; ++i) {
+        free(cov->misses[i].example);
+    }
+    free(cov->misses);
+    free(cov->counts);
+    *cov = (struct Coverage) {};
 }
 
 
-static int
-parse_headmove(const wchar_t* text, enum HeadMove* head) {
-    size_t n = wcslen(text);
-    if (n != 1) {
-        parse_error("invalid move instruction %ls", text);
-        return 1;
+static void
+coverage_miss(struct Coverage* cov, size_t state, wchar_t c, size_t hits,
+    const wchar_t* example) {
+    for (size_t i = 0; i < cov->miss_count; ++i) {
+        struct CoverageMiss* miss = &cov->misses[i];
+        if (miss->state == state && miss->c == c) {
+            miss->hits += hits;
+            return;
+        }
     }
-    wchar_t c = text[0];
-    switch ((enum HeadMove) c) {
-        case HeadMove_left:
-        case HeadMove_right:
-            *head = c;
-            return 0;
-        default:
-            parse_error("invalid move instruction %ls", text);
-            return 1;
+    if (cov->miss_count >= cov->miss_cap) {
+        size_t cap = cov->miss_cap != 0 ? cov->miss_cap * 2 : 16;
+        void* p = realloc(cov->misses, cap * sizeof(cov->misses[0]));
+        if (p == NULL) {
+            return;
+        }
+        cov->misses = p;
+        cov->miss_cap = cap;
     }
+    cov->misses[cov->miss_count++] = (struct CoverageMiss) {
+        .state = state,
+        .c = c,
+        .hits = hits,
+        .example = wcsdup(example),
+    };
 }
 
 
-static int
-symtable_insert(struct SymTable* symtable, wchar_t* symbol, size_t* sid) {
-    for (size_t i = 0; i < symtable->size; ++i) {
-        if (wcscmp(symtable->symbols[i], symbol) == 0) {
-            *sid = i;
-            return 0;
-        }
+// Adds up one finished run: the rule counts are already in place, an
+// unhandled pair is recorded from the probe.
+static void
+coverage_record(struct Coverage* cov, const struct MillProbe* probe, int res,
+    const wchar_t* input) {
+    cov->tapes += 1;
+    if (res < 0) {
+        coverage_miss(cov, probe->unhandled_state, probe->unhandled_char, 1, input);
     }
-    if (symtable->size >= MILL_STATES_MAX) {
-        parse_error("symbol table limit reached");
-        return -1;
+}
+
+
+static void
+coverage_merge(struct Coverage* into, const struct Coverage* from, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        into->counts[i] += from->counts[i];
     }
-    size_t symsize = wcslen(symbol) + 1;
-    size_t symmax = sizeof(symtable->symdata) / sizeof(symtable->symdata[0]);
-    if (symtable->datasize + symsize > symmax) {
-        parse_error("symbols buffer exhausted");
-        return -1;
+    into->tapes += from->tapes;
+    for (size_t i = 0; i < from->miss_count; ++i) {
+        const struct CoverageMiss* miss = &from->misses[i];
+        coverage_miss(into, miss->state, miss->c, miss->hits, miss->example);
     }
-    wchar_t* p = &symtable->symdata[symtable->datasize];
-    wcscpy(p, symbol);
-    *sid = symtable->size;
-    symtable->datasize += symsize;
-    symtable->symbols[symtable->size++] = p;
-    symtable->symbols[symtable->size] = NULL;
-    return 0;
 }
 
 
 static int
-mill_parse_instruction(FILE* file, struct SymTable* symtable,
-    struct MillInstr* instr) {
-    struct MillInstr data = {};
-    size_t tokmax = MILL_STATE_MAX;
-    wchar_t token[tokmax + 1];
-    size_t toksize = 0;
-    token[toksize] = L'\0';
-    size_t sid;
-    int state = 0;
+_compare_misses(const void* a, const void* b) {
+    const struct CoverageMiss* x = a;
+    const struct CoverageMiss* y = b;
+    return (x->hits < y->hits) - (x->hits > y->hits);
+}
 
-    for (; state < 100; ) {
-        wint_t c = fgetwc(file);
-        if (c == WEOF) {
+
+static void
+mill_print_coverage(FILE* file, const struct MillCode* code, struct Coverage* cov) {
+    struct MillProgram* prog = code->prog;
+    size_t count = code->states * code->symbols;
+    unsigned char* claimed = calloc(count, 1);
+    if (claimed == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    size_t fired = 0;
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        struct MillInstr* instr = &prog->instructions[i];
+        size_t index = instr->state_in * code->symbols
+            + mill_code_symbol(code, instr->char_in);
+        fired += (claimed[index] == 0 && cov->counts[index] != 0);
+        claimed[index] = 1;
+    }
+    fprintf(file, "coverage: %zu/%zu rules fired over %zu tapes\n",
+        fired, prog->instr_count, cov->tapes);
+
+    memset(claimed, 0, count);
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        struct MillInstr* instr = &prog->instructions[i];
+        size_t index = instr->state_in * code->symbols
+            + mill_code_symbol(code, instr->char_in);
+        if (claimed[index] != 0 || cov->counts[index] == 0) {
+            fprintf(file, "  never fired: %ls %lc %ls %lc %c%s\n",
+                prog->symtable.symbols[instr->state_in],
+                instr->char_in != L'\0' ? instr->char_in : L'_',
+                prog->symtable.symbols[instr->state_out],
+                instr->char_out != L'\0' ? instr->char_out : L'_',
+                instr->move, claimed[index] != 0 ? " (shadowed)" : "");
+        }
+        claimed[index] = 1;
+    }
+    free(claimed);
+
+    if (cov->miss_count > 0) {
+        qsort(cov->misses, cov->miss_count, sizeof(cov->misses[0]), _compare_misses);
+    }
+    for (size_t i = 0; i < cov->miss_count; ++i) {
+        const struct CoverageMiss* miss = &cov->misses[i];
+        fprintf(file, "  unhandled: %ls %lc reached %zu times, e.g. on '%ls'\n",
+            prog->symtable.symbols[miss->state],
+            miss->c != L'\0' ? miss->c : L'_', miss->hits, miss->example);
+    }
+}
+
+
+enum GradeStatus {
+    GradeStatus_pass = 0,
+    GradeStatus_mismatch,
+    GradeStatus_error,
+    GradeStatus_timeout,
+    GradeStatus_reference,
+};
+
+
+struct GradeFailure {
+    size_t index;
+    enum GradeStatus status;
+    size_t steps;
+    wchar_t* input;
+    wchar_t* expected;
+    wchar_t* output;
+    char* diagnosis;
+};
+
+
+// Grading keeps the transition history so a timed-out case can report
+// the loop it was stuck in; the submission matrix only needs outcomes.
+// -t adds history for the steps its timeout report reads, and batches
+// report a timeout by its step count alone.
+static const int _grade_flags = MillRun_quiet | MillRun_poll | MillRun_history;
+static const int _submit_flags = MillRun_quiet | MillRun_poll;
+static const int _run_flags = MillRun_poll;
+static const int _batch_flags = MillRun_quiet | MillRun_poll;
+
+
+struct GradeContext {
+    const struct MillCode* code;
+    mill_exec_fn exec;
+    int flags;
+    size_t deadline_ms;
+    const struct GradeSpec* spec;
+    const char* expect;
+    wchar_t** expect_lines;
+    int grade_all;
+
+    atomic_size_t next;
+    atomic_int stop;
+    atomic_size_t passed;
+    atomic_size_t failed;
+    atomic_size_t steps_max;
+    atomic_size_t worker_ids;
+    struct Coverage* coverage;
+
+    // With shared prefixes, the family cut into items, and the steps
+    // run against those separate runs would have taken.
+    struct TrieItem* items;
+    size_t item_count;
+    atomic_size_t steps_run;
+    atomic_size_t steps_each;
+    atomic_size_t forks;
+    atomic_int broken;
+
+    pthread_mutex_t lock;
+    size_t failure_count;
+    size_t failure_cap;
+    struct GradeFailure* failures;
+};
+
+
+static void
+grade_record_failure(struct GradeContext* ctx, size_t index,
+    enum GradeStatus status, size_t steps,
+    const wchar_t* input, const wchar_t* expected, const wchar_t* output,
+    char* diagnosis) {
+    atomic_fetch_add(&ctx->failed, 1);
+    atomic_store(&ctx->stop, 1);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->grade_all == 0 && ctx->failure_count > 0) {
+        struct GradeFailure* first = &ctx->failures[0];
+        if (first->index < index) {
+            pthread_mutex_unlock(&ctx->lock);
+            free(diagnosis);
+            return;
+        }
+        free(first->input);
+        free(first->expected);
+        free(first->output);
+        free(first->diagnosis);
+        ctx->failure_count = 0;
+    }
+    if (ctx->failure_count >= ctx->failure_cap) {
+        size_t cap = ctx->failure_cap != 0 ? ctx->failure_cap * 2 : 16;
+        void* p = realloc(ctx->failures, cap * sizeof(ctx->failures[0]));
+        if (p == NULL) {
+            pthread_mutex_unlock(&ctx->lock);
+            free(diagnosis);
+            return;
+        }
+        ctx->failures = p;
+        ctx->failure_cap = cap;
+    }
+    ctx->failures[ctx->failure_count++] = (struct GradeFailure) {
+        .index = index,
+        .status = status,
+        .steps = steps,
+        .input = wcsdup(input),
+        .expected = expected != NULL ? wcsdup(expected) : NULL,
+        .output = output != NULL ? wcsdup(output) : NULL,
+        .diagnosis = diagnosis,
+    };
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+
+// The output expected from input `index`, written to expected unless the
+// reference lists it; NULL, recorded as a failure, when there is none.
+static const wchar_t*
+grade_want(struct GradeContext* ctx, size_t index, const wchar_t* input,
+    const struct GradeVars* vars, wchar_t* expected, size_t bufsize) {
+    if (ctx->expect_lines != NULL) {
+        return ctx->expect_lines[index];
+    }
+    long long value = 0;
+    int res = grade_expr_eval(ctx->expect, vars, &value);
+    if (res == 0) {
+        res = grade_expected(ctx->spec, value, expected, bufsize);
+    }
+    if (res != 0) {
+        grade_record_failure(ctx, index, GradeStatus_reference, 0,
+            input, NULL, NULL, NULL);
+        return NULL;
+    }
+    return expected;
+}
+
+
+// Records the outcome of one run against want. A timeout is diagnosed
+// from the probe's history, if there is one.
+static void
+grade_check(struct GradeContext* ctx, size_t index, const wchar_t* input,
+    size_t len, const wchar_t* want, int res, size_t steps,
+    struct MillTape* tape, const struct MillProbe* probe,
+    wchar_t* output, size_t bufsize) {
+    size_t prev = atomic_load(&ctx->steps_max);
+    while (prev < steps &&
+        !atomic_compare_exchange_weak(&ctx->steps_max, &prev, steps)) {
+    }
+
+    if (res != 0) {
+        char* diagnosis = NULL;
+        if (res > 0 && probe != NULL) {
+            size_t size = 0;
+            FILE* report = open_memstream(&diagnosis, &size);
+            if (report != NULL) {
+                mill_timeout_report(report, ctx->code, tape, probe, steps);
+                fclose(report);
+            }
+        }
+        grade_record_failure(ctx, index,
+            res > 0 ? GradeStatus_timeout : GradeStatus_error, steps,
+            input, want, NULL, diagnosis);
+        return;
+    }
+
+    size_t start = mill_tape_start_used(tape, len, steps);
+    mill_tape_text(tape, start, output, bufsize);
+    if (wcscmp(output, want) == 0) {
+        atomic_fetch_add(&ctx->passed, 1);
+    }
+    else {
+        grade_record_failure(ctx, index, GradeStatus_mismatch, steps,
+            input, want, output, NULL);
+    }
+}
+
+
+static void*
+grade_worker(void* arg) {
+    struct GradeContext* ctx = arg;
+    size_t bufsize = MILL_TAPE_SIZE + 1;
+    struct MillTape* tape = calloc(1, sizeof(*tape));
+    wchar_t* input = malloc(bufsize * sizeof(wchar_t));
+    wchar_t* expected = malloc(bufsize * sizeof(wchar_t));
+    wchar_t* output = malloc(bufsize * sizeof(wchar_t));
+    if (tape == NULL || input == NULL || expected == NULL || output == NULL) {
+        perror("malloc");
+        atomic_store(&ctx->stop, 1);
+        goto done;
+    }
+    tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+
+    struct Coverage* cov = NULL;
+    if (ctx->coverage != NULL) {
+        cov = &ctx->coverage[atomic_fetch_add(&ctx->worker_ids, 1)];
+    }
+
+    for (;;) {
+        if (ctx->grade_all == 0 && atomic_load(&ctx->stop) != 0) {
+            break;
+        }
+        size_t index = atomic_fetch_add(&ctx->next, 1);
+        if (index >= ctx->spec->count) {
+            break;
+        }
+
+        struct GradeVars vars;
+        size_t len = grade_input(ctx->spec, index, input, &vars);
+        const wchar_t* want = grade_want(ctx, index, input, &vars, expected, bufsize);
+        if (want == NULL) {
+            continue;
+        }
+
+        size_t steps = 0;
+        struct MillProbe probe;
+        mill_probe_start(&probe, ctx->deadline_ms);
+        probe.counts = cov != NULL ? cov->counts : NULL;
+        mill_tape_load(tape, input, len);
+        int res = ctx->exec(ctx->code, tape, &steps, ctx->flags, &probe);
+        if (cov != NULL) {
+            coverage_record(cov, &probe, res, input);
+        }
+        grade_check(ctx, index, input, len, want, res, steps, tape, &probe,
+            output, bufsize);
+        mill_tape_clear(tape, len, steps);
+    }
+
+done:
+    free(output);
+    free(expected);
+    free(input);
+    free(tape);
+    return NULL;
+}
+
+
+// Per-worker buffers for grading the inputs a trie run reports.
+struct GradeLeaf {
+    struct GradeContext* ctx;
+    size_t bufsize;
+    wchar_t* expected;
+    wchar_t* output;
+    // Where a timed-out input whose history was overwritten by its
+    // siblings runs again on its own.
+    struct MillTape* tape;
+    size_t steps;
+};
+
+
+static int
+grade_leaf(void* arg, const wchar_t* input, size_t len,
+    int status, size_t steps, struct MillTape* tape, const struct MillProbe* probe) {
+    struct GradeLeaf* leaf = arg;
+    struct GradeContext* ctx = leaf->ctx;
+    size_t index = grade_index(ctx->spec, input, len);
+
+    // Only for its variables; the output buffer is free until the check.
+    struct GradeVars vars;
+    grade_input(ctx->spec, index, leaf->output, &vars);
+    const wchar_t* want = grade_want(ctx, index, input, &vars,
+        leaf->expected, leaf->bufsize);
+    leaf->steps += steps;
+
+    if (want != NULL && status > 0 && probe == NULL) {
+        struct MillProbe own;
+        mill_probe_start(&own, 0);
+        mill_tape_load(leaf->tape, input, len);
+        status = ctx->exec(ctx->code, leaf->tape, &steps, ctx->flags, &own);
+        grade_check(ctx, index, input, len, want, status, steps, leaf->tape, &own,
+            leaf->output, leaf->bufsize);
+        mill_tape_clear(leaf->tape, len, steps);
+    }
+    else if (want != NULL) {
+        grade_check(ctx, index, input, len, want, status, steps, tape, probe,
+            leaf->output, leaf->bufsize);
+    }
+    return atomic_load(&ctx->broken) != 0;
+}
+
+
+static void*
+grade_share_worker(void* arg) {
+    struct GradeContext* ctx = arg;
+    struct GradeLeaf leaf = {
+        .ctx = ctx,
+        .bufsize = MILL_TAPE_SIZE + 1,
+        .expected = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t)),
+        .output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t)),
+        .tape = calloc(1, sizeof(struct MillTape)),
+    };
+    struct Trie trie;
+    int res = trie_init(&trie, ctx->code, ctx->spec, grade_leaf, &leaf);
+    if (res != 0 || leaf.expected == NULL || leaf.output == NULL || leaf.tape == NULL) {
+        if (res == 0) {
+            perror("malloc");
+        }
+        atomic_store(&ctx->broken, 1);
+        goto done;
+    }
+    leaf.tape->size = sizeof(leaf.tape->buf) / sizeof(leaf.tape->buf[0]);
+
+    // Inputs come in trie order, not index order, so there is no stopping
+    // at the first failure: the lowest one is only known at the end.
+    for (;;) {
+        if (atomic_load(&ctx->broken) != 0) {
+            break;
+        }
+        size_t i = atomic_fetch_add(&ctx->next, 1);
+        if (i >= ctx->item_count) {
+            break;
+        }
+        trie_run_item(&trie, &ctx->items[i]);
+        if (trie.broken != 0) {
+            atomic_store(&ctx->broken, 1);
+            break;
+        }
+    }
+    atomic_fetch_add(&ctx->steps_run, trie.steps);
+    atomic_fetch_add(&ctx->steps_each, leaf.steps);
+    atomic_fetch_add(&ctx->forks, trie.forks);
+
+done:
+    trie_free(&trie);
+    free(leaf.tape);
+    free(leaf.output);
+    free(leaf.expected);
+    return NULL;
+}
+
+
+static int
+grade_read_expected(FILE* file, size_t count, wchar_t*** lines) {
+    size_t bufsize = MILL_TAPE_SIZE + 2;
+    wchar_t* buf = malloc(bufsize * sizeof(wchar_t));
+    wchar_t** res = calloc(count, sizeof(wchar_t*));
+    if (buf == NULL || res == NULL) {
+        perror("malloc");
+        free(buf);
+        free(res);
+        return 1;
+    }
+
+    size_t n = 0;
+    for (; n < count; ++n) {
+        if (fgetws(buf, bufsize, file) == NULL) {
+            break;
+        }
+        size_t len = wcslen(buf);
+        while (len > 0 && (buf[len - 1] == L'\n' || buf[len - 1] == L'\r')) {
+            buf[--len] = L'\0';
+        }
+        res[n] = wcsdup(buf);
+    }
+    free(buf);
+
+    if (n < count) {
+        fprintf(stderr, "error: expected %zu lines, got %zu\n", count, n);
+        for (size_t i = 0; i < n; ++i) {
+            free(res[i]);
+        }
+        free(res);
+        return 1;
+    }
+
+    *lines = res;
+    return 0;
+}
+
+
+static int
+_compare_failures(const void* a, const void* b) {
+    const struct GradeFailure* x = a;
+    const struct GradeFailure* y = b;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+
+static int
+mill_grade(FILE* file, const struct MillCode* code, const struct GradeSpec* spec,
+    const char* expect, wchar_t** expect_lines, size_t jobs, int grade_all,
+    size_t deadline_ms, int coverage, int share) {
+    static const char* status_names[] = {
+        [GradeStatus_pass] = "pass",
+        [GradeStatus_mismatch] = "mismatch",
+        [GradeStatus_error] = "error",
+        [GradeStatus_timeout] = "timed out",
+        [GradeStatus_reference] = "no reference",
+    };
+
+    int flags = _grade_flags | (coverage != 0 ? MillRun_count : 0);
+    struct GradeContext ctx = {
+        .code = code,
+        .exec = mill_exec_select(flags),
+        .flags = flags,
+        .deadline_ms = deadline_ms,
+        .spec = spec,
+        .expect = expect,
+        .expect_lines = expect_lines,
+        .grade_all = grade_all,
+    };
+    if (jobs > spec->count) {
+        jobs = spec->count;
+    }
+    void* (*worker)(void*) = grade_worker;
+    if (share != 0) {
+        if (trie_split(spec, jobs * 4, &ctx.items, &ctx.item_count) != 0) {
+            return 1;
+        }
+        worker = grade_share_worker;
+    }
+    if (share != 0 && jobs > ctx.item_count) {
+        jobs = ctx.item_count;
+    }
+    if (coverage != 0) {
+        ctx.coverage = calloc(jobs, sizeof(ctx.coverage[0]));
+        if (ctx.coverage == NULL) {
+            perror("malloc");
+            trie_items_free(ctx.items, ctx.item_count);
+            return 1;
+        }
+        for (size_t i = 0; i < jobs; ++i) {
+            if (coverage_init(&ctx.coverage[i], code) != 0) {
+                for (size_t j = 0; j < i; ++j) {
+                    coverage_free(&ctx.coverage[j]);
+                }
+                free(ctx.coverage);
+                trie_items_free(ctx.items, ctx.item_count);
+                return 1;
+            }
+        }
+    }
+    pthread_mutex_init(&ctx.lock, NULL);
+
+    pthread_t* threads = malloc(jobs * sizeof(threads[0]));
+    size_t started = 0;
+    for (; threads != NULL && started < jobs; ++started) {
+        int res = pthread_create(&threads[started], NULL, worker, &ctx);
+        if (res != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        worker(&ctx);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&ctx.lock);
+
+    if (ctx.failure_count > 0) {
+        qsort(ctx.failures, ctx.failure_count, sizeof(ctx.failures[0]), _compare_failures);
+    }
+    for (size_t i = 0; i < ctx.failure_count; ++i) {
+        struct GradeFailure* f = &ctx.failures[i];
+        fprintf(file, "%s: '%ls'", status_names[f->status], f->input);
+        if (f->expected != NULL) {
+            fprintf(file, " expected '%ls'", f->expected);
+        }
+        if (f->output != NULL) {
+            fprintf(file, " got '%ls'", f->output);
+        }
+        if (f->status != GradeStatus_reference) {
+            fprintf(file, " (%zu steps)", f->steps);
+        }
+        fputc('\n', file);
+        if (f->diagnosis != NULL) {
+            fputs(f->diagnosis, file);
+        }
+        free(f->input);
+        free(f->expected);
+        free(f->output);
+        free(f->diagnosis);
+    }
+    free(ctx.failures);
+
+    size_t passed = atomic_load(&ctx.passed);
+    size_t failed = atomic_load(&ctx.failed);
+    fprintf(file, "%zu/%zu passed, %zu failed, %zu steps max\n",
+        passed, spec->count, failed, atomic_load(&ctx.steps_max));
+    if (share != 0) {
+        fprintf(file, "%zu steps run for %zu, %zu forks\n",
+            atomic_load(&ctx.steps_run), atomic_load(&ctx.steps_each),
+            atomic_load(&ctx.forks));
+        trie_items_free(ctx.items, ctx.item_count);
+    }
+
+    if (ctx.coverage != NULL) {
+        fflush(file);
+        for (size_t i = 1; i < jobs; ++i) {
+            coverage_merge(&ctx.coverage[0], &ctx.coverage[i], code->states * code->symbols);
+            coverage_free(&ctx.coverage[i]);
+        }
+        mill_print_coverage(stderr, code, &ctx.coverage[0]);
+        coverage_free(&ctx.coverage[0]);
+        free(ctx.coverage);
+    }
+
+    if (atomic_load(&ctx.broken) != 0) {
+        return 1;
+    }
+    return (passed == spec->count) ? 0 : 1;
+}
+
+
+struct SubmitTest {
+    wchar_t* input;
+    size_t len;
+    wchar_t* expected;
+    atomic_size_t timeouts;
+};
+
+
+struct SubmitRow {
+    int parsed;
+    size_t passed;
+    size_t steps;
+    double ms;
+    unsigned char* status;
+    size_t* steps_by_test;
+};
+
+
+struct SubmitContext {
+    char** programs;
+    size_t program_count;
+    struct SubmitTest* tests;
+    size_t test_count;
+    struct SubmitRow* rows;
+    size_t deadline_ms;
+    atomic_size_t next;
+};
+
+
+static double
+_elapsed_ms(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+
+static int
+_compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+
+// Runs one program over the test set, cheapest tests first: tests that
+// timed out for earlier programs go last, and the first failure ends
+// the row.
+static void
+submit_run_program(struct SubmitContext* ctx, size_t index,
+    struct MillProgram* prog, struct MillTape* tape,
+    wchar_t* output, size_t outsize, uint64_t* order) {
+    struct SubmitRow* row = &ctx->rows[index];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    FILE* file = fopen(ctx->programs[index], "r");
+    if (file == NULL) {
+        perror(ctx->programs[index]);
+        return;
+    }
+    int res = mill_parse_program(file, prog);
+    fclose(file);
+    if (res != 0) {
+        fprintf(stderr, "%s: parse failed\n", ctx->programs[index]);
+        return;
+    }
+
+    struct MillCode code;
+    res = mill_compile(prog, &code);
+    if (res != 0) { return; }
+    row->parsed = 1;
+    mill_exec_fn exec = mill_exec_select(_submit_flags);
+
+    for (size_t i = 0; i < ctx->test_count; ++i) {
+        uint64_t timeouts = atomic_load(&ctx->tests[i].timeouts);
+        order[i] = (timeouts << 32) | i;
+    }
+    qsort(order, ctx->test_count, sizeof(order[0]), _compare_u64);
+
+    for (size_t k = 0; k < ctx->test_count; ++k) {
+        size_t i = order[k] & 0xffffffff;
+        struct SubmitTest* test = &ctx->tests[i];
+        size_t steps = 0;
+        struct MillProbe probe;
+        mill_probe_start(&probe, ctx->deadline_ms);
+
+        mill_tape_load(tape, test->input, test->len);
+        res = exec(&code, tape, &steps, _submit_flags, &probe);
+
+        enum GradeStatus status = GradeStatus_pass;
+        if (res > 0) {
+            status = GradeStatus_timeout;
+            atomic_fetch_add(&test->timeouts, 1);
+        }
+        else if (res < 0) {
+            status = GradeStatus_error;
+        }
+        else {
+            size_t start = mill_tape_start_used(tape, test->len, steps);
+            mill_tape_text(tape, start, output, outsize);
+            if (wcscmp(output, test->expected) != 0) {
+                status = GradeStatus_mismatch;
+            }
+        }
+        mill_tape_clear(tape, test->len, steps);
+
+        row->status[i] = status;
+        row->steps_by_test[i] = steps;
+        row->steps += steps;
+        if (status != GradeStatus_pass) {
+            break;
+        }
+        row->passed += 1;
+    }
+
+    mill_code_free(&code);
+    row->ms = _elapsed_ms(&start);
+}
+
+
+struct SubmitWorker {
+    struct SubmitContext* ctx;
+    // The CPU to pin to, or -1 to leave the thread where it is.
+    int cpu;
+};
+
+
+static void*
+submit_worker(void* arg) {
+    struct SubmitWorker* worker = arg;
+    struct SubmitContext* ctx = worker->ctx;
+
+#ifdef __linux__
+    if (worker->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(worker->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    size_t outsize = MILL_TAPE_SIZE + 1;
+    struct MillProgram* prog = malloc(sizeof(*prog));
+    struct MillTape* tape = calloc(1, sizeof(*tape));
+    wchar_t* output = malloc(outsize * sizeof(wchar_t));
+    uint64_t* order = malloc(ctx->test_count * sizeof(uint64_t));
+    if (prog == NULL || tape == NULL || output == NULL || order == NULL) {
+        perror("malloc");
+        goto done;
+    }
+    tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+
+    for (;;) {
+        size_t index = atomic_fetch_add(&ctx->next, 1);
+        if (index >= ctx->program_count) {
+            break;
+        }
+        submit_run_program(ctx, index, prog, tape, output, outsize, order);
+    }
+
+done:
+    free(order);
+    free(output);
+    free(tape);
+    free(prog);
+    return NULL;
+}
+
+
+static void
+submit_print_matrix(FILE* file, struct SubmitContext* ctx) {
+    fputs("program\tpassed\tsteps\tms", file);
+    for (size_t i = 0; i < ctx->test_count; ++i) {
+        fprintf(file, "\t%zu", i);
+    }
+    fputc('\n', file);
+
+    for (size_t p = 0; p < ctx->program_count; ++p) {
+        struct SubmitRow* row = &ctx->rows[p];
+        if (row->parsed == 0) {
+            fprintf(file, "%s\terror\t-\t-", ctx->programs[p]);
+        }
+        else {
+            fprintf(file, "%s\t%zu/%zu\t%zu\t%.3f", ctx->programs[p],
+                row->passed, ctx->test_count, row->steps, row->ms);
+        }
+        for (size_t i = 0; i < ctx->test_count; ++i) {
+            switch (row->status[i]) {
+                case GradeStatus_pass:
+                    fprintf(file, "\t%zu", row->steps_by_test[i]);
+                    break;
+                case GradeStatus_mismatch:
+                    fprintf(file, "\t!%zu", row->steps_by_test[i]);
+                    break;
+                case GradeStatus_error:
+                    fputs("\tE", file);
+                    break;
+                case GradeStatus_timeout:
+                    fputs("\tT", file);
+                    break;
+                default:
+                    fputs("\t-", file);
+                    break;
+            }
+        }
+        fputc('\n', file);
+    }
+}
+
+
+static void
+submit_free_rows(struct SubmitContext* ctx) {
+    for (size_t p = 0; ctx->rows != NULL && p < ctx->program_count; ++p) {
+        free(ctx->rows[p].status);
+        free(ctx->rows[p].steps_by_test);
+    }
+    free(ctx->rows);
+}
+
+
+// Up to size of the CPUs the process may run on, in order, so workers
+// are pinned only to CPUs taskset or a cgroup leaves it; none if that is
+// unknown.
+static size_t
+submit_cpus(int* cpus, size_t size) {
+    size_t n = 0;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        return 0;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < size; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[n++] = cpu;
+        }
+    }
+#else
+    (void) cpus;
+    (void) size;
+#endif
+    return n;
+}
+
+
+// Grades many programs against one test set. Each worker takes whole
+// programs, so all tapes of a program run on the same core with its
+// compiled table hot in cache.
+static int
+mill_submit(FILE* file, char** programs, size_t program_count,
+    struct SubmitTest* tests, size_t test_count, size_t jobs,
+    size_t deadline_ms) {
+    struct SubmitContext ctx = {
+        .programs = programs,
+        .program_count = program_count,
+        .tests = tests,
+        .test_count = test_count,
+        .deadline_ms = deadline_ms,
+    };
+
+    ctx.rows = calloc(program_count, sizeof(ctx.rows[0]));
+    if (ctx.rows == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t p = 0; p < program_count; ++p) {
+        struct SubmitRow* row = &ctx.rows[p];
+        row->status = malloc(test_count);
+        row->steps_by_test = calloc(test_count, sizeof(size_t));
+        if (row->status == NULL || row->steps_by_test == NULL) {
+            perror("malloc");
+            submit_free_rows(&ctx);
+            return 1;
+        }
+        memset(row->status, GradeStatus_reference, test_count);
+    }
+
+    if (jobs > program_count) {
+        jobs = program_count;
+    }
+    int* cpus = malloc(jobs * sizeof(cpus[0]));
+    size_t ncpu = cpus != NULL ? submit_cpus(cpus, jobs) : 0;
+
+    pthread_t* threads = malloc(jobs * sizeof(threads[0]));
+    struct SubmitWorker* workers = malloc(jobs * sizeof(workers[0]));
+    size_t started = 0;
+    for (; threads != NULL && workers != NULL && started < jobs; ++started) {
+        workers[started] = (struct SubmitWorker) {&ctx, ncpu > 0 ? cpus[started % ncpu] : -1};
+        int res = pthread_create(&threads[started], NULL, submit_worker,
+            &workers[started]);
+        if (res != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        struct SubmitWorker worker = {&ctx, -1};
+        submit_worker(&worker);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(workers);
+    free(threads);
+    free(cpus);
+
+    submit_print_matrix(file, &ctx);
+
+    int failed = 0;
+    for (size_t p = 0; p < program_count; ++p) {
+        if (ctx.rows[p].passed != test_count) {
+            failed = 1;
+        }
+    }
+    submit_free_rows(&ctx);
+    return failed;
+}
+
+
+// Results cache for batch runs. Each tape keeps the (state, symbol) pairs
+// it read, with the interval of its run where each was first read, and
+// snapshots taken at the end of intervals; interval 0 ends at
+// MILL_POLL_STEPS steps and each later one doubles. After an edit, a
+// tape that read no changed pair keeps its result, and any other tape
+// resumes from the snapshot before the earliest changed pair it read.
+// States are stored by name, so edits may add or reorder them.
+
+#define CACHE_MAGIC "MILLCCH1"
+
+
+struct CacheKey {
+    size_t state;
+    wchar_t c;
+    uint32_t interval;
+};
+
+
+struct CacheCheckpoint {
+    size_t state;
+    size_t steps;
+    size_t pos;
+    size_t lo;
+    size_t size;
+    wchar_t* cells;
+};
+
+
+struct CacheEntry {
+    int valid;
+    size_t len;
+    uint64_t hash;
+    int status;
+    size_t steps;
+    wchar_t* output;
+    size_t key_count;
+    struct CacheKey* keys;
+    size_t checkpoint_count;
+    struct CacheCheckpoint* checkpoints;
+};
+
+
+struct CacheRule {
+    size_t state_in;
+    wchar_t c;
+    size_t state_out;
+    wchar_t write;
+    int move;
+};
+
+
+struct Cache {
+    size_t name_count;
+    wchar_t** names;
+    size_t rule_count;
+    struct CacheRule* rules;
+    size_t entry_count;
+    struct CacheEntry* entries;
+    // Open addressing by input hash over the valid entries, as position
+    // plus one, so that a tape finds its old entry after tapes before it
+    // were added or removed; index_size is a power of two, or 0.
+    size_t* index;
+    size_t index_size;
+};
+
+
+static uint64_t
+_hash_text(const wchar_t* text, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ (uint32_t) text[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+
+static void
+cache_entry_free(struct CacheEntry* entry) {
+    for (size_t i = 0; i < entry->checkpoint_count; ++i) {
+        free(entry->checkpoints[i].cells);
+    }
+    free(entry->checkpoints);
+    free(entry->keys);
+    free(entry->output);
+    *entry = (struct CacheEntry) {};
+}
+
+
+static void
+cache_free(struct Cache* cache) {
+    for (size_t i = 0; i < cache->name_count; ++i) {
+        free(cache->names[i]);
+    }
+    free(cache->names);
+    free(cache->rules);
+    for (size_t i = 0; i < cache->entry_count; ++i) {
+        cache_entry_free(&cache->entries[i]);
+    }
+    free(cache->entries);
+    free(cache->index);
+    *cache = (struct Cache) {};
+}
+
+
+static int
+_compare_rules(const void* a, const void* b) {
+    const struct CacheRule* x = a;
+    const struct CacheRule* y = b;
+    if (x->state_in != y->state_in) {
+        return (x->state_in > y->state_in) - (x->state_in < y->state_in);
+    }
+    return (x->c > y->c) - (x->c < y->c);
+}
+
+
+// Takes the program's states and effective rules, first rule winning,
+// sorted for lookup.
+static int
+cache_set_program(struct Cache* cache, const struct MillCode* code) {
+    const struct MillProgram* prog = code->prog;
+    cache->name_count = prog->symtable.size;
+    cache->names = calloc(cache->name_count, sizeof(wchar_t*));
+    cache->rules = malloc((prog->instr_count + 1) * sizeof(struct CacheRule));
+    if (cache->names == NULL || cache->rules == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    for (size_t i = 0; i < cache->name_count; ++i) {
+        cache->names[i] = wcsdup(prog->symtable.symbols[i]);
+        if (cache->names[i] == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    size_t n = 0;
+    for (size_t s = 0; s < code->states; ++s) {
+        for (size_t c = 1; c < code->symbols; ++c) {
+            const struct MillOp* op = mill_code_op(code, s, c);
+            if (op->state == MILL_CODE_NONE) {
+                continue;
+            }
+            cache->rules[n++] = (struct CacheRule) {
+                .state_in = s,
+                .c = mill_code_char(code, c),
+                .state_out = op->state,
+                .write = op->write,
+                .move = op->move,
+            };
+        }
+    }
+    cache->rule_count = n;
+    qsort(cache->rules, n, sizeof(cache->rules[0]), _compare_rules);
+    return 0;
+}
+
+
+static const struct CacheRule*
+cache_find_rule(const struct Cache* cache, size_t state, wchar_t c) {
+    struct CacheRule key = {.state_in = state, .c = c};
+    return bsearch(&key, cache->rules, cache->rule_count, sizeof(key), _compare_rules);
+}
+
+
+// Maps the cache's state names to the program's states, MILL_CODE_NONE
+// for states the program no longer has.
+static size_t*
+cache_state_map(const struct Cache* cache, const struct MillCode* code) {
+    size_t* map = malloc((cache->name_count + 1) * sizeof(size_t));
+    if (map == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    const struct SymTable* symtable = &code->prog->symtable;
+    for (size_t i = 0; i < cache->name_count; ++i) {
+        map[i] = MILL_CODE_NONE;
+        for (size_t j = 0; j < symtable->size; ++j) {
+            if (wcscmp(cache->names[i], symtable->symbols[j]) == 0) {
+                map[i] = j;
+                break;
+            }
+        }
+    }
+    return map;
+}
+
+
+static int
+cache_key_changed(const struct Cache* cache, const size_t* map,
+    const struct MillCode* code, size_t state, wchar_t c) {
+    const struct CacheRule* old = cache_find_rule(cache, state, c);
+    const struct MillOp* op = NULL;
+    if (map[state] != MILL_CODE_NONE) {
+        op = mill_code_op(code, map[state], mill_code_symbol(code, c));
+        if (op->state == MILL_CODE_NONE) {
+            op = NULL;
+        }
+    }
+    if (old == NULL || op == NULL) {
+        return (old == NULL) != (op == NULL);
+    }
+    return map[old->state_out] != op->state || old->write != op->write ||
+        old->move != op->move;
+}
+
+
+static int
+_cache_write(FILE* file, const void* data, size_t size) {
+    return size == 0 || fwrite(data, 1, size, file) == size ? 0 : 1;
+}
+
+
+static int
+_cache_write_u64(FILE* file, uint64_t value) {
+    return _cache_write(file, &value, sizeof(value));
+}
+
+
+static int
+_cache_write_text(FILE* file, const wchar_t* text, size_t len) {
+    return _cache_write_u64(file, len) || _cache_write(file, text, len * sizeof(wchar_t));
+}
+
+
+static int
+cache_write(const char* filename, const struct Cache* cache) {
+    size_t size = strlen(filename) + 5;
+    char temp[size];
+    snprintf(temp, size, "%s.tmp", filename);
+    FILE* file = fopen(temp, "wb");
+    if (file == NULL) {
+        perror(temp);
+        return 1;
+    }
+
+    int res = _cache_write(file, CACHE_MAGIC, 8);
+    res = res || _cache_write_u64(file, cache->name_count);
+    for (size_t i = 0; i < cache->name_count && res == 0; ++i) {
+        res = _cache_write_text(file, cache->names[i], wcslen(cache->names[i]));
+    }
+    res = res || _cache_write_u64(file, cache->rule_count);
+    res = res || _cache_write(file, cache->rules, cache->rule_count * sizeof(cache->rules[0]));
+    res = res || _cache_write_u64(file, cache->entry_count);
+    for (size_t i = 0; i < cache->entry_count && res == 0; ++i) {
+        const struct CacheEntry* entry = &cache->entries[i];
+        res = _cache_write_u64(file, entry->valid);
+        if (entry->valid == 0) {
+            continue;
+        }
+        res = res || _cache_write_u64(file, entry->len);
+        res = res || _cache_write_u64(file, entry->hash);
+        res = res || _cache_write_u64(file, (uint64_t) (int64_t) entry->status);
+        res = res || _cache_write_u64(file, entry->steps);
+        res = res || _cache_write_text(file, entry->output,
+            entry->output != NULL ? wcslen(entry->output) : 0);
+        res = res || _cache_write_u64(file, entry->key_count);
+        res = res || _cache_write(file, entry->keys, entry->key_count * sizeof(entry->keys[0]));
+        res = res || _cache_write_u64(file, entry->checkpoint_count);
+        for (size_t k = 0; k < entry->checkpoint_count && res == 0; ++k) {
+            const struct CacheCheckpoint* cp = &entry->checkpoints[k];
+            res = _cache_write_u64(file, cp->state);
+            res = res || _cache_write_u64(file, cp->steps);
+            res = res || _cache_write_u64(file, cp->pos);
+            res = res || _cache_write_u64(file, cp->lo);
+            res = res || _cache_write_text(file, cp->cells, cp->size);
+        }
+    }
+
+    if (fclose(file) != 0) {
+        res = 1;
+    }
+    if (res == 0 && rename(temp, filename) != 0) {
+        res = 1;
+    }
+    if (res != 0) {
+        perror(filename);
+        remove(temp);
+    }
+    return res;
+}
+
+
+static int
+_cache_read(FILE* file, void* data, size_t size) {
+    return size == 0 || fread(data, 1, size, file) == size ? 0 : 1;
+}
+
+
+static int
+_cache_read_u64(FILE* file, uint64_t* value) {
+    return _cache_read(file, value, sizeof(*value));
+}
+
+
+static int
+_cache_read_text(FILE* file, wchar_t** text, size_t* len) {
+    uint64_t n = 0;
+    if (_cache_read_u64(file, &n) != 0 || n > MILL_TAPE_SIZE) {
+        return 1;
+    }
+    *text = malloc((n + 1) * sizeof(wchar_t));
+    if (*text == NULL) {
+        return 1;
+    }
+    (*text)[n] = L'\0';
+    if (len != NULL) {
+        *len = n;
+    }
+    return _cache_read(file, *text, n * sizeof(wchar_t));
+}
+
+
+static int
+_cache_read_array(FILE* file, void** data, size_t* count, size_t size, size_t max) {
+    uint64_t n = 0;
+    if (_cache_read_u64(file, &n) != 0 || n > max) {
+        return 1;
+    }
+    *count = n;
+    *data = malloc(n * size + 1);
+    if (*data == NULL) {
+        return 1;
+    }
+    return _cache_read(file, *data, n * size);
+}
+
+
+static void
+_cache_build_index(struct Cache* cache) {
+    size_t size = 16;
+    while (size < 2 * cache->entry_count) {
+        size *= 2;
+    }
+    cache->index = calloc(size, sizeof(cache->index[0]));
+    if (cache->index == NULL) {
+        return;
+    }
+    cache->index_size = size;
+    for (size_t i = 0; i < cache->entry_count; ++i) {
+        if (cache->entries[i].valid == 0) {
+            continue;
+        }
+        size_t slot = cache->entries[i].hash & (size - 1);
+        while (cache->index[slot] != 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        cache->index[slot] = i + 1;
+    }
+}
+
+
+// The old entry for a tape of len cells and this hash: the one at the
+// tape's position in the batch if it matches, or else any that does.
+static const struct CacheEntry*
+cache_lookup(const struct Cache* cache, size_t position, size_t len, uint64_t hash) {
+    if (position < cache->entry_count) {
+        const struct CacheEntry* entry = &cache->entries[position];
+        if (entry->valid != 0 && entry->len == len && entry->hash == hash) {
+            return entry;
+        }
+    }
+    for (size_t slot = hash & (cache->index_size - 1);
+        cache->index_size != 0 && cache->index[slot] != 0;
+        slot = (slot + 1) & (cache->index_size - 1)) {
+        const struct CacheEntry* entry = &cache->entries[cache->index[slot] - 1];
+        if (entry->len == len && entry->hash == hash) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+
+// Loads a cache written by cache_write; a missing file is an empty cache.
+static int
+cache_read(const char* filename, struct Cache* cache) {
+    *cache = (struct Cache) {};
+    FILE* file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+
+    char magic[8];
+    uint64_t n = 0;
+    int res = _cache_read(file, magic, 8) || memcmp(magic, CACHE_MAGIC, 8) != 0;
+    res = res || _cache_read_u64(file, &n) || n > MILL_STATES_MAX + 1;
+    if (res == 0) {
+        cache->names = calloc(n, sizeof(wchar_t*));
+        res = cache->names == NULL;
+    }
+    for (size_t i = 0; i < n && res == 0; ++i) {
+        res = _cache_read_text(file, &cache->names[i], NULL);
+        cache->name_count = i + 1;
+    }
+    res = res || _cache_read_array(file, (void**) &cache->rules, &cache->rule_count,
+        sizeof(cache->rules[0]), MILL_INSTR_MAX);
+    for (size_t i = 0; i < cache->rule_count && res == 0; ++i) {
+        res = cache->rules[i].state_in >= cache->name_count ||
+            cache->rules[i].state_out >= cache->name_count;
+    }
+    res = res || _cache_read_u64(file, &n);
+    if (res == 0) {
+        cache->entries = calloc(n + 1, sizeof(cache->entries[0]));
+        res = cache->entries == NULL;
+    }
+    for (size_t i = 0; i < n && res == 0; ++i) {
+        struct CacheEntry* entry = &cache->entries[i];
+        cache->entry_count = i + 1;
+        uint64_t value = 0;
+        res = _cache_read_u64(file, &value);
+        if (res != 0 || value == 0) {
+            continue;
+        }
+        entry->valid = 1;
+        res = _cache_read_u64(file, &value);
+        entry->len = value;
+        res = res || _cache_read_u64(file, &entry->hash);
+        res = res || _cache_read_u64(file, &value);
+        entry->status = (int) (int64_t) value;
+        res = res || _cache_read_u64(file, &value);
+        entry->steps = value;
+        res = res || _cache_read_text(file, &entry->output, NULL);
+        res = res || _cache_read_array(file, (void**) &entry->keys, &entry->key_count,
+            sizeof(entry->keys[0]), MILL_STATES_MAX * MILL_INSTR_MAX);
+        for (size_t k = 0; k < entry->key_count && res == 0; ++k) {
+            res = entry->keys[k].state >= cache->name_count;
+        }
+        res = res || _cache_read_u64(file, &value) || value > 64;
+        if (res == 0) {
+            entry->checkpoints = calloc(value + 1, sizeof(entry->checkpoints[0]));
+            res = entry->checkpoints == NULL;
+        }
+        for (size_t k = 0; k < value && res == 0; ++k) {
+            struct CacheCheckpoint* cp = &entry->checkpoints[k];
+            entry->checkpoint_count = k + 1;
+            uint64_t fields[4];
+            res = _cache_read(file, fields, sizeof(fields));
+            res = res || _cache_read_text(file, &cp->cells, &cp->size);
+            cp->state = fields[0];
+            cp->steps = fields[1];
+            cp->pos = fields[2];
+            cp->lo = fields[3];
+            res = res || cp->state >= cache->name_count ||
+                cp->pos >= MILL_TAPE_SIZE || cp->lo >= MILL_TAPE_SIZE;
+        }
+    }
+    fclose(file);
+
+    if (res != 0) {
+        fprintf(stderr, "warning: %s: ignoring unreadable cache\n", filename);
+        cache_free(cache);
+    }
+    else {
+        _cache_build_index(cache);
+    }
+    return 0;
+}
+
+
+static int
+cache_checkpoint(struct CacheCheckpoint* cp, const struct MillTape* tape,
+    size_t len, size_t state, size_t steps) {
+    // The touched window as in mill_tape_clear, trimmed to written cells.
+    size_t right = _used_right(len, steps);
+    size_t size = right + steps;
+    if (size > tape->size) {
+        size = tape->size;
+    }
+    size_t lo = (tape->size - steps) % tape->size;
+    while (size > 0 && tape->buf[lo] == L'\0') {
+        lo = (lo + 1) % tape->size;
+        --size;
+    }
+    while (size > 0 && tape->buf[(lo + size - 1) % tape->size] == L'\0') {
+        --size;
+    }
+
+    *cp = (struct CacheCheckpoint) {
+        .state = state,
+        .steps = steps,
+        .pos = tape->pos,
+        .lo = lo,
+        .size = size,
+        .cells = malloc((size + 1) * sizeof(wchar_t)),
+    };
+    if (cp->cells == NULL) {
+        return 1;
+    }
+    for (size_t i = 0; i < size; ++i) {
+        cp->cells[i] = tape->buf[(lo + i) % tape->size];
+    }
+    return 0;
+}
+
+
+static void
+cache_restore(const struct CacheCheckpoint* cp, struct MillTape* tape) {
+    for (size_t i = 0; i < cp->size; ++i) {
+        tape->buf[(cp->lo + i) % tape->size] = cp->cells[i];
+    }
+    tape->pos = cp->pos;
+}
+
+
+// What runs cost, as distributions rather than means: the few runs near
+// the step limit or the deadline are what a workload's capacity hinges
+// on. Every batch worker records into a RunStats of its own, merged once
+// the workers are done, so recording takes no lock.
+struct RunStats {
+    struct Hist latency;
+    struct Hist steps;
+    struct Hist parse;
+    struct Hist output;
+};
+
+
+static uint64_t
+_elapsed_ns(const struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ull + now.tv_nsec - start->tv_nsec;
+}
+
+
+static size_t
+_output_bytes(const wchar_t* output) {
+    if (output == NULL) {
+        return 0;
+    }
+    size_t n = wcstombs(NULL, output, 0);
+    return n != (size_t) -1 ? n : wcslen(output);
+}
+
+
+static void
+run_stats_record(struct RunStats* stats, uint64_t latency_ns, size_t steps,
+    size_t output_bytes) {
+    hist_record(&stats->latency, latency_ns);
+    hist_record(&stats->steps, steps);
+    hist_record(&stats->output, output_bytes);
+}
+
+
+static void
+run_stats_merge(struct RunStats* dst, const struct RunStats* src) {
+    hist_merge(&dst->latency, &src->latency);
+    hist_merge(&dst->steps, &src->steps);
+    hist_merge(&dst->parse, &src->parse);
+    hist_merge(&dst->output, &src->output);
+}
+
+
+static void
+_run_stats_hist(FILE* file, const char* name, const struct Hist* hist,
+    double scale, int json) {
+    static const double percents[] = {50, 90, 99, 99.9};
+    static const char* const names[] = {"p50", "p90", "p99", "p99.9"};
+    if (json != 0) {
+        fprintf(file, "\"%s\": {\"count\": %llu, \"min\": %.*f", name,
+            (unsigned long long) hist->total, scale > 1 ? 1 : 0, hist->min / scale);
+        for (size_t i = 0; i < 4; ++i) {
+            fprintf(file, ", \"%s\": %.*f", names[i], scale > 1 ? 1 : 0,
+                hist_percentile(hist, percents[i]) / scale);
+        }
+        fprintf(file, ", \"max\": %.*f, \"mean\": %.1f}", scale > 1 ? 1 : 0,
+            hist->max / scale, hist_mean(hist) / scale);
+        return;
+    }
+    fprintf(file, "%s: %llu runs, min %.*f", name, (unsigned long long) hist->total,
+        scale > 1 ? 1 : 0, hist->min / scale);
+    for (size_t i = 0; i < 4; ++i) {
+        fprintf(file, ", %s %.*f", names[i], scale > 1 ? 1 : 0,
+            hist_percentile(hist, percents[i]) / scale);
+    }
+    fprintf(file, ", max %.*f, mean %.1f\n", scale > 1 ? 1 : 0,
+        hist->max / scale, hist_mean(hist) / scale);
+}
+
+
+// Prints a line per distribution, or with json one JSON object.
+static void
+run_stats_print(FILE* file, const struct RunStats* stats, int json) {
+    if (json != 0) {
+        fputc('{', file);
+        _run_stats_hist(file, "latency_us", &stats->latency, 1e3, 1);
+        fputs(", ", file);
+        _run_stats_hist(file, "steps", &stats->steps, 1, 1);
+        fputs(", ", file);
+        _run_stats_hist(file, "parse_us", &stats->parse, 1e3, 1);
+        fputs(", ", file);
+        _run_stats_hist(file, "output_bytes", &stats->output, 1, 1);
+        fputs("}\n", file);
+        return;
+    }
+    _run_stats_hist(file, "latency (us)", &stats->latency, 1e3, 0);
+    _run_stats_hist(file, "steps", &stats->steps, 1, 0);
+    _run_stats_hist(file, "parse (us)", &stats->parse, 1e3, 0);
+    _run_stats_hist(file, "output (bytes)", &stats->output, 1, 0);
+}
+
+
+struct BatchTape {
+    wchar_t* input;
+    size_t len;
+    int status;
+    size_t steps;
+    wchar_t* output;
+    ptrdiff_t offset;
+};
+
+
+// Writes a tape's output line in format; a failed run's is empty.
+static int
+batch_print_output(FILE* file, const struct BatchTape* job, enum OutputFormat format) {
+    if (job->output == NULL) {
+        return fputc('\n', file) == EOF ? 1 : 0;
+    }
+    if (format == OutputFormat_delta) {
+        return mill_print_delta(file, job->input, job->len, job->output,
+            wcslen(job->output), job->offset);
+    }
+    if (format == OutputFormat_rle) {
+        return mill_print_rle(file, job->output, wcslen(job->output));
+    }
+    return fprintf(file, "%ls\n", job->output) < 0 ? 1 : 0;
+}
+
+
+struct BatchContext {
+    const struct MillCode* code;
+    mill_exec_fn exec;
+    int flags;
+    int huge_pages;
+    size_t deadline_ms;
+    struct BatchTape* tapes;
+    size_t count;
+
+    atomic_size_t next;
+    atomic_size_t worker_ids;
+    struct Coverage* coverage;
+    struct RunStats* stats;
+
+    const struct Cache* cache_in;
+    const size_t* cache_map;
+    struct Cache* cache_out;
+    atomic_size_t cache_reused;
+    atomic_size_t cache_resumed;
+
+    struct Memo* memo;
+};
+
+
+static int
+cache_copy_checkpoint(struct CacheCheckpoint* dst, const struct CacheCheckpoint* src,
+    size_t state) {
+    *dst = *src;
+    dst->state = state;
+    dst->cells = malloc((src->size + 1) * sizeof(wchar_t));
+    if (dst->cells == NULL) {
+        return 1;
+    }
+    wmemcpy(dst->cells, src->cells, src->size);
+    return 0;
+}
+
+
+// Runs one batch tape against the cache: an unchanged tape takes its old
+// result, a changed one resumes from the latest usable checkpoint. Either
+// way the tape gets a fresh entry for the next run.
+static void
+batch_run_cached(struct BatchContext* ctx, size_t index, struct MillTape* tape,
+    struct MillProbe* probe, uint8_t* first, wchar_t* output, size_t outsize) {
+    const struct MillCode* code = ctx->code;
+    const struct Cache* cache = ctx->cache_in;
+    const size_t* map = ctx->cache_map;
+    struct BatchTape* job = &ctx->tapes[index];
+    struct CacheEntry* rec = &ctx->cache_out->entries[index];
+    uint64_t hash = _hash_text(job->input, job->len);
+
+    const struct CacheEntry* old = cache_lookup(cache, index, job->len, hash);
+
+    uint32_t from = old != NULL ? UINT32_MAX : 0;
+    for (size_t k = 0; old != NULL && k < old->key_count; ++k) {
+        const struct CacheKey* key = &old->keys[k];
+        if (map[key->state] == MILL_CODE_NONE ||
+            cache_key_changed(cache, map, code, key->state, key->c)) {
+            from = key->interval < from ? key->interval : from;
+        }
+    }
+
+    size_t kept = 0;
+    if (old != NULL) {
+        kept = from < old->checkpoint_count ? from : old->checkpoint_count;
+        while (kept > 0 && map[old->checkpoints[kept - 1].state] == MILL_CODE_NONE) {
+            --kept;
+        }
+    }
+
+    *rec = (struct CacheEntry) {
+        .len = job->len,
+        .hash = hash,
+        .checkpoints = calloc(MILL_STEPS_MAX / MILL_POLL_STEPS + 1, sizeof(rec->checkpoints[0])),
+    };
+    if (rec->checkpoints == NULL) {
+        job->status = -1;
+        return;
+    }
+    for (size_t k = 0; k < kept; ++k) {
+        const struct CacheCheckpoint* cp = &old->checkpoints[k];
+        if (cache_copy_checkpoint(&rec->checkpoints[k], cp, map[cp->state]) != 0) {
+            job->status = -1;
+            return;
+        }
+        rec->checkpoint_count = k + 1;
+    }
+
+    size_t count = code->states * code->symbols;
+    memset(first, 0xff, count);
+    if (from == UINT32_MAX) {
+        rec->status = old->status;
+        rec->steps = old->steps;
+        rec->output = old->output != NULL ? wcsdup(old->output) : NULL;
+        rec->keys = malloc((old->key_count + 1) * sizeof(rec->keys[0]));
+        if (rec->keys == NULL) {
+            job->status = -1;
+            return;
+        }
+        for (size_t k = 0; k < old->key_count; ++k) {
+            rec->keys[k] = old->keys[k];
+            rec->keys[k].state = map[old->keys[k].state];
+        }
+        rec->key_count = old->key_count;
+        rec->valid = 1;
+
+        job->status = rec->status;
+        job->steps = rec->steps;
+        job->output = rec->output != NULL ? wcsdup(rec->output) : NULL;
+        atomic_fetch_add(&ctx->cache_reused, 1);
+        return;
+    }
+
+    // Pairs first read before the kept checkpoints stay as they were.
+    for (size_t k = 0; old != NULL && k < old->key_count; ++k) {
+        const struct CacheKey* key = &old->keys[k];
+        size_t sym = mill_code_symbol(code, key->c);
+        if (key->interval < kept && sym != 0) {
+            first[map[key->state] * code->symbols + sym] = key->interval;
+        }
+    }
+
+    memset(probe->counts, 0, count * sizeof(size_t));
+    mill_probe_start(probe, ctx->deadline_ms);
+    uint32_t interval = kept;
+    if (kept > 0) {
+        const struct CacheCheckpoint* cp = &rec->checkpoints[kept - 1];
+        cache_restore(cp, tape);
+        probe->state = cp->state;
+        probe->steps = cp->steps;
+        atomic_fetch_add(&ctx->cache_resumed, 1);
+    }
+    else {
+        mill_tape_load(tape, job->input, job->len);
+        probe->state = code->syminit;
+        probe->steps = 0;
+    }
+
+    int flags = ctx->flags | MillRun_count | MillRun_resume;
+    mill_exec_fn exec = mill_exec_select(flags);
+    size_t steps = 0;
+    int res = 0;
+    for (;;) {
+        size_t boundary = (size_t) MILL_POLL_STEPS << interval;
+        probe->step_budget = boundary < MILL_STEPS_MAX ? boundary : 0;
+        res = exec(code, tape, &steps, flags, probe);
+        for (size_t i = 0; i < count; ++i) {
+            if (probe->counts[i] != 0 && first[i] == 0xff) {
+                first[i] = interval;
+            }
+        }
+        if (res != 1 || probe->step_budget == 0 || steps < probe->step_budget) {
+            break;
+        }
+        if (cache_checkpoint(&rec->checkpoints[rec->checkpoint_count], tape,
+            job->len, probe->state, steps) != 0) {
+            res = -1;
+            break;
+        }
+        rec->checkpoint_count += 1;
+        interval += 1;
+    }
+
+    size_t key_count = 0;
+    for (size_t i = 0; i < count; ++i) {
+        key_count += first[i] != 0xff;
+    }
+    rec->keys = malloc((key_count + 1) * sizeof(rec->keys[0]));
+    if (rec->keys != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            if (first[i] != 0xff) {
+                rec->keys[rec->key_count++] = (struct CacheKey) {
+                    .state = i / code->symbols,
+                    .c = mill_code_char(code, i % code->symbols),
+                    .interval = first[i],
+                };
+            }
+        }
+        if (res < 0) {
+            rec->keys[rec->key_count++] = (struct CacheKey) {
+                .state = probe->unhandled_state,
+                .c = probe->unhandled_char,
+                .interval = interval,
+            };
+        }
+    }
+
+    job->status = res;
+    job->steps = steps;
+    if (res == 0) {
+        size_t start = mill_tape_start_used(tape, job->len, steps);
+        mill_tape_text(tape, start, output, outsize);
+        job->output = wcsdup(output);
+        job->offset = mill_tape_offset(tape, start, job->len, steps);
+    }
+    mill_tape_clear(tape, job->len, steps);
+
+    // A run stopped by the deadline says nothing about the next one.
+    rec->valid = rec->keys != NULL && (res != 1 || steps >= MILL_STEPS_MAX);
+    rec->status = res;
+    rec->steps = steps;
+    rec->output = job->output != NULL ? wcsdup(job->output) : NULL;
+}
+
+
+// Keeps the scheduler's live machines, and their tapes, bounded on long
+// batches.
+#define BATCH_LIVE_MAX 4096
+
+
+static void
+batch_sched_done(void* arg, void* owner, size_t tag, const struct MillCode* code,
+    const struct SchedResult* result) {
+    (void) owner;
+    (void) code;
+    struct BatchContext* ctx = arg;
+    struct BatchTape* job = &ctx->tapes[tag];
+    job->status = result->status;
+    job->steps = result->steps;
+    if (result->status == 0) {
+        job->output = wcsdup(result->output);
+        job->offset = result->offset;
+        if (job->output == NULL) {
+            job->status = -1;
+        }
+    }
+    if (ctx->stats != NULL) {
+        run_stats_record(&ctx->stats[0], result->elapsed_ns, result->steps,
+            _output_bytes(job->output));
+    }
+}
+
+
+// Runs the batch on the calling thread, slice steps at a time.
+static int
+batch_run_sched(struct BatchContext* ctx, size_t slice) {
+    struct Sched sched;
+    if (sched_init(&sched, slice, ctx->huge_pages, batch_sched_done, ctx) != 0) {
+        return 1;
+    }
+    size_t next = 0;
+    while (next < ctx->count || sched.live > 0) {
+        for (; next < ctx->count && sched.live < BATCH_LIVE_MAX; ++next) {
+            struct BatchTape* job = &ctx->tapes[next];
+            if (sched_add(&sched, ctx->code, job->input, job->len,
+                ctx->deadline_ms, NULL, next) != 0) {
+                sched_free(&sched);
+                return 1;
+            }
+        }
+        sched_turn(&sched);
+    }
+    sched_free(&sched);
+    return 0;
+}
+
+
+static void
+batch_run_one(struct BatchContext* ctx, struct BatchTape* job, struct MillTape* tape,
+    struct MillProbe* probe, struct Coverage* cov, wchar_t* output, size_t outsize) {
+    size_t steps = 0;
+    mill_probe_start(probe, ctx->deadline_ms);
+    probe->counts = cov != NULL ? cov->counts : NULL;
+    mill_tape_load(tape, job->input, job->len);
+    job->status = ctx->exec(ctx->code, tape, &steps, ctx->flags, probe);
+    job->steps = steps;
+    if (cov != NULL) {
+        coverage_record(cov, probe, job->status, job->input);
+    }
+
+    if (job->status == 0) {
+        size_t start = mill_tape_start_used(tape, job->len, steps);
+        mill_tape_text(tape, start, output, outsize);
+        job->output = wcsdup(output);
+        job->offset = mill_tape_offset(tape, start, job->len, steps);
+        if (job->output == NULL) {
+            job->status = -1;
+        }
+    }
+    mill_tape_clear(tape, job->len, steps);
+}
+
+
+// Takes a tape's result from the memo, or runs the tape and leaves the
+// result there for the other workers.
+static void
+batch_run_memo(struct BatchContext* ctx, struct BatchTape* job, struct MillTape* tape,
+    struct MillProbe* probe, wchar_t* output, size_t outsize) {
+    uint64_t hash = _hash_text(job->input, job->len);
+    struct MemoEntry* entry = memo_get(ctx->memo, hash, job->input, job->len);
+    if (entry != NULL) {
+        job->status = entry->status;
+        job->steps = entry->steps;
+        job->offset = entry->offset;
+        if (entry->output != NULL && (job->output = wcsdup(entry->output)) == NULL) {
+            job->status = -1;
+        }
+        memo_release(entry);
+        return;
+    }
+
+    batch_run_one(ctx, job, tape, probe, NULL, output, outsize);
+    if (job->status != 0 || job->output != NULL) {
+        memo_put(ctx->memo, hash, job->input, job->len, job->status, job->steps,
+            job->output, job->offset);
+    }
+}
+
+
+static void*
+batch_worker(void* arg) {
+    struct BatchContext* ctx = arg;
+    size_t bufsize = MILL_TAPE_SIZE + 1;
+    enum MillPages pages;
+    struct MillTape* tape = mill_tape_alloc(ctx->huge_pages, &pages);
+    struct MillProbe* probe = malloc(sizeof(*probe));
+    wchar_t* output = malloc(bufsize * sizeof(wchar_t));
+    size_t* counts = NULL;
+    uint8_t* first = NULL;
+    if (ctx->cache_out != NULL) {
+        counts = malloc(ctx->code->states * ctx->code->symbols * sizeof(size_t));
+        first = malloc(ctx->code->states * ctx->code->symbols);
+    }
+    if (tape == NULL || probe == NULL || output == NULL ||
+        (ctx->cache_out != NULL && (counts == NULL || first == NULL))) {
+        perror("malloc");
+        atomic_store(&ctx->next, ctx->count);
+        goto done;
+    }
+    tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+
+    size_t id = atomic_fetch_add(&ctx->worker_ids, 1);
+    struct Coverage* cov = ctx->coverage != NULL ? &ctx->coverage[id] : NULL;
+    struct RunStats* stats = ctx->stats != NULL ? &ctx->stats[id] : NULL;
+
+    for (;;) {
+        size_t index = atomic_fetch_add(&ctx->next, 1);
+        if (index >= ctx->count) {
+            break;
+        }
+        struct BatchTape* job = &ctx->tapes[index];
+        struct timespec start;
+        if (stats != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+
+        if (ctx->cache_out != NULL) {
+            probe->counts = counts;
+            batch_run_cached(ctx, index, tape, probe, first, output, bufsize);
+        }
+        else if (ctx->memo != NULL) {
+            batch_run_memo(ctx, job, tape, probe, output, bufsize);
+        }
+        else {
+            batch_run_one(ctx, job, tape, probe, cov, output, bufsize);
+        }
+        if (stats != NULL) {
+            run_stats_record(stats, _elapsed_ns(&start), job->steps,
+                _output_bytes(job->output));
+        }
+    }
+
+done:
+    free(first);
+    free(counts);
+    free(output);
+    free(probe);
+    mill_tape_free(tape, pages);
+    return NULL;
+}
+
+
+// Runs the batch on up to jobs threads, or on the calling thread if none
+// can be started.
+static void
+batch_run_threads(struct BatchContext* ctx, size_t jobs) {
+    pthread_t* threads = malloc(jobs * sizeof(threads[0]));
+    size_t started = 0;
+    for (; threads != NULL && started < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, batch_worker, ctx) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        batch_worker(ctx);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+
+// Gives each of jobs workers its own coverage and stats, as asked for.
+static int
+batch_context_start(struct BatchContext* ctx, size_t jobs, int coverage,
+    struct RunStats* stats) {
+    if (coverage != 0) {
+        ctx->coverage = calloc(jobs, sizeof(ctx->coverage[0]));
+        if (ctx->coverage == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        for (size_t i = 0; i < jobs; ++i) {
+            if (coverage_init(&ctx->coverage[i], ctx->code) != 0) {
+                for (size_t j = 0; j < i; ++j) {
+                    coverage_free(&ctx->coverage[j]);
+                }
+                free(ctx->coverage);
+                ctx->coverage = NULL;
+                return 1;
+            }
+        }
+    }
+
+    if (stats != NULL) {
+        ctx->stats = calloc(jobs, sizeof(ctx->stats[0]));
+        if (ctx->stats == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Merges the workers' stats into stats, and reports the memo and
+// coverage after the outputs written to file.
+static void
+batch_context_finish(struct BatchContext* ctx, FILE* file, size_t jobs,
+    struct RunStats* stats) {
+    if (ctx->stats != NULL) {
+        for (size_t i = 0; i < jobs; ++i) {
+            run_stats_merge(stats, &ctx->stats[i]);
+        }
+        free(ctx->stats);
+        ctx->stats = NULL;
+    }
+    if (ctx->memo != NULL) {
+        fflush(file);
+        fprintf(stderr, "memo: %zu hits, %zu misses, %zu evicted\n",
+            atomic_load(&ctx->memo->hits), atomic_load(&ctx->memo->misses),
+            atomic_load(&ctx->memo->evicted));
+    }
+
+    if (ctx->coverage != NULL) {
+        const struct MillCode* code = ctx->code;
+        fflush(file);
+        for (size_t i = 1; i < jobs; ++i) {
+            coverage_merge(&ctx->coverage[0], &ctx->coverage[i], code->states * code->symbols);
+            coverage_free(&ctx->coverage[i]);
+        }
+        mill_print_coverage(stderr, code, &ctx->coverage[0]);
+        coverage_free(&ctx->coverage[0]);
+        free(ctx->coverage);
+        ctx->coverage = NULL;
+    }
+}
+
+
+// Runs every tape and writes the outputs in input order, one per line;
+// a tape that fails leaves an empty line and a note on stderr. With
+// stats, every run is recorded there.
+static int
+mill_batch(FILE* file, const struct MillCode* code, struct BatchTape* tapes,
+    size_t count, size_t jobs, size_t deadline_ms, int coverage, int huge_pages,
+    size_t slice, const struct Cache* cache_in, struct Cache* cache_out,
+    struct RunStats* stats, struct Memo* memo, enum OutputFormat format) {
+    int flags = _batch_flags | (coverage != 0 ? MillRun_count : 0);
+    struct BatchContext ctx = {
+        .code = code,
+        .exec = mill_exec_select(flags),
+        .flags = flags,
+        .huge_pages = huge_pages,
+        .deadline_ms = deadline_ms,
+        .tapes = tapes,
+        .count = count,
+        .cache_in = cache_in,
+        .cache_out = cache_out,
+        .memo = memo,
+    };
+    if (cache_out != NULL) {
+        ctx.cache_map = cache_state_map(cache_in, code);
+        if (ctx.cache_map == NULL) {
+            return 1;
+        }
+    }
+
+    if (jobs > count) {
+        jobs = count > 0 ? count : 1;
+    }
+    if (batch_context_start(&ctx, jobs, coverage, stats) != 0) {
+        return 1;
+    }
+
+    if (slice != 0) {
+        if (batch_run_sched(&ctx, slice) != 0) {
+            batch_context_finish(&ctx, file, jobs, stats);
+            return 1;
+        }
+    }
+    else {
+        batch_run_threads(&ctx, jobs);
+    }
+
+    int res = 0;
+    for (size_t i = 0; i < count; ++i) {
+        struct BatchTape* job = &tapes[i];
+        if (job->status != 0) {
+            fprintf(stderr, "tape %zu: %s after %zu steps\n", i + 1,
+                job->status > 0 ? "timed out" : "error", job->steps);
+            res = 1;
+        }
+        if (batch_print_output(file, job, format) != 0) {
+            res = 1;
+        }
+    }
+
+    if (cache_out != NULL) {
+        size_t reused = atomic_load(&ctx.cache_reused);
+        size_t resumed = atomic_load(&ctx.cache_resumed);
+        fflush(file);
+        fprintf(stderr, "cache: %zu reused, %zu resumed, %zu run\n",
+            reused, resumed, count - reused - resumed);
+        free((size_t*) ctx.cache_map);
+    }
+    batch_context_finish(&ctx, file, jobs, stats);
+    return res;
+}
+
+
+static void
+mill_print_profile(FILE* file, const struct MillCode* code, const size_t* counts) {
+    struct MillProgram* prog = code->prog;
+    size_t count = code->states * code->symbols;
+    unsigned char* claimed = calloc(count, 1);
+    if (claimed == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        struct MillInstr* instr = &prog->instructions[i];
+        size_t index = instr->state_in * code->symbols
+            + mill_code_symbol(code, instr->char_in);
+        size_t hits = claimed[index] == 0 ? counts[index] : 0;
+        claimed[index] = 1;
+        fprintf(file, "%10zu  %ls %lc %ls %lc %c\n", hits,
+            prog->symtable.symbols[instr->state_in],
+            instr->char_in != L'\0' ? instr->char_in : L'_',
+            prog->symtable.symbols[instr->state_out],
+            instr->char_out != L'\0' ? instr->char_out : L'_',
+            instr->move);
+    }
+    free(claimed);
+}
+
+
+// Names the checks a run with flags makes on each step.
+static void
+_explain_flags(FILE* file, int flags) {
+    static const struct {
+        int flag;
+        const char* name;
+    } features[] = {
+        {MillRun_verbose, "trace"},
+        {MillRun_count, "count"},
+        {MillRun_poll, "poll"},
+        {MillRun_history, "history"},
+    };
+    const char* sep = "";
+    for (size_t i = 0; i < sizeof(features) / sizeof(features[0]); ++i) {
+        if ((flags & features[i].flag) != 0) {
+            fprintf(file, "%s%s", sep, features[i].name);
+            sep = ", ";
+        }
+    }
+    if (*sep == '\0') {
+        fprintf(file, "none");
+    }
+}
+
+
+// What compiling the program made of it: states no run can reach or
+// stop in, rules that lose to an earlier one for the same state and
+// symbol, rules that leave a cell as it is and stay in their state, and
+// the table and lookup the run loop uses, and the checks it makes on
+// each step for every way of running.
+static int
+mill_explain(FILE* file, const struct MillCode* code) {
+    struct MillProgram* prog = code->prog;
+    wchar_t** names = prog->symtable.symbols;
+    size_t count = code->states * code->symbols;
+    unsigned char* claimed = calloc(count, 1);
+    unsigned char* reached = calloc(code->states, 1);
+    size_t* queue = malloc(code->states * sizeof(size_t));
+    if (claimed == NULL || reached == NULL || queue == NULL) {
+        perror("malloc");
+        free(claimed);
+        free(reached);
+        free(queue);
+        return 1;
+    }
+
+    size_t head = 0;
+    size_t tail = 0;
+    reached[code->syminit] = 1;
+    queue[tail++] = code->syminit;
+    while (head < tail) {
+        size_t state = queue[head++];
+        for (size_t k = 0; k < code->symbols; ++k) {
+            size_t next = mill_code_op(code, state, k)->state;
+            if (next != MILL_CODE_NONE && reached[next] == 0) {
+                reached[next] = 1;
+                queue[tail++] = next;
+            }
+        }
+    }
+    fprintf(file, "states: %zu, %zu reachable from %ls\n", code->states, tail,
+        names[code->syminit]);
+    if (reached[code->symhalt] == 0) {
+        fprintf(file, "  %ls is unreachable, no run halts\n", names[code->symhalt]);
+    }
+    for (int pass = 0; pass < 2; ++pass) {
+        const char* label = pass == 0 ? "  unreachable, kept in the table:"
+            : "  reachable without rules, runs stop there with an error:";
+        int any = 0;
+        for (size_t state = 0; state < code->states; ++state) {
+            size_t rules = 0;
+            for (size_t k = 0; k < code->symbols; ++k) {
+                rules += mill_code_op(code, state, k)->state != MILL_CODE_NONE;
+            }
+            int listed = pass == 0 ? reached[state] == 0 && state != code->symhalt
+                : reached[state] != 0 && rules == 0 && state != code->symhalt;
+            if (listed) {
+                fprintf(file, "%s %ls", any == 0 ? label : "", names[state]);
+                any = 1;
+            }
+        }
+        if (any != 0) {
+            fputc('\n', file);
+        }
+    }
+
+    size_t shadowed = 0;
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        struct MillInstr* instr = &prog->instructions[i];
+        size_t index = instr->state_in * code->symbols + mill_code_symbol(code, instr->char_in);
+        shadowed += claimed[index];
+        claimed[index] = 1;
+    }
+    fprintf(file, "rules: %zu, %zu shadowed by an earlier rule and dropped\n",
+        prog->instr_count, shadowed);
+    memset(claimed, 0, count);
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        struct MillInstr* instr = &prog->instructions[i];
+        size_t index = instr->state_in * code->symbols + mill_code_symbol(code, instr->char_in);
+        if (claimed[index] != 0) {
+            fprintf(file, "  dropped: %ls %lc %ls %lc %c\n",
+                names[instr->state_in], instr->char_in != L'\0' ? instr->char_in : L'_',
+                names[instr->state_out], instr->char_out != L'\0' ? instr->char_out : L'_',
+                instr->move);
+        }
+        claimed[index] = 1;
+    }
+
+    size_t sweeps = 0;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (size_t state = 0; state < code->states; ++state) {
+            for (int move = -1; move <= 1; move += 2) {
+                int any = 0;
+                for (size_t k = 1; k < code->symbols; ++k) {
+                    const struct MillOp* op = mill_code_op(code, state, k);
+                    wchar_t c = mill_code_char(code, k);
+                    if (op->state != state || op->move != move || op->write != c) {
+                        continue;
+                    }
+                    if (pass == 0) {
+                        sweeps += any == 0;
+                    }
+                    else {
+                        if (any == 0) {
+                            fprintf(file, "  %ls %c over", names[state], move < 0 ? 'L' : 'R');
+                        }
+                        fprintf(file, " %lc", c != L'\0' ? c : L'_');
+                    }
+                    any = 1;
+                }
+                if (pass != 0 && any != 0) {
+                    fputc('\n', file);
+                }
+            }
+        }
+        if (pass == 0) {
+            fprintf(file, "sweep loops: %zu, run a step at a time\n", sweeps);
+        }
+    }
+    fprintf(file, "superinstructions: none, each step runs one rule\n");
+
+    fprintf(file, "alphabet: %zu symbols, %zu below U+%04X looked up directly, "
+        "%zu wider by binary search; cells are %zu-bit\n",
+        code->symbols - 1, code->symbols - 1 - code->wide_count, MILL_CODE_DIRECT,
+        code->wide_count, sizeof(wchar_t) * CHAR_BIT);
+    fprintf(file, "table: %zu states x %zu symbols x %zu bytes = %zu bytes dense, "
+        "a column for symbols no rule reads\n",
+        code->states, code->symbols, sizeof(struct MillOp),
+        count * sizeof(struct MillOp));
+    if (code->ops == NULL) {
+        fprintf(file, "  sparse instead, %zu rules in %zu bytes: the dense table "
+            "is over %d kB and under 1/%d full\n", (size_t) code->rows[code->states],
+            mill_code_bytes(code), MILL_SPARSE_BYTES >> 10, MILL_SPARSE_RATIO);
+    }
+    fprintf(file, "engine: %s; checks each step makes, by mode:\n", code->ops != NULL ? "dense table"
+        : "sparse rows, a binary search over the state's rules each step");
+    struct {
+        const char* mode;
+        int flags;
+    } modes[] = {
+        {"-b, --tape-dir, --serve", _batch_flags},
+        {"--slice", _sched_flags},
+        {"-g", _grade_flags},
+        {"-P", _submit_flags},
+    };
+    fprintf(file, "  -t: ");
+    _explain_flags(file, _run_flags);
+    fprintf(file, "; ");
+    _explain_flags(file, MillRun_history);
+    fprintf(file, " over the last %d steps, or throughout with --deadline\n",
+        MILL_HISTORY_SIZE);
+    for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); ++i) {
+        fprintf(file, "  %s: ", modes[i].mode);
+        _explain_flags(file, modes[i].flags);
+        fputc('\n', file);
+    }
+
+    free(queue);
+    free(reached);
+    free(claimed);
+    return 0;
+}
+
+
+static void
+main_print_stats(FILE* file, const struct MillCode* code, const struct MillTape* tape,
+    enum MillPages tape_pages, size_t steps, double seconds) {
+    fprintf(file, "steps: %zu in %.3f ms (%.0f steps/s)\n",
+        steps, seconds * 1e3, seconds > 0 ? steps / seconds : 0.0);
+
+    size_t size = sizeof(*tape);
+    fprintf(file, "tape: %zu kB, %s", size / 1024, mill_pages_name(tape_pages));
+    if (tape_pages != MillPages_heap) {
+        fprintf(file, ", %zu kB huge", mill_pages_huge_bytes(tape, size, tape_pages) / 1024);
+    }
+    fputc('\n', file);
+
+    size = mill_code_bytes(code);
+    fprintf(file, "table: %zu bytes (%zu states x %zu symbols%s), %s", size,
+        code->states, code->symbols, code->ops == NULL ? ", sparse" : "",
+        mill_pages_name(code->ops_pages));
+    if (code->ops_pages != MillPages_heap) {
+        fprintf(file, ", %zu kB huge",
+            mill_pages_huge_bytes(code->ops, size, code->ops_pages) / 1024);
+    }
+    fputc('\n', file);
+}
+
+
+static int
+main_run(const struct AppArgs* args, struct MillProgram* prog,
+    struct MillTape* tape, enum MillPages tape_pages, size_t* steps) {
+    struct MillCode code;
+    int res = mill_compile(prog, &code);
+    if (res != 0) { return res; }
+    if (args->huge_pages != 0 && mill_code_huge_pages(&code) != 0) {
+        mill_code_free(&code);
+        return 1;
+    }
+
+    int flags = _run_flags;
+    if (args->verbose != 0) {
+        flags |= MillRun_verbose;
+    }
+
+    struct MillProbe probe = {};
+    if (args->profile != 0) {
+        flags |= MillRun_count;
+        probe.counts = calloc(code.states * code.symbols, sizeof(size_t));
+        if (probe.counts == NULL) {
+            perror("malloc");
+            mill_code_free(&code);
+            return 1;
+        }
+    }
+
+    // History is read only by the timeout report, which looks at the last
+    // MILL_HISTORY_SIZE steps. Without a deadline a run can only time out
+    // at MILL_STEPS_MAX, so it keeps history only from the last poll
+    // before that window, resuming there.
+    mill_probe_start(&probe, args->deadline_ms);
+    if (args->deadline_ms != 0) {
+        flags |= MillRun_history;
+    }
+    else {
+        probe.step_budget = (MILL_STEPS_MAX - MILL_HISTORY_SIZE) / MILL_POLL_STEPS
+            * MILL_POLL_STEPS;
+    }
+    res = mill_exec_select(flags)(&code, tape, steps, flags, &probe);
+    if (res == 1 && probe.step_budget != 0 && *steps < MILL_STEPS_MAX) {
+        probe.step_budget = 0;
+        flags |= MillRun_history | MillRun_resume;
+        res = mill_exec_select(flags)(&code, tape, steps, flags, &probe);
+    }
+    if (args->stats != 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        main_print_stats(stderr, &code, tape, tape_pages, *steps,
+            (now.tv_sec - probe.start.tv_sec) + (now.tv_nsec - probe.start.tv_nsec) * 1e-9);
+    }
+    if (res == 1) {
+        mill_timeout_report(stderr, &code, tape, &probe, *steps);
+    }
+    if (args->profile != 0) {
+        mill_print_profile(stderr, &code, probe.counts);
+    }
+
+    free(probe.counts);
+    mill_code_free(&code);
+    return res;
+}
+
+
+static struct MillProgram _Program;
+
+
+static int
+main_print_delta(FILE* file, struct MillTape* tape, const wchar_t* input, size_t steps) {
+    wchar_t* output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    if (output == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    size_t len = wcslen(input);
+    size_t start = mill_tape_start(tape);
+    size_t n = mill_tape_text(tape, start, output, MILL_TAPE_SIZE + 1);
+    int res = mill_print_delta(file, input, len, output, n,
+        mill_tape_offset(tape, start, len, steps));
+    free(output);
+    return res;
+}
+
+
+static int
+main_print_rle(FILE* file, struct MillTape* tape) {
+    wchar_t* output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    if (output == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    size_t n = mill_tape_text(tape, mill_tape_start(tape), output, MILL_TAPE_SIZE + 1);
+    int res = mill_print_rle(file, output, n);
+    free(output);
+    return res;
+}
+
+
+// Rebuilds outputs from their tapes and delta lines: one of each with
+// -t, as a single run reads its tape, or a line per tape with -b.
+static int
+delta_main(struct AppArgs* args) {
+    FILE* deltas = NULL;
+    if (args_open_file(args->apply_delta, "r", &deltas) != 0) {
+        arg_perror("--apply-delta");
+        return 1;
+    }
+    FILE* tapes = args->tape_file != NULL ? args->tape_file : args->batch_file;
+    size_t delta_size = 4 * MILL_TAPE_SIZE;
+    wchar_t* input = malloc((MILL_TAPE_SIZE + 2) * sizeof(wchar_t));
+    wchar_t* delta = malloc(delta_size * sizeof(wchar_t));
+    wchar_t* output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    wchar_t* runs = malloc((MILL_TAPE_SIZE + 2) * sizeof(wchar_t));
+    if (input == NULL || delta == NULL || output == NULL || runs == NULL) {
+        perror("malloc");
+        free(input);
+        free(delta);
+        free(output);
+        free(runs);
+        fclose(deltas);
+        return 1;
+    }
+
+    int res = 0;
+    for (size_t line = 1; fgetws(delta, delta_size, deltas) != NULL; ++line) {
+        if (fgetws(input, MILL_TAPE_SIZE + 2, tapes) == NULL) {
+            fprintf(stderr, "error: delta %zu: no tape left\n", line);
+            res = 1;
+            break;
+        }
+        size_t len = wcslen(input);
+        while (args->batch != NULL && len > 0 &&
+            (input[len - 1] == L'\n' || input[len - 1] == L'\r')) {
+            input[--len] = L'\0';
+        }
+        if (wcschr(input, L'{') != NULL) {
+            wmemcpy(runs, input, len + 1);
+            if (mill_rle_decode(runs, len, input, MILL_TAPE_SIZE + 2, &len) != 0) {
+                fprintf(stderr, "error: delta %zu: tape too long\n", line);
+                res = 1;
+                break;
+            }
+        }
+        // A run that failed left an empty line.
+        size_t n = 0;
+        if (delta[0] == L'\n' || delta[0] == L'\0') {
+            output[0] = L'\0';
+        }
+        else if (mill_delta_apply(input, len, delta, output, MILL_TAPE_SIZE, &n) != 0) {
+            fprintf(stderr, "error: delta %zu: malformed\n", line);
+            res = 1;
+            break;
+        }
+        fprintf(args->output_file, "%ls\n", output);
+        if (args->tape != NULL) {
+            break;
+        }
+    }
+
+    free(input);
+    free(delta);
+    free(output);
+    free(runs);
+    fclose(deltas);
+    return res;
+}
+
+
+static size_t
+args_jobs(const struct AppArgs* args) {
+    if (args->jobs != 0) {
+        return args->jobs;
+    }
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+
+static int
+grade_load_reference(const struct AppArgs* args, const struct GradeSpec* spec,
+    wchar_t*** lines) {
+    *lines = NULL;
+    if (args->expect != NULL) {
+        struct GradeVars vars = {};
+        long long value = 0;
+        if (grade_expr_eval(args->expect, &vars, &value) < 0) {
+            arg_error("-e/--expect: invalid expression");
+            return 1;
+        }
+        return 0;
+    }
+
+    FILE* file = NULL;
+    int res = args_open_file(args->expect_file, "r", &file);
+    if (res != 0) {
+        arg_perror("-E/--expect-file");
+        return res;
+    }
+    res = grade_read_expected(file, spec->count, lines);
+    fclose(file);
+    return res;
+}
+
+
+static void
+grade_free_reference(const struct GradeSpec* spec, wchar_t** lines) {
+    if (lines != NULL) {
+        for (size_t i = 0; i < spec->count; ++i) {
+            free(lines[i]);
+        }
+        free(lines);
+    }
+}
+
+
+static int
+grade_main(struct AppArgs* args) {
+    struct GradeSpec spec = {};
+    int res = grade_parse_family(args->grade, &spec);
+    if (res != 0) {
+        arg_error("-g/--grade: expected unary:N, sum:N or binary:L");
+        return 1;
+    }
+
+    wchar_t** lines = NULL;
+    res = grade_load_reference(args, &spec, &lines);
+    if (res != 0) { return res; }
+
+    if (args->share_prefixes != 0 && trie_fits(&spec) == 0) {
+        arg_error("--share-prefixes: inputs too long to share");
+        grade_free_reference(&spec, lines);
+        return 1;
+    }
+    if (args->share_prefixes != 0 && trie_sentinel(&_Program) == L'\0') {
+        fprintf(stderr, "error: --share-prefixes: no character left for a sentinel\n");
+        grade_free_reference(&spec, lines);
+        return 1;
+    }
+
+    struct MillCode code;
+    res = mill_compile(&_Program, &code);
+    if (res == 0) {
+        res = mill_grade(args->output_file, &code, &spec,
+            args->expect, lines, args_jobs(args), args->grade_all,
+            args->deadline_ms, args->coverage, args->share_prefixes);
+        mill_code_free(&code);
+    }
+
+    grade_free_reference(&spec, lines);
+    return res;
+}
+
+
+static int
+submit_family_tests(const struct AppArgs* args,
+    struct SubmitTest** tests, size_t* count) {
+    struct GradeSpec spec = {};
+    int res = grade_parse_family(args->grade, &spec);
+    if (res != 0 || spec.count > UINT32_MAX) {
+        arg_error("-g/--grade: expected unary:N, sum:N or binary:L");
+        return 1;
+    }
+
+    wchar_t** lines = NULL;
+    res = grade_load_reference(args, &spec, &lines);
+    if (res != 0) { return res; }
+
+    size_t bufsize = MILL_TAPE_SIZE + 1;
+    wchar_t* input = malloc(bufsize * sizeof(wchar_t));
+    wchar_t* expected = malloc(bufsize * sizeof(wchar_t));
+    struct SubmitTest* res_tests = calloc(spec.count, sizeof(res_tests[0]));
+    if (input == NULL || expected == NULL || res_tests == NULL) {
+        perror("malloc");
+        res = 1;
+        goto done;
+    }
+
+    for (size_t i = 0; i < spec.count; ++i) {
+        struct GradeVars vars;
+        size_t len = grade_input(&spec, i, input, &vars);
+        if (lines == NULL) {
+            long long value = 0;
+            res = grade_expr_eval(args->expect, &vars, &value);
+            if (res == 0) {
+                res = grade_expected(&spec, value, expected, bufsize);
+            }
+            if (res != 0) {
+                fprintf(stderr, "error: no reference for '%ls'\n", input);
+                res = 1;
+                goto done;
+            }
+        }
+        res_tests[i].input = wcsdup(input);
+        res_tests[i].len = len;
+        res_tests[i].expected = wcsdup(lines != NULL ? lines[i] : expected);
+    }
+
+    *tests = res_tests;
+    *count = spec.count;
+    res_tests = NULL;
+
+done:
+    free(res_tests);
+    free(expected);
+    free(input);
+    grade_free_reference(&spec, lines);
+    return res;
+}
+
+
+static int
+submit_file_tests(const char* filename,
+    struct SubmitTest** tests, size_t* count) {
+    FILE* file = NULL;
+    int res = args_open_file(filename, "r", &file);
+    if (res != 0) {
+        arg_perror("-T/--tests");
+        return res;
+    }
+
+    size_t bufsize = 2 * MILL_TAPE_SIZE + 2;
+    wchar_t* buf = malloc(bufsize * sizeof(wchar_t));
+    if (buf == NULL) {
+        perror("malloc");
+        fclose(file);
+        return 1;
+    }
+
+    size_t n = 0;
+    size_t cap = 0;
+    struct SubmitTest* res_tests = NULL;
+    while (fgetws(buf, bufsize, file) != NULL) {
+        size_t len = wcslen(buf);
+        while (len > 0 && (buf[len - 1] == L'\n' || buf[len - 1] == L'\r')) {
+            buf[--len] = L'\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        wchar_t* sep = wcschr(buf, L'\t');
+        if (sep == NULL || sep - buf >= MILL_TAPE_SIZE) {
+            fprintf(stderr, "error: test %zu: expected INPUT<tab>EXPECTED\n", n + 1);
+            res = 1;
+            break;
+        }
+        *sep = L'\0';
+        if (n >= cap) {
+            cap = cap != 0 ? cap * 2 : 64;
+            void* p = realloc(res_tests, cap * sizeof(res_tests[0]));
+            if (p == NULL) {
+                perror("malloc");
+                res = 1;
+                break;
+            }
+            res_tests = p;
+        }
+        res_tests[n++] = (struct SubmitTest) {
+            .input = wcsdup(buf),
+            .len = sep - buf,
+            .expected = wcsdup(sep + 1),
+        };
+    }
+    free(buf);
+    fclose(file);
+
+    if (res != 0) {
+        for (size_t i = 0; i < n; ++i) {
+            free(res_tests[i].input);
+            free(res_tests[i].expected);
+        }
+        free(res_tests);
+        return res;
+    }
+
+    *tests = res_tests;
+    *count = n;
+    return 0;
+}
+
+
+static int
+submit_read_list(const char* filename, char*** programs, size_t* count) {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        arg_perror("-P/--programs");
+        return 1;
+    }
+
+    char* line = NULL;
+    size_t linesize = 0;
+    size_t n = 0;
+    size_t cap = 0;
+    char** res = NULL;
+    ssize_t len;
+    while ((len = getline(&line, &linesize, file)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (n >= cap) {
+            cap = cap != 0 ? cap * 2 : 64;
+            void* p = realloc(res, cap * sizeof(res[0]));
+            if (p == NULL) {
+                perror("malloc");
+                break;
+            }
+            res = p;
+        }
+        res[n++] = strdup(line);
+    }
+    free(line);
+    fclose(file);
+
+    *programs = res;
+    *count = n;
+    return 0;
+}
+
+
+static int
+submit_main(struct AppArgs* args) {
+    struct SubmitTest* tests = NULL;
+    size_t test_count = 0;
+    int res = (args->tests != NULL)
+        ? submit_file_tests(args->tests, &tests, &test_count)
+        : submit_family_tests(args, &tests, &test_count);
+    if (res != 0) { return res; }
+
+    char** programs = NULL;
+    size_t program_count = 0;
+    res = submit_read_list(args->programs, &programs, &program_count);
+    if (res == 0 && program_count > 0) {
+        res = mill_submit(args->output_file, programs, program_count,
+            tests, test_count, args_jobs(args), args->deadline_ms);
+    }
+
+    for (size_t i = 0; i < program_count; ++i) {
+        free(programs[i]);
+    }
+    free(programs);
+    for (size_t i = 0; i < test_count; ++i) {
+        free(tests[i].input);
+        free(tests[i].expected);
+    }
+    free(tests);
+    return res;
+}
+
+
+// With parse, records the time taken to read and decode each tape.
+// Trims the line end from buf, of room for MILL_TAPE_SIZE + 2 cells, and
+// expands its runs in place through *runs, made on first use. Returns 1
+// if the tape is too long, or -1 if out of memory.
+static int
+batch_tape_line(wchar_t* buf, wchar_t** runs, size_t* len) {
+    size_t n = wcslen(buf);
+    while (n > 0 && (buf[n - 1] == L'\n' || buf[n - 1] == L'\r')) {
+        buf[--n] = L'\0';
+    }
+    if (wcschr(buf, L'{') != NULL) {
+        if (*runs == NULL && (*runs = malloc((MILL_TAPE_SIZE + 2) * sizeof(wchar_t))) == NULL) {
+            perror("malloc");
+            return -1;
+        }
+        wmemcpy(*runs, buf, n + 1);
+        if (mill_rle_decode(*runs, n, buf, MILL_TAPE_SIZE, &n) != 0) {
+            return 1;
+        }
+    }
+    if (n >= MILL_TAPE_SIZE) {
+        return 1;
+    }
+    *len = n;
+    return 0;
+}
+
+
+static int
+batch_read_tapes(FILE* file, struct BatchTape** tapes, size_t* count, struct Hist* parse) {
+    size_t bufsize = MILL_TAPE_SIZE + 2;
+    wchar_t* buf = malloc(bufsize * sizeof(wchar_t));
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    int res = 0;
+    size_t n = 0;
+    size_t cap = 0;
+    struct BatchTape* res_tapes = NULL;
+    // Scratch for expanding run-length lines, made on the first.
+    wchar_t* runs = NULL;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (fgetws(buf, bufsize, file) != NULL) {
+        size_t len = 0;
+        res = batch_tape_line(buf, &runs, &len);
+        if (res != 0) {
+            if (res > 0) {
+                fprintf(stderr, "error: tape %zu: too long\n", n + 1);
+            }
+            res = 1;
+            break;
+        }
+        if (n >= cap) {
+            cap = cap != 0 ? cap * 2 : 64;
+            void* p = realloc(res_tapes, cap * sizeof(res_tapes[0]));
+            if (p == NULL) {
+                perror("malloc");
+                res = 1;
+                break;
+            }
+            res_tapes = p;
+        }
+        res_tapes[n] = (struct BatchTape) {
+            .input = wcsdup(buf),
+            .len = len,
+        };
+        if (res_tapes[n++].input == NULL) {
+            perror("malloc");
+            res = 1;
+            break;
+        }
+        if (parse != NULL) {
+            hist_record(parse, _elapsed_ns(&start));
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+    }
+    free(runs);
+    free(buf);
+
+    if (res != 0) {
+        for (size_t i = 0; i < n; ++i) {
+            free(res_tapes[i].input);
+        }
+        free(res_tapes);
+        return res;
+    }
+    *tapes = res_tapes;
+    *count = n;
+    return 0;
+}
+
+
+// Pipelined batch: a reader thread decodes tapes into a ring of slots,
+// workers run them, and the calling thread writes the outputs in input
+// order, handing each slot back to the reader. The ring bounds how far
+// reading runs ahead of writing, and slots keep their input buffers from
+// one tape to the next.
+#define PIPE_SLOTS 1024
+
+
+struct PipeSlot {
+    struct BatchTape job;
+    size_t cap;
+    int done;
+};
+
+
+struct Pipe {
+    struct BatchContext batch;
+    FILE* in;
+    struct Hist* parse;
+    struct Capture* capture;
+    pthread_mutex_t lock;
+    // Signalled to the reader when a slot is written, to workers when a
+    // tape is read and to the writer when a tape is run.
+    pthread_cond_t room;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    size_t read;
+    size_t taken;
+    size_t written;
+    int eof;
+    int error;
+    struct PipeSlot slots[PIPE_SLOTS];
+};
+
+
+static void*
+pipe_reader(void* arg) {
+    struct Pipe* pipe = arg;
+    size_t bufsize = MILL_TAPE_SIZE + 2;
+    wchar_t* buf = malloc(bufsize * sizeof(wchar_t));
+    wchar_t* runs = NULL;
+    int error = buf == NULL;
+    if (error != 0) {
+        perror("malloc");
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t n = 0; error == 0 && fgetws(buf, bufsize, pipe->in) != NULL; ++n) {
+        size_t len = 0;
+        int res = batch_tape_line(buf, &runs, &len);
+        if (res != 0) {
+            if (res > 0) {
+                fprintf(stderr, "error: tape %zu: too long\n", n + 1);
+            }
+            error = 1;
+            break;
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        while (pipe->read - pipe->written >= PIPE_SLOTS) {
+            pthread_cond_wait(&pipe->room, &pipe->lock);
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        struct PipeSlot* slot = &pipe->slots[n % PIPE_SLOTS];
+        if (slot->cap <= len) {
+            size_t cap = len + 1 > 64 ? len + 1 : 64;
+            void* p = realloc(slot->job.input, cap * sizeof(wchar_t));
+            if (p == NULL) {
+                perror("malloc");
+                error = 1;
+                break;
+            }
+            slot->job.input = p;
+            slot->cap = cap;
+        }
+        wmemcpy(slot->job.input, buf, len + 1);
+        slot->job = (struct BatchTape) {.input = slot->job.input, .len = len};
+        if (pipe->capture != NULL) {
+            capture_run(pipe->capture, pipe->capture->program, pipe->batch.deadline_ms,
+                buf, len);
+        }
+        slot->done = 0;
+        if (pipe->parse != NULL) {
+            hist_record(pipe->parse, _elapsed_ns(&start));
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->read += 1;
+        pthread_cond_signal(&pipe->work);
+        pthread_mutex_unlock(&pipe->lock);
+        if (pipe->parse != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+    }
+    free(runs);
+    free(buf);
+
+    pthread_mutex_lock(&pipe->lock);
+    pipe->eof = 1;
+    pipe->error = error;
+    pthread_cond_broadcast(&pipe->work);
+    pthread_cond_signal(&pipe->done);
+    pthread_mutex_unlock(&pipe->lock);
+    return NULL;
+}
+
+
+static void*
+pipe_worker(void* arg) {
+    struct Pipe* pipe = arg;
+    struct BatchContext* ctx = &pipe->batch;
+    size_t bufsize = MILL_TAPE_SIZE + 1;
+    enum MillPages pages;
+    struct MillTape* tape = mill_tape_alloc(ctx->huge_pages, &pages);
+    struct MillProbe* probe = malloc(sizeof(*probe));
+    wchar_t* output = malloc(bufsize * sizeof(wchar_t));
+    if (tape == NULL || probe == NULL || output == NULL) {
+        perror("malloc");
+    }
+    else {
+        tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+    }
+
+    size_t id = atomic_fetch_add(&ctx->worker_ids, 1);
+    struct Coverage* cov = ctx->coverage != NULL ? &ctx->coverage[id] : NULL;
+    struct RunStats* stats = ctx->stats != NULL ? &ctx->stats[id] : NULL;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        while (pipe->taken == pipe->read && pipe->eof == 0) {
+            pthread_cond_wait(&pipe->work, &pipe->lock);
+        }
+        if (pipe->taken == pipe->read) {
+            break;
+        }
+        size_t index = pipe->taken++;
+        pthread_mutex_unlock(&pipe->lock);
+
+        struct BatchTape* job = &pipe->slots[index % PIPE_SLOTS].job;
+        struct timespec start;
+        if (stats != NULL) {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        }
+        if (output == NULL || probe == NULL || tape == NULL) {
+            job->status = -1;
+        }
+        else if (ctx->memo != NULL) {
+            batch_run_memo(ctx, job, tape, probe, output, bufsize);
+        }
+        else {
+            batch_run_one(ctx, job, tape, probe, cov, output, bufsize);
+        }
+        if (stats != NULL) {
+            run_stats_record(stats, _elapsed_ns(&start), job->steps,
+                _output_bytes(job->output));
+        }
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->slots[index % PIPE_SLOTS].done = 1;
+        if (index == pipe->written) {
+            pthread_cond_signal(&pipe->done);
+        }
+    }
+    pthread_mutex_unlock(&pipe->lock);
+
+    free(output);
+    free(probe);
+    mill_tape_free(tape, pages);
+    return NULL;
+}
+
+
+// Like mill_batch, for tapes read from in as the batch runs instead of
+// all first.
+static int
+mill_batch_pipe(FILE* in, FILE* file, const struct MillCode* code, size_t jobs,
+    size_t deadline_ms, int coverage, int huge_pages, struct RunStats* stats,
+    struct Memo* memo, struct Capture* capture, enum OutputFormat format) {
+    struct Pipe* pipe = calloc(1, sizeof(*pipe));
+    if (pipe == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    int flags = _batch_flags | (coverage != 0 ? MillRun_count : 0);
+    pipe->batch = (struct BatchContext) {
+        .code = code,
+        .exec = mill_exec_select(flags),
+        .flags = flags,
+        .huge_pages = huge_pages,
+        .deadline_ms = deadline_ms,
+        .memo = memo,
+    };
+    pipe->in = in;
+    pipe->parse = stats != NULL ? &stats->parse : NULL;
+    pipe->capture = capture;
+    if (batch_context_start(&pipe->batch, jobs, coverage, stats) != 0) {
+        free(pipe);
+        return 1;
+    }
+    pthread_mutex_init(&pipe->lock, NULL);
+    pthread_cond_init(&pipe->room, NULL);
+    pthread_cond_init(&pipe->work, NULL);
+    pthread_cond_init(&pipe->done, NULL);
+
+    pthread_t* threads = malloc(jobs * sizeof(threads[0]));
+    size_t started = 0;
+    for (; threads != NULL && started < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, pipe_worker, pipe) != 0) {
+            break;
+        }
+    }
+    pthread_t reader;
+    int res = 0;
+    if (started == 0 || pthread_create(&reader, NULL, pipe_reader, pipe) != 0) {
+        perror("pthread_create");
+        pthread_mutex_lock(&pipe->lock);
+        pipe->eof = 1;
+        pthread_cond_broadcast(&pipe->work);
+        pthread_mutex_unlock(&pipe->lock);
+        res = 1;
+    }
+
+    int failed = 0;
+    while (res == 0) {
+        pthread_mutex_lock(&pipe->lock);
+        struct PipeSlot* slot = &pipe->slots[pipe->written % PIPE_SLOTS];
+        while (pipe->written == pipe->read ? pipe->eof == 0 : slot->done == 0) {
+            pthread_cond_wait(&pipe->done, &pipe->lock);
+        }
+        int end = pipe->written == pipe->read;
+        pthread_mutex_unlock(&pipe->lock);
+        if (end != 0) {
+            break;
+        }
+
+        struct BatchTape* job = &slot->job;
+        if (job->status != 0) {
+            fprintf(stderr, "tape %zu: %s after %zu steps\n", pipe->written + 1,
+                job->status > 0 ? "timed out" : "error", job->steps);
+            failed = 1;
+        }
+        if (batch_print_output(file, job, format) != 0) {
+            failed = 1;
+        }
+        free(job->output);
+        job->output = NULL;
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->written += 1;
+        pthread_cond_signal(&pipe->room);
+        pthread_mutex_unlock(&pipe->lock);
+    }
+
+    if (res == 0) {
+        pthread_join(reader, NULL);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    batch_context_finish(&pipe->batch, file, jobs, stats);
+
+    for (size_t i = 0; i < PIPE_SLOTS; ++i) {
+        free(pipe->slots[i].job.input);
+    }
+    pthread_cond_destroy(&pipe->done);
+    pthread_cond_destroy(&pipe->work);
+    pthread_cond_destroy(&pipe->room);
+    pthread_mutex_destroy(&pipe->lock);
+    res = (res != 0 || failed != 0 || pipe->error != 0) ? 1 : 0;
+    free(pipe);
+    return res;
+}
+
+
+static int
+batch_main(struct AppArgs* args, struct Capture* capture) {
+    struct RunStats* stats = NULL;
+    if (args->stats != 0) {
+        stats = calloc(1, sizeof(*stats));
+        if (stats == NULL) {
+            perror("malloc");
+            return 1;
+        }
+    }
+
+    // The cache needs every tape up front, as does the scheduler; other
+    // batches read tapes as they run.
+    int pipelined = args->cache == NULL && args->slice == 0;
+    struct BatchTape* tapes = NULL;
+    size_t count = 0;
+    int res = pipelined ? 0 : batch_read_tapes(args->batch_file, &tapes, &count,
+        stats != NULL ? &stats->parse : NULL);
+    if (res != 0) {
+        free(stats);
+        return res;
+    }
+    for (size_t i = 0; capture != NULL && i < count; ++i) {
+        capture_run(capture, capture->program, args->deadline_ms, tapes[i].input,
+            tapes[i].len);
+    }
+
+    struct MillCode code;
+    res = mill_compile(&_Program, &code);
+    if (res != 0) { goto done; }
+    if (args->huge_pages != 0 && mill_code_huge_pages(&code) != 0) {
+        mill_code_free(&code);
+        res = 1;
+        goto done;
+    }
+
+    struct Cache cache_in = {};
+    struct Cache cache_out = {};
+    if (args->cache != NULL) {
+        res = cache_read(args->cache, &cache_in);
+        if (res == 0) {
+            res = cache_set_program(&cache_out, &code);
+        }
+        if (res == 0) {
+            cache_out.entries = calloc(count + 1, sizeof(cache_out.entries[0]));
+            cache_out.entry_count = count;
+            if (cache_out.entries == NULL) {
+                perror("malloc");
+                res = 1;
+            }
+        }
+    }
+
+    struct Memo* memo = NULL;
+    if (res == 0 && args->memo_mb != 0 && (memo = memo_new(args->memo_mb << 20)) == NULL) {
+        res = 1;
+    }
+
+    int ran = res == 0;
+    if (res == 0 && pipelined) {
+        res = mill_batch_pipe(args->batch_file, args->output_file, &code,
+            args_jobs(args), args->deadline_ms, args->coverage, args->huge_pages, stats,
+            memo, capture, args->output_format);
+    }
+    else if (res == 0) {
+        res = mill_batch(args->output_file, &code, tapes, count,
+            args_jobs(args), args->deadline_ms, args->coverage, args->huge_pages,
+            args->slice, &cache_in, args->cache != NULL ? &cache_out : NULL, stats,
+            memo, args->output_format);
+        if (args->cache != NULL && cache_write(args->cache, &cache_out) != 0) {
+            res = 1;
+        }
+    }
+    if (stats != NULL && ran != 0) {
+        fflush(args->output_file);
+        run_stats_print(stderr, stats, args->stats_json);
+    }
+    memo_free(memo);
+    mill_code_free(&code);
+    cache_free(&cache_out);
+    cache_free(&cache_in);
+
+done:
+    for (size_t i = 0; i < count; ++i) {
+        free(tapes[i].input);
+        free(tapes[i].output);
+    }
+    free(tapes);
+    free(stats);
+    return res;
+}
+
+
+// Directory mode: every NAME.tape in a directory runs as one batch, with
+// its output written to NAME.output and checked against NAME.expected if
+// there is one. An I/O pool reads the files ahead of the run workers and
+// writes the outputs behind them; the workers take tapes in name order.
+
+#define TAPEDIR_SUFFIX ".tape"
+
+
+enum DirPath {
+    DirPath_tape,
+    DirPath_expected,
+    DirPath_output,
+    DirPath_count,
+};
+
+
+struct DirTape {
+    struct DirContext* ctx;
+    char* name;
+    char* paths[DirPath_count];
+    struct BatchTape job;
+    wchar_t* expected;
+    // The errno of a tape or expected file that could not be read, and of
+    // an output that could not be encoded.
+    int error;
+    int output_error;
+    const char* status;
+    int reads_left;
+    struct IoRequest reads[2];
+    struct IoRequest write;
+};
+
+
+struct DirContext {
+    struct BatchContext batch;
+    struct DirTape* tapes;
+    size_t count;
+    struct IoPool pool;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    atomic_size_t next;
+    size_t window;
+};
+
+
+// Tapes read ahead of the running ones, so that a large directory holds
+// the files of only this many tapes and the jobs at a time.
+#define TAPEDIR_READ_AHEAD (2 * IO_THREADS)
+
+
+// The first line of a file's bytes as a tape, expanding runs, which the
+// bytes lend their storage to.
+static int
+_decode_tape_line(char* bytes, wchar_t** text, size_t* len) {
+    bytes[strcspn(bytes, "\r\n")] = '\0';
+    size_t n = mbstowcs(NULL, bytes, 0);
+    if (n == (size_t) -1 || n >= MILL_TAPE_SIZE) {
+        return EINVAL;
+    }
+    wchar_t* res = malloc((n + 1) * sizeof(wchar_t));
+    if (res == NULL) {
+        return ENOMEM;
+    }
+    mbstowcs(res, bytes, n + 1);
+    if (wcschr(res, L'{') != NULL) {
+        wchar_t* runs = malloc(MILL_TAPE_SIZE * sizeof(wchar_t));
+        if (runs == NULL) {
+            free(res);
+            return ENOMEM;
+        }
+        int error = mill_rle_decode(res, n, runs, MILL_TAPE_SIZE, &n) != 0 ? EINVAL : 0;
+        free(res);
+        res = error == 0 ? realloc(runs, (n + 1) * sizeof(wchar_t)) : NULL;
+        if (res == NULL) {
+            free(runs);
+            return error != 0 ? error : ENOMEM;
+        }
+    }
+    *text = res;
+    *len = n;
+    return 0;
+}
+
+
+static void
+tapedir_read_done(struct IoRequest* req) {
+    struct DirTape* t = req->arg;
+    int error = req->error;
+    if (req == &t->reads[0] && error == 0) {
+        error = _decode_tape_line(req->data, &t->job.input, &t->job.len);
+    }
+    else if (error == 0) {
+        size_t len = 0;
+        error = _decode_tape_line(req->data, &t->expected, &len);
+    }
+    else if (req == &t->reads[1] && error == ENOENT) {
+        error = 0;
+    }
+    free(req->data);
+    req->data = NULL;
+
+    pthread_mutex_lock(&t->ctx->lock);
+    if (error != 0 && t->error == 0) {
+        t->error = error;
+    }
+    if (--t->reads_left == 0) {
+        pthread_cond_broadcast(&t->ctx->ready);
+    }
+    pthread_mutex_unlock(&t->ctx->lock);
+}
+
+
+static void
+tapedir_write_done(struct IoRequest* req) {
+    free(req->data);
+    req->data = NULL;
+}
+
+
+static void
+tapedir_submit_reads(struct DirContext* ctx, struct DirTape* t) {
+    for (size_t k = 0; k < 2; ++k) {
+        t->reads[k] = (struct IoRequest) {
+            .op = IoOp_read,
+            .path = t->paths[k == 0 ? DirPath_tape : DirPath_expected],
+            .done = tapedir_read_done,
+            .arg = t,
+        };
+        io_submit(&ctx->pool, &t->reads[k]);
+    }
+}
+
+
+static const char*
+_tapedir_status(const struct DirTape* t) {
+    if (t->error != 0) {
+        return "unreadable";
+    }
+    if (t->job.status > 0) {
+        return "timeout";
+    }
+    if (t->job.status < 0 || t->job.output == NULL || t->output_error != 0) {
+        return "error";
+    }
+    if (t->expected == NULL) {
+        return "ok";
+    }
+    return wcscmp(t->job.output, t->expected) == 0 ? "pass" : "mismatch";
+}
+
+
+static void*
+tapedir_worker(void* arg) {
+    struct DirContext* ctx = arg;
+    size_t bufsize = MILL_TAPE_SIZE + 1;
+    enum MillPages pages;
+    struct MillTape* tape = mill_tape_alloc(ctx->batch.huge_pages, &pages);
+    struct MillProbe* probe = malloc(sizeof(*probe));
+    wchar_t* output = malloc(bufsize * sizeof(wchar_t));
+    if (tape == NULL || probe == NULL || output == NULL) {
+        perror("malloc");
+        goto done;
+    }
+    tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+
+    for (;;) {
+        size_t index = atomic_fetch_add(&ctx->next, 1);
+        if (index >= ctx->count) {
+            break;
+        }
+        if (index + ctx->window < ctx->count) {
+            tapedir_submit_reads(ctx, &ctx->tapes[index + ctx->window]);
+        }
+        struct DirTape* t = &ctx->tapes[index];
+        pthread_mutex_lock(&ctx->lock);
+        while (t->reads_left > 0) {
+            pthread_cond_wait(&ctx->ready, &ctx->lock);
+        }
+        pthread_mutex_unlock(&ctx->lock);
+
+        // A tape without output still gets its NAME.output emptied, so
+        // that one from an earlier run is not taken for this one's.
+        char* data = NULL;
+        size_t size = 0;
+        if (t->error == 0) {
+            batch_run_one(&ctx->batch, &t->job, tape, probe, NULL, output, bufsize);
+        }
+        if (t->error == 0 && t->job.output != NULL) {
+            size_t n = wcstombs(NULL, t->job.output, 0);
+            data = n != (size_t) -1 ? malloc(n + 2) : NULL;
+            if (data != NULL) {
+                wcstombs(data, t->job.output, n + 1);
+                data[n] = '\n';
+                size = n + 1;
+            }
+            else {
+                t->output_error = n == (size_t) -1 ? EILSEQ : ENOMEM;
+            }
+        }
+        t->status = _tapedir_status(t);
+        free(t->job.input);
+        free(t->job.output);
+        free(t->expected);
+        t->job.input = NULL;
+        t->job.output = NULL;
+        t->expected = NULL;
+        t->write = (struct IoRequest) {
+            .op = IoOp_write,
+            .path = t->paths[DirPath_output],
+            .data = data,
+            .size = size,
+            .done = tapedir_write_done,
+            .arg = t,
+        };
+        io_submit(&ctx->pool, &t->write);
+    }
+
+done:
+    free(output);
+    free(probe);
+    mill_tape_free(tape, pages);
+    return NULL;
+}
+
+
+static int
+_compare_dir_tapes(const void* a, const void* b) {
+    return strcmp(((const struct DirTape*) a)->name, ((const struct DirTape*) b)->name);
+}
+
+
+static char*
+_dir_path(const char* dir, const char* name, const char* suffix) {
+    size_t size = strlen(dir) + strlen(name) + strlen(suffix) + 2;
+    char* path = malloc(size);
+    if (path != NULL) {
+        snprintf(path, size, "%s/%s%s", dir, name, suffix);
+    }
+    return path;
+}
+
+
+static void
+tapedir_free(struct DirTape* tapes, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t k = 0; k < DirPath_count; ++k) {
+            free(tapes[i].paths[k]);
+        }
+        free(tapes[i].name);
+        free(tapes[i].job.input);
+        free(tapes[i].job.output);
+        free(tapes[i].expected);
+    }
+    free(tapes);
+}
+
+
+// The NAME.tape files in dir, in name order.
+static int
+tapedir_list(const char* dir, struct DirTape** tapes, size_t* count) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror(dir);
+        return 1;
+    }
+    size_t n = 0;
+    size_t cap = 0;
+    struct DirTape* res = NULL;
+    size_t suffix = strlen(TAPEDIR_SUFFIX);
+    int error = 0;
+    for (struct dirent* entry; error == 0 && (entry = readdir(d)) != NULL;) {
+        size_t len = strlen(entry->d_name);
+        if (len <= suffix || strcmp(&entry->d_name[len - suffix], TAPEDIR_SUFFIX) != 0) {
+            continue;
+        }
+        if (n >= cap) {
+            cap = cap != 0 ? cap * 2 : 64;
+            void* p = realloc(res, cap * sizeof(res[0]));
+            if (p == NULL) {
+                error = 1;
+                break;
+            }
+            res = p;
+        }
+        struct DirTape* t = &res[n++];
+        *t = (struct DirTape) {.name = strndup(entry->d_name, len - suffix)};
+        if (t->name != NULL) {
+            t->paths[DirPath_tape] = _dir_path(dir, t->name, TAPEDIR_SUFFIX);
+            t->paths[DirPath_expected] = _dir_path(dir, t->name, ".expected");
+            t->paths[DirPath_output] = _dir_path(dir, t->name, ".output");
+        }
+        for (size_t k = 0; k < DirPath_count; ++k) {
+            error = error || t->paths[k] == NULL;
+        }
+    }
+    closedir(d);
+    if (error != 0) {
+        perror("malloc");
+        tapedir_free(res, n);
+        return 1;
+    }
+    if (n > 0) {
+        qsort(res, n, sizeof(res[0]), _compare_dir_tapes);
+    }
+    *tapes = res;
+    *count = n;
+    return 0;
+}
+
+
+static int
+tapedir_main(struct AppArgs* args) {
+    struct DirContext ctx = {};
+    int res = tapedir_list(args->tape_dir, &ctx.tapes, &ctx.count);
+    if (res != 0) {
+        return res;
+    }
+    if (ctx.count == 0) {
+        fprintf(stderr, "error: %s: no *%s files\n", args->tape_dir, TAPEDIR_SUFFIX);
+        tapedir_free(ctx.tapes, ctx.count);
+        return 1;
+    }
+
+    struct MillCode code;
+    res = mill_compile(&_Program, &code);
+    if (res != 0) {
+        tapedir_free(ctx.tapes, ctx.count);
+        return res;
+    }
+    if (io_pool_start(&ctx.pool, IO_THREADS) != 0) {
+        perror("pthread_create");
+        mill_code_free(&code);
+        tapedir_free(ctx.tapes, ctx.count);
+        return 1;
+    }
+
+    int flags = _batch_flags;
+    ctx.batch = (struct BatchContext) {
+        .code = &code,
+        .exec = mill_exec_select(flags),
+        .flags = flags,
+        .huge_pages = args->huge_pages,
+        .deadline_ms = args->deadline_ms,
+    };
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.ready, NULL);
+
+    size_t jobs = args_jobs(args);
+    if (jobs > ctx.count) {
+        jobs = ctx.count;
+    }
+    // A worker taking tape i submits the reads of tape i + window, so
+    // every tape is waited on only once its reads are on their way.
+    ctx.window = TAPEDIR_READ_AHEAD + jobs;
+    for (size_t i = 0; i < ctx.count; ++i) {
+        ctx.tapes[i].ctx = &ctx;
+        ctx.tapes[i].reads_left = 2;
+    }
+    for (size_t i = 0; i < ctx.count && i < ctx.window; ++i) {
+        tapedir_submit_reads(&ctx, &ctx.tapes[i]);
+    }
+
+    pthread_t* threads = malloc(jobs * sizeof(threads[0]));
+    size_t started = 0;
+    for (; threads != NULL && started < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, tapedir_worker, &ctx) != 0) {
             break;
         }
+    }
+    if (started == 0) {
+        tapedir_worker(&ctx);
+    }
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    io_pool_finish(&ctx.pool);
+    pthread_cond_destroy(&ctx.ready);
+    pthread_mutex_destroy(&ctx.lock);
 
-        switch (state) {
-            case 0:
-                if (iswspace(c) == 0) {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    state = 1;
-                }
-                break;
+    size_t passed = 0;
+    size_t failed = 0;
+    size_t unchecked = 0;
+    for (size_t i = 0; i < ctx.count; ++i) {
+        struct DirTape* t = &ctx.tapes[i];
+        if (t->status == NULL) {
+            // No worker could start to run it.
+            t->status = "error";
+        }
+        if (t->error != 0) {
+            fprintf(stderr, "%s: %s\n", t->name, strerror(t->error));
+        }
+        else if (t->output_error != 0) {
+            fprintf(stderr, "%s: output: %s\n", t->name, strerror(t->output_error));
+        }
+        passed += strcmp(t->status, "pass") == 0;
+        unchecked += strcmp(t->status, "ok") == 0;
+        if (t->write.error != 0) {
+            fprintf(stderr, "%s: %s\n", t->paths[DirPath_output], strerror(t->write.error));
+            res = 1;
+        }
+        fprintf(args->output_file, "%s %s %zu\n", t->name, t->status, t->job.steps);
+    }
+    failed = ctx.count - passed - unchecked;
+    fflush(args->output_file);
+    fprintf(stderr, "%zu tapes: %zu passed, %zu failed, %zu without expected output\n",
+        ctx.count, passed, failed, unchecked);
 
-            case 1:
-                if (iswspace(c) != 0) {
-                    int res = symtable_insert(symtable, token, &sid);
-                    if (res != 0) { return -1; }
-                    toksize = 0;
-                    token[toksize] = L'\0';
-                    data.state_in = sid;
-                    state = 2;
-                }
-                else if (toksize >= tokmax) {
-                    parse_error("symbol is too long: %ls", token);
-                    return -1;
-                }
-                else {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    if (toksize == 2 && wcscmp(token, L"//") == 0) {
-                        toksize = 0;
-                        token[toksize] = L'\0';
-                        state = 20;
-                    }
-                }
-                break;
+    mill_code_free(&code);
+    tapedir_free(ctx.tapes, ctx.count);
+    return (res != 0 || failed != 0) ? 1 : 0;
+}
 
-            case 2:
-                if (iswspace(c) == 0) {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    state = 3;
-                }
-                break;
 
-            case 3:
-                if (iswspace(c) != 0) {
-                    data.char_in = token[0];
-                    if (data.char_in == L'_') {
-                        data.char_in = L'\0';
-                    }
-                    toksize = 0;
-                    token[toksize] = L'\0';
-                    state = 4;
-                }
-                else {
-                    parse_error("symbol is too long: %ls", token);
-                    return -1;
-                }
-                break;
+// Socket server. Requests and replies are lines:
+//
+//     program N          followed by N bytes of program text, which
+//                        replaces the connection's program; replies
+//                        "program ok" or "program error"
+//     run ID TAPE [MS]   runs TAPE, with a deadline of MS milliseconds
+//                        if given; replies "ID STATUS STEPS OUTPUT", where
+//                        STATUS is halted, error, timeout or deadline
+//     stats [json]       replies with percentiles over every run so far,
+//                        four "stats ..." lines or one "stats {...}"
+//
+// ID is a number echoed in the reply. All runs share one thread through
+// the scheduler, so replies come in completion order and a short run is
+// not held up by a long one. Connections start with the -p program.
 
-            case 4:
-                if (iswspace(c) == 0) {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    state = 5;
-                }
-                break;
+#define SERVE_LINE_MAX (MILL_TAPE_SIZE * 4 + 64)
+#define SERVE_PROGRAM_MAX ((size_t) 1 << 24)
+#define SERVE_TURN_NS 1000000
+#define SERVE_RECENT 64
 
-            case 5:
-                if (iswspace(c) != 0) {
-                    int res = symtable_insert(symtable, token, &sid);
-                    if (res != 0) { return -1; }
-                    toksize = 0;
-                    token[toksize] = L'\0';
-                    data.state_out = sid;
-                    state = 6;
-                }
-                else if (toksize >= tokmax) {
-                    parse_error("symbol is too long: %ls", token);
-                    return -1;
-                }
-                else {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                }
-                break;
 
-            case 6:
-                if (iswspace(c) == 0) {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    state = 7;
-                }
-                break;
+struct ServeProgram {
+    struct MillProgram* prog;
+    int owns_prog;
+    struct MillCode code;
+    size_t refs;
+    uint64_t hash;
+    char* text;
+    size_t text_len;
+    // Results shared by the threads of a worker, if it keeps any.
+    struct Memo* memo;
+};
 
-            case 7:
-                if (iswspace(c) != 0) {
-                    data.char_out = token[0];
-                    if (data.char_out == L'_') {
-                        data.char_out = L'\0';
-                    }
-                    toksize = 0;
-                    token[toksize] = L'\0';
-                    state = 8;
-                }
-                else {
-                    parse_error("symbol is too long: %ls", token);
-                    return -1;
-                }
-                break;
 
-            case 8:
-                if (iswspace(c) == 0) {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    state = 9;
-                }
-                break;
+struct ServeConn {
+    int fd;
+    int eof;
+    char* in;
+    size_t in_start;
+    size_t in_len;
+    size_t in_cap;
+    char* out;
+    size_t out_sent;
+    size_t out_len;
+    size_t out_cap;
+    size_t program_need;
+    struct ServeProgram* program;
+    size_t pending;
+};
 
-            case 9:
-                if (iswspace(c) != 0) {
-                    int res = parse_headmove(token, &data.move);
-                    if (res != 0) { return -1; }
-                    toksize = 0;
-                    token[toksize] = L'\0';
-                    state = c == L'\n' ? 100 : 10;
-                }
-                else if (toksize >= tokmax) {
-                    parse_error("symbol is too long: %ls", token);
-                    return -1;
-                }
-                else {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    if (toksize >= 3 && token[toksize-2] == L'/' && token[toksize-1] == L'/') {
-                        toksize -= 2;
-                        token[toksize] = L'\0';
-                        int res = parse_headmove(token, &data.move);
-                        if (res != 0) { return -1; }
-                        state = 12;
-                    }
-                }
+
+struct Server {
+    struct Sched sched;
+    size_t deadline_ms;
+    struct ServeProgram* program;
+    // Recently sent programs, each holding a reference, so clients that
+    // switch between a few programs do not parse them every time.
+    struct ServeProgram* recent[SERVE_RECENT];
+    size_t recent_next;
+    struct ServeConn** conns;
+    size_t conn_count;
+    size_t conn_cap;
+    wchar_t* wide;
+    struct RunStats* stats;
+    struct Capture* capture;
+};
+
+
+static volatile sig_atomic_t _serve_stop;
+
+
+static void
+serve_stop_signal(int sig) {
+    (void) sig;
+    _serve_stop = 1;
+}
+
+
+static void
+serve_program_release(struct ServeProgram* program) {
+    if (program == NULL || --program->refs > 0) {
+        return;
+    }
+    memo_free(program->memo);
+    mill_code_free(&program->code);
+    if (program->owns_prog != 0) {
+        free(program->prog);
+    }
+    free(program->text);
+    free(program);
+}
+
+
+static struct ServeProgram*
+serve_program_new(struct MillProgram* prog, int owns_prog) {
+    struct ServeProgram* program = malloc(sizeof(*program));
+    if (program == NULL) {
+        perror("malloc");
+        if (owns_prog != 0) {
+            free(prog);
+        }
+        return NULL;
+    }
+    *program = (struct ServeProgram) {
+        .prog = prog,
+        .owns_prog = owns_prog,
+        .refs = 1,
+    };
+    if (mill_compile(prog, &program->code) != 0) {
+        if (owns_prog != 0) {
+            free(prog);
+        }
+        free(program);
+        return NULL;
+    }
+    return program;
+}
+
+
+static struct ServeProgram*
+serve_program_parse(const char* text, size_t len) {
+    struct MillProgram* prog = malloc(sizeof(*prog));
+    FILE* file = mill_open_text(text, len);
+    if (prog == NULL || file == NULL) {
+        perror("tmpfile");
+        free(prog);
+        if (file != NULL) {
+            fclose(file);
+        }
+        return NULL;
+    }
+    int res = mill_parse_program(file, prog);
+    fclose(file);
+    if (res != 0) {
+        free(prog);
+        return NULL;
+    }
+    return serve_program_new(prog, 1);
+}
+
+
+static uint64_t
+_serve_program_hash(const char* text, size_t len) {
+    return capture_hash(text, len);
+}
+
+
+// The program for text, parsed unless one of the recent programs has
+// the same text. The caller gets a reference.
+static struct ServeProgram*
+serve_program_get(struct Server* server, const char* text, size_t len) {
+    uint64_t hash = _serve_program_hash(text, len);
+    for (size_t i = 0; i < SERVE_RECENT; ++i) {
+        struct ServeProgram* program = server->recent[i];
+        if (program != NULL && program->hash == hash && program->text_len == len &&
+            memcmp(program->text, text, len) == 0) {
+            program->refs += 1;
+            return program;
+        }
+    }
+
+    struct ServeProgram* program = serve_program_parse(text, len);
+    if (program == NULL) {
+        return NULL;
+    }
+    program->text = malloc(len);
+    if (program->text != NULL) {
+        memcpy(program->text, text, len);
+        program->text_len = len;
+        program->hash = hash;
+        serve_program_release(server->recent[server->recent_next]);
+        server->recent[server->recent_next] = program;
+        server->recent_next = (server->recent_next + 1) % SERVE_RECENT;
+        program->refs += 1;
+    }
+    return program;
+}
+
+
+static int
+_serve_reserve(char** buf, size_t* cap, size_t need) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t n = *cap != 0 ? *cap : 4096;
+    while (n < need) {
+        n *= 2;
+    }
+    void* p = realloc(*buf, n);
+    if (p == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    *buf = p;
+    *cap = n;
+    return 0;
+}
+
+
+static void
+serve_reply(struct ServeConn* conn, const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (n < 0 || _serve_reserve(&conn->out, &conn->out_cap, conn->out_len + n + 1) != 0) {
+        return;
+    }
+    va_start(args, fmt);
+    vsnprintf(&conn->out[conn->out_len], n + 1, fmt, args);
+    va_end(args);
+    conn->out_len += n;
+}
+
+
+static const struct ServeProgram*
+_serve_program_of(const struct MillCode* code) {
+    return (const struct ServeProgram*)
+        ((const char*) code - offsetof(struct ServeProgram, code));
+}
+
+
+static void
+serve_done(void* arg, void* owner, size_t tag, const struct MillCode* code,
+    const struct SchedResult* result) {
+    struct Server* server = arg;
+    int status = result->status;
+    size_t steps = result->steps;
+    const wchar_t* output = result->output;
+    size_t output_len = result->output_len;
+    struct ServeConn* conn = owner;
+    conn->pending -= 1;
+    serve_program_release((struct ServeProgram*) _serve_program_of(code));
+    if (status == -2) {
+        return;
+    }
+
+    const char* name = status == 0 ? "halted"
+        : status < 0 ? "error"
+        : steps < MILL_STEPS_MAX ? "deadline" : "timeout";
+    serve_reply(conn, "%zu %s %zu ", tag, name, steps);
+    if (_serve_reserve(&conn->out, &conn->out_cap,
+        conn->out_len + output_len * MB_CUR_MAX + 2) != 0) {
+        return;
+    }
+    size_t out_start = conn->out_len;
+    mbstate_t mbs = {};
+    for (size_t i = 0; i < output_len; ++i) {
+        size_t n = wcrtomb(&conn->out[conn->out_len], output[i], &mbs);
+        if (n == (size_t) -1) {
+            conn->out[conn->out_len] = '?';
+            n = 1;
+            mbs = (mbstate_t) {};
+        }
+        conn->out_len += n;
+    }
+    run_stats_record(server->stats, result->elapsed_ns, steps, conn->out_len - out_start);
+    conn->out[conn->out_len++] = '\n';
+}
+
+
+static void
+serve_run_request(struct Server* server, struct ServeConn* conn, char* args) {
+    char* save = NULL;
+    char* id_text = strtok_r(args, " \t", &save);
+    char* tape = strtok_r(NULL, " \t", &save);
+    char* ms_text = strtok_r(NULL, " \t", &save);
+    char* end = NULL;
+
+    if (id_text == NULL) {
+        serve_reply(conn, "error run: expected ID\n");
+        return;
+    }
+    size_t id = strtoull(id_text, &end, 10);
+    if (*end != '\0') {
+        serve_reply(conn, "error run: expected a numeric ID\n");
+        return;
+    }
+    size_t deadline_ms = server->deadline_ms;
+    if (ms_text != NULL) {
+        deadline_ms = strtoull(ms_text, &end, 10);
+        if (*end != '\0') {
+            serve_reply(conn, "%zu invalid deadline\n", id);
+            return;
+        }
+    }
+
+    size_t len = 0;
+    if (tape != NULL) {
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        const char* src = tape;
+        mbstate_t mbs = {};
+        len = mbsrtowcs(server->wide, &src, MILL_TAPE_SIZE, &mbs);
+        if (len == (size_t) -1 || src != NULL) {
+            serve_reply(conn, "%zu invalid tape\n", id);
+            return;
+        }
+        hist_record(&server->stats->parse, _elapsed_ns(&start));
+    }
+
+    struct ServeProgram* program = conn->program;
+    if (server->capture != NULL && (program == server->program ||
+        (program->text != NULL && capture_program(server->capture, program->hash,
+        program->text, program->text_len) == 0))) {
+        capture_run(server->capture, program->hash, deadline_ms, server->wide, len);
+    }
+    if (sched_add(&server->sched, &program->code, server->wide, len,
+        deadline_ms, conn, id) != 0) {
+        serve_reply(conn, "%zu invalid out of memory\n", id);
+        return;
+    }
+    program->refs += 1;
+    conn->pending += 1;
+}
+
+
+static void
+serve_stats(struct Server* server, struct ServeConn* conn, int json) {
+    char* text = NULL;
+    size_t size = 0;
+    FILE* file = open_memstream(&text, &size);
+    if (file == NULL) {
+        perror("open_memstream");
+        serve_reply(conn, "stats error\n");
+        return;
+    }
+    run_stats_print(file, server->stats, json);
+    fclose(file);
+    for (char* line = text; *line != '\0'; ) {
+        char* nl = strchr(line, '\n');
+        serve_reply(conn, "stats %.*s\n", (int) (nl - line), line);
+        line = nl + 1;
+    }
+    free(text);
+}
+
+
+static void
+serve_line(struct Server* server, struct ServeConn* conn, char* line) {
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\r') {
+        line[len - 1] = '\0';
+    }
+
+    if (strncmp(line, "run ", 4) == 0) {
+        serve_run_request(server, conn, line + 4);
+    }
+    else if (strncmp(line, "program ", 8) == 0) {
+        char* end = NULL;
+        size_t n = strtoull(line + 8, &end, 10);
+        if (*end != '\0' || n == 0 || n > SERVE_PROGRAM_MAX) {
+            serve_reply(conn, "program error: expected a size up to %zu\n",
+                SERVE_PROGRAM_MAX);
+            return;
+        }
+        conn->program_need = n;
+    }
+    else if (strcmp(line, "stats") == 0 || strcmp(line, "stats json") == 0) {
+        serve_stats(server, conn, line[5] != '\0');
+    }
+    else if (line[0] != '\0') {
+        serve_reply(conn, "error unknown request\n");
+    }
+}
+
+
+// Handles every complete request in the input buffer. Returns nonzero
+// if the connection has to be dropped.
+static int
+serve_input(struct Server* server, struct ServeConn* conn) {
+    for (;;) {
+        char* start = &conn->in[conn->in_start];
+        size_t avail = conn->in_len - conn->in_start;
+
+        if (conn->program_need > 0) {
+            if (avail < conn->program_need) {
                 break;
+            }
+            struct ServeProgram* program = serve_program_get(server, start, conn->program_need);
+            conn->in_start += conn->program_need;
+            conn->program_need = 0;
+            if (program == NULL) {
+                serve_reply(conn, "program error\n");
+                continue;
+            }
+            serve_program_release(conn->program);
+            conn->program = program;
+            serve_reply(conn, "program ok %zu states %zu rules\n",
+                program->code.states, program->prog->instr_count);
+            continue;
+        }
+
+        char* nl = memchr(start, '\n', avail);
+        if (nl == NULL) {
+            if (avail > SERVE_LINE_MAX) {
+                serve_reply(conn, "error request too long\n");
+                return 1;
+            }
+            break;
+        }
+        *nl = '\0';
+        conn->in_start += nl - start + 1;
+        serve_line(server, conn, start);
+    }
+
+    if (conn->in_start == conn->in_len) {
+        conn->in_start = 0;
+        conn->in_len = 0;
+    }
+    return 0;
+}
+
+
+static int
+serve_read(struct Server* server, struct ServeConn* conn) {
+    if (conn->in_start > 0 && conn->in_len == conn->in_cap) {
+        memmove(conn->in, &conn->in[conn->in_start], conn->in_len - conn->in_start);
+        conn->in_len -= conn->in_start;
+        conn->in_start = 0;
+    }
+    if (_serve_reserve(&conn->in, &conn->in_cap, conn->in_len + 4096) != 0) {
+        return 1;
+    }
+    ssize_t n = read(conn->fd, &conn->in[conn->in_len], conn->in_cap - conn->in_len);
+    if (n < 0) {
+        return errno == EAGAIN || errno == EINTR ? 0 : 1;
+    }
+    if (n == 0) {
+        conn->eof = 1;
+        return 0;
+    }
+    conn->in_len += n;
+    return serve_input(server, conn);
+}
+
+
+static int
+serve_write(struct ServeConn* conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t n = send(conn->fd, &conn->out[conn->out_sent],
+            conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            return errno == EAGAIN || errno == EINTR ? 0 : 1;
+        }
+        conn->out_sent += n;
+    }
+    conn->out_sent = 0;
+    conn->out_len = 0;
+    return 0;
+}
+
+
+static void
+serve_close(struct Server* server, size_t index) {
+    struct ServeConn* conn = server->conns[index];
+    sched_drop(&server->sched, conn);
+    serve_program_release(conn->program);
+    close(conn->fd);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+    server->conns[index] = server->conns[--server->conn_count];
+}
+
+
+static void
+serve_accept(struct Server* server, int listener) {
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        if (server->conn_count >= server->conn_cap) {
+            size_t cap = server->conn_cap != 0 ? server->conn_cap * 2 : 16;
+            void* p = realloc(server->conns, cap * sizeof(server->conns[0]));
+            if (p == NULL) {
+                perror("malloc");
+                close(fd);
+                return;
+            }
+            server->conns = p;
+            server->conn_cap = cap;
+        }
+        struct ServeConn* conn = calloc(1, sizeof(*conn));
+        if (conn == NULL) {
+            perror("malloc");
+            close(fd);
+            return;
+        }
+        conn->fd = fd;
+        conn->program = server->program;
+        conn->program->refs += 1;
+        server->conns[server->conn_count++] = conn;
+    }
+}
+
+
+static int
+serve_listen(const char* path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "error: --serve: socket path too long\n");
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(fd, 128) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+// Gives machines turns for about a millisecond between polls.
+static void
+serve_turns(struct Server* server) {
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (sched_turn(&server->sched) != 0) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ns = (now.tv_sec - start.tv_sec) * 1000000000L + (now.tv_nsec - start.tv_nsec);
+        if (ns >= SERVE_TURN_NS) {
+            break;
+        }
+    }
+}
+
+
+static int
+serve_main(struct AppArgs* args, struct Capture* capture) {
+    struct Server server = {.deadline_ms = args->deadline_ms, .capture = capture};
+    server.program = serve_program_new(&_Program, 0);
+    if (server.program != NULL && capture != NULL) {
+        server.program->hash = capture->program;
+    }
+    server.wide = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    server.stats = calloc(1, sizeof(*server.stats));
+    if (server.program == NULL || server.wide == NULL || server.stats == NULL) {
+        serve_program_release(server.program);
+        free(server.wide);
+        free(server.stats);
+        return 1;
+    }
+    if (sched_init(&server.sched, args->slice, args->huge_pages, serve_done, &server) != 0) {
+        serve_program_release(server.program);
+        free(server.wide);
+        free(server.stats);
+        return 1;
+    }
+
+    int listener = serve_listen(args->serve);
+    if (listener < 0) {
+        sched_free(&server.sched);
+        serve_program_release(server.program);
+        free(server.wide);
+        free(server.stats);
+        return 1;
+    }
 
-            case 10:
-                if (c == L'\n') {
-                    state = 100;
-                }
-                else if (c == L'/') {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    state = 11;
-                }
-                else if (iswspace(c) == 0) {
-                    parse_error("unexpected token: %lc", c);
-                    return -1;
-                }
-                break;
+    struct sigaction action = {.sa_handler = serve_stop_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
 
-            case 11:
-                if (c == L'/') {
-                    state = 12;
-                }
-                else {
-                    token[toksize++] = c;
-                    token[toksize] = L'\0';
-                    parse_error("unexpected token: %ls", token);
-                    return -1;
-                }
+    struct pollfd* fds = NULL;
+    size_t fds_cap = 0;
+    while (_serve_stop == 0) {
+        size_t count = server.conn_count + 1;
+        if (count > fds_cap) {
+            void* p = realloc(fds, count * 2 * sizeof(fds[0]));
+            if (p == NULL) {
+                perror("malloc");
                 break;
+            }
+            fds = p;
+            fds_cap = count * 2;
+        }
+        fds[0] = (struct pollfd) {.fd = listener, .events = POLLIN};
+        for (size_t i = 0; i < server.conn_count; ++i) {
+            struct ServeConn* conn = server.conns[i];
+            fds[i + 1] = (struct pollfd) {
+                .fd = conn->fd,
+                .events = (conn->eof == 0 ? POLLIN : 0) |
+                    (conn->out_len > 0 ? POLLOUT : 0),
+            };
+        }
 
-            case 12:
-                if (c == L'\n') {
-                    state = 100;
-                }
-                break;
+        int n = poll(fds, count, server.sched.live > 0 ? 0 : -1);
+        if (n < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+        if (n > 0 && (fds[0].revents & POLLIN)) {
+            serve_accept(&server, listener);
+        }
 
-            case 20:
-                if (c == L'\n') {
-                    state = 0;
-                }
-                break;
+        // Connections accepted above have no entry in fds yet.
+        for (size_t i = count - 1; n > 0 && i > 0; --i) {
+            struct ServeConn* conn = server.conns[i - 1];
+            short revents = fds[i].revents;
+            int failed = (revents & (POLLERR | POLLNVAL)) != 0;
+            if (failed == 0 && (revents & (POLLIN | POLLHUP))) {
+                failed = serve_read(&server, conn);
+            }
+            if (failed != 0) {
+                serve_close(&server, i - 1);
+            }
+        }
 
-            default:
-                parse_error("invalid state %d", state);
-                return -1;
+        serve_turns(&server);
+
+        for (size_t i = server.conn_count; i > 0; --i) {
+            struct ServeConn* conn = server.conns[i - 1];
+            if (serve_write(conn) != 0 ||
+                (conn->eof != 0 && conn->pending == 0 && conn->out_len == 0)) {
+                serve_close(&server, i - 1);
+            }
         }
     }
 
-    switch (state) {
-        case 0:
-        case 20:
-            return 0;
-        case 1 ... 8:
-            parse_error("expecting a token");
-            return -1;
-        case 9: {
-            int res = parse_headmove(token, &data.move);
-            if (res != 0) { return -1; }
-            *instr = data;
-            return 1;
-        }
-        case 11:
-            parse_error("unexpected token: %ls", token);
-            return -1;
-        case 10:
-        case 12:
-        case 100:
-            *instr = data;
-            return 1;
+    while (server.conn_count > 0) {
+        serve_close(&server, server.conn_count - 1);
+    }
+    free(fds);
+    free(server.conns);
+    close(listener);
+    unlink(args->serve);
+    sched_free(&server.sched);
+    for (size_t i = 0; i < SERVE_RECENT; ++i) {
+        serve_program_release(server.recent[i]);
     }
-    parse_error("invalid state %d", state);
-    return -1;
+    serve_program_release(server.program);
+    free(server.wide);
+    free(server.stats);
+    return 0;
 }
 
 
-static int
-mill_parse_program(FILE* file, struct MillProgram* program) {
-    *program = (struct MillProgram) {};
-    int res;
+// Distributed batches. A coordinator (-b TAPES --coordinator ADDR) hands
+// units of tapes to the workers (--worker ADDR) that connect to it over
+// TCP, and writes the outputs in input order as units come back.
+// Messages are lines:
+//
+//     worker  hello [HASH...]       the programs it has compiled
+//     coord   program HASH N        followed by N bytes of program text
+//             use HASH              a program the worker has
+//             unit ID COUNT MS      followed by COUNT tapes, one per line
+//             done                  the batch is finished
+//     worker  result ID COUNT       followed by COUNT lines
+//                                   "STATUS STEPS OFFSET OUTPUT"
+//
+// HASH is the FNV-1a hash of the program text in hex. A unit holds at
+// most COORD_UNIT_MAX tapes, and a worker holds one unit at a time; if
+// its connection drops, or it stays silent for COORD_SILENCE_S seconds
+// plus its unit's deadlines, the unit goes back to the queue. Workers
+// keep their programs across batches and reconnect until stopped.
 
-    res = symtable_insert(&program->symtable, L"INIT", &program->syminit);
-    if (res != 0) { return res; }
+#define COORD_UNIT 64
+#define COORD_UNIT_MAX 65536
+#define COORD_SILENCE_S 60
+#define WORKER_PROGRAMS 16
 
-    res = symtable_insert(&program->symtable, L"HALT", &program->symhalt);
-    if (res != 0) { return res; }
 
-    for (;;) {
-        struct MillInstr instr = {};
-        int n = mill_parse_instruction(file, &program->symtable, &instr);
-        if (n == 0) { break; }
-        if (n != 1) { return n; }
+struct Coord {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    FILE* file;
+    enum OutputFormat format;
+    struct BatchTape* tapes;
+    size_t count;
+    size_t unit_size;
+    size_t deadline_ms;
+    const char* text;
+    size_t text_len;
+    uint64_t hash;
+
+    size_t unit_count;
+    size_t next_unit;
+    size_t* requeued;
+    size_t requeued_count;
+    uint8_t* unit_done;
+    size_t units_done;
+    size_t written;
+    int res;
+};
+
+
+struct CoordConn {
+    struct Coord* coord;
+    int fd;
+    pthread_t thread;
+};
 
-        if (program->instr_count >= MILL_INSTR_MAX) {
-            parse_error("too many instructions");
-            return 1;
-        }
 
-        program->instructions[program->instr_count++] = instr;
+// Splits HOST:PORT, HOST being optional, and resolves it.
+static int
+_tcp_resolve(const char* addr, int passive, struct addrinfo** res) {
+    const char* colon = strrchr(addr, ':');
+    if (colon == NULL || colon[1] == '\0') {
+        fprintf(stderr, "error: %s: expected HOST:PORT\n", addr);
+        return 1;
+    }
+    char host[256];
+    size_t len = colon - addr;
+    if (len >= sizeof(host)) {
+        fprintf(stderr, "error: %s: host name too long\n", addr);
+        return 1;
     }
+    memcpy(host, addr, len);
+    host[len] = '\0';
 
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = passive != 0 ? AI_PASSIVE : 0,
+    };
+    int err = getaddrinfo(len > 0 ? host : NULL, colon + 1, &hints, res);
+    if (err != 0) {
+        fprintf(stderr, "error: %s: %s\n", addr, gai_strerror(err));
+        return 1;
+    }
     return 0;
 }
 
 
 static int
-mill_read_tape(FILE* file, struct MillTape* tape) {
-    wchar_t* res = fgetws(tape->buf, tape->size, file);
-    if (res == NULL) {
-        perror("fgets");
-        return 1;
+coord_listen(const char* addr) {
+    struct addrinfo* info = NULL;
+    if (_tcp_resolve(addr, 1, &info) != 0) {
+        return -1;
     }
-    return 0;
+    int fd = -1;
+    for (struct addrinfo* ai = info; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, 64) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        perror(addr);
+    }
+    freeaddrinfo(info);
+    return fd;
 }
 
 
-static size_t
-mill_tape_start(struct MillTape* tape) {
-    size_t pos = tape->pos;
-    for (size_t i = 0; i < tape->size; ++i) {
-        if (tape->buf[pos] == L'\0') {
+// Takes the next unit to hand out, requeued ones first, waiting while
+// every unit left is with some worker. Returns 0 once all are done.
+static int
+coord_take(struct Coord* coord, size_t* unit) {
+    pthread_mutex_lock(&coord->lock);
+    for (;;) {
+        if (coord->requeued_count > 0) {
+            *unit = coord->requeued[--coord->requeued_count];
             break;
         }
-        else {
-            pos = (pos - 1) % tape->size;
+        if (coord->next_unit < coord->unit_count) {
+            *unit = coord->next_unit++;
+            break;
         }
+        if (coord->units_done == coord->unit_count) {
+            pthread_mutex_unlock(&coord->lock);
+            return 0;
+        }
+        pthread_cond_wait(&coord->cond, &coord->lock);
     }
-    for (size_t i = 0; i < tape->size; ++i) {
-        if (tape->buf[pos] != L'\0') {
-            break;
+    pthread_mutex_unlock(&coord->lock);
+    return 1;
+}
+
+
+static void
+coord_requeue(struct Coord* coord, size_t unit) {
+    pthread_mutex_lock(&coord->lock);
+    coord->requeued[coord->requeued_count++] = unit;
+    pthread_cond_signal(&coord->cond);
+    pthread_mutex_unlock(&coord->lock);
+}
+
+
+// Writes the outputs of every finished unit that follows those already
+// written. Called with the lock held.
+static void
+coord_write(struct Coord* coord) {
+    while (coord->written < coord->count &&
+        coord->unit_done[coord->written / coord->unit_size] != 0) {
+        struct BatchTape* job = &coord->tapes[coord->written++];
+        if (job->status != 0) {
+            fflush(coord->file);
+            fprintf(stderr, "tape %zu: %s after %zu steps\n", coord->written,
+                job->status > 0 ? "timed out" : "error", job->steps);
+            coord->res = 1;
         }
-        else {
-            pos = (pos + 1) % tape->size;
+        if (batch_print_output(coord->file, job, coord->format) != 0) {
+            coord->res = 1;
         }
     }
-    return pos;
+    fflush(coord->file);
 }
 
 
+// Reads a unit's results into tapes. Returns nonzero, leaving no output
+// allocated, if the worker sent anything else.
 static int
-mill_print_tape(FILE* file, struct MillTape* tape) {
-    size_t start = mill_tape_start(tape);
-    int res = fputws(&tape->buf[start], file);
-    if (res < 0) {
-        perror("fputws");
+coord_read_result(FILE* in, size_t unit, struct BatchTape* tapes, size_t count,
+    char** line, size_t* cap) {
+    size_t id = 0;
+    size_t n = 0;
+    if (getline(line, cap, in) < 0 ||
+        sscanf(*line, "result %zu %zu", &id, &n) != 2 || id != unit || n != count) {
         return 1;
     }
-    if (start > 0 && tape->buf[0] != L'\0') {
-        int res = fputws(&tape->buf[0], file);
-        if (res < 0) {
-            perror("fputws");
-            return 1;
+    size_t i = 0;
+    for (; i < count; ++i) {
+        ssize_t len = getline(line, cap, in);
+        int status = 0;
+        int offset = 0;
+        if (len <= 0 || (*line)[len - 1] != '\n' ||
+            sscanf(*line, "%d %zu %td %n", &status, &tapes[i].steps,
+                &tapes[i].offset, &offset) != 3 ||
+            offset == 0) {
+            break;
+        }
+        (*line)[len - 1] = '\0';
+        tapes[i].status = status;
+        tapes[i].output = NULL;
+        if (status == 0) {
+            size_t wlen = mbstowcs(NULL, *line + offset, 0);
+            if (wlen == (size_t) -1 ||
+                (tapes[i].output = malloc((wlen + 1) * sizeof(wchar_t))) == NULL) {
+                break;
+            }
+            mbstowcs(tapes[i].output, *line + offset, wlen + 1);
         }
     }
-    wint_t r = fputwc(L'\n', file);
-    if (r == WEOF) {
-        perror("fputwc");
+    if (i < count) {
+        for (size_t j = 0; j < i; ++j) {
+            free(tapes[j].output);
+            tapes[j].output = NULL;
+        }
         return 1;
     }
     return 0;
@@ -614,182 +5317,501 @@ mill_print_tape(FILE* file, struct MillTape* tape) {
 
 
 static int
-_dump_tape(FILE* file, struct MillTape* tape, int color) {
-    size_t bufsize = tape->size;
-    size_t half = bufsize / 2;
-    size_t pos = tape->pos;
+coord_send_unit(FILE* out, const struct Coord* coord, size_t unit) {
+    size_t first = unit * coord->unit_size;
+    size_t count = coord->count - first < coord->unit_size ?
+        coord->count - first : coord->unit_size;
+    fprintf(out, "unit %zu %zu %zu\n", unit, count, coord->deadline_ms);
+    for (size_t i = first; i < first + count; ++i) {
+        fprintf(out, "%ls\n", coord->tapes[i].input);
+    }
+    return fflush(out) != 0 || ferror(out) ? 1 : 0;
+}
 
-    size_t a = bufsize;
-    size_t b = bufsize;
-    size_t c = bufsize;
-    size_t d = bufsize;
 
-    wchar_t* p = &tape->buf[0];
-    for (size_t i = 0; i < half; ++i) {
-        if (*p++ != L'\0') {
-            if (i < a) {
-                a = i;
-            }
-            b = i;
+// Serves one worker until the batch is finished or the worker is lost.
+static void*
+coord_conn(void* arg) {
+    struct CoordConn* conn = arg;
+    struct Coord* coord = conn->coord;
+    struct timeval silence = {
+        .tv_sec = COORD_SILENCE_S + coord->unit_size * coord->deadline_ms / 1000,
+    };
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &silence, sizeof(silence));
+    int one = 1;
+    setsockopt(conn->fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char* line = NULL;
+    size_t cap = 0;
+
+    // The streams get descriptors of their own; conn->fd stays open for
+    // mill_coordinate to shut down and close.
+    int in_fd = dup(conn->fd);
+    int out_fd = dup(conn->fd);
+    FILE* in = in_fd >= 0 ? fdopen(in_fd, "r") : NULL;
+    FILE* out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (in == NULL || out == NULL) {
+        perror("fdopen");
+        if (in == NULL && in_fd >= 0) {
+            close(in_fd);
         }
-    }
-    wchar_t* q = &tape->buf[half];
-    for (size_t i = 0; i < half; ++i) {
-        if (*q++ != L'\0') {
-            size_t j = i + half;
-            if (j < c) {
-                c = j;
-            }
-            d = j;
+        if (out == NULL && out_fd >= 0) {
+            close(out_fd);
         }
+        goto done;
     }
 
-    if (a == bufsize && c == bufsize) {
-        return 0;
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%016llx", (unsigned long long) coord->hash);
+    if (getline(&line, &cap, in) < 0 || strncmp(line, "hello", 5) != 0) {
+        goto done;
+    }
+    if (strstr(line, hash) != NULL) {
+        fprintf(out, "use %s\n", hash);
+    }
+    else {
+        fprintf(out, "program %s %zu\n", hash, coord->text_len);
+        fwrite(coord->text, 1, coord->text_len, out);
     }
 
-    size_t start = (c != bufsize) ? c : a;
-    size_t end = (b != bufsize) ? b : d;
-    for (size_t i = 1; i < 100; ++i) {
-        if ((pos + i) % bufsize == start) {
-            start = pos;
+    size_t unit = 0;
+    while (coord_take(coord, &unit) != 0) {
+        size_t first = unit * coord->unit_size;
+        size_t count = coord->count - first < coord->unit_size ?
+            coord->count - first : coord->unit_size;
+        struct BatchTape results[count];
+        if (coord_send_unit(out, coord, unit) != 0 ||
+            coord_read_result(in, unit, results, count, &line, &cap) != 0) {
+            coord_requeue(coord, unit);
             break;
         }
+
+        pthread_mutex_lock(&coord->lock);
+        for (size_t i = 0; i < count; ++i) {
+            struct BatchTape* job = &coord->tapes[first + i];
+            job->status = results[i].status;
+            job->steps = results[i].steps;
+            job->output = results[i].output;
+            job->offset = results[i].offset;
+        }
+        coord->unit_done[unit] = 1;
+        coord->units_done += 1;
+        coord_write(coord);
+        if (coord->units_done == coord->unit_count) {
+            pthread_cond_broadcast(&coord->cond);
+        }
+        pthread_mutex_unlock(&coord->lock);
+    }
+    pthread_mutex_lock(&coord->lock);
+    int finished = coord->units_done == coord->unit_count && coord->res >= 0;
+    pthread_mutex_unlock(&coord->lock);
+    if (finished != 0) {
+        fputs("done\n", out);
+    }
+
+done:
+    free(line);
+    if (in != NULL) {
+        fclose(in);
+    }
+    if (out != NULL) {
+        fclose(out);
+    }
+    return NULL;
+}
+
+
+// Runs the batch on the workers that connect to addr, started before or
+// after the coordinator, and writes the outputs in order.
+static int
+mill_coordinate(FILE* file, enum OutputFormat format, const char* addr,
+    struct BatchTape* tapes, size_t count, size_t unit_size, size_t deadline_ms,
+    const char* text, size_t text_len) {
+    int listener = coord_listen(addr);
+    if (listener < 0) {
+        return 1;
+    }
+
+    struct Coord coord = {
+        .file = file,
+        .format = format,
+        .tapes = tapes,
+        .count = count,
+        .unit_size = unit_size,
+        .deadline_ms = deadline_ms,
+        .text = text,
+        .text_len = text_len,
+        .hash = _serve_program_hash(text, text_len),
+        .unit_count = (count + unit_size - 1) / unit_size,
+    };
+    coord.requeued = malloc((coord.unit_count + 1) * sizeof(coord.requeued[0]));
+    coord.unit_done = calloc(coord.unit_count + 1, 1);
+    if (coord.requeued == NULL || coord.unit_done == NULL) {
+        perror("malloc");
+        free(coord.requeued);
+        free(coord.unit_done);
+        close(listener);
+        return 1;
     }
-    for (size_t i = 1; i < 100; ++i) {
-        if ((pos - i) % bufsize == end) {
-            end = pos;
+    pthread_mutex_init(&coord.lock, NULL);
+    pthread_cond_init(&coord.cond, NULL);
+
+    struct CoordConn** conns = NULL;
+    size_t conn_count = 0;
+    size_t conn_cap = 0;
+    for (;;) {
+        pthread_mutex_lock(&coord.lock);
+        int finished = coord.units_done == coord.unit_count;
+        pthread_mutex_unlock(&coord.lock);
+        if (finished != 0 || _serve_stop != 0) {
             break;
         }
-    }
-    end = (end + 1) % bufsize;
 
-    for (size_t i = start; i != end; ) {
-        wchar_t c = tape->buf[i];
-        if (c == L'\0') {
-            c = L'_';
+        struct pollfd pfd = {.fd = listener, .events = POLLIN};
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
         }
-        if (color != 0 && i == pos) {
-            fputs("\x1b[40;34m", file);
-            fputwc(c, file);
-            fputs("\x1b[0m", file);
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
         }
-        else {
-            fputwc(c, file);
+        if (conn_count >= conn_cap) {
+            size_t cap = conn_cap != 0 ? conn_cap * 2 : 16;
+            void* p = realloc(conns, cap * sizeof(conns[0]));
+            if (p == NULL) {
+                perror("malloc");
+                close(fd);
+                continue;
+            }
+            conns = p;
+            conn_cap = cap;
+        }
+        struct CoordConn* conn = malloc(sizeof(*conn));
+        if (conn == NULL) {
+            perror("malloc");
+            close(fd);
+            continue;
+        }
+        *conn = (struct CoordConn) {.coord = &coord, .fd = fd};
+        if (pthread_create(&conn->thread, NULL, coord_conn, conn) != 0) {
+            perror("pthread_create");
+            close(fd);
+            free(conn);
+            continue;
         }
-        i = (i + 1) % bufsize;
+        conns[conn_count++] = conn;
     }
-    return 0;
+    close(listener);
+
+    // Stopped early: marks every unit done, with res -1, to release the
+    // threads waiting for units, and cuts the connections of the rest.
+    // Otherwise only threads still waiting for a hello are left to cut.
+    pthread_mutex_lock(&coord.lock);
+    if (coord.units_done < coord.unit_count) {
+        fprintf(stderr, "error: stopped with %zu of %zu tapes written\n",
+            coord.written, count);
+        coord.units_done = coord.unit_count;
+        coord.res = -1;
+        pthread_cond_broadcast(&coord.cond);
+    }
+    int res = coord.res;
+    pthread_mutex_unlock(&coord.lock);
+    for (size_t i = 0; i < conn_count; ++i) {
+        shutdown(conns[i]->fd, res < 0 ? SHUT_RDWR : SHUT_RD);
+    }
+    for (size_t i = 0; i < conn_count; ++i) {
+        pthread_join(conns[i]->thread, NULL);
+        close(conns[i]->fd);
+        free(conns[i]);
+    }
+    free(conns);
+    pthread_cond_destroy(&coord.cond);
+    pthread_mutex_destroy(&coord.lock);
+    free(coord.requeued);
+    free(coord.unit_done);
+    return res != 0 ? 1 : 0;
 }
 
 
 static int
-_dump_state(FILE* file, struct MillProgram* prog,
-    struct MillTape* tape, size_t state, size_t ts) {
-    int color = isatty(fileno(file));
-    fprintf(file, "%04zx: ", ts);
-    int res = _dump_tape(file, tape, color);
-    if (res != 0) { return res; }
+worker_connect(const char* addr) {
+    struct addrinfo* info = NULL;
+    if (_tcp_resolve(addr, 0, &info) != 0) {
+        return -2;
+    }
+    int fd = -1;
+    for (struct addrinfo* ai = info; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(info);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
 
-    wchar_t* s = prog->symtable.symbols[state];
-    if (color != 0) {
-        fputs("\x1b[35m", file);
-        res = fprintf(file, " %ls\n", s);
-        fputs("\x1b[0m", file);
+// Reads the program text that follows a program message, and compiles
+// it into the cache unless it is there already.
+static struct ServeProgram*
+worker_program(FILE* in, const char* args, struct ServeProgram** cache, size_t* next,
+    size_t memo_bytes) {
+    unsigned long long hash = 0;
+    size_t len = 0;
+    if (sscanf(args, "%llx %zu", &hash, &len) != 2 || len > SERVE_PROGRAM_MAX) {
+        return NULL;
     }
-    else {
-        res = fprintf(file, " %ls\n", s);
+    char* text = malloc(len + 1);
+    if (text == NULL) {
+        perror("malloc");
+        return NULL;
     }
-    if (res < 0) {
-        perror("fprintf");
-        return 1;
+    if (fread(text, 1, len, in) != len || _serve_program_hash(text, len) != hash) {
+        free(text);
+        return NULL;
     }
-    return 0;
+    struct ServeProgram* program = serve_program_parse(text, len);
+    free(text);
+    if (program == NULL) {
+        return NULL;
+    }
+    program->hash = hash;
+    if (memo_bytes != 0) {
+        program->memo = memo_new(memo_bytes);
+    }
+    serve_program_release(cache[*next]);
+    cache[*next] = program;
+    *next = (*next + 1) % WORKER_PROGRAMS;
+    return program;
 }
 
 
+// Reads a unit's tapes, runs them and sends back the results.
 static int
-mill_run(struct MillProgram* prog, struct MillTape* tape,
-    size_t* steps, int verbose) {
-    size_t pos = tape->pos;
-    size_t state = prog->syminit;
-    size_t halt = prog->symhalt;
+worker_unit(FILE* in, FILE* out, const char* args, const struct ServeProgram* program,
+    size_t jobs, int huge_pages, char** line, size_t* cap) {
+    size_t id = 0;
+    size_t count = 0;
+    size_t deadline_ms = 0;
+    if (program == NULL ||
+        sscanf(args, "%zu %zu %zu", &id, &count, &deadline_ms) != 3 ||
+        count == 0 || count > COORD_UNIT_MAX) {
+        return 1;
+    }
+    struct BatchTape* tapes = calloc(count, sizeof(tapes[0]));
+    if (tapes == NULL) {
+        perror("malloc");
+        return 1;
+    }
+
+    int res = 0;
+    for (size_t i = 0; i < count && res == 0; ++i) {
+        ssize_t len = getline(line, cap, in);
+        if (len <= 0) {
+            res = 1;
+            break;
+        }
+        if ((*line)[len - 1] == '\n') {
+            (*line)[--len] = '\0';
+        }
+        size_t wlen = mbstowcs(NULL, *line, 0);
+        if (wlen == (size_t) -1 || wlen >= MILL_TAPE_SIZE ||
+            (tapes[i].input = malloc((wlen + 1) * sizeof(wchar_t))) == NULL) {
+            res = 1;
+            break;
+        }
+        mbstowcs(tapes[i].input, *line, wlen + 1);
+        tapes[i].len = wlen;
+    }
 
-    for (size_t t = 0; t < MILL_STEPS_MAX; ++t) {
-        size_t prev = pos;
-        wchar_t c = tape->buf[pos];
+    if (res == 0) {
+        int flags = _batch_flags;
+        struct BatchContext ctx = {
+            .code = &program->code,
+            .exec = mill_exec_select(flags),
+            .flags = flags,
+            .huge_pages = huge_pages,
+            .deadline_ms = deadline_ms,
+            .tapes = tapes,
+            .count = count,
+            .memo = program->memo,
+        };
+        batch_run_threads(&ctx, jobs < count ? jobs : count);
 
-        if (verbose != 0) {
-            tape->pos = pos;
-            _dump_state(stderr, prog, tape, state, t);
+        fprintf(out, "result %zu %zu\n", id, count);
+        for (size_t i = 0; i < count; ++i) {
+            fprintf(out, "%d %zu %td %ls\n", tapes[i].status, tapes[i].steps,
+                tapes[i].offset, tapes[i].output != NULL ? tapes[i].output : L"");
         }
+        res = fflush(out) != 0 || ferror(out) ? 1 : 0;
+    }
 
-        for (size_t i = 0; i < prog->instr_count; ++i) {
-            struct MillInstr* instr = &prog->instructions[i];
-            if (instr->state_in == state && instr->char_in == c) {
-                tape->buf[pos] = instr->char_out;
-                state = instr->state_out;
-                int dp = 0;
-                switch (instr->move) {
-                    case HeadMove_left: dp = -1; break;
-                    case HeadMove_right: dp = 1; break;
-                    default:
-                        tape->pos = pos;
-                        if (steps != NULL) {
-                            *steps = t + 1;
-                        }
-                        fprintf(stderr, "error: invalid head movement\n");
-                        return -1;
-                }
-                pos = (pos + dp) % tape->size;
-                if (state == halt) {
-                    tape->pos = pos;
-                    if (steps != NULL) {
-                        *steps = t + 1;
-                    }
-                    if (verbose != 0) {
-                        _dump_state(stderr, prog, tape, state, t + 1);
-                    }
-                    return 0;
-                }
+    for (size_t i = 0; i < count; ++i) {
+        free(tapes[i].input);
+        free(tapes[i].output);
+    }
+    free(tapes);
+    return res;
+}
+
+
+// Works for one coordinator until it is done or the connection is lost.
+static void
+worker_session(int fd, struct ServeProgram** cache, size_t* next, size_t jobs,
+    int huge_pages, size_t memo_bytes) {
+    int fd2 = dup(fd);
+    FILE* in = fd2 >= 0 ? fdopen(fd2, "r") : NULL;
+    FILE* out = fdopen(fd, "w");
+    if (in == NULL || out == NULL) {
+        perror("fdopen");
+        if (in != NULL) {
+            fclose(in);
+        }
+        else if (fd2 >= 0) {
+            close(fd2);
+        }
+        if (out != NULL) {
+            fclose(out);
+        }
+        else {
+            close(fd);
+        }
+        return;
+    }
+
+    fputs("hello", out);
+    for (size_t i = 0; i < WORKER_PROGRAMS; ++i) {
+        if (cache[i] != NULL) {
+            fprintf(out, " %016llx", (unsigned long long) cache[i]->hash);
+        }
+    }
+    fputc('\n', out);
+    fflush(out);
+
+    const struct ServeProgram* program = NULL;
+    char* line = NULL;
+    size_t cap = 0;
+    char* unit_line = NULL;
+    size_t unit_cap = 0;
+    while (_serve_stop == 0 && getline(&line, &cap, in) > 0) {
+        if (strncmp(line, "unit ", 5) == 0) {
+            if (worker_unit(in, out, line + 5, program, jobs, huge_pages,
+                &unit_line, &unit_cap) != 0) {
+                fprintf(stderr, "worker: bad unit\n");
                 break;
             }
         }
-        if (pos == prev) {
-            wchar_t* s = prog->symtable.symbols[state];
-            if (c == L'\0') {
-                c = L'_';
+        else if (strncmp(line, "program ", 8) == 0) {
+            program = worker_program(in, line + 8, cache, next, memo_bytes);
+            if (program == NULL) {
+                fprintf(stderr, "worker: bad program\n");
+                break;
             }
-            tape->pos = pos;
-            if (steps != NULL) {
-                *steps = t + 1;
+        }
+        else if (strncmp(line, "use ", 4) == 0) {
+            unsigned long long hash = 0;
+            sscanf(line + 4, "%llx", &hash);
+            program = NULL;
+            for (size_t i = 0; i < WORKER_PROGRAMS; ++i) {
+                if (cache[i] != NULL && cache[i]->hash == hash) {
+                    program = cache[i];
+                }
             }
-            fprintf(stderr, "error: unhandled state %ls '%lc'\n", s, c);
-            return -1;
+        }
+        else {
+            break;
         }
     }
+    free(unit_line);
+    free(line);
+    fclose(in);
+    fclose(out);
+}
+
 
-    tape->pos = pos;
-    if (steps != NULL) {
-        *steps = MILL_STEPS_MAX;
+static int
+worker_main(struct AppArgs* args) {
+    struct sigaction action = {.sa_handler = serve_stop_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct ServeProgram* cache[WORKER_PROGRAMS] = {};
+    size_t next = 0;
+    int res = 0;
+    while (_serve_stop == 0) {
+        int fd = worker_connect(args->worker);
+        if (fd == -2) {
+            res = 1;
+            break;
+        }
+        if (fd < 0) {
+            sleep(1);
+            continue;
+        }
+        worker_session(fd, cache, &next, args_jobs(args), args->huge_pages,
+            args->memo_mb << 20);
+    }
+    for (size_t i = 0; i < WORKER_PROGRAMS; ++i) {
+        serve_program_release(cache[i]);
     }
+    return res;
+}
+
 
-    if (verbose != 0) {
-        _dump_state(stderr, prog, tape, state, MILL_STEPS_MAX);
+static int
+coord_main(struct AppArgs* args, const char* text, size_t text_len) {
+    if (args->unit > COORD_UNIT_MAX) {
+        arg_error("--unit: expected at most 65536 tapes");
+        return 1;
     }
 
-    fprintf(stderr, "timed out after %zu instructions\n", (size_t) MILL_STEPS_MAX);
-    return 1;
-}
+    struct BatchTape* tapes = NULL;
+    size_t count = 0;
+    int res = batch_read_tapes(args->batch_file, &tapes, &count, NULL);
+    if (res != 0) {
+        return res;
+    }
 
+    struct sigaction action = {.sa_handler = serve_stop_signal};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-static struct MillProgram _Program;
-static struct MillTape _Tape;
+    res = mill_coordinate(args->output_file, args->output_format, args->coordinator,
+        tapes, count, args->unit != 0 ? args->unit : COORD_UNIT, args->deadline_ms,
+        text, text_len);
+    for (size_t i = 0; i < count; ++i) {
+        free(tapes[i].input);
+        free(tapes[i].output);
+    }
+    free(tapes);
+    return res;
+}
 
 
 int main(int argc, const char* argv[]) {
     setlocale(LC_ALL, "");
 
+    struct sigaction action = {
+        .sa_handler = mill_progress_signal,
+        .sa_flags = SA_RESTART,
+    };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+
     struct AppArgs args = {};
     int res = parse_args(argc, argv, &args);
     if (res != 0) { return res; }
@@ -798,17 +5820,60 @@ int main(int argc, const char* argv[]) {
         puts(_help_page);
         return 0;
     }
+
+    if (args.worker != NULL) {
+        return worker_main(&args);
+    }
+
+    if (args.apply_delta != NULL) {
+        res = args.tape != NULL ? args_open_file(args.tape, "r", &args.tape_file)
+            : args_open_file(args.batch, "r", &args.batch_file);
+        if (res != 0) {
+            arg_perror(args.tape != NULL ? "-t/--tape" : "-b/--batch");
+            return res;
+        }
+        res = args_open_file(args.output, "w", &args.output_file);
+        if (res != 0) {
+            arg_perror("-o/--output");
+            args_close_files(&args);
+            return res;
+        }
+        res = delta_main(&args);
+        args_close_files(&args);
+        return res;
+    }
     
+    if (args.programs != NULL) {
+        res = args_open_file(args.output, "w", &args.output_file);
+        if (res != 0) {
+            arg_perror("-o/--output");
+            return res;
+        }
+        res = submit_main(&args);
+        args_close_files(&args);
+        return res;
+    }
+
     res = args_open_file(args.program, "r", &args.program_file);
     if (res != 0) {
         arg_perror("-p/--program");
         return res;
     }
 
-    res = args_open_file(args.tape, "r", &args.tape_file);
-    if (res != 0) {
-        arg_perror("-t/--tape");
-        return res;
+    if (args.batch != NULL) {
+        res = args_open_file(args.batch, "r", &args.batch_file);
+        if (res != 0) {
+            arg_perror("-b/--batch");
+            return res;
+        }
+    }
+    else if (args.grade == NULL && args.serve == NULL && args.tape_dir == NULL &&
+        args.explain == 0) {
+        res = args_open_file(args.tape, "r", &args.tape_file);
+        if (res != 0) {
+            arg_perror("-t/--tape");
+            return res;
+        }
     }
 
     res = args_open_file(args.output, "w", &args.output_file);
@@ -817,37 +5882,115 @@ int main(int argc, const char* argv[]) {
         return res;
     }
 
+    // The coordinator ships the program's text to its workers, and a
+    // capture keeps it for replaying.
+    char* program_text = NULL;
+    size_t program_len = 0;
+    if (args.coordinator != NULL || args.capture != NULL) {
+        res = args_read_program(&args, &program_text, &program_len);
+        if (res != 0) {
+            args_close_files(&args);
+            return res;
+        }
+    }
+
     res = mill_parse_program(args.program_file, &_Program);
     if (res != 0) {
+        free(program_text);
         args_close_files(&args);
         return res;
     }
 
-    _Tape.size = sizeof(_Tape.buf) / sizeof(_Tape.buf[0]);
+    if (args.coordinator != NULL) {
+        res = coord_main(&args, program_text, program_len);
+        free(program_text);
+        args_close_files(&args);
+        return res;
+    }
 
-    res = mill_read_tape(args.tape_file, &_Tape);
-    if (res != 0) {
+    if (args.grade != NULL) {
+        res = grade_main(&args);
         args_close_files(&args);
         return res;
     }
 
-    size_t steps = 0;
-    res = mill_run(&_Program, &_Tape, &steps, args.verbose);
-    if (res != 0) {
+    struct Capture* capture = NULL;
+    if (args.capture != NULL) {
+        capture = capture_open(args.capture, program_text, program_len);
+        free(program_text);
+        if (capture == NULL) {
+            args_close_files(&args);
+            return 1;
+        }
+    }
+
+    if (args.batch != NULL) {
+        res = batch_main(&args, capture);
+        if (capture_close(capture) != 0) {
+            res = 1;
+        }
         args_close_files(&args);
         return res;
     }
 
-    if (args.log_steps != 0) {
-        fprintf(stderr, "%zu steps\n", steps);
+    if (args.tape_dir != NULL) {
+        res = tapedir_main(&args);
+        args_close_files(&args);
+        return res;
     }
 
-    res = mill_print_tape(args.output_file, &_Tape);
-    if (res != 0) {
+    if (args.explain != 0) {
+        struct MillCode code;
+        res = mill_compile(&_Program, &code);
+        if (res == 0) {
+            res = mill_explain(args.output_file, &code);
+            mill_code_free(&code);
+        }
+        args_close_files(&args);
+        return res;
+    }
+
+    if (args.serve != NULL) {
+        res = serve_main(&args, capture);
+        if (capture_close(capture) != 0) {
+            res = 1;
+        }
         args_close_files(&args);
         return res;
     }
 
+    enum MillPages pages;
+    struct MillTape* tape = mill_tape_alloc(args.huge_pages, &pages);
+    if (tape == NULL) {
+        perror("malloc");
+        args_close_files(&args);
+        return 1;
+    }
+
+    res = mill_read_tape(args.tape_file, tape);
+    wchar_t* input = NULL;
+    if (res == 0 && args.output_format == OutputFormat_delta) {
+        input = wcsdup(tape->buf);
+        if (input == NULL) {
+            perror("malloc");
+            res = 1;
+        }
+    }
+    size_t steps = 0;
+    if (res == 0) {
+        res = main_run(&args, &_Program, tape, pages, &steps);
+        if (res == 0 && args.log_steps != 0) {
+            fprintf(stderr, "%zu steps\n", steps);
+        }
+    }
+    if (res == 0) {
+        res = input != NULL ? main_print_delta(args.output_file, tape, input, steps)
+            : args.output_format == OutputFormat_rle ? main_print_rle(args.output_file, tape)
+            : mill_print_tape(args.output_file, tape);
+    }
+
+    free(input);
+    mill_tape_free(tape, pages);
     args_close_files(&args);
-    return 0;
+    return res;
 }
@@ -0,0 +1,1673 @@
+#ifndef MILL_H
+#define MILL_H
+
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
+#include <wctype.h>
+
+
+#define MILL_TAPE_SIZE 0x100000
+#define MILL_STATES_MAX 1024
+#define MILL_STATE_MAX 32
+#define MILL_INSTR_MAX 0x10000
+#define MILL_STEPS_MAX 1000000
+#define MILL_POLL_STEPS 4096
+#define MILL_HISTORY_SIZE 4096
+
+
+enum HeadMove {
+    HeadMove_none = 0,
+    HeadMove_left = 'L',
+    HeadMove_right = 'R',
+};
+
+
+struct MillInstr {
+    size_t state_in;
+    wchar_t char_in;
+    size_t state_out;
+    wchar_t char_out;
+    enum HeadMove move;
+};
+
+
+struct SymTable {
+    size_t size;
+    wchar_t* symbols[MILL_STATES_MAX + 1];
+    size_t datasize;
+    wchar_t symdata[MILL_STATES_MAX * (MILL_STATE_MAX + 1)];
+};
+
+
+struct MillProgram {
+    struct SymTable symtable;
+    size_t syminit;
+    size_t symhalt;
+    size_t instr_count;
+    struct MillInstr instructions[MILL_INSTR_MAX];
+};
+
+
+struct MillTape {
+    size_t size;
+    size_t pos;
+    wchar_t buf[MILL_TAPE_SIZE];
+    wchar_t _null;
+};
+
+
+// Flags below MILL_RUN_FEATURES are checked on every step and select a
+// specialised variant of the run loop.
+enum MillRunFlags {
+    MillRun_verbose = 1,
+    MillRun_count = 2,
+    MillRun_poll = 4,
+    MillRun_history = 8,
+    MillRun_quiet = 0x100,
+    MillRun_resume = 0x200,
+};
+
+#define MILL_RUN_FEATURES \
+    (MillRun_verbose | MillRun_count | MillRun_poll | MillRun_history)
+
+
+// Opens text as a readable stream. glibc memory streams do not support
+// wide orientation, so the text goes through a temporary file.
+static inline FILE*
+mill_open_text(const char* text, size_t size) {
+    FILE* fp = tmpfile();
+    if (fp == NULL) {
+        return NULL;
+    }
+    if (write(fileno(fp), text, size) != (ssize_t) size ||
+        lseek(fileno(fp), 0, SEEK_SET) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+
+static inline void
+parse_error(const char* fmt, ...) {
+    fputs("parse error: ", stderr);
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+
+static inline int
+parse_headmove(const wchar_t* text, enum HeadMove* head) {
+    size_t n = wcslen(text);
+    if (n != 1) {
+        parse_error("invalid move instruction %ls", text);
+        return 1;
+    }
+    wchar_t c = text[0];
+    switch ((enum HeadMove) c) {
+        case HeadMove_left:
+        case HeadMove_right:
+            *head = c;
+            return 0;
+        default:
+            parse_error("invalid move instruction %ls", text);
+            return 1;
+    }
+}
+
+
+static inline int
+symtable_insert(struct SymTable* symtable, wchar_t* symbol, size_t* sid) {
+    for (size_t i = 0; i < symtable->size; ++i) {
+        if (wcscmp(symtable->symbols[i], symbol) == 0) {
+            *sid = i;
+            return 0;
+        }
+    }
+    if (symtable->size >= MILL_STATES_MAX) {
+        parse_error("symbol table limit reached");
+        return -1;
+    }
+    size_t symsize = wcslen(symbol) + 1;
+    size_t symmax = sizeof(symtable->symdata) / sizeof(symtable->symdata[0]);
+    if (symtable->datasize + symsize > symmax) {
+        parse_error("symbols buffer exhausted");
+        return -1;
+    }
+    wchar_t* p = &symtable->symdata[symtable->datasize];
+    wcscpy(p, symbol);
+    *sid = symtable->size;
+    symtable->datasize += symsize;
+    symtable->symbols[symtable->size++] = p;
+    symtable->symbols[symtable->size] = NULL;
+    return 0;
+}
+
+
+static inline int
+mill_parse_instruction(FILE* file, struct SymTable* symtable,
+    struct MillInstr* instr) {
+    struct MillInstr data = {};
+    size_t tokmax = MILL_STATE_MAX;
+    wchar_t token[tokmax + 1];
+    size_t toksize = 0;
+    token[toksize] = L'\0';
+    size_t sid;
+    int state = 0;
+
+    for (; state < 100; ) {
+        wint_t c = fgetwc(file);
+        if (c == WEOF) {
+            break;
+        }
+
+        switch (state) {
+            case 0:
+                if (iswspace(c) == 0) {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    state = 1;
+                }
+                break;
+
+            case 1:
+                if (iswspace(c) != 0) {
+                    int res = symtable_insert(symtable, token, &sid);
+                    if (res != 0) { return -1; }
+                    toksize = 0;
+                    token[toksize] = L'\0';
+                    data.state_in = sid;
+                    state = 2;
+                }
+                else if (toksize >= tokmax) {
+                    parse_error("symbol is too long: %ls", token);
+                    return -1;
+                }
+                else {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    if (toksize == 2 && wcscmp(token, L"//") == 0) {
+                        toksize = 0;
+                        token[toksize] = L'\0';
+                        state = 20;
+                    }
+                }
+                break;
+
+            case 2:
+                if (iswspace(c) == 0) {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    state = 3;
+                }
+                break;
+
+            case 3:
+                if (iswspace(c) != 0) {
+                    data.char_in = token[0];
+                    if (data.char_in == L'_') {
+                        data.char_in = L'\0';
+                    }
+                    toksize = 0;
+                    token[toksize] = L'\0';
+                    state = 4;
+                }
+                else {
+                    parse_error("symbol is too long: %ls", token);
+                    return -1;
+                }
+                break;
+
+            case 4:
+                if (iswspace(c) == 0) {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    state = 5;
+                }
+                break;
+
+            case 5:
+                if (iswspace(c) != 0) {
+                    int res = symtable_insert(symtable, token, &sid);
+                    if (res != 0) { return -1; }
+                    toksize = 0;
+                    token[toksize] = L'\0';
+                    data.state_out = sid;
+                    state = 6;
+                }
+                else if (toksize >= tokmax) {
+                    parse_error("symbol is too long: %ls", token);
+                    return -1;
+                }
+                else {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                }
+                break;
+
+            case 6:
+                if (iswspace(c) == 0) {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    state = 7;
+                }
+                break;
+
+            case 7:
+                if (iswspace(c) != 0) {
+                    data.char_out = token[0];
+                    if (data.char_out == L'_') {
+                        data.char_out = L'\0';
+                    }
+                    toksize = 0;
+                    token[toksize] = L'\0';
+                    state = 8;
+                }
+                else {
+                    parse_error("symbol is too long: %ls", token);
+                    return -1;
+                }
+                break;
+
+            case 8:
+                if (iswspace(c) == 0) {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    state = 9;
+                }
+                break;
+
+            case 9:
+                if (iswspace(c) != 0) {
+                    int res = parse_headmove(token, &data.move);
+                    if (res != 0) { return -1; }
+                    toksize = 0;
+                    token[toksize] = L'\0';
+                    state = c == L'\n' ? 100 : 10;
+                }
+                else if (toksize >= tokmax) {
+                    parse_error("symbol is too long: %ls", token);
+                    return -1;
+                }
+                else {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    if (toksize >= 3 && token[toksize-2] == L'/' && token[toksize-1] == L'/') {
+                        toksize -= 2;
+                        token[toksize] = L'\0';
+                        int res = parse_headmove(token, &data.move);
+                        if (res != 0) { return -1; }
+                        state = 12;
+                    }
+                }
+                break;
+
+            case 10:
+                if (c == L'\n') {
+                    state = 100;
+                }
+                else if (c == L'/') {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    state = 11;
+                }
+                else if (iswspace(c) == 0) {
+                    parse_error("unexpected token: %lc", c);
+                    return -1;
+                }
+                break;
+
+            case 11:
+                if (c == L'/') {
+                    state = 12;
+                }
+                else {
+                    token[toksize++] = c;
+                    token[toksize] = L'\0';
+                    parse_error("unexpected token: %ls", token);
+                    return -1;
+                }
+                break;
+
+            case 12:
+                if (c == L'\n') {
+                    state = 100;
+                }
+                break;
+
+            case 20:
+                if (c == L'\n') {
+                    state = 0;
+                }
+                break;
+
+            default:
+                parse_error("invalid state %d", state);
+                return -1;
+        }
+    }
+
+    switch (state) {
+        case 0:
+        case 20:
+            return 0;
+        case 1 ... 8:
+            parse_error("expecting a token");
+            return -1;
+        case 9: {
+            int res = parse_headmove(token, &data.move);
+            if (res != 0) { return -1; }
+            *instr = data;
+            return 1;
+        }
+        case 11:
+            parse_error("unexpected token: %ls", token);
+            return -1;
+        case 10:
+        case 12:
+        case 100:
+            *instr = data;
+            return 1;
+    }
+    parse_error("invalid state %d", state);
+    return -1;
+}
+
+
+static inline int
+mill_parse_program(FILE* file, struct MillProgram* program) {
+    *program = (struct MillProgram) {};
+    int res;
+
+    res = symtable_insert(&program->symtable, L"INIT", &program->syminit);
+    if (res != 0) { return res; }
+
+    res = symtable_insert(&program->symtable, L"HALT", &program->symhalt);
+    if (res != 0) { return res; }
+
+    for (;;) {
+        struct MillInstr instr = {};
+        int n = mill_parse_instruction(file, &program->symtable, &instr);
+        if (n == 0) { break; }
+        if (n != 1) { return n; }
+
+        if (program->instr_count >= MILL_INSTR_MAX) {
+            parse_error("too many instructions");
+            return 1;
+        }
+
+        program->instructions[program->instr_count++] = instr;
+    }
+
+    return 0;
+}
+
+
+// Run-length tapes: a cell followed by {N} stands for N of that cell, so
+// |{1000000}_|{5} is a million strokes, a blank and five more. A brace
+// not between a cell and {N} is an ordinary cell, and printing writes a
+// brace cell as {{N} so that it reads back the same.
+#define MILL_RLE_MIN 5
+
+
+// Expands text[0, len) into out, of room for size cells and the
+// terminating null, and sets *n to its length. Returns nonzero if it
+// does not fit.
+static inline int
+mill_rle_decode(const wchar_t* text, size_t len, wchar_t* out, size_t size, size_t* n) {
+    size_t k = 0;
+    for (size_t i = 0; i < len;) {
+        wchar_t c = text[i++];
+        size_t count = 1;
+        if (i + 1 < len && text[i] == L'{' && iswdigit(text[i + 1])) {
+            size_t value = 0;
+            size_t j = i + 1;
+            for (; j < len && iswdigit(text[j]); ++j) {
+                value = value <= size ? value * 10 + (text[j] - L'0') : value;
+            }
+            if (j < len && text[j] == L'}') {
+                count = value;
+                i = j + 1;
+            }
+        }
+        if (count >= size - k) {
+            return 1;
+        }
+        wmemset(&out[k], c, count);
+        k += count;
+    }
+    out[k] = L'\0';
+    *n = k;
+    return 0;
+}
+
+
+static inline int
+mill_read_tape(FILE* file, struct MillTape* tape) {
+    wchar_t* res = fgetws(tape->buf, tape->size, file);
+    if (res == NULL) {
+        perror("fgets");
+        return 1;
+    }
+    if (wcschr(tape->buf, L'{') == NULL) {
+        return 0;
+    }
+    size_t len = wcslen(tape->buf);
+    wchar_t* text = wcsdup(tape->buf);
+    if (text == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    size_t n = 0;
+    int r = mill_rle_decode(text, len, tape->buf, tape->size, &n);
+    free(text);
+    if (r != 0) {
+        fprintf(stderr, "error: tape too long\n");
+        return 1;
+    }
+    if (n < len) {
+        wmemset(&tape->buf[n], L'\0', len - n);
+    }
+    return 0;
+}
+
+
+static inline size_t
+mill_tape_start(struct MillTape* tape) {
+    size_t pos = tape->pos;
+    for (size_t i = 0; i < tape->size; ++i) {
+        if (tape->buf[pos] == L'\0') {
+            break;
+        }
+        else {
+            pos = (pos - 1) % tape->size;
+        }
+    }
+    for (size_t i = 0; i < tape->size; ++i) {
+        if (tape->buf[pos] != L'\0') {
+            break;
+        }
+        else {
+            pos = (pos + 1) % tape->size;
+        }
+    }
+    return pos;
+}
+
+
+static inline int
+mill_print_tape(FILE* file, struct MillTape* tape) {
+    size_t start = mill_tape_start(tape);
+    int res = fputws(&tape->buf[start], file);
+    if (res < 0) {
+        perror("fputws");
+        return 1;
+    }
+    if (start > 0 && tape->buf[0] != L'\0') {
+        int res = fputws(&tape->buf[0], file);
+        if (res < 0) {
+            perror("fputws");
+            return 1;
+        }
+    }
+    wint_t r = fputwc(L'\n', file);
+    if (r == WEOF) {
+        perror("fputwc");
+        return 1;
+    }
+    return 0;
+}
+
+
+// Delta output: the output as the span [S, E) of cells it covers, counted
+// from the first input cell, and the runs of cells in it that differ
+// from the input, cells past the input being blank:
+//
+//     S E OFF:TEXT OFF:TEXT ...
+//
+// Runs a few unchanged cells apart are joined. A program cannot write
+// whitespace, so TEXT ends at the next space.
+#define MILL_DELTA_JOIN 4
+
+
+static inline int
+_print_cells(FILE* file, const wchar_t* cells, size_t n) {
+    char buf[MB_LEN_MAX];
+    mbstate_t mbs = {};
+    for (size_t i = 0; i < n; ++i) {
+        size_t k = wcrtomb(buf, cells[i], &mbs);
+        if (k == (size_t) -1 || fwrite(buf, 1, k, file) != k) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+// Writes cells[0, n) and a newline in run-length form, runs of at least
+// MILL_RLE_MIN cells as C{N}. Byte-oriented, like batch output.
+static inline int
+mill_print_rle(FILE* file, const wchar_t* cells, size_t n) {
+    for (size_t i = 0; i < n;) {
+        size_t k = 1;
+        while (i + k < n && cells[i + k] == cells[i]) {
+            k += 1;
+        }
+        if (k < MILL_RLE_MIN && cells[i] != L'{') {
+            k = 1;
+        }
+        int res = _print_cells(file, &cells[i], 1);
+        if (res == 0 && (k > 1 || cells[i] == L'{')) {
+            res = fprintf(file, "{%zu}", k) < 0;
+        }
+        if (res != 0) {
+            perror("fprintf");
+            return 1;
+        }
+        i += k;
+    }
+    if (fputc('\n', file) == EOF) {
+        perror("fputc");
+        return 1;
+    }
+    return 0;
+}
+
+
+// Byte-oriented, like batch output.
+static inline int
+mill_print_delta(FILE* file, const wchar_t* input, size_t len,
+    const wchar_t* output, size_t n, ptrdiff_t offset) {
+    if (fprintf(file, "%td %td", offset, offset + (ptrdiff_t) n) < 0) {
+        perror("fprintf");
+        return 1;
+    }
+    size_t i = 0;
+    while (i < n) {
+        ptrdiff_t c = offset + (ptrdiff_t) i;
+        if (c >= 0 && (size_t) c < len && input[c] == output[i]) {
+            i += 1;
+            continue;
+        }
+        size_t end = i + 1;
+        size_t last = i + 1;
+        for (; end < n && end - last <= MILL_DELTA_JOIN; ++end) {
+            c = offset + (ptrdiff_t) end;
+            if (c < 0 || (size_t) c >= len || input[c] != output[end]) {
+                last = end + 1;
+            }
+            else if (iswspace(output[end])) {
+                break;
+            }
+        }
+        if (fprintf(file, " %td:", offset + (ptrdiff_t) i) < 0 ||
+            _print_cells(file, &output[i], last - i) != 0) {
+            perror("fprintf");
+            return 1;
+        }
+        i = last;
+    }
+    if (fputc('\n', file) == EOF) {
+        perror("fputc");
+        return 1;
+    }
+    return 0;
+}
+
+
+// Rebuilds the output from the input and a delta line into output, of
+// room for size cells and the terminating null, and sets *n to its
+// length. Returns nonzero if the delta is malformed or does not fit.
+static inline int
+mill_delta_apply(const wchar_t* input, size_t len, const wchar_t* delta,
+    wchar_t* output, size_t size, size_t* n) {
+    wchar_t* end = NULL;
+    long long first = wcstoll(delta, &end, 10);
+    if (end == delta) { return 1; }
+    delta = end;
+    long long last = wcstoll(delta, &end, 10);
+    if (end == delta || last < first || (unsigned long long) (last - first) > size) {
+        return 1;
+    }
+    delta = end;
+
+    size_t count = last - first;
+    for (size_t i = 0; i < count; ++i) {
+        long long c = first + (long long) i;
+        output[i] = c >= 0 && (unsigned long long) c < len ? input[c] : L'\0';
+    }
+    while (*delta == L' ') {
+        long long off = wcstoll(delta + 1, &end, 10);
+        if (end == delta + 1 || *end != L':' || off < first) {
+            return 1;
+        }
+        delta = end + 1;
+        size_t i = off - first;
+        for (; *delta != L'\0' && !iswspace(*delta); ++delta, ++i) {
+            if (i >= count) { return 1; }
+            output[i] = *delta;
+        }
+    }
+    if (*delta != L'\0' && *delta != L'\n') {
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (output[i] == L'\0') { return 1; }
+    }
+    output[count] = L'\0';
+    *n = count;
+    return 0;
+}
+
+
+static inline size_t
+mill_tape_text(struct MillTape* tape, size_t start,
+    wchar_t* text, size_t textsize) {
+    size_t n = 0;
+    for (size_t i = start; i < tape->size && tape->buf[i] != L'\0'; ++i) {
+        if (n + 1 >= textsize) { break; }
+        text[n++] = tape->buf[i];
+    }
+    if (start > 0) {
+        for (size_t i = 0; i < tape->size && tape->buf[i] != L'\0'; ++i) {
+            if (n + 1 >= textsize) { break; }
+            text[n++] = tape->buf[i];
+        }
+    }
+    text[n] = L'\0';
+    return n;
+}
+
+
+static inline void
+mill_tape_load(struct MillTape* tape, const wchar_t* text, size_t len) {
+    wmemcpy(tape->buf, text, len);
+    tape->pos = 0;
+}
+
+
+static inline size_t
+_used_right(size_t len, size_t steps) {
+    return (len > steps + 1) ? len : steps + 1;
+}
+
+
+// Same as mill_tape_start, knowing that a run of `steps` over an input
+// of `len` cells could only write to [-steps, max(len, steps + 1)).
+static inline size_t
+mill_tape_start_used(struct MillTape* tape, size_t len, size_t steps) {
+    size_t right = _used_right(len, steps);
+    if (right >= tape->size || steps >= tape->size - right) {
+        return mill_tape_start(tape);
+    }
+
+    size_t pos = tape->pos;
+    while (tape->buf[pos] != L'\0') {
+        pos = (pos - 1) % tape->size;
+    }
+
+    if (pos < right) {
+        for (size_t i = pos; i < right; ++i) {
+            if (tape->buf[i] != L'\0') { return i; }
+        }
+        pos = tape->size - steps;
+    }
+    for (size_t i = pos; i < tape->size; ++i) {
+        if (tape->buf[i] != L'\0') { return i; }
+    }
+    for (size_t i = 0; i < right; ++i) {
+        if (tape->buf[i] != L'\0') { return i; }
+    }
+    return tape->pos;
+}
+
+
+// Where the text from start lies relative to the first input cell, for
+// a run of steps over len cells.
+static inline ptrdiff_t
+mill_tape_offset(const struct MillTape* tape, size_t start, size_t len, size_t steps) {
+    return start < _used_right(len, steps) ? (ptrdiff_t) start
+        : (ptrdiff_t) start - (ptrdiff_t) tape->size;
+}
+
+
+static inline void
+mill_tape_clear(struct MillTape* tape, size_t len, size_t steps) {
+    size_t right = _used_right(len, steps);
+    if (right >= tape->size || steps >= tape->size - right) {
+        wmemset(tape->buf, L'\0', tape->size);
+    }
+    else {
+        wmemset(tape->buf, L'\0', right);
+        wmemset(&tape->buf[tape->size - steps], L'\0', steps);
+    }
+    tape->pos = 0;
+}
+
+
+// Memory behind a tape or a transition table. A 4 MB tape spans a
+// thousand 4 KB pages, so a head that sweeps far keeps missing the TLB;
+// huge pages cover it with two entries.
+enum MillPages {
+    MillPages_heap,
+    MillPages_small,
+    MillPages_transparent,
+    MillPages_hugetlb,
+};
+
+#define MILL_HUGE_PAGE_SIZE ((size_t) 0x200000)
+
+
+static inline const char*
+mill_pages_name(enum MillPages pages) {
+    switch (pages) {
+        case MillPages_heap: return "heap";
+        case MillPages_small: return "4 KB pages";
+        case MillPages_transparent: return "transparent huge pages";
+        case MillPages_hugetlb: return "hugetlbfs";
+    }
+    return "?";
+}
+
+
+static inline size_t
+_huge_round(size_t size) {
+    return (size + MILL_HUGE_PAGE_SIZE - 1) & ~(MILL_HUGE_PAGE_SIZE - 1);
+}
+
+
+// Zeroed memory of at least size bytes. With huge set, tries a
+// MAP_HUGETLB mapping first, then a huge-page-aligned mapping advised
+// with MADV_HUGEPAGE; *pages records what was obtained, and is
+// MillPages_heap on failure so freeing the null result is safe.
+static inline void*
+mill_pages_alloc(size_t size, int huge, enum MillPages* pages) {
+    *pages = MillPages_heap;
+    if (huge == 0) {
+        return calloc(1, size);
+    }
+
+    size = _huge_round(size);
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        *pages = MillPages_hugetlb;
+        return p;
+    }
+
+    // Over-map by one huge page and trim, so the region starts on a
+    // huge page boundary where the kernel can back it with one.
+    uint8_t* raw = mmap(NULL, size + MILL_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    uint8_t* start = (uint8_t*) _huge_round((uintptr_t) raw);
+    if (start > raw) {
+        munmap(raw, start - raw);
+    }
+    if (start + size < raw + size + MILL_HUGE_PAGE_SIZE) {
+        munmap(start + size, raw + MILL_HUGE_PAGE_SIZE - start);
+    }
+    *pages = madvise(start, size, MADV_HUGEPAGE) == 0
+        ? MillPages_transparent : MillPages_small;
+    return start;
+}
+
+
+static inline void
+mill_pages_free(void* p, size_t size, enum MillPages pages) {
+    if (pages == MillPages_heap) {
+        free(p);
+    }
+    else if (p != NULL) {
+        munmap(p, _huge_round(size));
+    }
+}
+
+
+// Bytes of [p, p + size) the kernel currently backs with huge pages,
+// from /proc/self/smaps; 0 where that cannot be read.
+static inline size_t
+mill_pages_huge_bytes(const void* p, size_t size, enum MillPages pages) {
+    if (pages == MillPages_hugetlb) {
+        return _huge_round(size);
+    }
+    FILE* file = fopen("/proc/self/smaps", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    uintptr_t addr = (uintptr_t) p;
+    int inside = 0;
+    size_t res = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned long lo, hi;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+            inside = lo < addr + size && addr < hi;
+        }
+        else if (inside && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+            res += kb * 1024;
+        }
+    }
+    fclose(file);
+    return res;
+}
+
+
+static inline struct MillTape*
+mill_tape_alloc(int huge, enum MillPages* pages) {
+    struct MillTape* tape = mill_pages_alloc(sizeof(*tape), huge, pages);
+    if (tape != NULL) {
+        tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+    }
+    return tape;
+}
+
+
+static inline void
+mill_tape_free(struct MillTape* tape, enum MillPages pages) {
+    mill_pages_free(tape, sizeof(*tape), pages);
+}
+
+
+static inline int
+_dump_tape(FILE* file, struct MillTape* tape, int color) {
+    size_t bufsize = tape->size;
+    size_t half = bufsize / 2;
+    size_t pos = tape->pos;
+
+    size_t a = bufsize;
+    size_t b = bufsize;
+    size_t c = bufsize;
+    size_t d = bufsize;
+
+    wchar_t* p = &tape->buf[0];
+    for (size_t i = 0; i < half; ++i) {
+        if (*p++ != L'\0') {
+            if (i < a) {
+                a = i;
+            }
+            b = i;
+        }
+    }
+    wchar_t* q = &tape->buf[half];
+    for (size_t i = 0; i < half; ++i) {
+        if (*q++ != L'\0') {
+            size_t j = i + half;
+            if (j < c) {
+                c = j;
+            }
+            d = j;
+        }
+    }
+
+    if (a == bufsize && c == bufsize) {
+        return 0;
+    }
+
+    size_t start = (c != bufsize) ? c : a;
+    size_t end = (b != bufsize) ? b : d;
+    for (size_t i = 1; i < 100; ++i) {
+        if ((pos + i) % bufsize == start) {
+            start = pos;
+            break;
+        }
+    }
+    for (size_t i = 1; i < 100; ++i) {
+        if ((pos - i) % bufsize == end) {
+            end = pos;
+            break;
+        }
+    }
+    end = (end + 1) % bufsize;
+
+    for (size_t i = start; i != end; ) {
+        wchar_t c = tape->buf[i];
+        if (c == L'\0') {
+            c = L'_';
+        }
+        if (color != 0 && i == pos) {
+            fputs("\x1b[40;34m", file);
+            fprintf(file, "%lc", c);
+            fputs("\x1b[0m", file);
+        }
+        else {
+            fprintf(file, "%lc", c);
+        }
+        i = (i + 1) % bufsize;
+    }
+    return 0;
+}
+
+
+static inline int
+_dump_state(FILE* file, struct MillProgram* prog,
+    struct MillTape* tape, size_t state, size_t ts) {
+    int color = isatty(fileno(file));
+    fprintf(file, "%04zx: ", ts);
+    int res = _dump_tape(file, tape, color);
+    if (res != 0) { return res; }
+
+    wchar_t* s = prog->symtable.symbols[state];
+    if (color != 0) {
+        fputs("\x1b[35m", file);
+        res = fprintf(file, " %ls\n", s);
+        fputs("\x1b[0m", file);
+    }
+    else {
+        res = fprintf(file, " %ls\n", s);
+    }
+    if (res < 0) {
+        perror("fprintf");
+        return 1;
+    }
+    return 0;
+}
+
+
+#define MILL_CODE_DIRECT 0x100
+#define MILL_CODE_NONE 0xffff
+// A table of more than MILL_SPARSE_BYTES with fewer than one cell in
+// MILL_SPARSE_RATIO holding a rule is compiled into sparse rows instead.
+#define MILL_SPARSE_BYTES (1 << 20)
+#define MILL_SPARSE_RATIO 16
+
+
+struct MillOp {
+    uint16_t state;
+    int16_t move;
+    wchar_t write;
+};
+
+
+struct MillSparseOp {
+    uint16_t symbol;
+    struct MillOp op;
+};
+
+
+struct MillCode {
+    struct MillProgram* prog;
+    size_t syminit;
+    size_t symhalt;
+    size_t states;
+    size_t symbols;
+    uint16_t direct[MILL_CODE_DIRECT];
+    size_t wide_count;
+    wchar_t* wide;
+    uint16_t* wide_ids;
+    // The dense table, or NULL if the code has sparse rows: the rules of
+    // state s, sorted by symbol, are sparse[rows[s], rows[s + 1]).
+    struct MillOp* ops;
+    enum MillPages ops_pages;
+    uint32_t* rows;
+    struct MillSparseOp* sparse;
+};
+
+
+static const struct MillOp _mill_op_none = {.state = MILL_CODE_NONE};
+
+
+// The cell value a symbol id stands for; symbol 0 has none.
+static inline wchar_t
+mill_code_char(const struct MillCode* code, size_t symbol) {
+    if (symbol == 0) {
+        return L'\0';
+    }
+    for (size_t c = 0; c < MILL_CODE_DIRECT; ++c) {
+        if (code->direct[c] == symbol) {
+            return c;
+        }
+    }
+    for (size_t i = 0; i < code->wide_count; ++i) {
+        if (code->wide_ids[i] == symbol) {
+            return code->wide[i];
+        }
+    }
+    return L'\0';
+}
+
+
+static inline size_t
+mill_code_symbol(const struct MillCode* code, wchar_t c) {
+    if ((uint32_t) c < MILL_CODE_DIRECT) {
+        return code->direct[c];
+    }
+    size_t lo = 0;
+    size_t hi = code->wide_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (code->wide[mid] < c) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo < code->wide_count && code->wide[lo] == c) {
+        return code->wide_ids[lo];
+    }
+    return 0;
+}
+
+
+static inline const struct MillOp*
+mill_code_sparse_op(const struct MillCode* code, size_t state, size_t symbol) {
+    size_t lo = code->rows[state];
+    size_t hi = code->rows[state + 1];
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (code->sparse[mid].symbol < symbol) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    if (lo < code->rows[state + 1] && code->sparse[lo].symbol == symbol) {
+        return &code->sparse[lo].op;
+    }
+    return &_mill_op_none;
+}
+
+
+// The rule for state and symbol, whose state is MILL_CODE_NONE if there
+// is none.
+static inline const struct MillOp*
+mill_code_op(const struct MillCode* code, size_t state, size_t symbol) {
+    if (code->ops != NULL) {
+        return &code->ops[state * code->symbols + symbol];
+    }
+    return mill_code_sparse_op(code, state, symbol);
+}
+
+
+// Bytes the table takes, dense or sparse.
+static inline size_t
+mill_code_bytes(const struct MillCode* code) {
+    if (code->ops != NULL) {
+        return code->states * code->symbols * sizeof(struct MillOp);
+    }
+    return (code->states + 1) * sizeof(uint32_t)
+        + code->rows[code->states] * sizeof(struct MillSparseOp);
+}
+
+
+static inline int
+_compare_wchar(const void* a, const void* b) {
+    wchar_t x = *(const wchar_t*) a;
+    wchar_t y = *(const wchar_t*) b;
+    return (x > y) - (x < y);
+}
+
+
+static inline void
+mill_code_free(struct MillCode* code) {
+    if (code->ops != NULL) {
+        mill_pages_free(code->ops, code->states * code->symbols * sizeof(struct MillOp),
+            code->ops_pages);
+    }
+    free(code->sparse);
+    free(code->rows);
+    free(code->wide_ids);
+    free(code->wide);
+    *code = (struct MillCode) {};
+}
+
+
+// Builds sparse rows: each rule goes into its state's row in symbol
+// order unless an earlier rule holds the symbol, and the rows are then
+// packed together.
+static inline int
+_mill_compile_sparse(struct MillProgram* prog, struct MillCode* code) {
+    size_t states = code->states;
+    code->rows = calloc(states + 1, sizeof(uint32_t));
+    uint32_t* used = calloc(states, sizeof(uint32_t));
+    code->sparse = malloc((prog->instr_count + 1) * sizeof(struct MillSparseOp));
+    if (code->rows == NULL || used == NULL || code->sparse == NULL) {
+        perror("malloc");
+        free(used);
+        return 1;
+    }
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        code->rows[prog->instructions[i].state_in + 1] += 1;
+    }
+    for (size_t s = 0; s < states; ++s) {
+        code->rows[s + 1] += code->rows[s];
+    }
+
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        struct MillInstr* instr = &prog->instructions[i];
+        uint16_t symbol = mill_code_symbol(code, instr->char_in);
+        struct MillSparseOp* row = &code->sparse[code->rows[instr->state_in]];
+        size_t n = used[instr->state_in];
+        size_t k = 0;
+        while (k < n && row[k].symbol < symbol) {
+            ++k;
+        }
+        if (k < n && row[k].symbol == symbol) {
+            continue;
+        }
+        memmove(&row[k + 1], &row[k], (n - k) * sizeof(row[0]));
+        row[k] = (struct MillSparseOp) {
+            .symbol = symbol,
+            .op = {
+                .state = instr->state_out,
+                .move = instr->move == HeadMove_left ? -1 : 1,
+                .write = instr->char_out,
+            },
+        };
+        used[instr->state_in] = n + 1;
+    }
+
+    size_t n = 0;
+    for (size_t s = 0; s < states; ++s) {
+        size_t start = code->rows[s];
+        memmove(&code->sparse[n], &code->sparse[start], used[s] * sizeof(code->sparse[0]));
+        code->rows[s] = n;
+        n += used[s];
+    }
+    code->rows[states] = n;
+    free(used);
+    return 0;
+}
+
+
+// Compiles the program into a dense (state x symbol) table, or sparse
+// rows if that table would be large and mostly empty. Symbol 0 stands
+// for any character no rule reads; the first rule for a (state,
+// character) pair wins.
+static inline int
+mill_compile(struct MillProgram* prog, struct MillCode* code) {
+    *code = (struct MillCode) {
+        .prog = prog,
+        .syminit = prog->syminit,
+        .symhalt = prog->symhalt,
+        .states = prog->symtable.size,
+    };
+
+    size_t wide_cap = 0;
+    size_t symbols = 1;
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        wchar_t c = prog->instructions[i].char_in;
+        if ((uint32_t) c < MILL_CODE_DIRECT) {
+            if (code->direct[c] == 0) {
+                code->direct[c] = symbols++;
+            }
+            continue;
+        }
+        if (code->wide_count >= wide_cap) {
+            wide_cap = wide_cap != 0 ? wide_cap * 2 : 16;
+            void* p = realloc(code->wide, wide_cap * sizeof(wchar_t));
+            if (p == NULL) {
+                perror("malloc");
+                mill_code_free(code);
+                return 1;
+            }
+            code->wide = p;
+        }
+        code->wide[code->wide_count++] = c;
+    }
+
+    if (code->wide_count > 0) {
+        qsort(code->wide, code->wide_count, sizeof(wchar_t), _compare_wchar);
+        size_t n = 1;
+        for (size_t i = 1; i < code->wide_count; ++i) {
+            if (code->wide[i] != code->wide[n - 1]) {
+                code->wide[n++] = code->wide[i];
+            }
+        }
+        code->wide_count = n;
+        if (symbols + n > UINT16_MAX + 1) {
+            fprintf(stderr, "error: more than %d distinct characters read\n", UINT16_MAX);
+            mill_code_free(code);
+            return 1;
+        }
+        code->wide_ids = malloc(n * sizeof(uint16_t));
+        if (code->wide_ids == NULL) {
+            perror("malloc");
+            mill_code_free(code);
+            return 1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            code->wide_ids[i] = symbols++;
+        }
+    }
+    code->symbols = symbols;
+
+    size_t count = code->states * code->symbols;
+    if (count * sizeof(struct MillOp) > MILL_SPARSE_BYTES &&
+        prog->instr_count * MILL_SPARSE_RATIO < count) {
+        if (_mill_compile_sparse(prog, code) != 0) {
+            mill_code_free(code);
+            return 1;
+        }
+        return 0;
+    }
+    code->ops = malloc(count * sizeof(struct MillOp));
+    if (code->ops == NULL) {
+        perror("malloc");
+        mill_code_free(code);
+        return 1;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        code->ops[i] = (struct MillOp) {.state = MILL_CODE_NONE};
+    }
+
+    for (size_t i = 0; i < prog->instr_count; ++i) {
+        struct MillInstr* instr = &prog->instructions[i];
+        size_t sym = mill_code_symbol(code, instr->char_in);
+        struct MillOp* op = &code->ops[instr->state_in * code->symbols + sym];
+        if (op->state != MILL_CODE_NONE) {
+            continue;
+        }
+        *op = (struct MillOp) {
+            .state = instr->state_out,
+            .move = instr->move == HeadMove_left ? -1 : 1,
+            .write = instr->char_out,
+        };
+    }
+
+    return 0;
+}
+
+
+// Moves a dense table onto huge pages where the system has them; sparse
+// rows are small enough to stay where they are.
+static inline int
+mill_code_huge_pages(struct MillCode* code) {
+    if (code->ops == NULL) {
+        return 0;
+    }
+    size_t size = code->states * code->symbols * sizeof(struct MillOp);
+    enum MillPages pages;
+    struct MillOp* ops = mill_pages_alloc(size, 1, &pages);
+    if (ops == NULL) {
+        perror("mmap");
+        return 1;
+    }
+    memcpy(ops, code->ops, size);
+    mill_pages_free(code->ops, size, code->ops_pages);
+    code->ops = ops;
+    code->ops_pages = pages;
+    return 0;
+}
+
+
+// Optional per-run instrumentation, used according to the run flags.
+struct MillProbe {
+    size_t* counts;
+    struct timespec start;
+    struct timespec deadline;
+    size_t step_budget;
+    // Where a polled run stopped early, and where MillRun_resume starts.
+    size_t state;
+    size_t steps;
+    // The rule a counted or polled run found missing.
+    size_t unhandled_state;
+    wchar_t unhandled_char;
+    uint32_t history[MILL_HISTORY_SIZE];
+};
+
+
+// Set from a signal handler; a polling run reports its progress and
+// clears it.
+static volatile sig_atomic_t mill_progress_requested;
+
+
+static inline void
+mill_progress_signal(int sig) {
+    (void) sig;
+    mill_progress_requested = 1;
+}
+
+
+// Starts the probe clock, with a wall-clock limit unless ms is 0.
+static inline void
+mill_probe_start(struct MillProbe* probe, size_t ms) {
+    clock_gettime(CLOCK_MONOTONIC, &probe->start);
+    probe->deadline = (struct timespec) {};
+    probe->step_budget = 0;
+    if (ms != 0) {
+        probe->deadline.tv_sec = probe->start.tv_sec + ms / 1000;
+        probe->deadline.tv_nsec = probe->start.tv_nsec + (ms % 1000) * 1000000;
+        if (probe->deadline.tv_nsec >= 1000000000) {
+            probe->deadline.tv_sec += 1;
+            probe->deadline.tv_nsec -= 1000000000;
+        }
+    }
+}
+
+
+// Called every MILL_POLL_STEPS steps; returns nonzero once the deadline
+// has passed or the step budget, if any, is spent.
+static inline int
+_mill_poll(const struct MillCode* code, const struct MillProbe* probe,
+    size_t state, size_t pos, size_t t) {
+    if (probe->step_budget != 0 && t >= probe->step_budget) {
+        return 1;
+    }
+    int has_deadline = probe->deadline.tv_sec != 0 || probe->deadline.tv_nsec != 0;
+    if (mill_progress_requested == 0 && has_deadline == 0) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (mill_progress_requested != 0) {
+        mill_progress_requested = 0;
+        double elapsed = (now.tv_sec - probe->start.tv_sec)
+            + (now.tv_nsec - probe->start.tv_nsec) / 1e9;
+        fprintf(stderr, "progress: step %zu, state %ls, head %zu, %.0f steps/s\n",
+            t, code->prog->symtable.symbols[state], pos,
+            elapsed > 0 ? t / elapsed : 0.0);
+    }
+
+    return has_deadline != 0 &&
+        (now.tv_sec > probe->deadline.tv_sec ||
+         (now.tv_sec == probe->deadline.tv_sec && now.tv_nsec >= probe->deadline.tv_nsec));
+}
+
+
+// Loop body shared by all mill_exec variants. `features` is a constant
+// in every instantiation, so a variant carries only the per-step checks
+// of the features it was built for.
+static inline __attribute__((always_inline)) int
+_mill_exec(const struct MillCode* code, struct MillTape* tape,
+    size_t* steps, int flags, struct MillProbe* probe, const int features) {
+    int quiet = flags & MillRun_quiet;
+    size_t pos = tape->pos;
+    size_t state = code->syminit;
+    size_t halt = code->symhalt;
+    size_t mask = tape->size - 1;
+    size_t symbols = code->symbols;
+    const struct MillOp* ops = code->ops;
+    wchar_t* buf = tape->buf;
+
+    size_t t = 0;
+    if (flags & MillRun_resume) {
+        state = probe->state;
+        t = probe->steps;
+    }
+
+    size_t chunk = (features & MillRun_poll) ? MILL_POLL_STEPS : MILL_STEPS_MAX;
+    while (t < MILL_STEPS_MAX) {
+        size_t end = (MILL_STEPS_MAX - t > chunk) ? t + chunk : MILL_STEPS_MAX;
+        for (; t < end; ++t) {
+            wchar_t c = buf[pos];
+
+            if (features & MillRun_verbose) {
+                tape->pos = pos;
+                _dump_state(stderr, code->prog, tape, state, t);
+            }
+
+            size_t symbol = mill_code_symbol(code, c);
+            size_t index = state * symbols + symbol;
+            const struct MillOp* op = ops != NULL ? &ops[index]
+                : mill_code_sparse_op(code, state, symbol);
+            if (op->state == MILL_CODE_NONE) {
+                if (features & (MillRun_count | MillRun_poll)) {
+                    probe->unhandled_state = state;
+                    probe->unhandled_char = c;
+                }
+                wchar_t* s = code->prog->symtable.symbols[state];
+                if (c == L'\0') {
+                    c = L'_';
+                }
+                tape->pos = pos;
+                if (steps != NULL) {
+                    *steps = t + 1;
+                }
+                if (quiet == 0) {
+                    fprintf(stderr, "error: unhandled state %ls '%lc'\n", s, c);
+                }
+                return -1;
+            }
+
+            if (features & MillRun_count) {
+                probe->counts[index] += 1;
+            }
+            if (features & MillRun_history) {
+                probe->history[t % MILL_HISTORY_SIZE] = index;
+            }
+
+            buf[pos] = op->write;
+            state = op->state;
+            pos = (pos + op->move) & mask;
+            if (state == halt) {
+                tape->pos = pos;
+                if (steps != NULL) {
+                    *steps = t + 1;
+                }
+                if (features & MillRun_verbose) {
+                    _dump_state(stderr, code->prog, tape, state, t + 1);
+                }
+                return 0;
+            }
+        }
+
+        if ((features & MillRun_poll) && t < MILL_STEPS_MAX &&
+            _mill_poll(code, probe, state, pos, t) != 0) {
+            tape->pos = pos;
+            probe->state = state;
+            probe->steps = t;
+            if (steps != NULL) {
+                *steps = t;
+            }
+            // A spent step budget is the caller's to report.
+            if (quiet == 0 && (probe->step_budget == 0 || t < probe->step_budget)) {
+                fprintf(stderr, "deadline exceeded after %zu instructions\n", t);
+            }
+            return 1;
+        }
+    }
+
+    tape->pos = pos;
+    if (steps != NULL) {
+        *steps = MILL_STEPS_MAX;
+    }
+
+    if (features & MillRun_verbose) {
+        _dump_state(stderr, code->prog, tape, state, MILL_STEPS_MAX);
+    }
+
+    if (quiet == 0) {
+        fprintf(stderr, "timed out after %zu instructions\n", (size_t) MILL_STEPS_MAX);
+    }
+    return 1;
+}
+
+
+struct _HistoryRun {
+    size_t state;
+    size_t length;
+    long drift;
+};
+
+
+static inline void
+_report_snapshot(FILE* file, const struct MillTape* tape, size_t radius) {
+    fputs("  tape: ", file);
+    for (size_t i = 0; i < 2 * radius + 1; ++i) {
+        size_t pos = (tape->pos - radius + i) % tape->size;
+        wchar_t c = tape->buf[pos];
+        if (c == L'\0') {
+            c = L'_';
+        }
+        if (i == radius) {
+            fprintf(file, "[%lc]", c);
+        }
+        else {
+            fprintf(file, "%lc", c);
+        }
+    }
+    fprintf(file, " at %zu\n", tape->pos);
+}
+
+
+// Summarises the loop a run was stuck in when it hit its step limit,
+// from the transitions kept by MillRun_history: the repeating sequence
+// of states, its period and head drift, and how fast the head's range
+// grows.
+static inline void
+mill_timeout_report(FILE* file, const struct MillCode* code,
+    const struct MillTape* tape, const struct MillProbe* probe, size_t steps) {
+    size_t n = steps < MILL_HISTORY_SIZE ? steps : MILL_HISTORY_SIZE;
+    struct _HistoryRun* runs = malloc((n + 1) * sizeof(runs[0]));
+    if (n == 0 || runs == NULL) {
+        free(runs);
+        _report_snapshot(file, tape, 24);
+        return;
+    }
+
+    size_t m = 0;
+    long rel = 0;
+    long lo = 0;
+    long hi = 0;
+    size_t half_extent = 0;
+    for (size_t k = 0; k < n; ++k) {
+        uint32_t index = probe->history[(steps - n + k) % MILL_HISTORY_SIZE];
+        size_t state = index / code->symbols;
+        int move = mill_code_op(code, state, index % code->symbols)->move;
+        if (m == 0 || runs[m - 1].state != state) {
+            runs[m++] = (struct _HistoryRun) {.state = state};
+        }
+        runs[m - 1].length += 1;
+        runs[m - 1].drift += move;
+
+        rel += move;
+        lo = rel < lo ? rel : lo;
+        hi = rel > hi ? rel : hi;
+        if (k + 1 == n / 2) {
+            half_extent = hi - lo;
+        }
+    }
+    size_t extent = hi - lo;
+
+    // Smallest period q over the state runs; the first run may be cut
+    // off by the start of the window, so it is not compared.
+    size_t period = 0;
+    for (size_t q = 1; q + 1 < m && period == 0; ++q) {
+        size_t i = 1 + q;
+        while (i < m && runs[i].state == runs[i - q].state) {
+            ++i;
+        }
+        if (i == m) {
+            period = q;
+        }
+    }
+
+    // Averages are taken over whole cycles between the first and last
+    // runs, which the window may have cut short. A single state running
+    // for the whole window repeats every step.
+    size_t first = 1;
+    size_t last = m;
+    size_t cycles = 0;
+    if (m == 1) {
+        period = 1;
+        first = 0;
+        cycles = runs[0].length;
+    }
+    else if (period != 0) {
+        last = (m - 2 >= period) ? m - 1 : m;
+        cycles = (last - 1) / period;
+        first = last - cycles * period;
+    }
+
+    if (period == 0) {
+        fprintf(file, "  loop: no repeating state cycle in the last %zu steps\n", n);
+    }
+    else {
+        size_t length = 0;
+        long drift = 0;
+        for (size_t i = first; i < last; ++i) {
+            length += runs[i].length;
+            drift += runs[i].drift;
+        }
+
+        fputs("  loop:", file);
+        size_t shown = period < 8 ? period : 8;
+        for (size_t i = m - period; i < m - period + shown; ++i) {
+            fprintf(file, "%s %ls", i > m - period ? " ->" : "",
+                code->prog->symtable.symbols[runs[i].state]);
+        }
+        if (shown < period) {
+            fputs(" ...", file);
+        }
+        fprintf(file, ", period ~%.1f steps, head drift %+.1f per period\n",
+            (double) length / cycles, (double) drift / cycles);
+    }
+
+    size_t tail = n - n / 2;
+    fprintf(file, "  span: %zu cells in the last %zu steps, growing %.1f cells per 1000 steps\n",
+        extent + 1, n, (extent - half_extent) * 1000.0 / tail);
+    _report_snapshot(file, tape, 24);
+    free(runs);
+}
+
+
+typedef int (*mill_exec_fn)(const struct MillCode* code, struct MillTape* tape,
+    size_t* steps, int flags, struct MillProbe* probe);
+
+
+// One mill_exec variant per combination of per-step features, named by
+// its feature mask.
+#define MILL_EXEC_VARIANTS(X) \
+    X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7) \
+    X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15)
+
+_Static_assert(MILL_RUN_FEATURES == 15, "MILL_EXEC_VARIANTS must cover every feature mask");
+
+
+#define X(features) \
+    static int \
+    _mill_exec_##features(const struct MillCode* code, struct MillTape* tape, \
+        size_t* steps, int flags, struct MillProbe* probe) { \
+        return _mill_exec(code, tape, steps, flags, probe, features); \
+    }
+MILL_EXEC_VARIANTS(X)
+#undef X
+
+
+static const mill_exec_fn _mill_exec_variants[MILL_RUN_FEATURES + 1] = {
+#define X(features) [features] = _mill_exec_##features,
+    MILL_EXEC_VARIANTS(X)
+#undef X
+};
+
+
+// Picks the loop variant for the flags; callers running many tapes
+// select once and call the result directly.
+static inline mill_exec_fn
+mill_exec_select(int flags) {
+    return _mill_exec_variants[flags & MILL_RUN_FEATURES];
+}
+
+
+// Runs compiled code without a probe, reporting errors and timeouts
+// to stderr unless MillRun_quiet is set.
+static inline int
+mill_exec(const struct MillCode* code, struct MillTape* tape,
+    size_t* steps, int flags) {
+    flags &= MillRun_verbose | MillRun_quiet;
+    return mill_exec_select(flags)(code, tape, steps, flags, NULL);
+}
+
+
+#endif
@@ -0,0 +1,365 @@
+// Header-only C++17 Logic Mill engine.
+//
+// Rules known at compile time become a constexpr transition table:
+//
+//     constexpr mill::Rule<char> rules[] = {
+//         {"INIT", '|', "FIND", '|', mill::Move::right},
+//         {"FIND", '|', "FIND", '|', mill::Move::right},
+//         {"FIND", '_', "HALT", '|', mill::Move::right},
+//     };
+//     static constexpr auto table = mill::compile<char, 4>(rules);
+//
+//     mill::Tape<char> tape("|||");
+//     auto res = mill::run<table>(tape);     // dispatch folded at compile time
+//
+// mill::Machine holds a table by value for tables built at run time.
+// Semantics follow mill.h: the tape is a ring of TAPE_SIZE cells, the run
+// starts at the first input cell in state INIT, and '_' in a rule is the
+// blank. Input cells are kept as given, so an input '_' is a symbol of
+// its own that no rule reads, as with the mill tool.
+
+#ifndef MILL_HPP
+#define MILL_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+
+namespace mill {
+
+inline constexpr std::size_t TAPE_SIZE = 0x100000;
+inline constexpr std::size_t STEPS_MAX = 1000000;
+
+
+enum class Move : std::int8_t {
+    left = -1,
+    right = 1,
+};
+
+
+enum class Status : int {
+    halted = 0,
+    error = -1,
+    timeout = 1,
+};
+
+
+template <class CellT>
+struct Rule {
+    std::string_view state_in;
+    CellT cell_in;
+    std::string_view state_out;
+    CellT cell_out;
+    Move move;
+};
+
+
+struct Result {
+    Status status;
+    std::size_t steps;
+    std::size_t state;
+};
+
+
+template <class CellT>
+struct Op {
+    static constexpr std::uint16_t none = 0xffff;
+
+    std::uint16_t state;
+    std::int8_t move;
+    CellT write;
+};
+
+
+namespace detail {
+
+template <class CellT>
+constexpr CellT blank(CellT c) {
+    return c == CellT('_') ? CellT{} : c;
+}
+
+template <class CellT>
+inline constexpr bool direct_cells = sizeof(CellT) == 1;
+
+}  // namespace detail
+
+
+// Dense (state x symbol) table. Single-byte cells index the table
+// directly; wider cells map through a small sorted alphabet, with
+// symbol 0 standing for any cell no rule reads.
+template <class CellT, std::size_t MaxStates, std::size_t MaxSymbols = 16>
+struct Table {
+    static_assert(std::is_integral_v<CellT>, "cells must be integral");
+    static_assert(MaxStates >= 2 && MaxStates < Op<CellT>::none, "MaxStates out of range");
+
+    static constexpr std::size_t symbol_slots =
+        detail::direct_cells<CellT> ? 256 : MaxSymbols + 1;
+
+    std::size_t states = 0;
+    std::size_t symbols = 0;
+    std::size_t init = 0;
+    std::size_t halt = 1;
+    std::array<std::string_view, MaxStates> names{};
+    std::array<CellT, MaxSymbols> alphabet{};
+    std::array<Op<CellT>, MaxStates * symbol_slots> ops{};
+
+    constexpr std::size_t symbol(CellT c) const {
+        if constexpr (detail::direct_cells<CellT>) {
+            return static_cast<unsigned char>(c);
+        }
+        else {
+            std::size_t lo = 0;
+            std::size_t hi = symbols;
+            while (lo < hi) {
+                std::size_t mid = (lo + hi) / 2;
+                if (alphabet[mid] < c) {
+                    lo = mid + 1;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+            return (lo < symbols && alphabet[lo] == c) ? lo + 1 : 0;
+        }
+    }
+
+    constexpr const Op<CellT>& op(std::size_t state, CellT c) const {
+        return ops[state * symbol_slots + symbol(c)];
+    }
+
+    constexpr std::size_t intern(std::string_view name) {
+        for (std::size_t i = 0; i < states; ++i) {
+            if (names[i] == name) {
+                return i;
+            }
+        }
+        if (states >= MaxStates) {
+            throw std::length_error("mill: too many states");
+        }
+        names[states] = name;
+        return states++;
+    }
+
+    constexpr void add_symbol(CellT c) {
+        if constexpr (!detail::direct_cells<CellT>) {
+            std::size_t i = 0;
+            while (i < symbols && alphabet[i] < c) {
+                ++i;
+            }
+            if (i < symbols && alphabet[i] == c) {
+                return;
+            }
+            if (symbols >= MaxSymbols) {
+                throw std::length_error("mill: too many symbols");
+            }
+            for (std::size_t j = symbols; j > i; --j) {
+                alphabet[j] = alphabet[j - 1];
+            }
+            alphabet[i] = c;
+            ++symbols;
+        }
+    }
+};
+
+
+// Builds the table for a rule array; the first rule for a (state, cell)
+// pair wins. Usable in constant expressions, where overflowing MaxStates
+// or MaxSymbols is a compile error.
+template <class CellT, std::size_t MaxStates, std::size_t MaxSymbols = 16, std::size_t N>
+constexpr Table<CellT, MaxStates, MaxSymbols>
+compile(const Rule<CellT> (&rules)[N]) {
+    Table<CellT, MaxStates, MaxSymbols> table{};
+    // Filled here rather than by member initializers, which GCC 12 loses
+    // when the same table is also evaluated at compile time.
+    for (auto& op : table.ops) {
+        op = Op<CellT>{Op<CellT>::none, 0, CellT{}};
+    }
+    table.init = table.intern("INIT");
+    table.halt = table.intern("HALT");
+
+    for (const auto& rule : rules) {
+        table.add_symbol(detail::blank(rule.cell_in));
+    }
+    for (const auto& rule : rules) {
+        std::size_t in = table.intern(rule.state_in);
+        std::size_t out = table.intern(rule.state_out);
+        std::size_t sym = table.symbol(detail::blank(rule.cell_in));
+        auto& op = table.ops[in * table.symbol_slots + sym];
+        if (op.state != Op<CellT>::none) {
+            continue;
+        }
+        op.state = static_cast<std::uint16_t>(out);
+        op.move = static_cast<std::int8_t>(rule.move);
+        op.write = detail::blank(rule.cell_out);
+    }
+    return table;
+}
+
+
+// Owns a ring of TAPE_SIZE cells and clears what a run touched when
+// reloaded, so one tape can serve many runs.
+template <class CellT>
+class Tape {
+public:
+    using string_type = std::basic_string<CellT>;
+
+    Tape() : cells_(new CellT[TAPE_SIZE]()) {}
+
+    explicit Tape(std::basic_string_view<CellT> input) : Tape() {
+        load(input);
+    }
+
+    Tape(const Tape&) = delete;
+    Tape& operator=(const Tape&) = delete;
+    Tape(Tape&&) noexcept = default;
+    Tape& operator=(Tape&&) noexcept = default;
+
+    void load(std::basic_string_view<CellT> input) {
+        if (input.size() >= TAPE_SIZE) {
+            throw std::length_error("mill: tape is too long");
+        }
+        clear();
+        for (std::size_t i = 0; i < input.size(); ++i) {
+            cells_[i] = input[i];
+        }
+        len_ = input.size();
+    }
+
+    void clear() {
+        std::size_t right = (len_ > steps_ + 1) ? len_ : steps_ + 1;
+        if (right >= TAPE_SIZE || steps_ >= TAPE_SIZE - right) {
+            std::fill(cells_.get(), cells_.get() + TAPE_SIZE, CellT{});
+        }
+        else {
+            std::fill(cells_.get(), cells_.get() + right, CellT{});
+            std::fill(cells_.get() + TAPE_SIZE - steps_, cells_.get() + TAPE_SIZE, CellT{});
+        }
+        len_ = 0;
+        steps_ = 0;
+        pos_ = 0;
+    }
+
+    // The output word, as printed by the mill tool.
+    string_type text() const {
+        std::size_t pos = pos_;
+        for (std::size_t i = 0; i < TAPE_SIZE && cells_[pos] != CellT{}; ++i) {
+            pos = (pos - 1) & mask;
+        }
+        for (std::size_t i = 0; i < TAPE_SIZE && cells_[pos] == CellT{}; ++i) {
+            pos = (pos + 1) & mask;
+        }
+        string_type res;
+        for (std::size_t i = pos; i < TAPE_SIZE && cells_[i] != CellT{}; ++i) {
+            res.push_back(cells_[i]);
+        }
+        if (pos > 0) {
+            for (std::size_t i = 0; i < TAPE_SIZE && cells_[i] != CellT{}; ++i) {
+                res.push_back(cells_[i]);
+            }
+        }
+        return res;
+    }
+
+    std::size_t pos() const { return pos_; }
+    CellT* data() { return cells_.get(); }
+    const CellT* data() const { return cells_.get(); }
+
+    // Records where a run left the head and adds the steps it took to
+    // those since load(): a run picks up where the last one left the
+    // head, so together they bound the cells the next clear() resets.
+    void finish(std::size_t pos, std::size_t steps) {
+        pos_ = pos;
+        steps_ = steps < TAPE_SIZE - steps_ ? steps_ + steps : TAPE_SIZE;
+    }
+
+    static constexpr std::size_t mask = TAPE_SIZE - 1;
+
+private:
+    std::unique_ptr<CellT[]> cells_;
+    std::size_t pos_ = 0;
+    std::size_t len_ = 0;
+    std::size_t steps_ = 0;
+};
+
+
+template <class CellT, std::size_t MaxStates, std::size_t MaxSymbols>
+Result run(const Table<CellT, MaxStates, MaxSymbols>& table, Tape<CellT>& tape,
+    std::size_t max_steps = STEPS_MAX) {
+    CellT* cells = tape.data();
+    std::size_t pos = tape.pos();
+    std::size_t state = table.init;
+    Result res{Status::timeout, max_steps, state};
+
+    for (std::size_t t = 0; t < max_steps; ++t) {
+        const auto& op = table.op(state, cells[pos]);
+        if (op.state == Op<CellT>::none) {
+            res = Result{Status::error, t + 1, state};
+            break;
+        }
+        cells[pos] = op.write;
+        state = op.state;
+        pos = (pos + op.move) & Tape<CellT>::mask;
+        if (state == table.halt) {
+            res = Result{Status::halted, t + 1, state};
+            break;
+        }
+    }
+
+    if (res.status == Status::timeout) {
+        res.state = state;
+    }
+    tape.finish(pos, res.steps);
+    return res;
+}
+
+
+// Runs a table with static storage duration, letting the compiler see
+// every transition.
+template <const auto& table, class CellT>
+Result run(Tape<CellT>& tape, std::size_t max_steps = STEPS_MAX) {
+    return run(table, tape, max_steps);
+}
+
+
+template <class CellT, std::size_t MaxStates, std::size_t MaxSymbols = 16>
+class Machine {
+public:
+    using table_type = Table<CellT, MaxStates, MaxSymbols>;
+
+    constexpr explicit Machine(const table_type& table) : table_(table) {}
+
+    template <std::size_t N>
+    constexpr explicit Machine(const Rule<CellT> (&rules)[N])
+        : table_(compile<CellT, MaxStates, MaxSymbols>(rules)) {}
+
+    Result run(Tape<CellT>& tape, std::size_t max_steps = STEPS_MAX) const {
+        return mill::run(table_, tape, max_steps);
+    }
+
+    std::basic_string<CellT> operator()(std::basic_string_view<CellT> input) const {
+        Tape<CellT> tape(input);
+        Result res = run(tape);
+        if (res.status != Status::halted) {
+            throw std::runtime_error(res.status == Status::error
+                ? "mill: unhandled state" : "mill: timed out");
+        }
+        return tape.text();
+    }
+
+    constexpr const table_type& table() const { return table_; }
+
+private:
+    table_type table_;
+};
+
+}  // namespace mill
+
+
+#endif
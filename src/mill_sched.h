@@ -0,0 +1,434 @@
+// Cooperative scheduler: many machines share one thread and one working
+// tape, each running a slice of steps at a time.
+
+#ifndef MILL_SCHED_H
+#define MILL_SCHED_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wchar.h>
+
+#include "mill.h"
+
+
+// Machines start at level 0 and drop a level after every turn, so a run
+// of a few slices finishes ahead of any long one; a turn at level L runs
+// slice << L steps. Every SCHED_BOOST turns all machines go back to level
+// 0, so a stream of short runs cannot starve a long one.
+#define SCHED_LEVELS 4
+#define SCHED_BOOST 64
+
+
+// A live machine between turns. Its tape is kept as the arc
+// [lo, lo + size) of the ring, spanning the head and every cell it has
+// written; cells outside it are blank. The arc is cells[off, off + size),
+// with room to grow on both sides.
+struct SchedMachine {
+    const struct MillCode* code;
+    void* owner;
+    size_t tag;
+    size_t len;
+    size_t state;
+    size_t steps;
+    size_t pos;
+    size_t lo;
+    size_t size;
+    size_t off;
+    size_t cap;
+    wchar_t* cells;
+    struct timespec added;
+    struct timespec deadline;
+    unsigned level;
+    struct SchedMachine* next;
+};
+
+
+// What a machine came to. status is that of mill_exec, with 1 and fewer
+// than MILL_STEPS_MAX steps meaning the deadline passed, and -2 for a
+// machine dropped by sched_drop. output is set only for halted runs,
+// offset being where it starts relative to the first input cell, and
+// elapsed_ns is the time since sched_add.
+struct SchedResult {
+    int status;
+    size_t steps;
+    const wchar_t* output;
+    size_t output_len;
+    ptrdiff_t offset;
+    uint64_t elapsed_ns;
+};
+
+
+// Called once per machine.
+typedef void (*sched_done_fn)(void* arg, void* owner, size_t tag,
+    const struct MillCode* code, const struct SchedResult* result);
+
+
+struct Sched {
+    struct MillTape* tape;
+    enum MillPages tape_pages;
+    struct MillProbe* probe;
+    wchar_t* output;
+    size_t slice;
+    sched_done_fn done;
+    void* done_arg;
+    size_t live;
+    size_t turns;
+    struct SchedMachine* head[SCHED_LEVELS];
+    struct SchedMachine* tail[SCHED_LEVELS];
+};
+
+
+static const int _sched_flags = MillRun_quiet | MillRun_poll | MillRun_resume;
+
+
+// slice is rounded up to whole poll intervals, the granularity at which
+// a run can stop.
+static inline int
+sched_init(struct Sched* sched, size_t slice, int huge_pages,
+    sched_done_fn done, void* done_arg) {
+    size_t max = MILL_TAPE_SIZE / 2 >> SCHED_LEVELS;
+    slice = (slice + MILL_POLL_STEPS - 1) / MILL_POLL_STEPS * MILL_POLL_STEPS;
+    if (slice == 0) {
+        slice = MILL_POLL_STEPS;
+    }
+    *sched = (struct Sched) {
+        .slice = slice < max ? slice : max,
+        .done = done,
+        .done_arg = done_arg,
+    };
+    sched->tape = mill_tape_alloc(huge_pages, &sched->tape_pages);
+    sched->probe = malloc(sizeof(*sched->probe));
+    sched->output = malloc((MILL_TAPE_SIZE + 1) * sizeof(wchar_t));
+    if (sched->tape == NULL || sched->probe == NULL || sched->output == NULL) {
+        perror("malloc");
+        mill_tape_free(sched->tape, sched->tape_pages);
+        free(sched->probe);
+        free(sched->output);
+        return 1;
+    }
+    *sched->probe = (struct MillProbe) {};
+    return 0;
+}
+
+
+static inline void
+_sched_push(struct Sched* sched, struct SchedMachine* m) {
+    m->next = NULL;
+    if (sched->tail[m->level] != NULL) {
+        sched->tail[m->level]->next = m;
+    }
+    else {
+        sched->head[m->level] = m;
+    }
+    sched->tail[m->level] = m;
+}
+
+
+// Moves every machine to the back of level 0, keeping their order.
+static inline void
+_sched_boost(struct Sched* sched) {
+    for (unsigned level = 1; level < SCHED_LEVELS; ++level) {
+        struct SchedMachine* m = sched->head[level];
+        if (m == NULL) {
+            continue;
+        }
+        for (struct SchedMachine* n = m; n != NULL; n = n->next) {
+            n->level = 0;
+        }
+        if (sched->tail[0] != NULL) {
+            sched->tail[0]->next = m;
+        }
+        else {
+            sched->head[0] = m;
+        }
+        sched->tail[0] = sched->tail[level];
+        sched->head[level] = NULL;
+        sched->tail[level] = NULL;
+    }
+}
+
+
+static inline struct SchedMachine*
+_sched_pop(struct Sched* sched) {
+    for (unsigned level = 0; level < SCHED_LEVELS; ++level) {
+        struct SchedMachine* m = sched->head[level];
+        if (m != NULL) {
+            sched->head[level] = m->next;
+            if (sched->head[level] == NULL) {
+                sched->tail[level] = NULL;
+            }
+            return m;
+        }
+    }
+    return NULL;
+}
+
+
+static inline void
+_sched_finish(struct Sched* sched, struct SchedMachine* m, struct SchedResult* result) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    result->steps = m->steps;
+    result->elapsed_ns = (now.tv_sec - m->added.tv_sec) * 1000000000ull +
+        now.tv_nsec - m->added.tv_nsec;
+    sched->done(sched->done_arg, m->owner, m->tag, m->code, result);
+    sched->live -= 1;
+    free(m->cells);
+    free(m);
+}
+
+
+static inline int
+sched_add(struct Sched* sched, const struct MillCode* code,
+    const wchar_t* input, size_t len, size_t deadline_ms, void* owner, size_t tag) {
+    struct SchedMachine* m = malloc(sizeof(*m));
+    size_t size = len > 0 ? len : 1;
+    wchar_t* cells = calloc(size, sizeof(wchar_t));
+    if (m == NULL || cells == NULL) {
+        perror("malloc");
+        free(m);
+        free(cells);
+        return 1;
+    }
+    wmemcpy(cells, input, len);
+
+    *m = (struct SchedMachine) {
+        .code = code,
+        .owner = owner,
+        .tag = tag,
+        .len = len,
+        .state = code->syminit,
+        .size = size,
+        .cap = size,
+        .cells = cells,
+    };
+    clock_gettime(CLOCK_MONOTONIC, &m->added);
+    if (deadline_ms != 0) {
+        m->deadline = m->added;
+        m->deadline.tv_sec += deadline_ms / 1000;
+        m->deadline.tv_nsec += (deadline_ms % 1000) * 1000000;
+        if (m->deadline.tv_nsec >= 1000000000) {
+            m->deadline.tv_sec += 1;
+            m->deadline.tv_nsec -= 1000000000;
+        }
+    }
+    _sched_push(sched, m);
+    sched->live += 1;
+    return 0;
+}
+
+
+// Grows the arc by left cells before it and right cells after it. An arc
+// over half the ring becomes the whole ring, which keeps the offsets
+// _sched_load and _sched_save compute unambiguous.
+static inline int
+_sched_grow(struct SchedMachine* m, size_t ring, size_t left, size_t right) {
+    size_t size = m->size + left + right;
+    if (size >= ring / 2) {
+        wchar_t* cells = calloc(ring, sizeof(wchar_t));
+        if (cells == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        for (size_t i = 0; i < m->size; ++i) {
+            cells[(m->lo + i) & (ring - 1)] = m->cells[m->off + i];
+        }
+        free(m->cells);
+        m->cells = cells;
+        m->lo = 0;
+        m->size = ring;
+        m->off = 0;
+        m->cap = ring;
+        return 0;
+    }
+
+    if (left > m->off || m->off + m->size + right > m->cap) {
+        size_t cap = 2 * size;
+        size_t off = (cap - size) / 2 + left;
+        wchar_t* cells = calloc(cap, sizeof(wchar_t));
+        if (cells == NULL) {
+            perror("malloc");
+            return 1;
+        }
+        wmemcpy(&cells[off], &m->cells[m->off], m->size);
+        free(m->cells);
+        m->cells = cells;
+        m->cap = cap;
+        m->off = off;
+    }
+    m->off -= left;
+    wmemset(&m->cells[m->off], L'\0', left);
+    wmemset(&m->cells[m->off + left + m->size], L'\0', right);
+    m->lo = (m->lo - left) & (ring - 1);
+    m->size = size;
+    return 0;
+}
+
+
+// Copies the arc's cells within reach of the head onto the blank working
+// tape.
+static inline void
+_sched_load(const struct SchedMachine* m, struct MillTape* tape, size_t reach) {
+    size_t mask = tape->size - 1;
+    size_t head = (m->pos - m->lo) & mask;
+    for (size_t i = 0; i <= 2 * reach; ++i) {
+        size_t d = (head + i - reach) & mask;
+        if (d < m->size) {
+            tape->buf[(m->pos + i - reach) & mask] = m->cells[m->off + d];
+        }
+    }
+}
+
+
+// Copies the cells within reach of where the turn started back into the
+// arc, grown to span what the turn wrote and the new head, and blanks
+// them on the working tape.
+static inline int
+_sched_save(struct SchedMachine* m, struct MillTape* tape, size_t reach) {
+    size_t mask = tape->size - 1;
+    size_t from = (m->pos - reach) & mask;
+    size_t first = reach;
+    size_t last = reach;
+    size_t head = (tape->pos - from) & mask;
+    for (size_t i = 0; i <= 2 * reach; ++i) {
+        if (tape->buf[(from + i) & mask] != L'\0') {
+            first = i < first ? i : first;
+            last = i > last ? i : last;
+        }
+    }
+    first = head < first ? head : first;
+    last = head > last ? head : last;
+
+    size_t d = (m->pos - m->lo) & mask;
+    if (m->size < tape->size) {
+        size_t left = reach - first > d ? reach - first - d : 0;
+        size_t right = last - reach > m->size - 1 - d ? last - reach - (m->size - 1 - d) : 0;
+        if ((left != 0 || right != 0) && _sched_grow(m, tape->size, left, right) != 0) {
+            return 1;
+        }
+        d = (m->pos - m->lo) & mask;
+    }
+
+    for (size_t i = 0; i <= 2 * reach; ++i) {
+        wchar_t* cell = &tape->buf[(from + i) & mask];
+        size_t k = (d + i - reach) & mask;
+        if (k < m->size) {
+            m->cells[m->off + k] = *cell;
+        }
+        *cell = L'\0';
+    }
+    m->pos = tape->pos;
+    return 0;
+}
+
+
+static inline int
+_sched_expired(const struct SchedMachine* m) {
+    if (m->deadline.tv_sec == 0 && m->deadline.tv_nsec == 0) {
+        return 0;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec > m->deadline.tv_sec ||
+        (now.tv_sec == m->deadline.tv_sec && now.tv_nsec >= m->deadline.tv_nsec);
+}
+
+
+// Gives the next machine one turn. Returns 0 when no machine is left.
+static inline int
+sched_turn(struct Sched* sched) {
+    if (++sched->turns % SCHED_BOOST == 0) {
+        _sched_boost(sched);
+    }
+    struct SchedMachine* m = _sched_pop(sched);
+    if (m == NULL) {
+        return 0;
+    }
+    if (_sched_expired(m)) {
+        _sched_finish(sched, m, &(struct SchedResult) {.status = 1});
+        return 1;
+    }
+
+    struct MillTape* tape = sched->tape;
+    struct MillProbe* probe = sched->probe;
+    size_t reach = sched->slice << m->level;
+    _sched_load(m, tape, reach);
+
+    size_t steps = 0;
+    tape->pos = m->pos;
+    probe->state = m->state;
+    probe->steps = m->steps;
+    probe->step_budget = m->steps + reach;
+    int res = mill_exec_select(_sched_flags)(m->code, tape, &steps, _sched_flags, probe);
+    m->steps = steps;
+
+    if (res == 1 && steps < MILL_STEPS_MAX) {
+        if (_sched_save(m, tape, reach) != 0) {
+            _sched_finish(sched, m, &(struct SchedResult) {.status = -1});
+            return 1;
+        }
+        m->state = probe->state;
+        if (m->level + 1 < SCHED_LEVELS) {
+            m->level += 1;
+        }
+        _sched_push(sched, m);
+        return 1;
+    }
+
+    // Finished: lay the whole arc out on the tape to read the output.
+    size_t mask = tape->size - 1;
+    for (size_t i = 0; i < m->size; ++i) {
+        size_t r = (m->lo + i) & mask;
+        size_t d = (r - m->pos + reach) & mask;
+        if (d > 2 * reach) {
+            tape->buf[r] = m->cells[m->off + i];
+        }
+    }
+    m->pos = tape->pos;
+    struct SchedResult result = {.status = res};
+    if (res == 0) {
+        size_t start = mill_tape_start_used(tape, m->len, steps);
+        result.output = sched->output;
+        result.output_len = mill_tape_text(tape, start, sched->output, MILL_TAPE_SIZE + 1);
+        result.offset = mill_tape_offset(tape, start, m->len, steps);
+    }
+    mill_tape_clear(tape, m->len, steps);
+    _sched_finish(sched, m, &result);
+    return 1;
+}
+
+
+// Finishes every machine of owner with status -2.
+static inline void
+sched_drop(struct Sched* sched, void* owner) {
+    for (unsigned level = 0; level < SCHED_LEVELS; ++level) {
+        struct SchedMachine* m = sched->head[level];
+        sched->head[level] = NULL;
+        sched->tail[level] = NULL;
+        while (m != NULL) {
+            struct SchedMachine* next = m->next;
+            if (owner == NULL || m->owner == owner) {
+                _sched_finish(sched, m, &(struct SchedResult) {.status = -2});
+            }
+            else {
+                _sched_push(sched, m);
+            }
+            m = next;
+        }
+    }
+}
+
+
+static inline void
+sched_free(struct Sched* sched) {
+    sched_drop(sched, NULL);
+    mill_tape_free(sched->tape, sched->tape_pages);
+    free(sched->probe);
+    free(sched->output);
+}
+
+
+#endif
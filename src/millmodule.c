@@ -0,0 +1,509 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "mill.h"
+
+
+// A compiled program. run_batch holds a reference while it runs without
+// the GIL, so reinitialising the object from another thread cannot free
+// the table under it. Counted under the GIL.
+struct ProgramCode {
+    size_t refs;
+    struct MillProgram prog;
+    struct MillCode code;
+};
+
+
+typedef struct {
+    PyObject_HEAD
+    struct ProgramCode* compiled;
+    struct MillTape* tape;
+} ProgramObject;
+
+
+// Tape source that stays valid without the GIL: the data of a str or
+// bytes object, kept alive by the caller.
+struct TapeSource {
+    int kind;
+    const void* data;
+    Py_ssize_t len;
+};
+
+
+struct TapeResult {
+    int status;
+    size_t steps;
+    wchar_t* output;
+    size_t output_len;
+    int owned;
+};
+
+
+static PyObject* MillError;
+
+
+static struct MillTape*
+_tape_alloc(void) {
+    struct MillTape* tape = calloc(1, sizeof(*tape));
+    if (tape != NULL) {
+        tape->size = sizeof(tape->buf) / sizeof(tape->buf[0]);
+    }
+    return tape;
+}
+
+
+static int
+_source_from_object(PyObject* obj, struct TapeSource* src) {
+    if (PyUnicode_Check(obj)) {
+        if (PyUnicode_READY(obj) != 0) {
+            return -1;
+        }
+        src->kind = PyUnicode_KIND(obj);
+        src->data = PyUnicode_DATA(obj);
+        src->len = PyUnicode_GET_LENGTH(obj);
+    }
+    else if (PyBytes_Check(obj)) {
+        src->kind = 0;
+        src->data = PyBytes_AS_STRING(obj);
+        src->len = PyBytes_GET_SIZE(obj);
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "tape must be str or bytes, not %.100s",
+            Py_TYPE(obj)->tp_name);
+        return -1;
+    }
+    if ((size_t) src->len >= MILL_TAPE_SIZE) {
+        PyErr_SetString(PyExc_ValueError, "tape is too long");
+        return -1;
+    }
+    return 0;
+}
+
+
+// Decodes the source straight into the tape, returning the number of
+// cells, or -1 on malformed UTF-8.
+static Py_ssize_t
+_tape_load_source(struct MillTape* tape, const struct TapeSource* src) {
+    wchar_t* buf = tape->buf;
+    tape->pos = 0;
+
+    switch (src->kind) {
+        case PyUnicode_1BYTE_KIND: {
+            const Py_UCS1* p = src->data;
+            for (Py_ssize_t i = 0; i < src->len; ++i) {
+                buf[i] = p[i];
+            }
+            return src->len;
+        }
+        case PyUnicode_2BYTE_KIND: {
+            const Py_UCS2* p = src->data;
+            for (Py_ssize_t i = 0; i < src->len; ++i) {
+                buf[i] = p[i];
+            }
+            return src->len;
+        }
+        case PyUnicode_4BYTE_KIND:
+            if (sizeof(wchar_t) == sizeof(Py_UCS4)) {
+                memcpy(buf, src->data, src->len * sizeof(wchar_t));
+            }
+            else {
+                const Py_UCS4* p = src->data;
+                for (Py_ssize_t i = 0; i < src->len; ++i) {
+                    buf[i] = p[i];
+                }
+            }
+            return src->len;
+    }
+
+    const unsigned char* p = src->data;
+    const unsigned char* end = p + src->len;
+    Py_ssize_t n = 0;
+    while (p < end) {
+        uint32_t c = *p++;
+        int extra = 0;
+        if (c >= 0xf0) { c &= 0x07; extra = 3; }
+        else if (c >= 0xe0) { c &= 0x0f; extra = 2; }
+        else if (c >= 0xc0) { c &= 0x1f; extra = 1; }
+        else if (c >= 0x80) { return -1; }
+        if (end - p < extra) {
+            return -1;
+        }
+        for (; extra > 0; --extra) {
+            if ((*p & 0xc0) != 0x80) {
+                return -1;
+            }
+            c = (c << 6) | (*p++ & 0x3f);
+        }
+        buf[n++] = c;
+    }
+    return n;
+}
+
+
+// Runs one tape without touching Python objects; the output is copied
+// out of the tape only when the result word wraps around its end.
+static void
+_run_source(const struct MillCode* code, struct MillTape* tape,
+    const struct TapeSource* src, struct TapeResult* result, int copy) {
+    *result = (struct TapeResult) {.status = -1};
+
+    Py_ssize_t len = _tape_load_source(tape, src);
+    if (len < 0) {
+        result->status = -2;
+        wmemset(tape->buf, L'\0', src->len);
+        return;
+    }
+
+    result->status = mill_exec(code, tape, &result->steps, MillRun_quiet);
+    size_t start = mill_tape_start_used(tape, len, result->steps);
+    size_t n = 0;
+    while (start + n < tape->size && tape->buf[start + n] != L'\0') {
+        ++n;
+    }
+    int wraps = start > 0 && tape->buf[0] != L'\0';
+    if (copy != 0 || wraps != 0) {
+        size_t outsize = wraps != 0 ? tape->size + 1 : n + 1;
+        result->output = malloc(outsize * sizeof(wchar_t));
+        if (result->output != NULL) {
+            result->output_len = mill_tape_text(tape, start, result->output, outsize);
+            result->owned = 1;
+        }
+    }
+    else {
+        result->output = &tape->buf[start];
+        result->output_len = n;
+    }
+}
+
+
+static PyObject*
+_result_tuple(const struct TapeResult* result) {
+    if (result->status == -2) {
+        PyErr_SetString(PyExc_ValueError, "tape is not valid UTF-8");
+        return NULL;
+    }
+    if (result->output == NULL) {
+        return PyErr_NoMemory();
+    }
+    PyObject* output = PyUnicode_FromWideChar(result->output, result->output_len);
+    if (output == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("(inN)", result->status, (Py_ssize_t) result->steps, output);
+}
+
+
+static void
+_program_code_release(struct ProgramCode* compiled) {
+    if (compiled != NULL && --compiled->refs == 0) {
+        mill_code_free(&compiled->code);
+        free(compiled);
+    }
+}
+
+
+static void
+Program_dealloc(ProgramObject* self) {
+    _program_code_release(self->compiled);
+    free(self->tape);
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+
+static int
+Program_init(ProgramObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"text", NULL};
+    const char* text = NULL;
+    Py_ssize_t size = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#", kwlist, &text, &size)) {
+        return -1;
+    }
+
+    if (self->tape == NULL) {
+        self->tape = _tape_alloc();
+        if (self->tape == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    _program_code_release(self->compiled);
+    self->compiled = NULL;
+
+    struct ProgramCode* compiled = calloc(1, sizeof(*compiled));
+    if (compiled == NULL) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    compiled->refs = 1;
+    FILE* file = mill_open_text(text, size);
+    if (file == NULL) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        free(compiled);
+        return -1;
+    }
+    int res = mill_parse_program(file, &compiled->prog);
+    fclose(file);
+    if (res != 0) {
+        PyErr_SetString(MillError, "parse error");
+        free(compiled);
+        return -1;
+    }
+
+    res = mill_compile(&compiled->prog, &compiled->code);
+    if (res != 0) {
+        PyErr_NoMemory();
+        free(compiled);
+        return -1;
+    }
+    self->compiled = compiled;
+    return 0;
+}
+
+
+static int
+_program_ready(ProgramObject* self) {
+    if (self->compiled == NULL) {
+        PyErr_SetString(MillError, "program is not compiled");
+        return -1;
+    }
+    return 0;
+}
+
+
+PyDoc_STRVAR(Program_run_doc,
+"run(tape) -> (status, steps, output)\n"
+"\n"
+"Runs the program on a str or bytes tape. status is HALTED, ERROR\n"
+"or TIMEOUT.");
+
+static PyObject*
+Program_run(ProgramObject* self, PyObject* tape) {
+    if (_program_ready(self) != 0) { return NULL; }
+
+    struct TapeSource src;
+    if (_source_from_object(tape, &src) != 0) { return NULL; }
+
+    struct TapeResult result;
+    _run_source(&self->compiled->code, self->tape, &src, &result, 0);
+    PyObject* res = _result_tuple(&result);
+    if (result.owned != 0) {
+        free(result.output);
+    }
+    if (result.status != -2) {
+        mill_tape_clear(self->tape, src.len, result.steps);
+    }
+    return res;
+}
+
+
+struct BatchContext {
+    const struct MillCode* code;
+    const struct TapeSource* sources;
+    struct TapeResult* results;
+    size_t count;
+    atomic_size_t next;
+};
+
+
+static void*
+_batch_worker(void* arg) {
+    struct BatchContext* ctx = arg;
+    struct MillTape* tape = _tape_alloc();
+    if (tape == NULL) {
+        return NULL;
+    }
+
+    for (;;) {
+        size_t i = atomic_fetch_add(&ctx->next, 1);
+        if (i >= ctx->count) {
+            break;
+        }
+        _run_source(ctx->code, tape, &ctx->sources[i], &ctx->results[i], 1);
+        if (ctx->results[i].status != -2) {
+            mill_tape_clear(tape, ctx->sources[i].len, ctx->results[i].steps);
+        }
+    }
+
+    free(tape);
+    return NULL;
+}
+
+
+PyDoc_STRVAR(Program_run_batch_doc,
+"run_batch(tapes, jobs=0) -> list of (status, steps, output)\n"
+"\n"
+"Runs the program on every tape with the GIL released, spread over\n"
+"jobs threads (0 for one per CPU).");
+
+static PyObject*
+Program_run_batch(ProgramObject* self, PyObject* args, PyObject* kwds) {
+    static char* kwlist[] = {"tapes", "jobs", NULL};
+    PyObject* tapes = NULL;
+    Py_ssize_t jobs = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|n", kwlist, &tapes, &jobs)) {
+        return NULL;
+    }
+    if (_program_ready(self) != 0) { return NULL; }
+
+    // The tapes are read without the GIL, so they go into a tuple that
+    // keeps each alive and that other threads cannot change meanwhile.
+    PyObject* fast = PySequence_Fast(tapes, "tapes must be a sequence");
+    if (fast == NULL) { return NULL; }
+    PyObject* seq = PySequence_Tuple(fast);
+    Py_DECREF(fast);
+    if (seq == NULL) { return NULL; }
+
+    size_t count = PySequence_Fast_GET_SIZE(seq);
+    PyObject** items = PySequence_Fast_ITEMS(seq);
+    struct TapeSource* sources = PyMem_Calloc(count + 1, sizeof(sources[0]));
+    struct TapeResult* results = PyMem_Calloc(count + 1, sizeof(results[0]));
+    PyObject* list = NULL;
+    if (sources == NULL || results == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (_source_from_object(items[i], &sources[i]) != 0) {
+            goto done;
+        }
+    }
+
+    if (jobs <= 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = n > 0 ? n : 1;
+    }
+    if ((size_t) jobs > count) {
+        jobs = count;
+    }
+
+    struct ProgramCode* compiled = self->compiled;
+    compiled->refs += 1;
+    struct BatchContext ctx = {
+        .code = &compiled->code,
+        .sources = sources,
+        .results = results,
+        .count = count,
+    };
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_t threads[jobs > 0 ? jobs : 1];
+    Py_ssize_t started = 0;
+    for (; started < jobs; ++started) {
+        if (pthread_create(&threads[started], NULL, _batch_worker, &ctx) != 0) {
+            break;
+        }
+    }
+    if (started == 0) {
+        _batch_worker(&ctx);
+    }
+    for (Py_ssize_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    Py_END_ALLOW_THREADS
+    _program_code_release(compiled);
+
+    list = PyList_New(count);
+    if (list == NULL) { goto done; }
+    for (size_t i = 0; i < count; ++i) {
+        PyObject* item = _result_tuple(&results[i]);
+        if (item == NULL) {
+            Py_CLEAR(list);
+            goto done;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+
+done:
+    if (results != NULL) {
+        for (size_t i = 0; i < count; ++i) {
+            free(results[i].output);
+        }
+    }
+    PyMem_Free(results);
+    PyMem_Free(sources);
+    Py_DECREF(seq);
+    return list;
+}
+
+
+PyDoc_STRVAR(Program_stats_doc,
+"stats() -> dict\n"
+"\n"
+"Sizes of the parsed program and its compiled table.");
+
+static PyObject*
+Program_stats(ProgramObject* self, PyObject* Py_UNUSED(ignored)) {
+    if (_program_ready(self) != 0) { return NULL; }
+    const struct MillCode* code = &self->compiled->code;
+    return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n}",
+        "states", (Py_ssize_t) code->states,
+        "rules", (Py_ssize_t) self->compiled->prog.instr_count,
+        "symbols", (Py_ssize_t) code->symbols - 1,
+        "table_bytes", (Py_ssize_t) mill_code_bytes(code),
+        "steps_max", (Py_ssize_t) MILL_STEPS_MAX);
+}
+
+
+static PyMethodDef Program_methods[] = {
+    {"run", (PyCFunction) Program_run, METH_O, Program_run_doc},
+    {"run_batch", (PyCFunction) (void (*)(void)) Program_run_batch,
+        METH_VARARGS | METH_KEYWORDS, Program_run_batch_doc},
+    {"stats", (PyCFunction) Program_stats, METH_NOARGS, Program_stats_doc},
+    {NULL},
+};
+
+
+PyDoc_STRVAR(Program_doc,
+"Program(text)\n"
+"\n"
+"Logic Mill program, parsed and compiled once.");
+
+static PyTypeObject ProgramType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "mill.Program",
+    .tp_doc = Program_doc,
+    .tp_basicsize = sizeof(ProgramObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc) Program_init,
+    .tp_dealloc = (destructor) Program_dealloc,
+    .tp_methods = Program_methods,
+};
+
+
+static struct PyModuleDef millmodule = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "mill",
+    .m_doc = "Logic Mill engine https://mng.quest/",
+    .m_size = -1,
+};
+
+
+PyMODINIT_FUNC
+PyInit_mill(void) {
+    if (PyType_Ready(&ProgramType) < 0) {
+        return NULL;
+    }
+
+    PyObject* m = PyModule_Create(&millmodule);
+    if (m == NULL) {
+        return NULL;
+    }
+
+    MillError = PyErr_NewException("mill.MillError", NULL, NULL);
+    Py_INCREF(MillError);
+    Py_INCREF(&ProgramType);
+    if (PyModule_AddObject(m, "MillError", MillError) < 0 ||
+        PyModule_AddObject(m, "Program", (PyObject*) &ProgramType) < 0 ||
+        PyModule_AddIntConstant(m, "HALTED", 0) < 0 ||
+        PyModule_AddIntConstant(m, "ERROR", -1) < 0 ||
+        PyModule_AddIntConstant(m, "TIMEOUT", 1) < 0 ||
+        PyModule_AddIntConstant(m, "TAPE_SIZE", MILL_TAPE_SIZE) < 0 ||
+        PyModule_AddIntConstant(m, "STEPS_MAX", MILL_STEPS_MAX) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
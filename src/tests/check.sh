@@ -0,0 +1,53 @@
+#!/bin/sh
+# Runs fixed programs and tapes through the built tools and compares what
+# they print with tests/NAME.expected, one tests/*.test script per
+# feature. Run from src, as make check does.
+
+export LC_ALL=C.UTF-8
+t=tests
+out=$(mktemp -d) || exit 1
+trap 'rm -rf "$out"' EXIT
+failed=0
+
+
+# same NAME EXPECTED ACTUAL
+same() {
+    if diff -u "$2" "$3" > "$out/$1.diff"; then
+        echo "ok $1"
+    else
+        echo "FAIL $1"
+        cat "$out/$1.diff"
+        failed=1
+    fi
+}
+
+
+# Compares $out/NAME with $t/NAME.expected.
+check() {
+    same "$1" "$t/$1.expected" "$out/$1"
+}
+
+
+# run NAME COMMAND...: records the command's output, then its errors and
+# exit status, in $out/NAME, keeping the output alone in $out/NAME.out.
+run() {
+    name=$1
+    shift
+    "$@" > "$out/$name.out" 2> "$out/$name.err"
+    status=$?
+    {
+        cat "$out/$name.out"
+        echo "-- stderr"
+        cat "$out/$name.err"
+        echo "-- status $status"
+    } > "$out/$name"
+    check "$name"
+}
+
+
+# Each NAME.test adds its cases, sourced in turn with these helpers.
+for case in $t/*.test; do
+    . "$case"
+done
+
+exit $failed
@@ -0,0 +1,425 @@
+// Prefix-sharing runs over an input family. Inputs that agree on their
+// first d cells run alike until the head first reads cell d, so the
+// machine runs once per node of the family's trie rather than once per
+// input. A sentinel that no rule reads or writes stands on the first
+// cell the family leaves open; a run that reaches it stops unhandled and
+// is forked into one copy for each cell the family allows there. A run
+// that ends without reaching it ends the same way for every input under
+// that prefix.
+
+#ifndef TRIE_H
+#define TRIE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#include "grade.h"
+#include "mill.h"
+
+
+// Called for every input, as a terminated string, with the outcome of its run and the tape as the
+// run left it. probe holds the run's recent history when that history is
+// the input's own, and is NULL otherwise. Returns nonzero to stop.
+typedef int (*trie_leaf_fn)(void* arg, const wchar_t* input, size_t len,
+    int status, size_t steps, struct MillTape* tape, const struct MillProbe* probe);
+
+
+static const int _trie_flags =
+    MillRun_quiet | MillRun_poll | MillRun_history | MillRun_resume;
+
+
+// A prefix handed to one worker: the inputs below it, or only the input
+// itself when complete is set.
+struct TrieItem {
+    wchar_t* prefix;
+    size_t len;
+    int complete;
+};
+
+
+struct Trie {
+    const struct MillCode* code;
+    mill_exec_fn exec;
+    const struct GradeSpec* spec;
+    trie_leaf_fn leaf;
+    void* arg;
+
+    struct MillTape* tape;
+    struct MillProbe probe;
+    wchar_t sentinel;
+    // The cells fixed so far, and the choices left at each depth while a
+    // finished run is spread over its subtree.
+    wchar_t* input;
+    wchar_t (*next)[3];
+    unsigned char* next_count;
+    unsigned char* next_at;
+    // The tape is blank outside [-dirty_steps, dirty_right).
+    size_t dirty_steps;
+    size_t dirty_right;
+    // Where the last run started, to tell whether its history is its own.
+    size_t from;
+    int stop;
+    int broken;
+
+    size_t runs;
+    size_t forks;
+    size_t steps;
+};
+
+
+// The tape where the machine first read an open cell: the head, and the
+// cells it could have touched by then.
+struct TrieSnapshot {
+    size_t pos;
+    size_t left;
+    size_t right;
+    wchar_t* cells;
+};
+
+
+// A character no rule reads or writes, or L'\0' if every candidate is
+// taken.
+static inline wchar_t
+trie_sentinel(const struct MillProgram* prog) {
+    for (wchar_t c = 1; c < 0xD800; ++c) {
+        int used = 0;
+        for (size_t i = 0; i < prog->instr_count && used == 0; ++i) {
+            used = prog->instructions[i].char_in == c ||
+                prog->instructions[i].char_out == c;
+        }
+        if (used == 0) {
+            return c;
+        }
+    }
+    return L'\0';
+}
+
+
+// Cells past d stay as the family left them only while the head cannot
+// reach them from the far side of the ring.
+static inline int
+trie_fits(const struct GradeSpec* spec) {
+    return grade_max_len(spec) < MILL_TAPE_SIZE - MILL_STEPS_MAX;
+}
+
+
+static inline int
+trie_init(struct Trie* trie, const struct MillCode* code,
+    const struct GradeSpec* spec, trie_leaf_fn leaf, void* arg) {
+    size_t depth = grade_max_len(spec) + 2;
+    *trie = (struct Trie) {
+        .code = code,
+        .exec = mill_exec_select(_trie_flags),
+        .spec = spec,
+        .leaf = leaf,
+        .arg = arg,
+        .sentinel = trie_sentinel(code->prog),
+        .tape = calloc(1, sizeof(struct MillTape)),
+        .input = malloc(depth * sizeof(wchar_t)),
+        .next = malloc(depth * sizeof(trie->next[0])),
+        .next_count = malloc(depth),
+        .next_at = malloc(depth),
+    };
+    if (trie->tape == NULL || trie->input == NULL || trie->next == NULL ||
+        trie->next_count == NULL || trie->next_at == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    trie->tape->size = sizeof(trie->tape->buf) / sizeof(trie->tape->buf[0]);
+    mill_probe_start(&trie->probe, 0);
+    return 0;
+}
+
+
+static inline void
+trie_free(struct Trie* trie) {
+    free(trie->next_at);
+    free(trie->next_count);
+    free(trie->next);
+    free(trie->input);
+    free(trie->tape);
+}
+
+
+static inline int
+trie_run(struct Trie* trie, size_t state, size_t from, size_t right, size_t* steps) {
+    trie->probe.state = state;
+    trie->probe.steps = from;
+    trie->from = from;
+    int res = trie->exec(trie->code, trie->tape, steps, _trie_flags, &trie->probe);
+    trie->runs += 1;
+    trie->steps += *steps - from;
+
+    right = _used_right(right, *steps);
+    if (right > trie->dirty_right) {
+        trie->dirty_right = right;
+    }
+    if (*steps > trie->dirty_steps) {
+        trie->dirty_steps = *steps;
+    }
+    return res;
+}
+
+
+static inline const struct MillProbe*
+trie_history(const struct Trie* trie, size_t steps) {
+    return (trie->from == 0 || steps - trie->from >= MILL_HISTORY_SIZE)
+        ? &trie->probe : NULL;
+}
+
+
+// Reports one finished run for every input below the prefix
+// input[0, d), filling in the cells it never read.
+static inline void
+trie_spread(struct Trie* trie, size_t d, int status, size_t steps) {
+    const struct MillProbe* probe = trie_history(trie, steps);
+    wchar_t* buf = trie->tape->buf;
+    size_t top = d;
+    trie->next_count[top] = grade_next(trie->spec, trie->input, top, trie->next[top]);
+    trie->next_at[top] = 0;
+
+    for (;;) {
+        if (trie->next_at[top] == trie->next_count[top]) {
+            if (top == d) {
+                break;
+            }
+            buf[--top] = L'\0';
+            continue;
+        }
+        wchar_t c = trie->next[top][trie->next_at[top]++];
+        if (c == L'\0') {
+            trie->input[top] = L'\0';
+            if (trie->leaf(trie->arg, trie->input, top, status, steps, trie->tape, probe) != 0) {
+                trie->stop = 1;
+                wmemset(&buf[d], L'\0', top - d);
+                break;
+            }
+            continue;
+        }
+        trie->input[top] = c;
+        buf[top++] = c;
+        trie->next_count[top] = grade_next(trie->spec, trie->input, top, trie->next[top]);
+        trie->next_at[top] = 0;
+    }
+}
+
+
+// Runs the input input[0, len) to the end, from a machine that has not
+// yet read cell len.
+static inline void
+trie_finish(struct Trie* trie, size_t len, size_t state, size_t from) {
+    size_t steps = 0;
+    int res = trie_run(trie, state, from, len, &steps);
+    trie->input[len] = L'\0';
+    if (trie->leaf(trie->arg, trie->input, len, res, steps, trie->tape,
+        trie_history(trie, steps)) != 0) {
+        trie->stop = 1;
+    }
+}
+
+
+static inline int
+trie_save(struct Trie* trie, struct TrieSnapshot* snap, size_t d, size_t steps) {
+    size_t size = trie->tape->size;
+    size_t right = d + 1;
+    size_t left = steps < size - right ? steps : size - right;
+    *snap = (struct TrieSnapshot) {
+        .pos = trie->tape->pos,
+        .left = left,
+        .right = right,
+        .cells = malloc((left + right) * sizeof(wchar_t)),
+    };
+    if (snap->cells == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    wmemcpy(snap->cells, &trie->tape->buf[size - left], left);
+    wmemcpy(&snap->cells[left], trie->tape->buf, right);
+    return 0;
+}
+
+
+static inline void
+trie_restore(struct Trie* trie, const struct TrieSnapshot* snap) {
+    struct MillTape* tape = trie->tape;
+    mill_tape_clear(tape, trie->dirty_right, trie->dirty_steps);
+    wmemcpy(&tape->buf[tape->size - snap->left], snap->cells, snap->left);
+    wmemcpy(tape->buf, &snap->cells[snap->left], snap->right);
+    tape->pos = snap->pos;
+    trie->dirty_steps = snap->left;
+    trie->dirty_right = snap->right;
+}
+
+
+// Runs every input below the prefix input[0, d), from a machine in
+// state that has taken `from` steps without reading cell d. Each fork
+// but the last recurses; the last continues in place, so a family that
+// only ever grows in one direction needs no stack.
+static inline void
+trie_descend(struct Trie* trie, size_t d, size_t state, size_t from) {
+    wchar_t* buf = trie->tape->buf;
+    for (;;) {
+        wchar_t next[3];
+        size_t n = grade_next(trie->spec, trie->input, d, next);
+        while (n == 1 && next[0] != L'\0') {
+            trie->input[d] = buf[d] = next[0];
+            d += 1;
+            n = grade_next(trie->spec, trie->input, d, next);
+        }
+        if (n == 1) {
+            trie_finish(trie, d, state, from);
+            return;
+        }
+
+        buf[d] = trie->sentinel;
+        size_t steps = 0;
+        int res = trie_run(trie, state, from, d + 1, &steps);
+        if (res != -1 || trie->tape->pos != d ||
+            trie->probe.unhandled_char != trie->sentinel) {
+            buf[d] = L'\0';
+            trie_spread(trie, d, res, steps);
+            return;
+        }
+
+        trie->forks += 1;
+        state = trie->probe.unhandled_state;
+        from = steps - 1;
+        struct TrieSnapshot snap;
+        if (trie_save(trie, &snap, d, from) != 0) {
+            trie->stop = 1;
+            trie->broken = 1;
+            return;
+        }
+        for (size_t i = 0; i + 1 < n && trie->stop == 0; ++i) {
+            if (i > 0) {
+                trie_restore(trie, &snap);
+            }
+            trie->input[d] = buf[d] = next[i];
+            if (next[i] == L'\0') {
+                trie_finish(trie, d, state, from);
+            }
+            else {
+                trie_descend(trie, d + 1, state, from);
+            }
+        }
+        if (trie->stop == 0) {
+            trie_restore(trie, &snap);
+        }
+        free(snap.cells);
+        if (trie->stop != 0) {
+            return;
+        }
+        trie->input[d] = buf[d] = next[n - 1];
+        d += 1;
+    }
+}
+
+
+// Runs every input the item stands for, leaving the tape blank.
+static inline void
+trie_run_item(struct Trie* trie, const struct TrieItem* item) {
+    wmemcpy(trie->input, item->prefix, item->len);
+    mill_tape_load(trie->tape, item->prefix, item->len);
+    trie->dirty_steps = 0;
+    trie->dirty_right = item->len;
+    if (item->complete != 0) {
+        trie_finish(trie, item->len, trie->code->syminit, 0);
+    }
+    else {
+        trie_descend(trie, item->len, trie->code->syminit, 0);
+    }
+    mill_tape_clear(trie->tape, trie->dirty_right, trie->dirty_steps);
+}
+
+
+static inline void
+trie_items_free(struct TrieItem* items, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        free(items[i].prefix);
+    }
+    free(items);
+}
+
+
+// Cuts the family into at least `want` items where it branches enough,
+// opening prefixes breadth first.
+static inline int
+trie_split(const struct GradeSpec* spec, size_t want,
+    struct TrieItem** items, size_t* count) {
+    size_t cap = 16;
+    size_t n = 0;
+    struct TrieItem* res = malloc(cap * sizeof(res[0]));
+    if (res == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    res[n++] = (struct TrieItem) {.prefix = malloc(sizeof(wchar_t))};
+    if (res[0].prefix == NULL) {
+        perror("malloc");
+        free(res);
+        return 1;
+    }
+
+    for (size_t depth = 0; depth < 32; ++depth) {
+        size_t open = 0;
+        for (size_t i = 0; i < n; ++i) {
+            open += res[i].complete == 0;
+        }
+        if (open == 0 || open >= want) {
+            break;
+        }
+
+        size_t end = n;
+        for (size_t i = 0; i < end; ++i) {
+            if (res[i].complete != 0 || res[i].len != depth) {
+                continue;
+            }
+            wchar_t next[3];
+            size_t k = grade_next(spec, res[i].prefix, depth, next);
+            if (n + k > cap) {
+                cap = cap * 2 + k;
+                void* p = realloc(res, cap * sizeof(res[0]));
+                if (p == NULL) {
+                    perror("malloc");
+                    trie_items_free(res, n);
+                    return 1;
+                }
+                res = p;
+            }
+            wchar_t* prefix = res[i].prefix;
+            for (size_t j = 0; j < k; ++j) {
+                struct TrieItem* item = (j + 1 < k) ? &res[n++] : &res[i];
+                wchar_t* p = (j + 1 < k) ? malloc((depth + 2) * sizeof(wchar_t))
+                    : realloc(prefix, (depth + 2) * sizeof(wchar_t));
+                if (p == NULL) {
+                    perror("malloc");
+                    if (j + 1 < k) {
+                        n -= 1;
+                    }
+                    trie_items_free(res, n);
+                    return 1;
+                }
+                if (j + 1 < k) {
+                    wmemcpy(p, prefix, depth);
+                }
+                else {
+                    prefix = p;
+                }
+                *item = (struct TrieItem) {
+                    .prefix = p,
+                    .len = next[j] != L'\0' ? depth + 1 : depth,
+                    .complete = next[j] == L'\0',
+                };
+                p[depth] = next[j];
+            }
+        }
+    }
+
+    *items = res;
+    *count = n;
+    return 0;
+}
+
+
+#endif